@@ -1,3 +1,3 @@
 #!/usr/bin/bash
 
-c99 -Wall -o./src/raytracer src/main.c -lX11 -lm
+c99 -O2 -Wall -o./src/raytracer src/main.c -lX11 -lm -pthread
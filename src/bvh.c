@@ -0,0 +1,380 @@
+#include "bvh.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+#define BVH_BINS 12
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_MAX_DEPTH 60
+// cost of visiting a node relative to testing a primitive
+#define BVH_TRAVERSAL_COST 1.f
+
+typedef struct bvh_builder
+{
+	bvh_primitive *primitives;
+	bvh_node *nodes;
+	i32 nodeCount;
+	i32 nodeCapacity;
+} bvh_builder;
+
+typedef struct bvh_bin
+{
+	real32 min[3];
+	real32 max[3];
+	i32 primitiveCount;
+} bvh_bin;
+
+static void
+_bvh_grow_bounds(real32 *min, real32 *max, const real32 *otherMin, const real32 *otherMax)
+{
+	for(i32 i = 0; i < 3; ++i)
+	{
+		min[i] = otherMin[i] < min[i] ? otherMin[i] : min[i];
+		max[i] = otherMax[i] > max[i] ? otherMax[i] : max[i];
+	}
+}
+
+static real32
+_bvh_get_half_area(const real32 *min, const real32 *max)
+{
+	real32 x = max[0] - min[0];
+	real32 y = max[1] - min[1];
+	real32 z = max[2] - min[2];
+
+	return x*y + y*z + z*x;
+}
+
+static void
+_bvh_reset_bounds(real32 *min, real32 *max)
+{
+	for(i32 i = 0; i < 3; ++i)
+	{
+		min[i] = INFINITY;
+		max[i] = -INFINITY;
+	}
+}
+
+static i32
+_bvh_get_bin(const bvh_primitive *primitive, i32 axis, real32 centroidMin, 
+		real32 binScale)
+{
+	real32 centroid = 0.5f*(primitive->min[axis] + primitive->max[axis]);
+	i32 bin = (i32)((centroid - centroidMin)*binScale);
+
+	return bin < BVH_BINS ? bin : BVH_BINS - 1;
+}
+
+// picks the split plane with the lowest surface area heuristic cost among the bin
+// boundaries, partitions the node's primitives and sets the bounds of
+// both sides. Returns the primitives left of the plane, or 0 if keeping the node as a
+// leaf is cheaper or no plane separates the centroids.
+static i32
+_bvh_partition(bvh_builder *builder, bvh_node *node, 
+		bvh_node *outLeft, bvh_node *outRight)
+{
+	bvh_primitive *primitives = &builder->primitives[node->offset];
+
+	real32 centroidMin[3];
+	real32 centroidMax[3];
+	_bvh_reset_bounds(centroidMin, centroidMax);
+
+	for(i32 i = 0; i < node->primitiveCount; ++i)
+	{
+		for(i32 axis = 0; axis < 3; ++axis)
+		{
+			real32 centroid = 0.5f*(primitives[i].min[axis] + primitives[i].max[axis]);
+
+			centroidMin[axis] = centroid < centroidMin[axis] ? centroid : centroidMin[axis];
+			centroidMax[axis] = centroid > centroidMax[axis] ? centroid : centroidMax[axis];
+		}
+	}
+
+	// binning only along the axis the centroids spread the most is nearly as good as
+	// trying all three, for a third of the work
+	i32 axis = 0;
+
+	for(i32 i = 1; i < 3; ++i)
+	{
+		if(centroidMax[i] - centroidMin[i] > centroidMax[axis] - centroidMin[axis])
+		{
+			axis = i;
+		}
+	}
+
+	real32 extent = centroidMax[axis] - centroidMin[axis];
+
+	if(extent <= 0.f)
+	{
+		return 0;
+	}
+
+	real32 binScale = (real32)BVH_BINS*0.9999f/extent;
+	bvh_bin bins[BVH_BINS];
+
+	for(i32 b = 0; b < BVH_BINS; ++b)
+	{
+		_bvh_reset_bounds(bins[b].min, bins[b].max);
+		bins[b].primitiveCount = 0;
+	}
+
+	for(i32 i = 0; i < node->primitiveCount; ++i)
+	{
+		i32 b = _bvh_get_bin(&primitives[i], axis, centroidMin[axis], binScale);
+
+		_bvh_grow_bounds(bins[b].min, bins[b].max, primitives[i].min, primitives[i].max);
+		++bins[b].primitiveCount;
+	}
+
+	// areas and counts of everything right of each bin boundary, swept from the right
+	real32 rightAreas[BVH_BINS];
+	i32 rightCounts[BVH_BINS];
+	real32 min[3];
+	real32 max[3];
+	_bvh_reset_bounds(min, max);
+	i32 count = 0;
+
+	for(i32 b = BVH_BINS - 1; b > 0; --b)
+	{
+		if(bins[b].primitiveCount)
+		{
+			_bvh_grow_bounds(min, max, bins[b].min, bins[b].max);
+			count += bins[b].primitiveCount;
+		}
+
+		rightAreas[b] = count ? _bvh_get_half_area(min, max) : 0.f;
+		rightCounts[b] = count;
+	}
+
+	_bvh_reset_bounds(min, max);
+	count = 0;
+
+	real32 bestCost = INFINITY;
+	i32 bestBin = -1;
+
+	for(i32 b = 0; b < BVH_BINS - 1; ++b)
+	{
+		if(bins[b].primitiveCount)
+		{
+			_bvh_grow_bounds(min, max, bins[b].min, bins[b].max);
+			count += bins[b].primitiveCount;
+		}
+
+		if(!count || !rightCounts[b + 1])
+		{
+			continue;
+		}
+
+		real32 cost = _bvh_get_half_area(min, max)*(real32)count +
+			rightAreas[b + 1]*(real32)rightCounts[b + 1];
+
+		if(cost < bestCost)
+		{
+			bestCost = cost;
+			bestBin = b;
+		}
+	}
+
+	if(bestBin < 0)
+	{
+		return 0;
+	}
+
+	real32 nodeArea = _bvh_get_half_area(node->min, node->max);
+	bestCost = BVH_TRAVERSAL_COST + (nodeArea > 0.f ? bestCost/nodeArea : 0.f);
+
+	if(bestCost >= (real32)node->primitiveCount &&
+			node->primitiveCount <= BVH_MAX_LEAF_SIZE)
+	{
+		return 0;
+	}
+
+	_bvh_reset_bounds(outLeft->min, outLeft->max);
+	_bvh_reset_bounds(outRight->min, outRight->max);
+
+	for(i32 b = 0; b < BVH_BINS; ++b)
+	{
+		bvh_node *side = b <= bestBin ? outLeft : outRight;
+
+		if(bins[b].primitiveCount)
+		{
+			_bvh_grow_bounds(side->min, side->max, bins[b].min, bins[b].max);
+		}
+	}
+
+	i32 left = 0;
+	i32 right = node->primitiveCount - 1;
+
+	while(left <= right)
+	{
+		if(_bvh_get_bin(&primitives[left], axis, centroidMin[axis], binScale) <= 
+				bestBin)
+		{
+			++left;
+		}
+		else
+		{
+			bvh_primitive swap = primitives[left];
+			primitives[left] = primitives[right];
+			primitives[right--] = swap;
+		}
+	}
+
+	return left;
+}
+
+static void
+_bvh_get_bounds(bvh_builder *builder, bvh_node *node)
+{
+	_bvh_reset_bounds(node->min, node->max);
+
+	for(i32 i = 0; i < node->primitiveCount; ++i)
+	{
+		bvh_primitive *primitive = &builder->primitives[node->offset + i];
+		_bvh_grow_bounds(node->min, node->max, primitive->min, primitive->max);
+	}
+}
+
+bvh_node *
+bvh_build(bvh_primitive *primitives, i32 primitiveCount, i32 minLeafSize, 
+		i32 *outNodeCount)
+{
+	bvh_builder builder;
+	builder.primitives = primitives;
+	builder.nodeCapacity = primitiveCount/2 + 1;
+	builder.nodes = malloc(sizeof(bvh_node)*builder.nodeCapacity);
+	builder.nodeCount = 1;
+
+	builder.nodes[0].offset = 0;
+	builder.nodes[0].primitiveCount = primitiveCount;
+	_bvh_get_bounds(&builder, &builder.nodes[0]);
+
+	// nodes waiting to be split, with their depth
+	i32 stackCapacity = BVH_STACK_SIZE;
+	i32 *stack = malloc(sizeof(i32)*2*stackCapacity);
+
+	stack[0] = 0;
+	stack[1] = 0;
+	i32 stackCount = 1;
+
+	while(stackCount > 0)
+	{
+		--stackCount;
+		i32 nodeIndex = stack[2*stackCount];
+		i32 depth = stack[2*stackCount + 1];
+
+		bvh_node *node = &builder.nodes[nodeIndex];
+
+		if(node->primitiveCount <= minLeafSize || depth >= BVH_MAX_DEPTH)
+		{
+			continue;
+		}
+
+		bvh_node left;
+		bvh_node right;
+		i32 leftCount = _bvh_partition(&builder, node, &left, &right);
+
+		left.offset = node->offset;
+		left.primitiveCount = leftCount;
+
+		if(leftCount == 0)
+		{
+			if(node->primitiveCount <= BVH_MAX_LEAF_SIZE)
+			{
+				continue;
+			}
+
+			// coincident centroids, any split is as good as another
+			left.primitiveCount = node->primitiveCount/2;
+			_bvh_get_bounds(&builder, &left);
+		}
+
+		right.offset = node->offset + left.primitiveCount;
+		right.primitiveCount = node->primitiveCount - left.primitiveCount;
+
+		if(leftCount == 0)
+		{
+			_bvh_get_bounds(&builder, &right);
+		}
+
+		if(builder.nodeCount + 2 > builder.nodeCapacity)
+		{
+			builder.nodeCapacity *= 2;
+			builder.nodes = realloc(builder.nodes, sizeof(bvh_node)*builder.nodeCapacity);
+		}
+
+		i32 children = builder.nodeCount;
+		builder.nodeCount += 2;
+
+		builder.nodes[children] = left;
+		builder.nodes[children + 1] = right;
+
+		node = &builder.nodes[nodeIndex];
+		node->offset = children;
+		node->primitiveCount = 0;
+
+		if(stackCount + 2 > stackCapacity)
+		{
+			stackCapacity *= 2;
+			stack = realloc(stack, sizeof(i32)*2*stackCapacity);
+		}
+
+		for(i32 i = 0; i < 2; ++i)
+		{
+			stack[2*stackCount] = children + i;
+			stack[2*stackCount + 1] = depth + 1;
+			++stackCount;
+		}
+	}
+
+	free(stack);
+
+	*outNodeCount = builder.nodeCount;
+
+	return realloc(builder.nodes, sizeof(bvh_node)*builder.nodeCount);
+}
+
+real32
+bvh_refit(bvh_node *nodes, i32 nodeCount, const bvh_primitive *primitives)
+{
+	real32 area = 0.f;
+
+	// children always follow their parent, so a reverse walk visits them first
+	for(i32 i = nodeCount - 1; i >= 0; --i)
+	{
+		bvh_node *node = &nodes[i];
+		_bvh_reset_bounds(node->min, node->max);
+
+		if(node->primitiveCount)
+		{
+			for(i32 j = node->offset; j < node->offset + node->primitiveCount; ++j)
+			{
+				_bvh_grow_bounds(node->min, node->max, primitives[j].min, primitives[j].max);
+			}
+		}
+		else
+		{
+			const bvh_node *left = &nodes[node->offset];
+			const bvh_node *right = left + 1;
+
+			_bvh_grow_bounds(node->min, node->max, left->min, left->max);
+			_bvh_grow_bounds(node->min, node->max, right->min, right->max);
+		}
+
+		area += _bvh_get_half_area(node->min, node->max);
+	}
+
+	return area;
+}
+
+real32
+bvh_get_area(const bvh_node *nodes, i32 nodeCount)
+{
+	real32 area = 0.f;
+
+	for(i32 i = 0; i < nodeCount; ++i)
+	{
+		area += _bvh_get_half_area(nodes[i].min, nodes[i].max);
+	}
+
+	return area;
+}
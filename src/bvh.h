@@ -0,0 +1,74 @@
+#ifndef __BVH_H
+#define __BVH_H
+
+#include "stdinc.h"
+
+// bounding volume hierarchy over boxes, shared by the triangles of a mesh and the
+// objects of a scene
+#define BVH_STACK_SIZE 64
+
+// inner nodes have no primitives and their two children at offset and offset + 1,
+// leaves cover primitiveCount primitives starting at offset
+typedef struct bvh_node
+{
+	real32 min[3];
+	i32 offset;
+	real32 max[3];
+	i32 primitiveCount;
+} bvh_node;
+
+// bounds of a primitive and whatever the caller uses to find it again
+typedef struct bvh_primitive
+{
+	real32 min[3];
+	real32 max[3];
+	i32 index;
+} bvh_primitive;
+
+// binned surface area heuristic build. Nodes of up to minLeafSize primitives are never
+// split. Reorders the primitives so that every leaf is a single range of them and 
+// returns the nodes, root first.
+extern bvh_node *
+bvh_build(bvh_primitive *primitives, i32 primitiveCount, i32 minLeafSize, 
+		i32 *outNodeCount);
+
+// recomputes the node bounds bottom up after primitives moved, keeping the tree. The
+// primitives are in the order bvh_build left them in. Returns the same as bvh_get_area.
+extern real32
+bvh_refit(bvh_node *nodes, i32 nodeCount, const bvh_primitive *primitives);
+
+// half the summed surface area of all nodes, which grows as refits make the tree worse
+extern real32
+bvh_get_area(const bvh_node *nodes, i32 nodeCount);
+
+// slab test of the node bounds against (minDistance, maxDistance), outNear is where
+// the ray enters them
+static inline b32
+bvh_intersect_node(const bvh_node *node, const real32 *origin, const real32 *invDirection,
+		real32 minDistance, real32 maxDistance, real32 *outNear)
+{
+	real32 tNear = minDistance;
+	real32 tFar = maxDistance;
+
+	for(i32 i = 0; i < 3; ++i)
+	{
+		real32 t0 = (node->min[i] - origin[i])*invDirection[i];
+		real32 t1 = (node->max[i] - origin[i])*invDirection[i];
+
+		if(t0 > t1)
+		{
+			real32 swap = t0;
+			t0 = t1;
+			t1 = swap;
+		}
+
+		tNear = t0 > tNear ? t0 : tNear;
+		tFar = t1 < tFar ? t1 : tFar;
+	}
+
+	*outNear = tNear;
+
+	return tNear <= tFar;
+}
+
+#endif
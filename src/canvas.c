@@ -25,6 +25,7 @@ struct raytracer_canvas
 	i32 height;
 	canvas_text *texts;
 	i32 textCount;
+	i32 textCapacity;
 	b32 isShow;
 	
 	struct
@@ -107,6 +108,7 @@ canvas_create(Display *display, raytracer_canvas *parent, i32 width, i32 height)
 
 	canvas->texts = NULL;
 	canvas->textCount = 0;
+	canvas->textCapacity = 0;
 
 	return canvas;
 }
@@ -212,15 +214,12 @@ canvas_put_square(raytracer_canvas *canvas, i32 x, i32 y,
 i32
 canvas_text_create(raytracer_canvas *canvas)
 {
-	i32 index = canvas->textCount;
+	i32 index = canvas->textCount++;
 
-	if(canvas->textCount > 0)
+	if(canvas->textCount > canvas->textCapacity)
 	{
-		canvas->texts = realloc(canvas->texts, sizeof(canvas_text)*(++canvas->textCount));
-	}
-	else
-	{
-		canvas->texts = malloc(sizeof(canvas_text)*(++canvas->textCount));
+		canvas->textCapacity = canvas->textCapacity < 8 ? 8 : canvas->textCapacity*2;
+		canvas->texts = realloc(canvas->texts, sizeof(canvas_text)*canvas->textCapacity);
 	}
 
 	canvas->texts[index].x = 0;
@@ -0,0 +1,75 @@
+#include "fast_math.h"
+
+#include <math.h>
+
+typedef union fast_float_bits
+{
+	real32 f;
+	u32 u;
+	i32 i;
+} fast_float_bits;
+
+real32
+fast_rsqrt(real32 x)
+{
+	fast_float_bits bits;
+	bits.f = x;
+	bits.u = 0x5F3759DFu - (bits.u >> 1);
+
+	real32 y = bits.f;
+
+	y = y*(1.5f - 0.5f*x*y*y);
+
+	return y*(1.5f - 0.5f*x*y*y);
+}
+
+void
+fast_vec4_normal(const v4 *v, v4 *out)
+{
+	real32 invMag = fast_rsqrt(vec4_magnitude3_squared(v));
+
+	out->x = v->x*invMag;
+	out->y = v->y*invMag;
+	out->z = v->z*invMag;
+}
+
+void
+fast_vec4_direction(const v4 *lhs, const v4 *rhs, v4 *out)
+{
+	out->x = rhs->x - lhs->x;
+	out->y = rhs->y - lhs->y;
+	out->z = rhs->z - lhs->z;
+
+	fast_vec4_normal(out, out);
+}
+
+void
+fast_pow_table_init(fast_pow_table *table, real32 exponent)
+{
+	table->exponent = exponent;
+
+	for(i32 i = 0; i <= FAST_POW_TABLE_SIZE; ++i)
+	{
+		table->values[i] = powf((real32)i/(real32)FAST_POW_TABLE_SIZE, exponent);
+	}
+}
+
+real32
+fast_pow_table_lookup(const fast_pow_table *table, real32 x)
+{
+	if(x <= 0.f)
+	{
+		return table->values[0];
+	}
+
+	if(x >= 1.f)
+	{
+		return table->values[FAST_POW_TABLE_SIZE];
+	}
+
+	real32 position = x*(real32)FAST_POW_TABLE_SIZE;
+	i32 index = (i32)position;
+	real32 t = position - (real32)index;
+
+	return table->values[index] + (table->values[index + 1] - table->values[index])*t;
+}
@@ -0,0 +1,36 @@
+#ifndef __FAST_MATH_H
+#define __FAST_MATH_H
+
+#include "stdinc.h"
+#include "rt_math.h"
+
+// approximations for the shading hot paths. They trade a little accuracy for speed
+// and are only used when the scene is switched to its fast math mode.
+
+// 1/sqrt(x) from the exponent bit trick refined by two newton steps
+extern real32
+fast_rsqrt(real32 x);
+
+extern void
+fast_vec4_normal(const v4 *v, v4 *out);
+
+extern void
+fast_vec4_direction(const v4 *lhs, const v4 *rhs, v4 *out);
+
+// x^exponent sampled over [0, 1] and linearly interpolated in between
+#define FAST_POW_TABLE_SIZE 1024
+
+typedef struct fast_pow_table
+{
+	real32 exponent;
+	real32 values[FAST_POW_TABLE_SIZE + 1];
+} fast_pow_table;
+
+extern void
+fast_pow_table_init(fast_pow_table *table, real32 exponent);
+
+// x is clamped to [0, 1]
+extern real32
+fast_pow_table_lookup(const fast_pow_table *table, real32 x);
+
+#endif
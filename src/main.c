@@ -10,8 +10,14 @@
 #include "stdinc.h"
 #include "rt_math.h"
 #include "work.h"
+#include "memory.h"
+#include "mesh.h"
 #include "canvas.h"
 #include "scene.h"
+#include "scene_file.h"
+#include "scene_text.h"
+#include "scene_snapshot.h"
+#include "timeline.h"
 #include "renderer.h"
 
 #include <X11/Xlib.h>
@@ -44,14 +50,24 @@ typedef struct command_bar
 	i32 textObject;
 	i32 bufferStrSize;
 	char textBuffer[COMMAND_BAR_STR_LENGTH];
+	// the object of the last loaded mesh, which instances are scattered around
+	i32 meshObject;
+	// keyed by /key and rendered by /animate, created with the first key
+	raytracer_timeline *timeline;
+	// the timeline plays in a scene adopted from the edited one, created by /animate
+	raytracer_scene *animationScene;
 } command_bar;
 
 command_bar *
 command_bar_get();
 
+// arguments are allocated from the frame arena. Edits go to the scene, while render 
+// state such as the kernel is read from the render scene.
 b32
 command_bar_execute(command_bar *bar, raytracer_renderer *renderer, raytracer_scene *scene, 
-		raytracer_canvas *screenshotCanvas, raytracer_canvas *canvas);
+		raytracer_scene *renderScene, work_dispatcher *dispatcher, 
+		memory_arena *frameArena, raytracer_canvas *screenshotCanvas, 
+		raytracer_canvas *canvas);
 
 void
 command_bar_write(command_bar *bar, raytracer_canvas *canvas, const char *str);
@@ -70,6 +86,8 @@ command_bar_toggle(command_bar *bar, raytracer_canvas *canvas);
 #define WINDOW_HEIGHT 768
 #define PIXEL_SIZE 1.f
 #define MS_DELAY 32 
+// the frame arena is reset at the start of every frame
+#define FRAME_ARENA_BLOCK_SIZE (64*1024)
 
 #define PIXEL_SIZE_SHIFT_WEIGHT 1.f
 
@@ -86,7 +104,12 @@ main(int argc, char **argv)
 	raytracer_canvas *mainCanvas = canvas_create(display, NULL, WINDOW_WIDTH, WINDOW_HEIGHT);
 	raytracer_canvas *screenshotCanvas = canvas_create(display, mainCanvas, WINDOW_WIDTH, WINDOW_HEIGHT);
 	raytracer_scene *scene = scene_init();
+	// drawn from the snapshots the scene publishes between frames, so that rendering
+	// never sees an edit half way through
+	raytracer_scene *renderScene = scene_init();
 	raytracer_renderer *renderer = renderer_init();
+	work_dispatcher *dispatcher = work_init_dispatcher();
+	memory_arena *frameArena = memory_create_arena("frame", FRAME_ARENA_BLOCK_SIZE, 0);
 
 	i32 *screenshotTextures = NULL;
 	i32 screenshotTextureCount = 0;
@@ -147,11 +170,13 @@ main(int argc, char **argv)
 
 	i32 fpsText = canvas_text_create(mainCanvas);
 	i32 camText = canvas_text_create(mainCanvas);
+	i32 rayText = canvas_text_create(mainCanvas);
 	i32 screenshotText = canvas_text_create(screenshotCanvas);
 	v4 camPosition = {{0, 0, 0.f, 0}};
 	scene_set_camera_position(scene, &camPosition);
 
 #define CAM_MOVEMENT 0.1f
+#define CAM_ROTATION 5.f
 
 	XMapWindow(display, canvas_get_window(mainCanvas));
 	XSync(display, False);
@@ -176,6 +201,8 @@ main(int argc, char **argv)
 
 	while (isRunning)
 	{
+		memory_arena_reset(frameArena);
+
 		XEvent evt;
 
 		while(XPending(display))
@@ -200,6 +227,9 @@ main(int argc, char **argv)
 
 					if(!command_bar_get()->isShow)
 					{
+						// a loaded scene brings its own camera
+						scene_get_camera_position(scene, &camPosition);
+
 						if (sym == XK_Escape)
 						{
 							isRunning = B32_FALSE;
@@ -246,6 +276,20 @@ main(int argc, char **argv)
 							camPosition.z -= CAM_MOVEMENT;
 							scene_set_camera_position(scene, &camPosition);
 						}
+						else if(sym == XK_Left || sym == XK_Right || sym == XK_Up || 
+								sym == XK_Down)
+						{
+							real32 yaw;
+							real32 pitch;
+							scene_get_camera_orientation(scene, &yaw, &pitch);
+
+							yaw += sym == XK_Left ? -CAM_ROTATION : 
+								(sym == XK_Right ? CAM_ROTATION : 0.f);
+							pitch += sym == XK_Down ? -CAM_ROTATION : 
+								(sym == XK_Up ? CAM_ROTATION : 0.f);
+
+							scene_set_camera_orientation(scene, yaw, pitch);
+						}
 						else if(sym == XK_space)
 						{
 							if(!canvas_is_show(screenshotCanvas))
@@ -444,7 +488,8 @@ main(int argc, char **argv)
 						{
 							command_bar *commandBar = command_bar_get();
 
-							command_bar_execute(commandBar, renderer, scene, screenshotCanvas, mainCanvas);
+							command_bar_execute(commandBar, renderer, scene, renderScene, 
+									dispatcher, frameArena, screenshotCanvas, mainCanvas);
 							command_bar_toggle(commandBar, mainCanvas);
 						}
 					}
@@ -463,7 +508,13 @@ main(int argc, char **argv)
 			}
 		}
 
-		renderer_draw_scene(renderer, mainCanvas, scene);
+		scene_publish(scene);
+
+		scene_snapshot *snapshot = scene_acquire_snapshot(scene);
+		scene_adopt_snapshot(renderScene, snapshot);
+		scene_release_snapshot(snapshot);
+
+		renderer_draw_scene(renderer, mainCanvas, renderScene);
 		
 		struct timespec currentTime;
 		clock_gettime(CLOCK_MONOTONIC, &currentTime);
@@ -482,14 +533,27 @@ main(int argc, char **argv)
 		//i32 canvasHeight = canvas_get_height(mainCanvas);
 
 		char camTextBuffer[100];
-		sprintf(camTextBuffer, "cam position: (%.1f, %.1f, %.1f)", camPosition.x, 
-				camPosition.y, camPosition.z);
+		real32 camYaw;
+		real32 camPitch;
+		scene_get_camera_orientation(scene, &camYaw, &camPitch);
+		sprintf(camTextBuffer, "cam position: (%.1f, %.1f, %.1f) yaw %.0f pitch %.0f", 
+				camPosition.x, camPosition.y, camPosition.z, camYaw, camPitch);
 
 		real32 splitWidth = canvasWidth/4.f;
 		//real32 splitHeight = canvasHeight/4.f;
 
 		canvas_text_set(mainCanvas, camText, (splitWidth*3.f)-1, 50, camTextBuffer);
 
+		scene_trace_stats traceStats;
+		renderer_get_trace_stats(renderer, &traceStats);
+
+		char rayTextBuffer[100];
+		sprintf(rayTextBuffer, "rays: %d primary, %d secondary (%d over budget, %d roulette)", 
+				traceStats.primaryRayCount, traceStats.secondaryRayCount, 
+				traceStats.budgetTerminationCount, traceStats.rouletteTerminationCount);
+
+		canvas_text_set(mainCanvas, rayText, 50, 70, rayTextBuffer);
+
 		command_bar *commandBar = command_bar_get();
 		if(commandBar->isShow)
 		{
@@ -525,9 +589,18 @@ main(int argc, char **argv)
 }
 
 #include "rt_math.c"
+#include "fast_math.c"
 #include "work.c"
+#include "memory.c"
+#include "bvh.c"
+#include "parse.c"
+#include "mesh.c"
 #include "canvas.c"
 #include "scene.c"
+#include "scene_file.c"
+#include "scene_text.c"
+#include "scene_snapshot.c"
+#include "timeline.c"
 #include "renderer.c"
 
 command_bar *
@@ -553,21 +626,28 @@ command_bar_get()
 	bar->cursorSize = 20;
 	bar->cursorColor = (color32)((real32)(bar->backgroundColor >> 8)*0.5f) << 8;
 	bar->textObject = CANVAS_TEXT_NULL;
+	bar->meshObject = SCENE_OBJECT_NULL;
+	bar->timeline = NULL;
+	bar->animationScene = NULL;
 
 	return bar;
 }
 
 b32
 command_bar_execute(command_bar *bar, raytracer_renderer *renderer, raytracer_scene *scene, 
-		raytracer_canvas *screenshotCanvas, raytracer_canvas *canvas)
+		raytracer_scene *renderScene, work_dispatcher *dispatcher, 
+		memory_arena *frameArena, raytracer_canvas *screenshotCanvas, 
+		raytracer_canvas *canvas)
 {
 	char commandBuffer[50];
 	commandBuffer[0] = '\0';
-	char **args = NULL;
 	i32 argCount = 0;
 
 	const char *iter = bar->textBuffer;
 
+	// every other character is a separator at most
+	char **args = memory_arena_push(frameArena, sizeof(char *)*(strlen(iter)/2 + 1));
+
 	if(*iter == '\0')
 	{
 		return B32_TRUE;
@@ -617,18 +697,9 @@ command_bar_execute(command_bar *bar, raytracer_renderer *renderer, raytracer_sc
 
 		span = strcspn(iter, " \n\t");
 
-		i32 index = argCount;
+		i32 index = argCount++;
 
-		if(argCount > 0)
-		{
-			args = realloc(args, sizeof(char *)*(++argCount));
-		}
-		else
-		{
-			args = malloc(sizeof(char *)*(++argCount));
-		}
-
-		args[index] = malloc(span);
+		args[index] = memory_arena_push(frameArena, span + 1);
 
 		memcpy(args[index], iter, span);
 
@@ -745,12 +816,571 @@ command_bar_execute(command_bar *bar, raytracer_renderer *renderer, raytracer_sc
 			scene_object_set_value(scene, obj, SCENE_OBJECT_VALUE_COLOR, &color);
 		}
 	}
+	else if(!strcmp(commandBuffer, "lightsamples"))
+	{
+		if(argCount > 0)
+		{
+			i32 sampleCount = atoi(args[0]);
+			scene_set_light_samples(scene, sampleCount < 0 ? 0 : sampleCount);
+		}
+
+		printf("Sampling %d lights per hit (0 evaluates all lights).\n", 
+				scene_get_light_samples(scene));
+	}
+	else if(!strcmp(commandBuffer, "maxdepth"))
+	{
+		if(argCount > 0)
+		{
+			i32 maxDepth = atoi(args[0]);
+			scene_set_max_depth(scene, maxDepth < 0 ? 0 : maxDepth);
+		}
+
+		printf("Tracing up to %d bounces.\n", scene_get_max_depth(scene));
+	}
+	else if(!strcmp(commandBuffer, "raybudget"))
+	{
+		if(argCount > 0)
+		{
+			i32 rayBudget = atoi(args[0]);
+			scene_set_ray_budget(scene, rayBudget < 0 ? 0 : rayBudget);
+		}
+
+		printf("Tracing up to %d secondary rays per frame (0 does not limit them).\n", 
+				scene_get_ray_budget(scene));
+	}
+	else if(!strcmp(commandBuffer, "fastmath"))
+	{
+		scene_set_math_mode(scene, scene_get_math_mode(scene) == SCENE_MATH_FAST ? 
+				SCENE_MATH_EXACT : SCENE_MATH_FAST);
+
+		printf("Fast math %s.\n", scene_get_math_mode(scene) == SCENE_MATH_FAST ? 
+				"enabled" : "disabled");
+	}
+	else if(!strcmp(commandBuffer, "matherror"))
+	{
+		real32 maxError;
+		real32 meanError;
+		scene_measure_math_error(renderScene, canvas, &maxError, &meanError);
+
+		printf("Fast math differs by at most %.0f levels, %f on average.\n", maxError, 
+				meanError);
+	}
+	else if(!strcmp(commandBuffer, "lightcache"))
+	{
+		if(argCount > 0)
+		{
+			real32 cellSize = atof(args[0]);
+			scene_set_light_cache(scene, cellSize < 0.f ? 0.f : cellSize);
+		}
+
+		printf("Light cache cell size %f (0 disables the cache).\n", 
+				scene_get_light_cache(scene));
+	}
+	else if(!strcmp(commandBuffer, "obj"))
+	{
+		if(argCount > 0)
+		{
+			struct timespec startTime;
+			clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+			raytracer_mesh *mesh = mesh_load_obj(dispatcher, args[0]);
+
+			if(mesh)
+			{
+				struct timespec endTime;
+				clock_gettime(CLOCK_MONOTONIC, &endTime);
+
+				i32 obj = scene_create_object(scene, SCENE_OBJECT_MESH);
+				scene_object_set_value(scene, obj, SCENE_OBJECT_VALUE_MESH, &mesh);
+
+				v4 objPos = vec4_init(argCount > 1 ? atof(args[1]) : 0.f, 
+						argCount > 2 ? atof(args[2]) : 0.f, 
+						argCount > 3 ? atof(args[3]) : 2.f, 0.f);
+				scene_object_set_value(scene, obj, SCENE_OBJECT_VALUE_POSITION, &objPos);
+
+				bar->meshObject = obj;
+
+				printf("Loaded %d triangles from '%s' in %.0f ms.\n", 
+						mesh_get_triangle_count(mesh), args[0], 
+						(endTime.tv_sec - startTime.tv_sec)*1000.0 + 
+						(endTime.tv_nsec - startTime.tv_nsec)/1000000.0);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Usage: obj <path> [x y z]\n");
+		}
+	}
+	else if(!strcmp(commandBuffer, "instance"))
+	{
+		if(argCount > 0 && bar->meshObject != SCENE_OBJECT_NULL)
+		{
+			i32 instanceCount = atoi(args[0]);
+			instanceCount = instanceCount < 0 ? 0 : instanceCount;
+			real32 spread = argCount > 1 ? atof(args[1]) : 10.f;
+
+			raytracer_mesh *mesh;
+			v4 center;
+			scene_object_get_value(scene, bar->meshObject, SCENE_OBJECT_VALUE_MESH, &mesh);
+			scene_object_get_value(scene, bar->meshObject, SCENE_OBJECT_VALUE_POSITION, 
+					&center);
+
+			scene_object_desc *descs = malloc(sizeof(scene_object_desc)*(instanceCount + 1));
+
+			// every instance only stores its own transform and shares the mesh
+			for(i32 i = 0; i < instanceCount; ++i)
+			{
+				real32 angle = 2.f*3.14159265f*(real32)rand()/(real32)RAND_MAX;
+				real32 scale = 0.25f + 0.75f*(real32)rand()/(real32)RAND_MAX;
+
+				m44 transform = {{
+					{scale*cosf(angle), 0.f, scale*sinf(angle), 0.f},
+					{0.f, scale, 0.f, 0.f},
+					{-scale*sinf(angle), 0.f, scale*cosf(angle), 0.f},
+					{0.f, 0.f, 0.f, 1.f}
+				}};
+
+				scene_object_desc *desc = &descs[i];
+				scene_object_desc_init(desc);
+				desc->mesh = mesh;
+				desc->transform = transform;
+				desc->position = vec4_init(
+						center.x + spread*((real32)rand()/(real32)RAND_MAX - 0.5f), 
+						center.y, 
+						center.z + spread*((real32)rand()/(real32)RAND_MAX - 0.5f), 0.f);
+				desc->color = (color32)rand() & 0xFFFFFF;
+			}
+
+			scene_create_objects(scene, instanceCount, SCENE_OBJECT_MESH, descs);
+			free(descs);
+
+			printf("Scattered %d instances of %d triangles.\n", instanceCount, 
+					mesh_get_triangle_count(mesh));
+		}
+		else
+		{
+			fprintf(stderr, "Usage: instance <count> [spread], after loading a mesh with obj\n");
+		}
+	}
+	else if(!strcmp(commandBuffer, "cloud"))
+	{
+		i32 sphereCount = argCount > 0 ? atoi(args[0]) : 0;
+
+		if(sphereCount > 0)
+		{
+			real32 radius = argCount > 1 ? atof(args[1]) : 0.05f;
+			real32 spread = argCount > 2 ? atof(args[2]) : 10.f;
+
+			v4 *positions = malloc(sizeof(v4)*sphereCount);
+			real32 *radii = malloc(sizeof(real32)*sphereCount);
+			color32 *colors = malloc(sizeof(color32)*sphereCount);
+			u8 *materialIds = malloc(sphereCount);
+
+			if(!positions || !radii || !colors || !materialIds)
+			{
+				fprintf(stderr, "Cannot allocate %d spheres!\n", sphereCount);
+
+				free(positions);
+				free(radii);
+				free(colors);
+				free(materialIds);
+
+				return B32_FALSE;
+			}
+
+			scene_sphere_material materials[] = {
+				{0.18f, 0.f, 0.f, 1.f},
+				{0.18f, 0.5f, 0.f, 1.f},
+				{0.18f, 0.f, 0.8f, 1.5f}
+			};
+
+			for(i32 i = 0; i < sphereCount; ++i)
+			{
+				positions[i] = vec4_init(
+						spread*((real32)rand()/(real32)RAND_MAX - 0.5f),
+						spread*((real32)rand()/(real32)RAND_MAX - 0.5f),
+						spread*0.5f + spread*(real32)rand()/(real32)RAND_MAX, 0.f);
+				radii[i] = radius*(0.5f + (real32)rand()/(real32)RAND_MAX);
+				colors[i] = (color32)rand() & 0xFFFFFF;
+				materialIds[i] = (u8)(rand() % (sizeof(materials)/sizeof(materials[0])));
+			}
+
+			i32 clusterCount;
+			scene_create_sphere_clusters(scene, sphereCount, positions, radii, colors,
+					materialIds, materials, sizeof(materials)/sizeof(materials[0]),
+					&clusterCount);
+
+			free(positions);
+			free(radii);
+			free(colors);
+			free(materialIds);
+
+			printf("Packed %d spheres into %d clusters.\n", sphereCount, clusterCount);
+		}
+		else
+		{
+			fprintf(stderr, "Usage: cloud <count> [radius] [spread], with a count above 0\n");
+		}
+	}
+	else if(!strcmp(commandBuffer, "chunkwrite"))
+	{
+		if(argCount > 1)
+		{
+			i64 sphereCount = atoll(args[1]);
+			real32 radius = argCount > 2 ? atof(args[2]) : 0.05f;
+			real32 spread = argCount > 3 ? atof(args[3]) : 10.f;
+
+			scene_sphere_material materials[] = {
+				{0.18f, 0.f, 0.f, 1.f},
+				{0.18f, 0.5f, 0.f, 1.f}
+			};
+
+			scene_chunk_writer *writer = scene_chunk_writer_open(args[0], materials,
+					sizeof(materials)/sizeof(materials[0]));
+
+			if(writer)
+			{
+				// every batch is a slab along z, so that its chunks stay spatially close
+				i32 batchSize = 1 << 20;
+				i64 batchCount = (sphereCount + batchSize - 1)/batchSize;
+
+				v4 *positions = malloc(sizeof(v4)*batchSize);
+				real32 *radii = malloc(sizeof(real32)*batchSize);
+				color32 *colors = malloc(sizeof(color32)*batchSize);
+				u8 *materialIds = malloc(batchSize);
+
+				for(i64 batch = 0; batch < batchCount; ++batch)
+				{
+					i32 count = sphereCount - batch*batchSize < batchSize ?
+						(i32)(sphereCount - batch*batchSize) : batchSize;
+					real32 slabDepth = spread/(real32)batchCount;
+
+					for(i32 i = 0; i < count; ++i)
+					{
+						positions[i] = vec4_init(
+								spread*((real32)rand()/(real32)RAND_MAX - 0.5f),
+								spread*((real32)rand()/(real32)RAND_MAX - 0.5f),
+								spread*0.5f + slabDepth*
+								((real32)batch + (real32)rand()/(real32)RAND_MAX), 0.f);
+						radii[i] = radius*(0.5f + (real32)rand()/(real32)RAND_MAX);
+						colors[i] = (color32)rand() & 0xFFFFFF;
+						materialIds[i] = (u8)(rand() & 1);
+					}
+
+					if(!scene_chunk_writer_add_spheres(writer, count, positions, radii, colors,
+								materialIds))
+					{
+						break;
+					}
+				}
 
-	for(i32 i = 0; i < argCount; ++i)
+				free(positions);
+				free(radii);
+				free(colors);
+				free(materialIds);
+
+				if(scene_chunk_writer_close(writer))
+				{
+					printf("Wrote %lld spheres to '%s'.\n", (long long)sphereCount, args[0]);
+				}
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Usage: chunkwrite <path> <count> [radius] [spread]\n");
+		}
+	}
+	else if(!strcmp(commandBuffer, "chunkmap"))
 	{
-		free(args[i]);
+		if(argCount > 0)
+		{
+			i32 chunkCount;
+			if(scene_map_sphere_chunks(scene, args[0], &chunkCount) != SCENE_OBJECT_NULL)
+			{
+				printf("Mapped %d chunks from '%s'.\n", chunkCount, args[0]);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Usage: chunkmap <path>\n");
+		}
+	}
+	else if(!strcmp(commandBuffer, "chunkbudget"))
+	{
+		if(argCount > 0)
+		{
+			real32 megabytes = atof(args[0]);
+			megabytes = megabytes < 0.f ? 0.f : megabytes;
+			scene_set_chunk_budget(scene, (u64)(megabytes*1024.f*1024.f));
+		}
+
+		printf("%.1f MB of mapped chunks resident.\n",
+				(real64)scene_get_resident_chunk_bytes(renderScene)/(1024.0*1024.0));
+	}
+	else if(!strcmp(commandBuffer, "kernel"))
+	{
+		printf("Tracing with the %s kernel.\n", scene_get_kernel_name(renderScene));
+	}
+	else if(!strcmp(commandBuffer, "save"))
+	{
+		if(argCount > 0)
+		{
+			if(scene_save(scene, args[0]))
+			{
+				printf("Saved scene to '%s'.\n", args[0]);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Usage: save <path>\n");
+		}
+	}
+	else if(!strcmp(commandBuffer, "load"))
+	{
+		if(argCount > 0)
+		{
+			struct timespec startTime;
+			clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+			if(scene_load(scene, args[0]))
+			{
+				struct timespec endTime;
+				clock_gettime(CLOCK_MONOTONIC, &endTime);
+
+				// meshes are not saved with the scene
+				bar->meshObject = SCENE_OBJECT_NULL;
+
+				// keys refer to the objects and lights of the previous scene
+				if(bar->timeline)
+				{
+					timeline_destroy(bar->timeline);
+					bar->timeline = NULL;
+				}
+
+				printf("Loaded scene from '%s' in %.2f ms.\n", args[0], 
+						(endTime.tv_sec - startTime.tv_sec)*1000.0 + 
+						(endTime.tv_nsec - startTime.tv_nsec)/1000000.0);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Usage: load <path>\n");
+		}
+	}
+	else if(!strcmp(commandBuffer, "savetext"))
+	{
+		if(argCount > 0)
+		{
+			if(scene_save_text(scene, args[0]))
+			{
+				printf("Saved scene to '%s'.\n", args[0]);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Usage: savetext <path>\n");
+		}
+	}
+	else if(!strcmp(commandBuffer, "loadtext"))
+	{
+		if(argCount > 0)
+		{
+			struct timespec startTime;
+			clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+			if(scene_load_text(scene, dispatcher, args[0]))
+			{
+				struct timespec endTime;
+				clock_gettime(CLOCK_MONOTONIC, &endTime);
+
+				printf("Loaded scene from '%s' in %.0f ms.\n", args[0], 
+						(endTime.tv_sec - startTime.tv_sec)*1000.0 + 
+						(endTime.tv_nsec - startTime.tv_nsec)/1000000.0);
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Usage: loadtext <path>\n");
+		}
+	}
+	else if(!strcmp(commandBuffer, "prepass"))
+	{
+		renderer_toggle_visibility_prepass(renderer);
+
+		printf("Visibility prepass %s.\n", renderer_is_visibility_prepass(renderer) ? 
+				"enabled" : "disabled");
+	}
+	else if(!strcmp(commandBuffer, "memory"))
+	{
+		memory_print_stats();
+	}
+	else if(!strcmp(commandBuffer, "key"))
+	{
+		// keys the current values of the object, light or camera at the time
+		b32 isCamera = argCount > 1 && !strcmp(args[0], "camera");
+
+		if(argCount > 0 && !strcmp(args[0], "clear"))
+		{
+			if(bar->timeline)
+			{
+				timeline_destroy(bar->timeline);
+				bar->timeline = NULL;
+			}
+
+			printf("Cleared the timeline.\n");
+		}
+		else if(isCamera || (argCount > 2 && (!strcmp(args[0], "object") || 
+						!strcmp(args[0], "light"))))
+		{
+			if(!bar->timeline)
+			{
+				bar->timeline = timeline_create();
+			}
+
+			v4 position;
+
+			if(isCamera)
+			{
+				real32 time = atof(args[1]);
+				real32 yaw;
+				real32 pitch;
+				scene_get_camera_position(scene, &position);
+				scene_get_camera_orientation(scene, &yaw, &pitch);
+
+				timeline_add_camera_key(bar->timeline, time, &position, yaw, pitch);
+			}
+			else if(!strcmp(args[0], "object"))
+			{
+				i32 objectId = atoi(args[1]);
+
+				if(objectId < 0 || objectId >= scene_get_object_count(scene))
+				{
+					fprintf(stderr, "No object %d to key!\n", objectId);
+
+					return B32_FALSE;
+				}
+
+				scene_object_get_value(scene, objectId, SCENE_OBJECT_VALUE_POSITION, 
+						&position);
+
+				timeline_add_object_key(bar->timeline, objectId, atof(args[2]), &position);
+			}
+			else
+			{
+				i32 lightId = atoi(args[1]);
+
+				if(lightId < 0 || lightId >= scene_get_light_count(scene))
+				{
+					fprintf(stderr, "No light %d to key!\n", lightId);
+
+					return B32_FALSE;
+				}
+
+				color32 color;
+				real32 intensity;
+				light_get_value(scene, lightId, LIGHT_VALUE_POSITION, &position);
+				light_get_value(scene, lightId, LIGHT_VALUE_COLOR, &color);
+				light_get_value(scene, lightId, LIGHT_VALUE_INTENSITY, &intensity);
+
+				timeline_add_light_key(bar->timeline, lightId, atof(args[2]), &position, 
+						color, intensity);
+			}
+
+			printf("Timeline lasts %.2f s.\n", timeline_get_duration(bar->timeline));
+		}
+		else
+		{
+			fprintf(stderr, "Usage: key object <id> <time> | key light <id> <time> | "
+					"key camera <time> | key clear\n");
+		}
+	}
+	else if(!strcmp(commandBuffer, "animate"))
+	{
+		if(argCount > 0 && bar->timeline)
+		{
+			real32 frameRate = argCount > 1 ? atof(args[1]) : 24.f;
+			frameRate = frameRate > 0.f ? frameRate : 24.f;
+
+			i32 frameCount = (i32)(timeline_get_duration(bar->timeline)*frameRate) + 1;
+
+			struct timespec startTime;
+			clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+			// the edited scene keeps its values, as the timeline plays in a scene of its
+			// own. Unchanged objects keep their bounding volume nodes and cached lighting 
+			// from frame to frame, and from one animation to the next.
+			if(!bar->animationScene)
+			{
+				bar->animationScene = scene_init();
+			}
+
+			scene_publish(scene);
+			scene_snapshot *snapshot = scene_acquire_snapshot(scene);
+			scene_adopt_snapshot(bar->animationScene, snapshot);
+			scene_release_snapshot(snapshot);
+
+			i32 writtenCount = renderer_draw_timeline(renderer, screenshotCanvas, 
+					bar->animationScene, bar->timeline, 0, frameCount, frameRate, args[0]);
+
+			struct timespec endTime;
+			clock_gettime(CLOCK_MONOTONIC, &endTime);
+
+			real64 milliseconds = (endTime.tv_sec - startTime.tv_sec)*1000.0 + 
+				(endTime.tv_nsec - startTime.tv_nsec)/1000000.0;
+
+			printf("Rendered %d of %d frames in %.0f ms, %.1f ms per frame.\n", 
+					writtenCount, frameCount, milliseconds, 
+					milliseconds/(writtenCount > 0 ? writtenCount : 1));
+		}
+		else
+		{
+			fprintf(stderr, "Usage: animate <name> [fps], after keys were added with /key\n");
+		}
+	}
+	else if(!strcmp(commandBuffer, "turntable"))
+	{
+		i32 viewCount = argCount > 0 ? atoi(args[0]) : 8;
+		viewCount = viewCount < 1 ? 1 : viewCount;
+
+		i32 width = canvas_get_width(canvas);
+		i32 height = canvas_get_height(canvas);
+
+		v4 position;
+		real32 yaw;
+		real32 pitch;
+		scene_get_camera_position(renderScene, &position);
+		scene_get_camera_orientation(renderScene, &yaw, &pitch);
+
+		renderer_view *views = memory_arena_push(frameArena, sizeof(renderer_view)*viewCount);
+
+		for(i32 i = 0; i < viewCount; ++i)
+		{
+			views[i].position = position;
+			views[i].yaw = yaw + 360.f*(real32)i/(real32)viewCount;
+			views[i].pitch = pitch;
+			views[i].width = width;
+			views[i].height = height;
+			views[i].pixels = memory_arena_push(frameArena, sizeof(u32)*width*height);
+		}
+
+		struct timespec startTime;
+		clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+		renderer_draw_views(renderer, renderScene, dispatcher, views, viewCount);
+
+		struct timespec endTime;
+		clock_gettime(CLOCK_MONOTONIC, &endTime);
+
+		real64 milliseconds = (endTime.tv_sec - startTime.tv_sec)*1000.0 + 
+			(endTime.tv_nsec - startTime.tv_nsec)/1000000.0;
+
+		const char *name = argCount > 1 ? args[1] : "turntable";
+		i32 writtenCount = renderer_save_views(views, viewCount, name);
+
+		printf("Rendered %d views of %dx%d in %.0f ms, %.1f ms per view, wrote %d.\n", 
+				viewCount, width, height, milliseconds, milliseconds/viewCount, 
+				writtenCount);
 	}
-	free(args);
 
 	return B32_TRUE;
 }
@@ -0,0 +1,355 @@
+#include "memory.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#define MEMORY_ALIGNMENT 16
+#define MEMORY_HUGE_PAGE_SIZE (2*1024*1024)
+
+#define MEMORY_ALIGN(size) (((size) + MEMORY_ALIGNMENT - 1) & ~(u64)(MEMORY_ALIGNMENT - 1))
+
+// the header sits at the start of its own allocation, followed by size bytes
+typedef struct memory_block memory_block;
+
+struct memory_block
+{
+	memory_block *prev;
+	u64 size;
+	u64 used;
+	// arena position of the first byte, so that markers span blocks
+	u64 basePosition;
+};
+
+#define MEMORY_BLOCK_HEADER_SIZE MEMORY_ALIGN(sizeof(memory_block))
+
+struct memory_arena
+{
+	memory_arena *next;
+	const char *name;
+	u64 blockSize;
+	u32 flags;
+	memory_block *current;
+	// popped blocks, reused before anything new is allocated
+	memory_block *spare;
+	i32 blockCount;
+	u64 reservedBytes;
+	u64 peakBytes;
+	u64 allocationCount;
+};
+
+typedef struct memory_pool_element memory_pool_element;
+
+struct memory_pool_element
+{
+	memory_pool_element *next;
+};
+
+struct memory_pool
+{
+	memory_pool *next;
+	const char *name;
+	u64 elementSize;
+	i32 elementsPerBlock;
+	// every block starts with the pointer to the previous one
+	void *blocks;
+	memory_pool_element *freeList;
+	i32 blockCount;
+	u64 liveCount;
+	u64 peakCount;
+	u64 allocationCount;
+};
+
+static memory_arena *_memory_arenas = NULL;
+static memory_pool *_memory_pools = NULL;
+
+memory_arena *
+memory_create_arena(const char *name, u64 blockSize, u32 flags)
+{
+	memory_arena *arena = calloc(1, sizeof(memory_arena));
+	arena->name = name;
+	arena->blockSize = blockSize;
+	arena->flags = flags;
+
+	arena->next = _memory_arenas;
+	_memory_arenas = arena;
+
+	return arena;
+}
+
+static void
+_memory_free_blocks(memory_block *block)
+{
+	while(block)
+	{
+		memory_block *prev = block->prev;
+		free(block);
+		block = prev;
+	}
+}
+
+void
+memory_destroy_arena(memory_arena *arena)
+{
+	memory_arena **link = &_memory_arenas;
+
+	while(*link != arena)
+	{
+		link = &(*link)->next;
+	}
+
+	*link = arena->next;
+
+	_memory_free_blocks(arena->current);
+	_memory_free_blocks(arena->spare);
+	free(arena);
+}
+
+static memory_block *
+_memory_arena_take_block(memory_arena *arena, u64 size)
+{
+	for(memory_block **link = &arena->spare; *link; link = &(*link)->prev)
+	{
+		if((*link)->size >= size)
+		{
+			memory_block *block = *link;
+			*link = block->prev;
+
+			return block;
+		}
+	}
+
+	u64 blockSize = size > arena->blockSize ? size : arena->blockSize;
+	u64 allocationSize = MEMORY_BLOCK_HEADER_SIZE + blockSize;
+	u64 alignment = MEMORY_ALIGNMENT;
+
+	if(arena->flags & MEMORY_HUGE_PAGES)
+	{
+		alignment = MEMORY_HUGE_PAGE_SIZE;
+		allocationSize = (allocationSize + MEMORY_HUGE_PAGE_SIZE - 1) &
+			~(u64)(MEMORY_HUGE_PAGE_SIZE - 1);
+	}
+
+	void *memory;
+
+	if(posix_memalign(&memory, alignment, allocationSize) != 0)
+	{
+		return NULL;
+	}
+
+	memory_block *block = memory;
+	block->size = allocationSize - MEMORY_BLOCK_HEADER_SIZE;
+
+	++arena->blockCount;
+	arena->reservedBytes += allocationSize;
+
+	return block;
+}
+
+void *
+memory_arena_push(memory_arena *arena, u64 size)
+{
+	size = MEMORY_ALIGN(size);
+
+	memory_block *block = arena->current;
+
+	if(!block || block->used + size > block->size)
+	{
+		block = _memory_arena_take_block(arena, size);
+
+		if(!block)
+		{
+			return NULL;
+		}
+
+		block->prev = arena->current;
+		block->used = 0;
+		block->basePosition = memory_arena_get_marker(arena);
+		arena->current = block;
+	}
+
+	void *result = (u8 *)block + MEMORY_BLOCK_HEADER_SIZE + block->used;
+	block->used += size;
+
+	++arena->allocationCount;
+
+	u64 position = block->basePosition + block->used;
+
+	if(position > arena->peakBytes)
+	{
+		arena->peakBytes = position;
+	}
+
+	return result;
+}
+
+u64
+memory_arena_get_marker(memory_arena *arena)
+{
+	return arena->current ? arena->current->basePosition + arena->current->used : 0;
+}
+
+void
+memory_arena_pop(memory_arena *arena, u64 marker)
+{
+	// the first block is always kept, so that a reset arena needs no allocation
+	while(arena->current && arena->current->prev &&
+			arena->current->basePosition >= marker)
+	{
+		memory_block *block = arena->current;
+		arena->current = block->prev;
+
+		block->prev = arena->spare;
+		arena->spare = block;
+	}
+
+	if(arena->current && marker < arena->current->basePosition + arena->current->used)
+	{
+		arena->current->used = marker - arena->current->basePosition;
+	}
+}
+
+void
+memory_arena_reset(memory_arena *arena)
+{
+	memory_arena_pop(arena, 0);
+}
+
+void
+memory_get_arena_stats(memory_arena *arena, memory_stats *outStats)
+{
+	outStats->name = arena->name;
+	outStats->blockCount = arena->blockCount;
+	outStats->reservedBytes = arena->reservedBytes;
+	outStats->usedBytes = memory_arena_get_marker(arena);
+	outStats->peakBytes = arena->peakBytes;
+	outStats->allocationCount = arena->allocationCount;
+}
+
+memory_pool *
+memory_create_pool(const char *name, u64 elementSize, i32 elementsPerBlock)
+{
+	memory_pool *pool = calloc(1, sizeof(memory_pool));
+	pool->name = name;
+	pool->elementSize = MEMORY_ALIGN(elementSize);
+	pool->elementsPerBlock = elementsPerBlock > 0 ? elementsPerBlock : 1;
+
+	pool->next = _memory_pools;
+	_memory_pools = pool;
+
+	return pool;
+}
+
+void
+memory_destroy_pool(memory_pool *pool)
+{
+	memory_pool **link = &_memory_pools;
+
+	while(*link != pool)
+	{
+		link = &(*link)->next;
+	}
+
+	*link = pool->next;
+
+	while(pool->blocks)
+	{
+		void *prev = *(void **)pool->blocks;
+		free(pool->blocks);
+		pool->blocks = prev;
+	}
+
+	free(pool);
+}
+
+void *
+memory_pool_alloc(memory_pool *pool)
+{
+	if(!pool->freeList)
+	{
+		u8 *block = malloc(MEMORY_ALIGNMENT + pool->elementSize*pool->elementsPerBlock);
+
+		if(!block)
+		{
+			return NULL;
+		}
+
+		*(void **)block = pool->blocks;
+		pool->blocks = block;
+		++pool->blockCount;
+
+		// linked back to front, so that elements are handed out in address order
+		for(i32 i = pool->elementsPerBlock - 1; i >= 0; --i)
+		{
+			memory_pool_element *element = (memory_pool_element *)
+				(block + MEMORY_ALIGNMENT + pool->elementSize*i);
+			element->next = pool->freeList;
+			pool->freeList = element;
+		}
+	}
+
+	memory_pool_element *element = pool->freeList;
+	pool->freeList = element->next;
+
+	++pool->allocationCount;
+
+	if(++pool->liveCount > pool->peakCount)
+	{
+		pool->peakCount = pool->liveCount;
+	}
+
+	return element;
+}
+
+void
+memory_pool_free(memory_pool *pool, void *element)
+{
+	if(!element)
+	{
+		return;
+	}
+
+	memory_pool_element *freed = element;
+	freed->next = pool->freeList;
+	pool->freeList = freed;
+
+	--pool->liveCount;
+}
+
+void
+memory_get_pool_stats(memory_pool *pool, memory_stats *outStats)
+{
+	outStats->name = pool->name;
+	outStats->blockCount = pool->blockCount;
+	outStats->reservedBytes = (u64)pool->blockCount*
+		(MEMORY_ALIGNMENT + pool->elementSize*pool->elementsPerBlock);
+	outStats->usedBytes = pool->liveCount*pool->elementSize;
+	outStats->peakBytes = pool->peakCount*pool->elementSize;
+	outStats->allocationCount = pool->allocationCount;
+}
+
+static void
+_memory_print_stats(const char *kind, const memory_stats *stats)
+{
+	printf("%s %-16s %4d blocks %10.1f KB reserved %10.1f KB used %10.1f KB peak "
+			"%10llu allocations\n", kind, stats->name, stats->blockCount,
+			stats->reservedBytes/1024.0, stats->usedBytes/1024.0, stats->peakBytes/1024.0,
+			(unsigned long long)stats->allocationCount);
+}
+
+void
+memory_print_stats()
+{
+	memory_stats stats;
+
+	for(memory_arena *arena = _memory_arenas; arena; arena = arena->next)
+	{
+		memory_get_arena_stats(arena, &stats);
+		_memory_print_stats("arena", &stats);
+	}
+
+	for(memory_pool *pool = _memory_pools; pool; pool = pool->next)
+	{
+		memory_get_pool_stats(pool, &stats);
+		_memory_print_stats("pool ", &stats);
+	}
+}
@@ -0,0 +1,75 @@
+#ifndef __MEMORY_H
+#define __MEMORY_H
+
+#include "stdinc.h"
+
+// blocks are 2 MB aligned and sized, so that the kernel can back them with transparent
+// huge pages. Meant for arenas of large arrays that are walked every frame.
+#define MEMORY_HUGE_PAGES (1 << 0)
+
+// linear allocations that are released all at once. Neither arenas nor pools are
+// thread safe.
+typedef struct memory_arena memory_arena;
+
+// fixed size elements that are freed one at a time onto a free list
+typedef struct memory_pool memory_pool;
+
+typedef struct memory_stats
+{
+	const char *name;
+	i32 blockCount;
+	u64 reservedBytes;
+	u64 usedBytes;
+	u64 peakBytes;
+	// since creation, including released ones
+	u64 allocationCount;
+} memory_stats;
+
+// blocks of at least blockSize are added as needed. The name is not copied.
+extern memory_arena *
+memory_create_arena(const char *name, u64 blockSize, u32 flags);
+
+extern void
+memory_destroy_arena(memory_arena *arena);
+
+// 16 byte aligned and uninitialized. Returns NULL when out of memory.
+extern void *
+memory_arena_push(memory_arena *arena, u64 size);
+
+// the position to pop back to, for temporary allocations on a longer lived arena
+extern u64
+memory_arena_get_marker(memory_arena *arena);
+
+// releases everything pushed after the marker. Blocks are kept for the next pushes.
+extern void
+memory_arena_pop(memory_arena *arena, u64 marker);
+
+// releases everything, as scratch arenas do once per frame
+extern void
+memory_arena_reset(memory_arena *arena);
+
+extern void
+memory_get_arena_stats(memory_arena *arena, memory_stats *outStats);
+
+// the size is rounded up to a multiple of 16 bytes
+extern memory_pool *
+memory_create_pool(const char *name, u64 elementSize, i32 elementsPerBlock);
+
+extern void
+memory_destroy_pool(memory_pool *pool);
+
+// uninitialized, or NULL when out of memory
+extern void *
+memory_pool_alloc(memory_pool *pool);
+
+extern void
+memory_pool_free(memory_pool *pool, void *element);
+
+extern void
+memory_get_pool_stats(memory_pool *pool, memory_stats *outStats);
+
+// one line for every arena and pool that exists
+extern void
+memory_print_stats();
+
+#endif
@@ -0,0 +1,724 @@
+#include "mesh.h"
+#include "bvh.h"
+#include "parse.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// obj files are read in blocks of this size, cut at the last full line, and every
+// block is split into chunks of whole lines that are parsed in parallel
+#define MESH_OBJ_BLOCK_SIZE (32 << 20)
+#define MESH_OBJ_CHUNKS_PER_THREAD 4
+
+// triangles are cheap enough to test that leaves are split down to pairs
+#define MESH_BVH_MIN_LEAF_SIZE 2
+
+struct raytracer_mesh
+{
+	real32 *positions;
+	i32 vertexCount;
+	// three vertex indices per triangle, ordered so that every leaf is a single range
+	u32 *indices;
+	i32 triangleCount;
+	bvh_node *nodes;
+	i32 nodeCount;
+};
+
+// per ray constants of the watertight triangle test. The ray is sheared so that it
+// points down the z axis of its largest direction component, which reduces the test
+// to 2d edge functions over the shared vertices. Edges shared by two triangles are
+// evaluated from the same floats, so rays cannot slip through between them.
+typedef struct mesh_ray
+{
+	real32 origin[3];
+	real32 direction[3];
+	real32 invDirection[3];
+	i32 kx;
+	i32 ky;
+	i32 kz;
+	real32 shearX;
+	real32 shearY;
+	real32 shearZ;
+} mesh_ray;
+
+typedef struct mesh_obj_chunk
+{
+	const char *start;
+	const char *end;
+	i32 vertexCount;
+	i32 triangleCount;
+	i32 vertexOffset;
+	i32 triangleOffset;
+	b32 isMalformed;
+} mesh_obj_chunk;
+
+typedef struct mesh_obj_block
+{
+	mesh_obj_chunk *chunks;
+	real32 *positions;
+	u32 *indices;
+} mesh_obj_block;
+
+static void
+_mesh_get_triangle_bounds(const real32 *positions, const u32 *indices, i32 triangle,
+		real32 *outMin, real32 *outMax)
+{
+	const real32 *a = &positions[3*indices[3*triangle + 0]];
+	const real32 *b = &positions[3*indices[3*triangle + 1]];
+	const real32 *c = &positions[3*indices[3*triangle + 2]];
+
+	for(i32 i = 0; i < 3; ++i)
+	{
+		real32 min = a[i] < b[i] ? a[i] : b[i];
+		real32 max = a[i] > b[i] ? a[i] : b[i];
+
+		outMin[i] = c[i] < min ? c[i] : min;
+		outMax[i] = c[i] > max ? c[i] : max;
+	}
+}
+
+static void
+_mesh_build_bvh(raytracer_mesh *mesh)
+{
+	bvh_primitive *primitives = malloc(sizeof(bvh_primitive)*(mesh->triangleCount + 1));
+
+	for(i32 i = 0; i < mesh->triangleCount; ++i)
+	{
+		_mesh_get_triangle_bounds(mesh->positions, mesh->indices, i, primitives[i].min, 
+				primitives[i].max);
+		primitives[i].index = i;
+	}
+
+	mesh->nodes = bvh_build(primitives, mesh->triangleCount, MESH_BVH_MIN_LEAF_SIZE, 
+			&mesh->nodeCount);
+
+	// store the triangles in leaf order
+	u32 *indices = malloc(sizeof(u32)*3*(mesh->triangleCount ? mesh->triangleCount : 1));
+
+	for(i32 i = 0; i < mesh->triangleCount; ++i)
+	{
+		memcpy(&indices[3*i], &mesh->indices[3*primitives[i].index], sizeof(u32)*3);
+	}
+
+	free(mesh->indices);
+	free(primitives);
+
+	mesh->indices = indices;
+}
+
+// takes ownership of the buffers
+static raytracer_mesh *
+_mesh_create(real32 *positions, i32 vertexCount, u32 *indices, i32 triangleCount)
+{
+	for(i32 i = 0; i < 3*triangleCount; ++i)
+	{
+		if(indices[i] >= (u32)vertexCount)
+		{
+			fprintf(stderr, "Mesh vertex index %u is out of range!\n", indices[i]);
+
+			free(positions);
+			free(indices);
+
+			return NULL;
+		}
+	}
+
+	raytracer_mesh *mesh = malloc(sizeof(raytracer_mesh));
+	mesh->positions = positions;
+	mesh->vertexCount = vertexCount;
+	mesh->indices = indices;
+	mesh->triangleCount = triangleCount;
+
+	_mesh_build_bvh(mesh);
+
+	return mesh;
+}
+
+raytracer_mesh *
+mesh_create(const real32 *positions, i32 vertexCount, const u32 *indices,
+		i32 triangleCount)
+{
+	real32 *ownPositions = malloc(sizeof(real32)*3*(vertexCount ? vertexCount : 1));
+	u32 *ownIndices = malloc(sizeof(u32)*3*(triangleCount ? triangleCount : 1));
+
+	memcpy(ownPositions, positions, sizeof(real32)*3*vertexCount);
+	memcpy(ownIndices, indices, sizeof(u32)*3*triangleCount);
+
+	return _mesh_create(ownPositions, vertexCount, ownIndices, triangleCount);
+}
+
+void
+mesh_destroy(raytracer_mesh *mesh)
+{
+	free(mesh->positions);
+	free(mesh->indices);
+	free(mesh->nodes);
+	free(mesh);
+}
+
+i32
+mesh_get_vertex_count(raytracer_mesh *mesh)
+{
+	return mesh->vertexCount;
+}
+
+i32
+mesh_get_triangle_count(raytracer_mesh *mesh)
+{
+	return mesh->triangleCount;
+}
+
+void
+mesh_get_bounds(raytracer_mesh *mesh, v4 *outMin, v4 *outMax)
+{
+	if(!mesh->triangleCount)
+	{
+		*outMin = vec4_init(0.f, 0.f, 0.f, 0.f);
+		*outMax = vec4_init(0.f, 0.f, 0.f, 0.f);
+
+		return;
+	}
+
+	*outMin = vec4_init(mesh->nodes[0].min[0], mesh->nodes[0].min[1],
+			mesh->nodes[0].min[2], 0.f);
+	*outMax = vec4_init(mesh->nodes[0].max[0], mesh->nodes[0].max[1],
+			mesh->nodes[0].max[2], 0.f);
+}
+
+static void
+_mesh_init_ray(mesh_ray *ray, const v4 *origin, const v4 *direction)
+{
+	for(i32 i = 0; i < 3; ++i)
+	{
+		ray->origin[i] = origin->_[i];
+		ray->direction[i] = direction->_[i];
+		ray->invDirection[i] = 1.f/direction->_[i];
+	}
+
+	real32 x = fabsf(direction->x);
+	real32 y = fabsf(direction->y);
+	real32 z = fabsf(direction->z);
+
+	ray->kz = x > y ? (x > z ? 0 : 2) : (y > z ? 1 : 2);
+	ray->kx = (ray->kz + 1) % 3;
+	ray->ky = (ray->kx + 1) % 3;
+
+	// keeps the winding of the triangles
+	if(ray->direction[ray->kz] < 0.f)
+	{
+		i32 swap = ray->kx;
+		ray->kx = ray->ky;
+		ray->ky = swap;
+	}
+
+	ray->shearX = ray->direction[ray->kx]/ray->direction[ray->kz];
+	ray->shearY = ray->direction[ray->ky]/ray->direction[ray->kz];
+	ray->shearZ = 1.f/ray->direction[ray->kz];
+}
+
+static b32
+_mesh_intersect_triangle(const raytracer_mesh *mesh, const mesh_ray *ray, i32 triangle,
+		real32 minDistance, real32 maxDistance, real32 *outDistance)
+{
+	const u32 *indices = &mesh->indices[3*triangle];
+	const real32 *a = &mesh->positions[3*indices[0]];
+	const real32 *b = &mesh->positions[3*indices[1]];
+	const real32 *c = &mesh->positions[3*indices[2]];
+
+	i32 kx = ray->kx;
+	i32 ky = ray->ky;
+	i32 kz = ray->kz;
+
+	real32 az = a[kz] - ray->origin[kz];
+	real32 bz = b[kz] - ray->origin[kz];
+	real32 cz = c[kz] - ray->origin[kz];
+
+	real32 ax = a[kx] - ray->origin[kx] - ray->shearX*az;
+	real32 ay = a[ky] - ray->origin[ky] - ray->shearY*az;
+	real32 bx = b[kx] - ray->origin[kx] - ray->shearX*bz;
+	real32 by = b[ky] - ray->origin[ky] - ray->shearY*bz;
+	real32 cx = c[kx] - ray->origin[kx] - ray->shearX*cz;
+	real32 cy = c[ky] - ray->origin[ky] - ray->shearY*cz;
+
+	real32 u = cx*by - cy*bx;
+	real32 v = ax*cy - ay*cx;
+	real32 w = bx*ay - by*ax;
+
+	// the ray passes through an edge or a vertex, decided in double precision so that
+	// both triangles sharing the edge agree
+	if(u == 0.f || v == 0.f || w == 0.f)
+	{
+		u = (real32)((real64)cx*(real64)by - (real64)cy*(real64)bx);
+		v = (real32)((real64)ax*(real64)cy - (real64)ay*(real64)cx);
+		w = (real32)((real64)bx*(real64)ay - (real64)by*(real64)ax);
+	}
+
+	if((u < 0.f || v < 0.f || w < 0.f) && (u > 0.f || v > 0.f || w > 0.f))
+	{
+		return B32_FALSE;
+	}
+
+	real32 determinant = u + v + w;
+
+	if(determinant == 0.f)
+	{
+		return B32_FALSE;
+	}
+
+	real32 t = (u*az + v*bz + w*cz)*ray->shearZ/determinant;
+
+	if(!(t > minDistance && t < maxDistance))
+	{
+		return B32_FALSE;
+	}
+
+	*outDistance = t;
+
+	return B32_TRUE;
+}
+
+// visits the nearer child first and skips nodes beyond the nearest hit so far. With
+// isAnyHit the search ends at the first triangle hit.
+static i32
+_mesh_traverse(raytracer_mesh *mesh, const mesh_ray *ray, real32 minDistance,
+		real32 maxDistance, b32 isAnyHit, real32 *outDistance)
+{
+	if(!mesh->triangleCount)
+	{
+		return -1;
+	}
+
+	i32 nodeStack[BVH_STACK_SIZE];
+	real32 nearStack[BVH_STACK_SIZE];
+	i32 stackCount = 0;
+
+	real32 nearest = maxDistance;
+	i32 hitTriangle = -1;
+
+	real32 near;
+	if(!bvh_intersect_node(&mesh->nodes[0], ray->origin, ray->invDirection, minDistance, 
+				nearest, &near))
+	{
+		return -1;
+	}
+
+	nodeStack[0] = 0;
+	nearStack[0] = near;
+	stackCount = 1;
+
+	while(stackCount > 0)
+	{
+		--stackCount;
+
+		if(nearStack[stackCount] > nearest)
+		{
+			continue;
+		}
+
+		const bvh_node *node = &mesh->nodes[nodeStack[stackCount]];
+
+		if(node->primitiveCount)
+		{
+			for(i32 i = 0; i < node->primitiveCount; ++i)
+			{
+				real32 t;
+				if(_mesh_intersect_triangle(mesh, ray, node->offset + i, minDistance,
+							nearest, &t))
+				{
+					nearest = t;
+					hitTriangle = node->offset + i;
+
+					if(isAnyHit)
+					{
+						*outDistance = nearest;
+
+						return hitTriangle;
+					}
+				}
+			}
+
+			continue;
+		}
+
+		const bvh_node *left = &mesh->nodes[node->offset];
+		const bvh_node *right = left + 1;
+
+		real32 leftNear;
+		real32 rightNear;
+		b32 isLeftHit = bvh_intersect_node(left, ray->origin, ray->invDirection, 
+				minDistance, nearest, &leftNear);
+		b32 isRightHit = bvh_intersect_node(right, ray->origin, ray->invDirection, 
+				minDistance, nearest, &rightNear);
+
+		if(isLeftHit && isRightHit)
+		{
+			// the nearer child is pushed last so that it is popped first
+			b32 isLeftNearer = leftNear <= rightNear;
+
+			nodeStack[stackCount] = isLeftNearer ? node->offset + 1 : node->offset;
+			nearStack[stackCount++] = isLeftNearer ? rightNear : leftNear;
+			nodeStack[stackCount] = isLeftNearer ? node->offset : node->offset + 1;
+			nearStack[stackCount++] = isLeftNearer ? leftNear : rightNear;
+		}
+		else if(isLeftHit)
+		{
+			nodeStack[stackCount] = node->offset;
+			nearStack[stackCount++] = leftNear;
+		}
+		else if(isRightHit)
+		{
+			nodeStack[stackCount] = node->offset + 1;
+			nearStack[stackCount++] = rightNear;
+		}
+	}
+
+	*outDistance = nearest;
+
+	return hitTriangle;
+}
+
+b32
+mesh_intersect(raytracer_mesh *mesh, const v4 *origin, const v4 *direction,
+		real32 minDistance, real32 maxDistance, real32 *outDistance, v4 *outNormal)
+{
+	mesh_ray ray;
+	_mesh_init_ray(&ray, origin, direction);
+
+	i32 triangle = _mesh_traverse(mesh, &ray, minDistance, maxDistance, B32_FALSE,
+			outDistance);
+
+	if(triangle < 0)
+	{
+		return B32_FALSE;
+	}
+
+	const u32 *indices = &mesh->indices[3*triangle];
+	const real32 *a = &mesh->positions[3*indices[0]];
+	const real32 *b = &mesh->positions[3*indices[1]];
+	const real32 *c = &mesh->positions[3*indices[2]];
+
+	v4 ab = vec4_init(b[0] - a[0], b[1] - a[1], b[2] - a[2], 0.f);
+	v4 ac = vec4_init(c[0] - a[0], c[1] - a[1], c[2] - a[2], 0.f);
+
+	vec4_cross3(&ab, &ac, outNormal);
+	vec4_normal(outNormal, outNormal);
+
+	return B32_TRUE;
+}
+
+b32
+mesh_is_occluded(raytracer_mesh *mesh, const v4 *origin, const v4 *direction,
+		real32 minDistance, real32 maxDistance)
+{
+	mesh_ray ray;
+	_mesh_init_ray(&ray, origin, direction);
+
+	real32 distance;
+
+	return _mesh_traverse(mesh, &ray, minDistance, maxDistance, B32_TRUE, &distance) >= 0;
+}
+
+// whether the line is the statement, followed by whitespace
+static b32
+_mesh_obj_is_statement(const char *c, const char *end, char statement)
+{
+	return end - c > 1 && c[0] == statement && parse_is_space(c[1]);
+}
+
+static void
+_mesh_obj_count_chunk(void *data, i32 index)
+{
+	mesh_obj_chunk *chunk = &((mesh_obj_block *)data)->chunks[index];
+
+	const char *c = chunk->start;
+
+	while(c < chunk->end)
+	{
+		c = parse_skip_spaces(c, chunk->end);
+
+		if(_mesh_obj_is_statement(c, chunk->end, 'v'))
+		{
+			++chunk->vertexCount;
+		}
+		else if(_mesh_obj_is_statement(c, chunk->end, 'f'))
+		{
+			i32 cornerCount = parse_count_tokens(c + 1, chunk->end);
+
+			if(cornerCount < 3)
+			{
+				chunk->isMalformed = B32_TRUE;
+
+				return;
+			}
+
+			chunk->triangleCount += cornerCount - 2;
+		}
+
+		c = parse_skip_line(c, chunk->end);
+	}
+}
+
+static void
+_mesh_obj_parse_chunk(void *data, i32 index)
+{
+	mesh_obj_block *block = data;
+	mesh_obj_chunk *chunk = &block->chunks[index];
+
+	real32 *positions = &block->positions[3*chunk->vertexOffset];
+	u32 *indices = &block->indices[3*chunk->triangleOffset];
+
+	// relative indices count back from the last vertex before the face
+	i64 vertexCount = chunk->vertexOffset;
+
+	const char *c = chunk->start;
+
+	while(c < chunk->end)
+	{
+		c = parse_skip_spaces(c, chunk->end);
+
+		if(_mesh_obj_is_statement(c, chunk->end, 'v'))
+		{
+			++c;
+
+			for(i32 i = 0; i < 3; ++i)
+			{
+				c = parse_real(parse_skip_spaces(c, chunk->end), chunk->end,
+						positions++);
+
+				if(!c)
+				{
+					chunk->isMalformed = B32_TRUE;
+
+					return;
+				}
+			}
+
+			++vertexCount;
+		}
+		else if(_mesh_obj_is_statement(c, chunk->end, 'f'))
+		{
+			++c;
+
+			u32 first = 0;
+			u32 previous = 0;
+
+			for(i32 corner = 0;; ++corner)
+			{
+				c = parse_skip_spaces(c, chunk->end);
+
+				if(c == chunk->end || *c == '\n')
+				{
+					break;
+				}
+
+				// only the position index of v/vt/vn triples is used
+				i64 value;
+				c = parse_integer(c, chunk->end, &value);
+
+				if(!c || value == 0)
+				{
+					chunk->isMalformed = B32_TRUE;
+
+					return;
+				}
+
+				value = value > 0 ? value - 1 : vertexCount + value;
+
+				if(value < 0)
+				{
+					chunk->isMalformed = B32_TRUE;
+
+					return;
+				}
+
+				while(c < chunk->end && *c != '\n' && !parse_is_space(*c))
+				{
+					++c;
+				}
+
+				if(corner == 0)
+				{
+					first = (u32)value;
+				}
+				else if(corner >= 2)
+				{
+					*indices++ = first;
+					*indices++ = previous;
+					*indices++ = (u32)value;
+				}
+
+				previous = (u32)value;
+			}
+		}
+
+		c = parse_skip_line(c, chunk->end);
+	}
+}
+
+raytracer_mesh *
+mesh_load_obj(work_dispatcher *dispatcher, const char *path)
+{
+	FILE *file = fopen(path, "rb");
+
+	if(!file)
+	{
+		fprintf(stderr, "Cannot open obj file '%s'!\n", path);
+
+		return NULL;
+	}
+
+	i32 chunkCount = work_get_thread_count(dispatcher)*MESH_OBJ_CHUNKS_PER_THREAD;
+
+	char *buffer = malloc(MESH_OBJ_BLOCK_SIZE);
+	mesh_obj_chunk *chunks = malloc(sizeof(mesh_obj_chunk)*chunkCount);
+
+	i32 vertexCount = 0;
+	i32 vertexCapacity = 1 << 16;
+	real32 *positions = malloc(sizeof(real32)*3*vertexCapacity);
+
+	i32 triangleCount = 0;
+	i32 triangleCapacity = 1 << 16;
+	u32 *indices = malloc(sizeof(u32)*3*triangleCapacity);
+
+	b32 isMalformed = B32_FALSE;
+	size_t carrySize = 0;
+
+	for(;;)
+	{
+		size_t readSize = fread(buffer + carrySize, 1, MESH_OBJ_BLOCK_SIZE - carrySize, file);
+		size_t size = carrySize + readSize;
+		b32 isLastBlock = readSize < MESH_OBJ_BLOCK_SIZE - carrySize;
+
+		if(isLastBlock && ferror(file))
+		{
+			fprintf(stderr, "Cannot read obj file '%s'!\n", path);
+			isMalformed = B32_TRUE;
+
+			break;
+		}
+
+		// a partial last line is carried over to the next block
+		size_t parseSize = size;
+
+		if(!isLastBlock)
+		{
+			while(parseSize > 0 && buffer[parseSize - 1] != '\n')
+			{
+				--parseSize;
+			}
+
+			if(!parseSize)
+			{
+				fprintf(stderr, "Line too long in obj file '%s'!\n", path);
+				isMalformed = B32_TRUE;
+
+				break;
+			}
+		}
+
+		const char *start = buffer;
+		const char *end = buffer + parseSize;
+
+		for(i32 i = 0; i < chunkCount; ++i)
+		{
+			const char *chunkEnd = i == chunkCount - 1 ? end :
+				buffer + parseSize*(size_t)(i + 1)/(size_t)chunkCount;
+
+			if(chunkEnd < start)
+			{
+				chunkEnd = start;
+			}
+			else if(chunkEnd > start && chunkEnd < end && chunkEnd[-1] != '\n')
+			{
+				chunkEnd = parse_skip_line(chunkEnd, end);
+			}
+
+			memset(&chunks[i], 0, sizeof(mesh_obj_chunk));
+			chunks[i].start = start;
+			chunks[i].end = chunkEnd;
+
+			start = chunkEnd;
+		}
+
+		mesh_obj_block block;
+		block.chunks = chunks;
+
+		work_run(dispatcher, _mesh_obj_count_chunk, &block, chunkCount);
+
+		i32 blockVertexCount = 0;
+		i32 blockTriangleCount = 0;
+
+		for(i32 i = 0; i < chunkCount; ++i)
+		{
+			isMalformed = isMalformed || chunks[i].isMalformed;
+
+			chunks[i].vertexOffset = vertexCount + blockVertexCount;
+			chunks[i].triangleOffset = triangleCount + blockTriangleCount;
+			blockVertexCount += chunks[i].vertexCount;
+			blockTriangleCount += chunks[i].triangleCount;
+		}
+
+		if(isMalformed)
+		{
+			fprintf(stderr, "Malformed face in obj file '%s'!\n", path);
+
+			break;
+		}
+
+		while(vertexCount + blockVertexCount > vertexCapacity)
+		{
+			vertexCapacity *= 2;
+			positions = realloc(positions, sizeof(real32)*3*vertexCapacity);
+		}
+
+		while(triangleCount + blockTriangleCount > triangleCapacity)
+		{
+			triangleCapacity *= 2;
+			indices = realloc(indices, sizeof(u32)*3*triangleCapacity);
+		}
+
+		block.positions = positions;
+		block.indices = indices;
+
+		work_run(dispatcher, _mesh_obj_parse_chunk, &block, chunkCount);
+
+		for(i32 i = 0; i < chunkCount; ++i)
+		{
+			isMalformed = isMalformed || chunks[i].isMalformed;
+		}
+
+		if(isMalformed)
+		{
+			fprintf(stderr, "Malformed statement in obj file '%s'!\n", path);
+
+			break;
+		}
+
+		vertexCount += blockVertexCount;
+		triangleCount += blockTriangleCount;
+
+		if(isLastBlock)
+		{
+			break;
+		}
+
+		carrySize = size - parseSize;
+		memmove(buffer, buffer + parseSize, carrySize);
+	}
+
+	fclose(file);
+	free(buffer);
+	free(chunks);
+
+	if(isMalformed)
+	{
+		free(positions);
+		free(indices);
+
+		return NULL;
+	}
+
+	return _mesh_create(positions, vertexCount, indices, triangleCount);
+}
@@ -0,0 +1,48 @@
+#ifndef __MESH_H
+#define __MESH_H
+
+#include "stdinc.h"
+#include "rt_math.h"
+#include "work.h"
+
+// triangles over a shared vertex buffer, with a bounding volume hierarchy built once
+// on creation. Meshes are immutable and can be referenced by any number of objects.
+typedef struct raytracer_mesh raytracer_mesh;
+
+// copies xyz positions and three vertex indices per triangle. Returns NULL if an index
+// is out of range.
+extern raytracer_mesh *
+mesh_create(const real32 *positions, i32 vertexCount, const u32 *indices,
+		i32 triangleCount);
+
+// reads vertex positions and faces from a wavefront obj file in blocks, parsing every
+// block in parallel on the dispatcher. Polygons are split into triangle fans and every
+// other statement is skipped. Returns NULL if the file cannot be read or is malformed.
+extern raytracer_mesh *
+mesh_load_obj(work_dispatcher *dispatcher, const char *path);
+
+extern void
+mesh_destroy(raytracer_mesh *mesh);
+
+extern i32
+mesh_get_vertex_count(raytracer_mesh *mesh);
+
+extern i32
+mesh_get_triangle_count(raytracer_mesh *mesh);
+
+extern void
+mesh_get_bounds(raytracer_mesh *mesh, v4 *outMin, v4 *outMax);
+
+// nearest triangle hit in (minDistance, maxDistance), in multiples of the direction,
+// which does not need to be normalized. The normal is the geometric one, facing the
+// side the vertices wind counter clockwise on.
+extern b32
+mesh_intersect(raytracer_mesh *mesh, const v4 *origin, const v4 *direction,
+		real32 minDistance, real32 maxDistance, real32 *outDistance, v4 *outNormal);
+
+// any triangle hit in (minDistance, maxDistance)
+extern b32
+mesh_is_occluded(raytracer_mesh *mesh, const v4 *origin, const v4 *direction,
+		real32 minDistance, real32 maxDistance);
+
+#endif
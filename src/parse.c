@@ -0,0 +1,198 @@
+#include "parse.h"
+
+#include <string.h>
+#include <math.h>
+
+b32
+parse_is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+const char *
+parse_skip_spaces(const char *c, const char *end)
+{
+	while(c < end && parse_is_space(*c))
+	{
+		++c;
+	}
+
+	return c;
+}
+
+const char *
+parse_skip_line(const char *c, const char *end)
+{
+	const char *newLine = memchr(c, '\n', end - c);
+
+	return newLine ? newLine + 1 : end;
+}
+
+i32
+parse_count_tokens(const char *c, const char *end)
+{
+	i32 tokenCount = 0;
+
+	for(;;)
+	{
+		c = parse_skip_spaces(c, end);
+
+		if(c == end || *c == '\n')
+		{
+			return tokenCount;
+		}
+
+		++tokenCount;
+
+		while(c < end && *c != '\n' && !parse_is_space(*c))
+		{
+			++c;
+		}
+	}
+}
+
+const char *
+parse_integer(const char *c, const char *end, i64 *out)
+{
+	b32 isNegative = c < end && *c == '-';
+
+	if(c < end && (*c == '-' || *c == '+'))
+	{
+		++c;
+	}
+
+	if(c == end || *c < '0' || *c > '9')
+	{
+		return NULL;
+	}
+
+	i64 value = 0;
+
+	for(; c < end && *c >= '0' && *c <= '9'; ++c)
+	{
+		value = value*10 + (*c - '0');
+
+		if(value > 0xFFFFFFFFll)
+		{
+			return NULL;
+		}
+	}
+
+	*out = isNegative ? -value : value;
+
+	return c;
+}
+
+const char *
+parse_real(const char *c, const char *end, real32 *out)
+{
+	b32 isNegative = c < end && *c == '-';
+
+	if(c < end && (*c == '-' || *c == '+'))
+	{
+		++c;
+	}
+
+	u64 mantissa = 0;
+	i32 exponent = 0;
+	i32 digitCount = 0;
+
+	for(; c < end && *c >= '0' && *c <= '9'; ++c, ++digitCount)
+	{
+		if(mantissa < 100000000000000000ull)
+		{
+			mantissa = mantissa*10 + (u64)(*c - '0');
+		}
+		else
+		{
+			++exponent;
+		}
+	}
+
+	if(c < end && *c == '.')
+	{
+		for(++c; c < end && *c >= '0' && *c <= '9'; ++c, ++digitCount)
+		{
+			if(mantissa < 100000000000000000ull)
+			{
+				mantissa = mantissa*10 + (u64)(*c - '0');
+				--exponent;
+			}
+		}
+	}
+
+	if(!digitCount)
+	{
+		return NULL;
+	}
+
+	if(c < end && (*c == 'e' || *c == 'E'))
+	{
+		i64 value;
+		const char *next = parse_integer(c + 1, end, &value);
+
+		if(!next)
+		{
+			return NULL;
+		}
+
+		exponent += (i32)value;
+		c = next;
+	}
+
+	real64 value = (real64)mantissa;
+
+	if(exponent)
+	{
+		value *= pow(10.0, (real64)exponent);
+	}
+
+	*out = (real32)(isNegative ? -value : value);
+
+	return c;
+}
+
+const char *
+parse_hex(const char *c, const char *end, u32 *out)
+{
+	u32 value = 0;
+	i32 digitCount = 0;
+
+	for(; c < end; ++c, ++digitCount)
+	{
+		u32 digit;
+
+		if(*c >= '0' && *c <= '9')
+		{
+			digit = (u32)(*c - '0');
+		}
+		else if(*c >= 'a' && *c <= 'f')
+		{
+			digit = (u32)(*c - 'a' + 10);
+		}
+		else if(*c >= 'A' && *c <= 'F')
+		{
+			digit = (u32)(*c - 'A' + 10);
+		}
+		else
+		{
+			break;
+		}
+
+		if(digitCount == 8)
+		{
+			return NULL;
+		}
+
+		value = (value << 4) | digit;
+	}
+
+	if(!digitCount)
+	{
+		return NULL;
+	}
+
+	*out = value;
+
+	return c;
+}
@@ -0,0 +1,38 @@
+#ifndef __PARSE_H
+#define __PARSE_H
+
+#include "stdinc.h"
+
+// tokenizing for the line based text formats. Buffers do not need to be terminated,
+// every function stops at the given end. Parsers return the character after the
+// value, or NULL if there is no valid value.
+
+// spaces and tabs, and carriage returns so that crlf line endings parse
+extern b32
+parse_is_space(char c);
+
+extern const char *
+parse_skip_spaces(const char *c, const char *end);
+
+// the start of the next line, or the end
+extern const char *
+parse_skip_line(const char *c, const char *end);
+
+// whitespace separated tokens until the end of the line
+extern i32
+parse_count_tokens(const char *c, const char *end);
+
+// at most 32 bits of magnitude
+extern const char *
+parse_integer(const char *c, const char *end, i64 *out);
+
+// decimal numbers with an optional fraction and exponent, without strtof's locale
+// lookups
+extern const char *
+parse_real(const char *c, const char *end, real32 *out);
+
+// at most 8 hexadecimal digits, without a prefix
+extern const char *
+parse_hex(const char *c, const char *end, u32 *out);
+
+#endif
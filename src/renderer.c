@@ -1,6 +1,8 @@
 #include "renderer.h"
 #include "canvas.h"
 #include "scene.h"
+#include "memory.h"
+#include "timeline.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,6 +10,7 @@
 
 #include <sys/stat.h>
 #include <dirent.h>
+#include <pthread.h>
 
 typedef struct renderer_texture
 {
@@ -27,15 +30,51 @@ typedef struct renderer_overlay
 	i32 backgroundTextureId;
 } renderer_overlay;
 
+// the tiles of every view are numbered consecutively, starting at the view's offset
+typedef struct renderer_view_job
+{
+	raytracer_renderer *renderer;
+	raytracer_scene *scene;
+	const renderer_view *views;
+	scene_view **sceneViews;
+	i32 *tileOffsets;
+	// contexts not in use by any thread, taken and returned under the mutex
+	scene_trace_context **freeContexts;
+	i32 freeContextCount;
+	pthread_mutex_t mutex;
+} renderer_view_job;
+
+// textures are never released, so their pixels share one arena
+#define RENDERER_TEXTURE_BLOCK_SIZE (8*1024*1024)
+
 struct raytracer_renderer
 {
+	memory_arena *textureArena;
 	renderer_texture *textures;
 	i32 textureCount;
+	i32 textureCapacity;
 	renderer_overlay *overlays;
 	i32 overlayCount;
+	i32 overlayCapacity;
+	scene_trace_context *traceContext;
+	// one for each thread tracing views
+	scene_trace_context **viewContexts;
+	i32 viewContextCount;
+	// kept between batches, so that their tile bins are reused
+	scene_view **sceneViews;
+	i32 sceneViewCount;
+	scene_trace_stats traceStats;
+	v4 *accumulation;
+	i32 accumulationCapacity;
+	i32 accumulationSampleCount;
+	i32 accumulatedFrameCount;
+	// versions only order the changes of one scene
+	const raytracer_scene *accumulationScene;
+	u32 accumulationSceneVersion;
 	i32 activeOverlayId;
 	color32 backgroundColor;
 	b32 isSaveNextFrame;
+	b32 isVisibilityPrepass;
 	char saveNextFrameFileName[50];
 };
 
@@ -45,15 +84,78 @@ renderer_init()
 	raytracer_renderer *r = malloc(sizeof(raytracer_renderer));
 	r->backgroundColor = 0x0;
 	r->isSaveNextFrame = B32_FALSE;
+	r->isVisibilityPrepass = B32_FALSE;
+	r->textureArena = memory_create_arena("textures", RENDERER_TEXTURE_BLOCK_SIZE, 
+			MEMORY_HUGE_PAGES);
 	r->textures = NULL;
 	r->textureCount = 0;
+	r->textureCapacity = 0;
 	r->overlays = NULL;
 	r->overlayCount = 0;
+	r->overlayCapacity = 0;
 	r->activeOverlayId = RENDERER_OVERLAY_NULL;
+	r->traceContext = scene_create_trace_context();
+	r->viewContexts = NULL;
+	r->viewContextCount = 0;
+	r->sceneViews = NULL;
+	r->sceneViewCount = 0;
+	memset(&r->traceStats, 0, sizeof(r->traceStats));
+	r->accumulation = NULL;
+	r->accumulationCapacity = 0;
+	r->accumulationSampleCount = 0;
+	r->accumulatedFrameCount = 0;
+	r->accumulationScene = NULL;
+	r->accumulationSceneVersion = 0;
 
 	return r;
 }
 
+static void
+_renderer_make_screenshot_directory()
+{
+	struct stat st;
+	if(stat("screenshots", &st) == -1)
+	{
+		mkdir("screenshots", S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+	}
+}
+
+// the pixels after a header with the format code and size
+static b32
+_renderer_write_pixels(const u32 *pixels, i32 width, i32 height, const char *path)
+{
+	FILE *file = fopen(path, "wb");
+	if(!file)
+	{
+		fprintf(stderr, "Cannot open file '%s' to write image!\n", path);
+		return B32_FALSE;
+	}
+
+	struct
+	{
+		u16 imageFormatCode;
+		i16 imageWidth;
+		i16 imageHeight;
+		i16 padding1;
+	} header = {
+		(u16)0xDEAD, width, height, 0
+	};
+
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(pixels, sizeof(u32)*width, height, file);
+
+	fclose(file);
+
+	return B32_TRUE;
+}
+
+static b32
+_renderer_write_image(raytracer_canvas *canvas, const char *path)
+{
+	return _renderer_write_pixels(canvas_get_buffer(canvas), canvas_get_width(canvas), 
+			canvas_get_height(canvas), path);
+}
+
 void
 renderer_draw_scene(raytracer_renderer *renderer, raytracer_canvas *canvas, 
 		raytracer_scene *scene)
@@ -71,6 +173,54 @@ renderer_draw_scene(raytracer_renderer *renderer, raytracer_canvas *canvas,
 		i32 xPartitionCount = width/partitionWidth;
 		i32 yPartitionCount = height/partitionHeight;
 
+		scene_select_kernel(scene);
+		scene_update_ray_table(scene, canvas);
+		scene_bin_objects(scene, canvas, RENDERER_TILE_SIZE);
+		scene_update_light_index(scene);
+		scene_update_object_bvh(scene);
+		scene_update_chunk_residency(scene);
+
+		if(renderer->isVisibilityPrepass)
+		{
+			scene_rasterize_visibility(scene, canvas, partitionWidth, partitionHeight);
+		}
+
+		// stochastic light sampling and russian roulette converge by averaging frames 
+		// until the scene changes
+		b32 isAccumulating = scene_is_stochastic(scene);
+
+		if(isAccumulating)
+		{
+			i32 sampleCount = xPartitionCount*yPartitionCount;
+
+			if(sampleCount > renderer->accumulationCapacity)
+			{
+				renderer->accumulationCapacity = sampleCount;
+				renderer->accumulation = realloc(renderer->accumulation, 
+						sizeof(v4)*renderer->accumulationCapacity);
+				renderer->accumulatedFrameCount = 0;
+			}
+
+			if(renderer->accumulationSampleCount != sampleCount || 
+					renderer->accumulationScene != scene || 
+					renderer->accumulationSceneVersion != scene_get_version(scene))
+			{
+				renderer->accumulatedFrameCount = 0;
+			}
+
+			if(renderer->accumulatedFrameCount == 0)
+			{
+				memset(renderer->accumulation, 0, sizeof(v4)*sampleCount);
+			}
+
+			renderer->accumulationSampleCount = sampleCount;
+			renderer->accumulationScene = scene;
+			renderer->accumulationSceneVersion = scene_get_version(scene);
+			++renderer->accumulatedFrameCount;
+		}
+
+		scene_reset_trace_stats(renderer->traceContext);
+
 		i32 xMin = 0;
 		i32 yMin = 0;
 		i32 xMax = xPartitionCount;
@@ -84,38 +234,42 @@ renderer_draw_scene(raytracer_renderer *renderer, raytracer_canvas *canvas,
 			{
 				i32 x = _x*partitionWidth;
 
+				i32 tileId = scene_get_tile(scene, x+partitionWidth/2, y+partitionHeight/2);
+				i32 sampleId = renderer->isVisibilityPrepass ? scene_get_sample(scene, x, y) : 
+					SCENE_SAMPLE_NULL;
+
+				v4 color;
+
+				if(!scene_trace_pixel_ray(scene, renderer->traceContext, sampleId, tileId, 
+							x+partitionWidth/2, y+partitionHeight/2, &color))
+				{
+					color = vec4_from_color32(renderer->backgroundColor);
+				}
+
+				if(isAccumulating)
+				{
+					v4 *accumulated = &renderer->accumulation[_y*xPartitionCount + _x];
+					vec4_add3(accumulated, &color, accumulated);
+					vec4_scalar3(accumulated, 1.f/(real32)renderer->accumulatedFrameCount, &color);
+				}
+
+				color32 result = vec4_to_color32(&color);
+
 				for(i32 pY = 0; pY < partitionHeight; ++pY)
 				{
 					for(i32 pX = 0; pX < partitionWidth; ++pX)
 					{
-						v4 cameraPosition;
-						scene_get_camera_position(scene, &cameraPosition);
-
-						v4 viewportPoint;
-						scene_canvas_to_world_coordinates(scene, canvas, x+partitionWidth/2, y+partitionHeight/2, &viewportPoint);
-
-						color32 result;
-
-						if(scene_trace_ray(scene, &viewportPoint, &result))
-						{
-							canvas_put_pixel(canvas, x+pX, y+pY, result);
-						}
-						else
-						{
-							canvas_put_pixel(canvas, x+pX, y+pY, renderer->backgroundColor);
-						}
+						canvas_put_pixel(canvas, x+pX, y+pY, result);
 					}
 				}
 			}
 		}
 
+		scene_get_trace_stats(renderer->traceContext, &renderer->traceStats);
+
 		if(renderer->isSaveNextFrame)
 		{
-			struct stat st;
-			if(stat("screenshots", &st) == -1)
-			{
-				mkdir("screenshots", S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-			}
+			_renderer_make_screenshot_directory();
 
 			i32 fileIndex = 0;
 
@@ -146,30 +300,11 @@ renderer_draw_scene(raytracer_renderer *renderer, raytracer_canvas *canvas,
 
 			printf("Opening file '%s' for writing image!\n", nameBuffer);
 
-			FILE *file = fopen(nameBuffer, "wb");
-			if(!file)
+			if(!_renderer_write_image(canvas, nameBuffer))
 			{
-				fprintf(stderr, "Cannot open file '%s' to write image!\n", nameBuffer);
 				return;
 			}
 
-			u32 *canvasBuffer = canvas_get_buffer(canvas);
-
-			struct
-			{
-				u16 imageFormatCode;
-				i16 imageWidth;
-				i16 imageHeight;
-				i16 padding1;
-			} header = {
-				(u16)0xDEAD, width, height, 0
-			};
-
-			fwrite(&header, sizeof(header), 1, file);
-			fwrite(canvasBuffer, sizeof(u32)*width, height, file);
-
-			fclose(file);
-
 			renderer->isSaveNextFrame = B32_FALSE;
 		}
 	}
@@ -205,6 +340,219 @@ renderer_draw_scene(raytracer_renderer *renderer, raytracer_canvas *canvas,
 	}
 }
 
+static void
+_renderer_draw_view_tile(void *data, i32 index)
+{
+	renderer_view_job *job = data;
+
+	i32 viewId = 0;
+
+	while(index >= job->tileOffsets[viewId + 1])
+	{
+		++viewId;
+	}
+
+	const renderer_view *view = &job->views[viewId];
+	i32 tileId = index - job->tileOffsets[viewId];
+	i32 xTileCount = (view->width + RENDERER_TILE_SIZE - 1)/RENDERER_TILE_SIZE;
+
+	i32 xMin = (tileId%xTileCount)*RENDERER_TILE_SIZE;
+	i32 yMin = (tileId/xTileCount)*RENDERER_TILE_SIZE;
+	i32 xMax = xMin + RENDERER_TILE_SIZE < view->width ? xMin + RENDERER_TILE_SIZE : 
+		view->width;
+	i32 yMax = yMin + RENDERER_TILE_SIZE < view->height ? yMin + RENDERER_TILE_SIZE : 
+		view->height;
+
+	pthread_mutex_lock(&job->mutex);
+	scene_trace_context *context = job->freeContexts[--job->freeContextCount];
+	pthread_mutex_unlock(&job->mutex);
+
+	for(i32 y = yMin; y < yMax; ++y)
+	{
+		for(i32 x = xMin; x < xMax; ++x)
+		{
+			v4 color;
+
+			if(!scene_trace_view_ray(job->scene, context, job->sceneViews[viewId], x, y, 
+						&color))
+			{
+				color = vec4_from_color32(job->renderer->backgroundColor);
+			}
+
+			view->pixels[y*view->width + x] = vec4_to_color32(&color);
+		}
+	}
+
+	pthread_mutex_lock(&job->mutex);
+	job->freeContexts[job->freeContextCount++] = context;
+	pthread_mutex_unlock(&job->mutex);
+}
+
+void
+renderer_draw_views(raytracer_renderer *renderer, raytracer_scene *scene, 
+		work_dispatcher *dispatcher, const renderer_view *views, i32 viewCount)
+{
+	if(viewCount <= 0)
+	{
+		return;
+	}
+
+	scene_select_kernel(scene);
+	scene_update_light_index(scene);
+	scene_update_object_bvh(scene);
+	scene_update_chunk_residency(scene);
+
+	i32 threadCount = dispatcher ? work_get_thread_count(dispatcher) : 1;
+
+	if(threadCount > renderer->viewContextCount)
+	{
+		renderer->viewContexts = realloc(renderer->viewContexts, 
+				sizeof(scene_trace_context *)*threadCount);
+
+		for(i32 i = renderer->viewContextCount; i < threadCount; ++i)
+		{
+			renderer->viewContexts[i] = scene_create_trace_context();
+		}
+
+		renderer->viewContextCount = threadCount;
+	}
+
+	if(viewCount > renderer->sceneViewCount)
+	{
+		renderer->sceneViews = realloc(renderer->sceneViews, sizeof(scene_view *)*viewCount);
+
+		for(i32 i = renderer->sceneViewCount; i < viewCount; ++i)
+		{
+			renderer->sceneViews[i] = scene_create_view();
+		}
+
+		renderer->sceneViewCount = viewCount;
+	}
+
+	renderer_view_job job;
+	job.renderer = renderer;
+	job.scene = scene;
+	job.views = views;
+	job.sceneViews = renderer->sceneViews;
+	job.tileOffsets = malloc(sizeof(i32)*(viewCount + 1));
+	job.freeContexts = malloc(sizeof(scene_trace_context *)*threadCount);
+	job.freeContextCount = threadCount;
+	pthread_mutex_init(&job.mutex, NULL);
+
+	job.tileOffsets[0] = 0;
+
+	for(i32 i = 0; i < viewCount; ++i)
+	{
+		scene_update_view(scene, job.sceneViews[i], &views[i].position, views[i].yaw, 
+				views[i].pitch, views[i].width, views[i].height, RENDERER_TILE_SIZE);
+
+		i32 xTileCount = (views[i].width + RENDERER_TILE_SIZE - 1)/RENDERER_TILE_SIZE;
+		i32 yTileCount = (views[i].height + RENDERER_TILE_SIZE - 1)/RENDERER_TILE_SIZE;
+		job.tileOffsets[i + 1] = job.tileOffsets[i] + xTileCount*yTileCount;
+	}
+
+	for(i32 i = 0; i < threadCount; ++i)
+	{
+		job.freeContexts[i] = renderer->viewContexts[i];
+		scene_reset_trace_stats(renderer->viewContexts[i]);
+	}
+
+	i32 tileCount = job.tileOffsets[viewCount];
+
+	if(dispatcher)
+	{
+		work_run(dispatcher, _renderer_draw_view_tile, &job, tileCount);
+	}
+	else
+	{
+		for(i32 i = 0; i < tileCount; ++i)
+		{
+			_renderer_draw_view_tile(&job, i);
+		}
+	}
+
+	memset(&renderer->traceStats, 0, sizeof(renderer->traceStats));
+
+	for(i32 i = 0; i < threadCount; ++i)
+	{
+		scene_trace_stats stats;
+		scene_get_trace_stats(renderer->viewContexts[i], &stats);
+
+		renderer->traceStats.primaryRayCount += stats.primaryRayCount;
+		renderer->traceStats.secondaryRayCount += stats.secondaryRayCount;
+		renderer->traceStats.budgetTerminationCount += stats.budgetTerminationCount;
+		renderer->traceStats.rouletteTerminationCount += stats.rouletteTerminationCount;
+	}
+
+	pthread_mutex_destroy(&job.mutex);
+	free(job.freeContexts);
+	free(job.tileOffsets);
+}
+
+i32
+renderer_draw_timeline(raytracer_renderer *renderer, raytracer_canvas *canvas, 
+		raytracer_scene *scene, raytracer_timeline *timeline, i32 firstFrame, 
+		i32 frameCount, real32 frameRate, const char *name)
+{
+	_renderer_make_screenshot_directory();
+
+	for(i32 i = 0; i < frameCount; ++i)
+	{
+		i32 frame = firstFrame + i;
+
+		timeline_apply(timeline, scene, (real32)frame/frameRate);
+		renderer_draw_scene(renderer, canvas, scene);
+
+		char nameBuffer[100];
+		snprintf(nameBuffer, sizeof(nameBuffer), "screenshots/%s_%04d.scrn", name, frame);
+
+		if(!_renderer_write_image(canvas, nameBuffer))
+		{
+			return i;
+		}
+	}
+
+	return frameCount;
+}
+
+i32
+renderer_save_views(const renderer_view *views, i32 viewCount, const char *name)
+{
+	_renderer_make_screenshot_directory();
+
+	for(i32 i = 0; i < viewCount; ++i)
+	{
+		char nameBuffer[100];
+		snprintf(nameBuffer, sizeof(nameBuffer), "screenshots/%s_%04d.scrn", name, i);
+
+		if(!_renderer_write_pixels(views[i].pixels, views[i].width, views[i].height, 
+					nameBuffer))
+		{
+			return i;
+		}
+	}
+
+	return viewCount;
+}
+
+void
+renderer_toggle_visibility_prepass(raytracer_renderer *renderer)
+{
+	renderer->isVisibilityPrepass = !renderer->isVisibilityPrepass;
+}
+
+b32
+renderer_is_visibility_prepass(raytracer_renderer *renderer)
+{
+	return renderer->isVisibilityPrepass;
+}
+
+void
+renderer_get_trace_stats(raytracer_renderer *renderer, scene_trace_stats *outStats)
+{
+	*outStats = renderer->traceStats;
+}
+
 void
 renderer_draw_texture(raytracer_renderer *renderer, raytracer_canvas *canvas, 
 		i32 textureId)
@@ -229,24 +577,30 @@ renderer_save_next_frame(raytracer_renderer *renderer, const char *filename)
 	renderer->isSaveNextFrame = B32_TRUE;
 }
 
-i32
-renderer_create_texture(raytracer_renderer *renderer, i32 width, i32 height)
+// grows the texture array, doubling its capacity when full
+static i32
+_renderer_append_texture(raytracer_renderer *renderer)
 {
-	i32 index = renderer->textureCount;
-
-	if(renderer->textureCount > 0)
+	if(renderer->textureCount == renderer->textureCapacity)
 	{
+		renderer->textureCapacity = renderer->textureCapacity < 16 ? 16 : 
+			renderer->textureCapacity*2;
 		renderer->textures = realloc(renderer->textures, sizeof(renderer_texture)*
-				(++renderer->textureCount));
-	}
-	else
-	{
-		renderer->textures = malloc(sizeof(renderer_texture)*(++renderer->textureCount));
+				renderer->textureCapacity);
 	}
 
+	return renderer->textureCount++;
+}
+
+i32
+renderer_create_texture(raytracer_renderer *renderer, i32 width, i32 height)
+{
+	i32 index = _renderer_append_texture(renderer);
+
 	renderer->textures[index].width = width; 
 	renderer->textures[index].height = height; 
-	renderer->textures[index].pixels = malloc(sizeof(u32)*width*height); 
+	renderer->textures[index].pixels = memory_arena_push(renderer->textureArena, 
+			sizeof(u32)*width*height); 
 
 	return index;
 }
@@ -282,12 +636,13 @@ renderer_create_texture_from_file(raytracer_renderer *renderer, const char *path
 
 	i32 textureSize = header.imageWidth*header.imageHeight*sizeof(u32);
 
-	void *buffer = malloc(textureSize);
+	u64 textureMarker = memory_arena_get_marker(renderer->textureArena);
+	void *buffer = memory_arena_push(renderer->textureArena, textureSize);
 	readBytes = fread(buffer, sizeof(u32), header.imageWidth*header.imageHeight, file);
 
 	if(readBytes < (header.imageWidth*header.imageHeight))
 	{
-		free(buffer);
+		memory_arena_pop(renderer->textureArena, textureMarker);
 		fclose(file);
 		fprintf(stderr, "Could not read file header of '%s' for loading a texture! "
 				"Data appears to be corrupted.\n", path);
@@ -297,17 +652,7 @@ renderer_create_texture_from_file(raytracer_renderer *renderer, const char *path
 	
 	fclose(file);
 	
-	i32 index = renderer->textureCount;
-
-	if(renderer->textureCount > 0)
-	{
-		renderer->textures = realloc(renderer->textures, sizeof(renderer_texture)*
-				(++renderer->textureCount));
-	}
-	else
-	{
-		renderer->textures = malloc(sizeof(renderer_texture)*(++renderer->textureCount));
-	}
+	i32 index = _renderer_append_texture(renderer);
 
 	renderer->textures[index].width = header.imageWidth;
 	renderer->textures[index].height = header.imageHeight;
@@ -359,16 +704,14 @@ i32
 renderer_create_overlay(raytracer_renderer *renderer, i32 x, i32 y, i32 width, 
 		i32 height, i32 backgroundTextureId)
 {
-	i32 index = renderer->overlayCount;
+	i32 index = renderer->overlayCount++;
 
-	if(renderer->overlayCount > 0)
+	if(renderer->overlayCount > renderer->overlayCapacity)
 	{
+		renderer->overlayCapacity = renderer->overlayCapacity < 4 ? 4 : 
+			renderer->overlayCapacity*2;
 		renderer->overlays = realloc(renderer->overlays, sizeof(renderer_overlay)*
-				(++renderer->overlayCount));
-	}
-	else
-	{
-		renderer->overlays = malloc(sizeof(renderer_overlay)*(++renderer->overlayCount));
+				renderer->overlayCapacity);
 	}
 
 	renderer->overlays[index].width = width; 
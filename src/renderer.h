@@ -3,15 +3,21 @@
 
 #include "stdinc.h"
 #include "rt_math.h"
+#include "work.h"
 
 struct raytracer_canvas;
 struct raytracer_scene;
+struct scene_trace_stats;
+struct raytracer_timeline;
 
 typedef struct raytracer_renderer raytracer_renderer;
 
 #define RENDERER_TEXTURE_NULL -1
 #define RENDERER_OVERLAY_NULL -1
 
+// size in canvas pixels of the screen tiles objects are binned into each frame
+#define RENDERER_TILE_SIZE 32
+
 extern raytracer_renderer *
 renderer_init();
 
@@ -19,6 +25,51 @@ extern void
 renderer_draw_scene(raytracer_renderer *renderer, raytracer_canvas *canvas, 
 		raytracer_scene *scene);
 
+// a camera and the image it is rendered to by renderer_draw_views
+typedef struct renderer_view
+{
+	v4 position;
+	real32 yaw;
+	real32 pitch;
+	i32 width;
+	i32 height;
+	// width*height pixels, row by row
+	u32 *pixels;
+} renderer_view;
+
+// renders every view of the scene at full resolution, without overlays, accumulation
+// or the visibility prepass. The per frame scene setup is done once for all views, and
+// their tiles are traced together on the dispatcher, which can be NULL to trace on the
+// calling thread.
+extern void
+renderer_draw_views(raytracer_renderer *renderer, raytracer_scene *scene, 
+		work_dispatcher *dispatcher, const renderer_view *views, i32 viewCount);
+
+// writes each view to screenshots/<name>_<index>.scrn. Returns the number of views 
+// written.
+extern i32
+renderer_save_views(const renderer_view *views, i32 viewCount, const char *name);
+
+// applies the timeline at every frame time and writes the drawn canvas to 
+// screenshots/<name>_<frame>.scrn. Objects that do not move between frames keep their 
+// bounding volume nodes and cached lighting. Returns the number of frames written.
+extern i32
+renderer_draw_timeline(raytracer_renderer *renderer, raytracer_canvas *canvas, 
+		raytracer_scene *scene, raytracer_timeline *timeline, i32 firstFrame, 
+		i32 frameCount, real32 frameRate, const char *name);
+
+// rasterizes object bounds before tracing so that most primary rays only intersect
+// their first candidate
+extern void
+renderer_toggle_visibility_prepass(raytracer_renderer *renderer);
+
+extern b32
+renderer_is_visibility_prepass(raytracer_renderer *renderer);
+
+// rays traced by the last drawn frame
+extern void
+renderer_get_trace_stats(raytracer_renderer *renderer, struct scene_trace_stats *outStats);
+
 extern void
 renderer_draw_texture(raytracer_renderer *renderer, raytracer_canvas *canvas, 
 		i32 textureId);
@@ -2,134 +2,83 @@
 
 #include <math.h>
 
-extern v4
-vec4_init(real32 r, real32 g, real32 b, real32 a)
+v4
+vec4_from_color32(color32 c)
 {
-	v4 v = {{r, g, b, a}};
-	return v;
-}
-
-void
-vec4_add(const v4 *lhs, const v4 *rhs, v4 *out)
-{
-	out->r = lhs->r + rhs->r;
-	out->g = lhs->g + rhs->g;
-	out->b = lhs->b + rhs->b;
-	out->a = lhs->a + rhs->a;
-}
-
-void
-vec4_add3(const v4 *lhs, const v4 *rhs, v4 *out)
-{
-	out->r = lhs->r + rhs->r;
-	out->g = lhs->g + rhs->g;
-	out->b = lhs->b + rhs->b;
-}
-
-void
-vec4_subtract(const v4 *lhs, const v4 *rhs, v4 *out)
-{
-	out->r = lhs->r - rhs->r;
-	out->g = lhs->g - rhs->g;
-	out->b = lhs->b - rhs->b;
-	out->a = lhs->a - rhs->a;
-}
-
-void
-vec4_subtract3(const v4 *lhs, const v4 *rhs, v4 *out)
-{
-	out->r = lhs->r - rhs->r;
-	out->g = lhs->g - rhs->g;
-	out->b = lhs->b - rhs->b;
-}
-
-void
-vec4_scalar(const v4 *v, real32 scalar, v4 *out)
-{
-	out->r = v->r*scalar;
-	out->g = v->g*scalar;
-	out->b = v->b*scalar;
-	out->a = v->a*scalar;
-}
-
-void
-vec4_scalar3(const v4 *v, real32 scalar, v4 *out)
-{
-	out->r = v->r*scalar;
-	out->g = v->g*scalar;
-	out->b = v->b*scalar;
-}
-
-void
-vec4_normal(const v4 *v, v4 *out)
-{
-	real32 mag = vec4_magnitude3(v);
-
-	out->x = v->x/mag;
-	out->y = v->y/mag;
-	out->z = v->z/mag;
-}
-
-void
-vec4_direction(const v4 *lhs, const v4 *rhs, v4 *out)
-{
-	out->x = rhs->x - lhs->x;
-	out->y = rhs->y - lhs->y;
-	out->z = rhs->z - lhs->z;
-
-	vec4_normal(out, out);
-}
+	v4 v = {{
+		(real32)((c >> 16) & 0xFF)/(real32)0xFF,
+		(real32)((c >> 8) & 0xFF)/(real32)0xFF,
+		(real32)((c) & 0xFF)/(real32)0xFF,
+		0.f
+	}};
 
-real32
-vec4_magnitude(const v4 *v)
-{
-	return sqrtf((v->r*v->r) + (v->g*v->g) + (v->b*v->b) + (v->a*v->a));
-}
-
-real32
-vec4_magnitude3(const v4 *v)
-{
-	return sqrtf((v->r*v->r) + (v->g*v->g) + (v->b*v->b));
-}
-
-real32
-vec4_magnitude_squared(const v4 *v)
-{
-	return (v->r*v->r) + (v->g*v->g) + (v->b*v->b) + (v->a*v->a);
-}
-
-real32
-vec4_magnitude3_squared(const v4 *v)
-{
-	return (v->r*v->r) + (v->g*v->g) + (v->b*v->b);
-}
-
-real32
-vec4_dot(const v4 *lhs, const v4 *rhs)
-{
-	return lhs->r*rhs->r + lhs->g*rhs->g + lhs->b*rhs->b + lhs->a*rhs->a;
-}
-
-real32
-vec4_dot3(const v4 *lhs, const v4 *rhs)
-{
-	return lhs->r*rhs->r + lhs->g*rhs->g + lhs->b*rhs->b;
-}
-
-void
-vec4_cross3(const v4 *lhs, const v4 *rhs, v4 *out)
-{
-	out->x = lhs->y*rhs->z - lhs->z*rhs->y;
-	out->y = lhs->z*rhs->x - lhs->x*rhs->z;
-	out->z = lhs->x*rhs->y - lhs->y*rhs->x;
+	return v;
 }
 
-real32
-vec4_distance3(const v4 *lhs, const v4 *rhs)
-{
-	real32 x = rhs->x - lhs->x;
-	real32 y = rhs->y - lhs->y;
-	real32 z = rhs->z - lhs->z;
-
-	return sqrtf(x*x + y*y + z*z);
+color32
+vec4_to_color32(const v4 *v)
+{
+	// written so that NaN ends up as 0 instead of being converted
+	real32 r = v->r > 0.f ? (v->r < 1.f ? v->r : 1.f) : 0.f;
+	real32 g = v->g > 0.f ? (v->g < 1.f ? v->g : 1.f) : 0.f;
+	real32 b = v->b > 0.f ? (v->b < 1.f ? v->b : 1.f) : 0.f;
+
+	return ((u32)(r*0xFF) << 16) | ((u32)(g*0xFF) << 8) | (u32)(b*0xFF);
+}
+
+b32
+m44_inverse(const m44 *m, m44 *out)
+{
+	const real32 *a = m->_;
+	real32 inv[16];
+
+	// cofactors of the transposed matrix
+	inv[0] = a[5]*a[10]*a[15] - a[5]*a[11]*a[14] - a[9]*a[6]*a[15] + 
+		a[9]*a[7]*a[14] + a[13]*a[6]*a[11] - a[13]*a[7]*a[10];
+	inv[4] = -a[4]*a[10]*a[15] + a[4]*a[11]*a[14] + a[8]*a[6]*a[15] - 
+		a[8]*a[7]*a[14] - a[12]*a[6]*a[11] + a[12]*a[7]*a[10];
+	inv[8] = a[4]*a[9]*a[15] - a[4]*a[11]*a[13] - a[8]*a[5]*a[15] + 
+		a[8]*a[7]*a[13] + a[12]*a[5]*a[11] - a[12]*a[7]*a[9];
+	inv[12] = -a[4]*a[9]*a[14] + a[4]*a[10]*a[13] + a[8]*a[5]*a[14] - 
+		a[8]*a[6]*a[13] - a[12]*a[5]*a[10] + a[12]*a[6]*a[9];
+	inv[1] = -a[1]*a[10]*a[15] + a[1]*a[11]*a[14] + a[9]*a[2]*a[15] - 
+		a[9]*a[3]*a[14] - a[13]*a[2]*a[11] + a[13]*a[3]*a[10];
+	inv[5] = a[0]*a[10]*a[15] - a[0]*a[11]*a[14] - a[8]*a[2]*a[15] + 
+		a[8]*a[3]*a[14] + a[12]*a[2]*a[11] - a[12]*a[3]*a[10];
+	inv[9] = -a[0]*a[9]*a[15] + a[0]*a[11]*a[13] + a[8]*a[1]*a[15] - 
+		a[8]*a[3]*a[13] - a[12]*a[1]*a[11] + a[12]*a[3]*a[9];
+	inv[13] = a[0]*a[9]*a[14] - a[0]*a[10]*a[13] - a[8]*a[1]*a[14] + 
+		a[8]*a[2]*a[13] + a[12]*a[1]*a[10] - a[12]*a[2]*a[9];
+	inv[2] = a[1]*a[6]*a[15] - a[1]*a[7]*a[14] - a[5]*a[2]*a[15] + 
+		a[5]*a[3]*a[14] + a[13]*a[2]*a[7] - a[13]*a[3]*a[6];
+	inv[6] = -a[0]*a[6]*a[15] + a[0]*a[7]*a[14] + a[4]*a[2]*a[15] - 
+		a[4]*a[3]*a[14] - a[12]*a[2]*a[7] + a[12]*a[3]*a[6];
+	inv[10] = a[0]*a[5]*a[15] - a[0]*a[7]*a[13] - a[4]*a[1]*a[15] + 
+		a[4]*a[3]*a[13] + a[12]*a[1]*a[7] - a[12]*a[3]*a[5];
+	inv[14] = -a[0]*a[5]*a[14] + a[0]*a[6]*a[13] + a[4]*a[1]*a[14] - 
+		a[4]*a[2]*a[13] - a[12]*a[1]*a[6] + a[12]*a[2]*a[5];
+	inv[3] = -a[1]*a[6]*a[11] + a[1]*a[7]*a[10] + a[5]*a[2]*a[11] - 
+		a[5]*a[3]*a[10] - a[9]*a[2]*a[7] + a[9]*a[3]*a[6];
+	inv[7] = a[0]*a[6]*a[11] - a[0]*a[7]*a[10] - a[4]*a[2]*a[11] + 
+		a[4]*a[3]*a[10] + a[8]*a[2]*a[7] - a[8]*a[3]*a[6];
+	inv[11] = -a[0]*a[5]*a[11] + a[0]*a[7]*a[9] + a[4]*a[1]*a[11] - 
+		a[4]*a[3]*a[9] - a[8]*a[1]*a[7] + a[8]*a[3]*a[5];
+	inv[15] = a[0]*a[5]*a[10] - a[0]*a[6]*a[9] - a[4]*a[1]*a[10] + 
+		a[4]*a[2]*a[9] + a[8]*a[1]*a[6] - a[8]*a[2]*a[5];
+
+	real32 determinant = a[0]*inv[0] + a[1]*inv[4] + a[2]*inv[8] + a[3]*inv[12];
+
+	if(determinant == 0.f)
+	{
+		return B32_FALSE;
+	}
+
+	real32 invDeterminant = 1.f/determinant;
+
+	for(i32 i = 0; i < 16; ++i)
+	{
+		out->_[i] = inv[i]*invDeterminant;
+	}
+
+	return B32_TRUE;
 }
@@ -3,6 +3,15 @@
 
 #include "stdinc.h"
 
+#include <math.h>
+
+// vec4 and mat44 operations are inlined from this header. They use SSE when the
+// compiler targets it, define RT_MATH_SCALAR to force the scalar versions.
+#if defined(__SSE__) && !defined(RT_MATH_SCALAR)
+#define RT_MATH_SSE
+#include <xmmintrin.h>
+#endif
+
 typedef union vec4
 {
 	struct
@@ -22,70 +31,389 @@ typedef union vec4
 	};
 
 	real32 _[4];
+
+#ifdef RT_MATH_SSE
+	__m128 m;
+#endif
 } v4;
 
-extern v4
-vec4_init(real32 r, real32 g, real32 b, real32 a);
+// rows of a matrix applied to column vectors, out = M*v
+typedef union mat44
+{
+	struct
+	{
+		real32 _0[4];
+		real32 _1[4];
+		real32 _2[4];
+		real32 _3[4];
+	};
 
-extern void
-vec4_add(const v4 *lhs, const v4 *rhs, v4 *out);
+	real32 _[16];
+	v4 rows[4];
+} m44;
 
-extern void
-vec4_add3(const v4 *lhs, const v4 *rhs, v4 *out);
+#ifdef RT_MATH_SSE
 
-extern void
-vec4_subtract(const v4 *lhs, const v4 *rhs, v4 *out);
+// xyz of the first vector with w of the second
+static inline __m128
+_rt_math_merge_w(__m128 xyz, __m128 w)
+{
+	__m128 zw = _mm_shuffle_ps(xyz, w, _MM_SHUFFLE(3, 3, 2, 2));
+
+	return _mm_shuffle_ps(xyz, zw, _MM_SHUFFLE(2, 0, 1, 0));
+}
+
+// the sum of the first three lanes, in the lowest lane
+static inline __m128
+_rt_math_sum3(__m128 v)
+{
+	__m128 y = _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1));
+	__m128 z = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2));
+
+	return _mm_add_ss(_mm_add_ss(v, y), z);
+}
+
+static inline __m128
+_rt_math_sum4(__m128 v)
+{
+	__m128 t = _mm_add_ps(v, _mm_movehl_ps(v, v));
+
+	return _mm_add_ss(t, _mm_shuffle_ps(t, t, _MM_SHUFFLE(1, 1, 1, 1)));
+}
+
+#endif
 
-extern void
-vec4_subtract3(const v4 *lhs, const v4 *rhs, v4 *out);
+static inline v4
+vec4_init(real32 r, real32 g, real32 b, real32 a)
+{
+	v4 v = {{r, g, b, a}};
+	return v;
+}
 
-extern void
-vec4_scalar(const v4 *v, real32 scalar, v4 *out);
+static inline void
+vec4_add(const v4 *lhs, const v4 *rhs, v4 *out)
+{
+#ifdef RT_MATH_SSE
+	out->m = _mm_add_ps(lhs->m, rhs->m);
+#else
+	out->r = lhs->r + rhs->r;
+	out->g = lhs->g + rhs->g;
+	out->b = lhs->b + rhs->b;
+	out->a = lhs->a + rhs->a;
+#endif
+}
 
-extern void
-vec4_scalar3(const v4 *v, real32 scalar, v4 *out);
+// the 3 variants only operate on xyz and carry w over from the first operand
+static inline void
+vec4_add3(const v4 *lhs, const v4 *rhs, v4 *out)
+{
+#ifdef RT_MATH_SSE
+	out->m = _rt_math_merge_w(_mm_add_ps(lhs->m, rhs->m), lhs->m);
+#else
+	out->r = lhs->r + rhs->r;
+	out->g = lhs->g + rhs->g;
+	out->b = lhs->b + rhs->b;
+	out->a = lhs->a;
+#endif
+}
 
-extern void
-vec4_normal(const v4 *v, v4 *out);
+static inline void
+vec4_subtract(const v4 *lhs, const v4 *rhs, v4 *out)
+{
+#ifdef RT_MATH_SSE
+	out->m = _mm_sub_ps(lhs->m, rhs->m);
+#else
+	out->r = lhs->r - rhs->r;
+	out->g = lhs->g - rhs->g;
+	out->b = lhs->b - rhs->b;
+	out->a = lhs->a - rhs->a;
+#endif
+}
 
-extern void
-vec4_direction(const v4 *lhs, const v4 *rhs, v4 *out);
+static inline void
+vec4_subtract3(const v4 *lhs, const v4 *rhs, v4 *out)
+{
+#ifdef RT_MATH_SSE
+	out->m = _rt_math_merge_w(_mm_sub_ps(lhs->m, rhs->m), lhs->m);
+#else
+	out->r = lhs->r - rhs->r;
+	out->g = lhs->g - rhs->g;
+	out->b = lhs->b - rhs->b;
+	out->a = lhs->a;
+#endif
+}
 
-extern real32
-vec4_magnitude(const v4 *v);
+static inline void
+vec4_scalar(const v4 *v, real32 scalar, v4 *out)
+{
+#ifdef RT_MATH_SSE
+	out->m = _mm_mul_ps(v->m, _mm_set1_ps(scalar));
+#else
+	out->r = v->r*scalar;
+	out->g = v->g*scalar;
+	out->b = v->b*scalar;
+	out->a = v->a*scalar;
+#endif
+}
 
-extern real32
-vec4_magnitude3(const v4 *v);
+static inline void
+vec4_scalar3(const v4 *v, real32 scalar, v4 *out)
+{
+#ifdef RT_MATH_SSE
+	out->m = _rt_math_merge_w(_mm_mul_ps(v->m, _mm_set1_ps(scalar)), v->m);
+#else
+	out->r = v->r*scalar;
+	out->g = v->g*scalar;
+	out->b = v->b*scalar;
+	out->a = v->a;
+#endif
+}
 
-extern real32
-vec4_magnitude_squared(const v4 *v);
+static inline real32
+vec4_dot(const v4 *lhs, const v4 *rhs)
+{
+#ifdef RT_MATH_SSE
+	return _mm_cvtss_f32(_rt_math_sum4(_mm_mul_ps(lhs->m, rhs->m)));
+#else
+	return lhs->r*rhs->r + lhs->g*rhs->g + lhs->b*rhs->b + lhs->a*rhs->a;
+#endif
+}
 
-extern real32
-vec4_magnitude3_squared(const v4 *v);
+static inline real32
+vec4_dot3(const v4 *lhs, const v4 *rhs)
+{
+#ifdef RT_MATH_SSE
+	return _mm_cvtss_f32(_rt_math_sum3(_mm_mul_ps(lhs->m, rhs->m)));
+#else
+	return lhs->r*rhs->r + lhs->g*rhs->g + lhs->b*rhs->b;
+#endif
+}
 
-extern real32
-vec4_dot(const v4 *lhs, const v4 *rhs);
+static inline real32
+vec4_magnitude_squared(const v4 *v)
+{
+	return vec4_dot(v, v);
+}
 
-extern real32
-vec4_dot3(const v4 *lhs, const v4 *rhs);
+static inline real32
+vec4_magnitude3_squared(const v4 *v)
+{
+	return vec4_dot3(v, v);
+}
 
-extern void
-vec4_cross3(const v4 *lhs, const v4 *rhs, v4 *out);
+static inline real32
+vec4_magnitude(const v4 *v)
+{
+#ifdef RT_MATH_SSE
+	return _mm_cvtss_f32(_mm_sqrt_ss(_rt_math_sum4(_mm_mul_ps(v->m, v->m))));
+#else
+	return sqrtf((v->r*v->r) + (v->g*v->g) + (v->b*v->b) + (v->a*v->a));
+#endif
+}
 
-extern real32
-vec4_distance3(const v4 *lhs, const v4 *rhs);
+static inline real32
+vec4_magnitude3(const v4 *v)
+{
+#ifdef RT_MATH_SSE
+	return _mm_cvtss_f32(_mm_sqrt_ss(_rt_math_sum3(_mm_mul_ps(v->m, v->m))));
+#else
+	return sqrtf((v->r*v->r) + (v->g*v->g) + (v->b*v->b));
+#endif
+}
 
-typedef union mat44
+static inline void
+vec4_normal(const v4 *v, v4 *out)
 {
-	struct
+#ifdef RT_MATH_SSE
+	// rsqrt is good to 12 bits, a newton step brings it to float precision
+	__m128 magSquared = _rt_math_sum3(_mm_mul_ps(v->m, v->m));
+	__m128 y = _mm_rsqrt_ss(magSquared);
+	__m128 yy = _mm_mul_ss(y, y);
+	y = _mm_mul_ss(_mm_mul_ss(_mm_set_ss(0.5f), y),
+			_mm_sub_ss(_mm_set_ss(3.f), _mm_mul_ss(magSquared, yy)));
+
+	y = _mm_shuffle_ps(y, y, _MM_SHUFFLE(0, 0, 0, 0));
+	out->m = _rt_math_merge_w(_mm_mul_ps(v->m, y), v->m);
+#else
+	real32 mag = vec4_magnitude3(v);
+
+	out->x = v->x/mag;
+	out->y = v->y/mag;
+	out->z = v->z/mag;
+	out->w = v->w;
+#endif
+}
+
+static inline void
+vec4_direction(const v4 *lhs, const v4 *rhs, v4 *out)
+{
+	vec4_subtract3(rhs, lhs, out);
+	vec4_normal(out, out);
+}
+
+static inline void
+vec4_cross3(const v4 *lhs, const v4 *rhs, v4 *out)
+{
+#ifdef RT_MATH_SSE
+	__m128 lhsYZX = _mm_shuffle_ps(lhs->m, lhs->m, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 rhsYZX = _mm_shuffle_ps(rhs->m, rhs->m, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 c = _mm_sub_ps(_mm_mul_ps(lhs->m, rhsYZX), _mm_mul_ps(lhsYZX, rhs->m));
+
+	out->m = _rt_math_merge_w(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)), lhs->m);
+#else
+	real32 x = lhs->y*rhs->z - lhs->z*rhs->y;
+	real32 y = lhs->z*rhs->x - lhs->x*rhs->z;
+	real32 z = lhs->x*rhs->y - lhs->y*rhs->x;
+
+	out->w = lhs->w;
+	out->x = x;
+	out->y = y;
+	out->z = z;
+#endif
+}
+
+static inline real32
+vec4_distance3(const v4 *lhs, const v4 *rhs)
+{
+#ifdef RT_MATH_SSE
+	__m128 d = _mm_sub_ps(rhs->m, lhs->m);
+
+	return _mm_cvtss_f32(_mm_sqrt_ss(_rt_math_sum3(_mm_mul_ps(d, d))));
+#else
+	real32 x = rhs->x - lhs->x;
+	real32 y = rhs->y - lhs->y;
+	real32 z = rhs->z - lhs->z;
+
+	return sqrtf(x*x + y*y + z*z);
+#endif
+}
+
+// rgb channels in [0, 1], clamped when packing
+extern v4
+vec4_from_color32(color32 c);
+
+extern color32
+vec4_to_color32(const v4 *v);
+
+static inline m44
+m44_identity()
+{
+	m44 m = {{
+		{1.f, 0.f, 0.f, 0.f},
+		{0.f, 1.f, 0.f, 0.f},
+		{0.f, 0.f, 1.f, 0.f},
+		{0.f, 0.f, 0.f, 1.f}
+	}};
+
+	return m;
+}
+
+static inline void
+m44_transpose(const m44 *m, m44 *out)
+{
+#ifdef RT_MATH_SSE
+	__m128 r0 = m->rows[0].m;
+	__m128 r1 = m->rows[1].m;
+	__m128 r2 = m->rows[2].m;
+	__m128 r3 = m->rows[3].m;
+
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+	out->rows[0].m = r0;
+	out->rows[1].m = r1;
+	out->rows[2].m = r2;
+	out->rows[3].m = r3;
+#else
+	m44 t;
+
+	for(i32 i = 0; i < 4; ++i)
 	{
-		real32 _0[4];
-		real32 _1[4];
-		real32 _2[4];
-		real32 _3[4];
-	};
+		for(i32 j = 0; j < 4; ++j)
+		{
+			t._[i*4 + j] = m->_[j*4 + i];
+		}
+	}
 
-	real32 _[16];
-} m44;
+	*out = t;
+#endif
+}
+
+// out may be either of the inputs
+static inline void
+m44_multiply(const m44 *lhs, const m44 *rhs, m44 *out)
+{
+	m44 result;
+
+	for(i32 i = 0; i < 4; ++i)
+	{
+#ifdef RT_MATH_SSE
+		__m128 row = _mm_mul_ps(_mm_set1_ps(lhs->_[i*4]), rhs->rows[0].m);
+		row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(lhs->_[i*4 + 1]), rhs->rows[1].m));
+		row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(lhs->_[i*4 + 2]), rhs->rows[2].m));
+		row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(lhs->_[i*4 + 3]), rhs->rows[3].m));
+
+		result.rows[i].m = row;
+#else
+		for(i32 j = 0; j < 4; ++j)
+		{
+			result._[i*4 + j] = lhs->_[i*4]*rhs->_[j] + lhs->_[i*4 + 1]*rhs->_[4 + j] +
+				lhs->_[i*4 + 2]*rhs->_[8 + j] + lhs->_[i*4 + 3]*rhs->_[12 + j];
+		}
+#endif
+	}
+
+	*out = result;
+}
+
+// transforms all four components, out may be v
+static inline void
+m44_transform(const m44 *m, const v4 *v, v4 *out)
+{
+#ifdef RT_MATH_SSE
+	__m128 r0 = _mm_mul_ps(m->rows[0].m, v->m);
+	__m128 r1 = _mm_mul_ps(m->rows[1].m, v->m);
+	__m128 r2 = _mm_mul_ps(m->rows[2].m, v->m);
+	__m128 r3 = _mm_mul_ps(m->rows[3].m, v->m);
+
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+	out->m = _mm_add_ps(_mm_add_ps(r0, r1), _mm_add_ps(r2, r3));
+#else
+	v4 result;
+
+	for(i32 i = 0; i < 4; ++i)
+	{
+		result._[i] = vec4_dot(&m->rows[i], v);
+	}
+
+	*out = result;
+#endif
+}
+
+// positions in the scene keep w at 0, so these transform xyz as a point or as a
+// direction and carry w over from v
+static inline void
+m44_transform_point(const m44 *m, const v4 *v, v4 *out)
+{
+	v4 p = vec4_init(v->x, v->y, v->z, 1.f);
+	real32 w = v->w;
+
+	m44_transform(m, &p, out);
+	out->w = w;
+}
+
+static inline void
+m44_transform_direction(const m44 *m, const v4 *v, v4 *out)
+{
+	v4 d = vec4_init(v->x, v->y, v->z, 0.f);
+	real32 w = v->w;
+
+	m44_transform(m, &d, out);
+	out->w = w;
+}
+
+// returns false and leaves out unchanged for singular matrices
+extern b32
+m44_inverse(const m44 *m, m44 *out);
 
 #endif
@@ -1,9 +1,30 @@
 #include "scene.h"
+#include "scene_snapshot.h"
 #include "canvas.h"
 #include "rt_math.h"
+#include "fast_math.h"
+#include "bvh.h"
+#include "work.h"
+#include "memory.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#define SCENE_RAY_EPSILON 0.0001f
+#define SCENE_PI 3.14159265f
+// blocks larger temporaries need are added to the scratch arena and kept for reuse
+#define SCENE_SCRATCH_BLOCK_SIZE (1024*1024)
+
+// shadow rays per area light are a grid of strata, refined only in penumbras
+#define SCENE_AREA_LIGHT_GRID 2
+#define SCENE_AREA_LIGHT_PENUMBRA_GRID 4
 
 typedef struct camera_viewport
 {
@@ -21,6 +42,12 @@ typedef struct scene_camera
 	camera_viewport viewport;
 	v4 position;
 	v4 direction;
+	real32 yaw;
+	real32 pitch;
+	// camera to world rotation, with the right, up and direction axes as columns, and 
+	// its transpose for world to camera
+	m44 orientation;
+	m44 view;
 } scene_camera;
 
 typedef struct scene_sphere
@@ -31,18 +58,160 @@ typedef struct scene_sphere
 	real32 albedo;
 } scene_sphere;
 
+typedef struct scene_material
+{
+	real32 albedo;
+	i32 specularTableId;
+	real32 reflectivity;
+	real32 transparency;
+	real32 refractiveIndex;
+} scene_material;
+
+// sphere clusters quantize every position to a grid of 16 bit steps over the cluster
+// bounds, with a margin of a couple of steps so that rounding stays inside
+#define SCENE_SPHERE_CLUSTER_SIZE 4096
+#define SCENE_SPHERE_CLUSTER_GRID 65535
+#define SCENE_SPHERE_CLUSTER_MARGIN 2
+// sphere tests are cheap next to decoding a node, so leaves hold a few of them
+#define SCENE_SPHERE_CLUSTER_MIN_LEAF_SIZE 4
+#define SCENE_SPHERE_PALETTE_SIZE 65536
+
+typedef struct scene_sphere_palette
+{
+	color32 *colors;
+	i32 colorCount;
+	scene_material *materials;
+	i32 materialCount;
+} scene_sphere_palette;
+
+typedef struct scene_packed_sphere
+{
+	u16 position[3];
+	u16 radius;
+	u16 colorIndex;
+	u8 materialIndex;
+} scene_packed_sphere;
+
+// bounds in grid steps, laid out like bvh_node
+typedef struct scene_sphere_cluster_node
+{
+	u16 min[3];
+	u16 max[3];
+	u16 offset;
+	u16 sphereCount;
+} scene_sphere_cluster_node;
+
+// chunk contents are only checked once a ray reaches them
+typedef enum scene_chunk_state
+{
+	SCENE_CHUNK_UNCHECKED,
+	SCENE_CHUNK_VALID,
+	SCENE_CHUNK_CORRUPTED
+} scene_chunk_state;
+
+// a page aligned range of a mapped chunk file with the nodes and spheres of a cluster.
+// Residency is bookkeeping for the budget, the pages themselves come and go with the 
+// kernel.
+typedef struct scene_sphere_chunk
+{
+	i32 fd;
+	u8 *data;
+	u64 offset;
+	u64 size;
+	// a scene_chunk_state, set by whichever tracing thread reaches the chunk first
+	i32 state;
+	// both set by tracing threads, and cleared between frames
+	b32 isResident;
+	// reached by a ray since the residency was last updated
+	b32 isUsed;
+	u32 lastFrame;
+} scene_sphere_chunk;
+
+// the object position is the grid origin
+typedef struct scene_sphere_cluster
+{
+	real32 scale[3];
+	real32 radiusScale;
+	scene_packed_sphere *spheres;
+	i32 sphereCount;
+	scene_sphere_cluster_node *nodes;
+	i32 nodeCount;
+	const scene_sphere_palette *palette;
+	// NULL for clusters on the heap
+	scene_sphere_chunk *chunk;
+} scene_sphere_cluster;
+
+// chunk files start with the header, followed by the page aligned chunks and finally 
+// the directory, the color palette and the materials
+#define SCENE_CHUNK_FORMAT_CODE 0x4B4E4843
+#define SCENE_CHUNK_FORMAT_VERSION 1
+#define SCENE_CHUNK_DEFAULT_BUDGET ((u64)1 << 30)
+// clusters and chunks are allocated from pools of this many
+#define SCENE_CHUNK_POOL_BLOCK 256
+
+typedef struct scene_chunk_file_header
+{
+	u32 formatCode;
+	u32 version;
+	i32 chunkCount;
+	i32 colorCount;
+	i32 materialCount;
+	u32 padding;
+	u64 directoryOffset;
+} scene_chunk_file_header;
+
+typedef struct scene_chunk_entry
+{
+	real32 position[3];
+	real32 scale[3];
+	real32 radiusScale;
+	i32 sphereCount;
+	i32 nodeCount;
+	u32 padding;
+	// the nodes, followed by the spheres
+	u64 offset;
+	u64 size;
+} scene_chunk_entry;
+
+struct scene_chunk_writer
+{
+	FILE *file;
+	u64 pageSize;
+	u64 offset;
+	scene_chunk_entry *entries;
+	i32 entryCount;
+	i32 entryCapacity;
+	scene_sphere_material *materials;
+	i32 materialCount;
+};
+
 typedef struct scene_object
 {
 	scene_object_t type;
 	v4 position;
 	color32 color;
-	real32 albedo;
+	scene_material material;
 	real32 sphereRadius;
 	real32 boxWidth;
 	real32 boxHeight;
 	real32 boxDepth;
+	raytracer_mesh *mesh;
+	scene_sphere_cluster *cluster;
+	// index into the scene's instances, or SCENE_INSTANCE_NULL when not transformed
+	i32 instanceId;
 } scene_object;
 
+#define SCENE_INSTANCE_NULL (-1)
+
+// the transform of an object, kept apart as most objects have none. Each instance
+// belongs to the object it names, which gives it up when set back to the identity.
+typedef struct scene_instance
+{
+	m44 transform;
+	m44 inverseTransform;
+	i32 objectId;
+} scene_instance;
+
 typedef struct scene_light
 {
 	scene_light_t type;
@@ -51,18 +220,328 @@ typedef struct scene_light
 	color32 color;
 	real32 intensity;
 	real32 range;
+	real32 radius;
+	real32 width;
+	real32 height;
 } scene_light;
 
+typedef struct scene_tile_bins
+{
+	i32 tileSize;
+	i32 xCount;
+	i32 yCount;
+	i32 *offsets;
+	i32 offsetCapacity;
+	i32 *indices;
+	i32 indexCapacity;
+	i32 *rects;
+	i32 rectCapacity;
+} scene_tile_bins;
+
+// a camera besides the scene's own, with objects binned to its tiles the same way
+struct scene_view
+{
+	scene_camera camera;
+	scene_tile_bins tiles;
+	v4 corner;
+	v4 xStep;
+	v4 yStep;
+};
+
+// primary rays are generated incrementally from the rotated top left viewport corner
+// and per pixel and per row steps. The inverse length of each unnormalized direction
+// does not change under rotation, so it is only rebuilt with the viewport or the 
+// canvas size and rotating the camera costs no more than moving it.
+typedef struct scene_ray_table
+{
+	i32 width;
+	i32 height;
+	i32 capacity;
+	real32 *inverseLengths;
+	b32 isDirty;
+	v4 corner;
+	v4 xStep;
+	v4 yStep;
+} scene_ray_table;
+
+// top level hierarchy over the bounds of every object. Meshes carry their own, so
+// instances of a mesh only add a leaf here.
+typedef struct scene_object_bvh
+{
+	bvh_node *nodes;
+	i32 nodeCount;
+	// object ids in leaf order
+	i32 *objectIds;
+	// objects the tree was built over. While the count stays the same, moved objects
+	// only refit the bounds, until the tree got too much worse than when it was built.
+	i32 objectCount;
+	real32 builtArea;
+	b32 isDirty;
+	b32 isRebuildNeeded;
+} scene_object_bvh;
+
+// values that move the bounds of an object
+#define SCENE_OBJECT_BOUNDS_VALUES (SCENE_OBJECT_VALUE_TYPE | SCENE_OBJECT_VALUE_POSITION | \
+		SCENE_OBJECT_VALUE_SPHERE_RADIUS | SCENE_OBJECT_VALUE_BOX_WIDTH | \
+		SCENE_OBJECT_VALUE_BOX_HEIGHT | SCENE_OBJECT_VALUE_BOX_DEPTH | \
+		SCENE_OBJECT_VALUE_MESH | SCENE_OBJECT_VALUE_TRANSFORM)
+
+// the chunks of every mapped chunk file
+typedef struct scene_chunk_residency
+{
+	scene_sphere_chunk **chunks;
+	i32 chunkCount;
+	u64 budget;
+	u64 residentBytes;
+	u32 frame;
+} scene_chunk_residency;
+
+// tiles with more objects than this are traced through the object hierarchy instead
+#define SCENE_OBJECT_BVH_TILE_THRESHOLD 64
+#define SCENE_OBJECT_BVH_MIN_LEAF_SIZE 2
+#define SCENE_OBJECT_BVH_REFIT_LIMIT 2.f
+
+#define SCENE_VISIBILITY_CANDIDATES 4
+
+// batched queries are traced in packets of consecutive sorted rays, with one packet per
+// dispatched index. Smaller batches are traced in the order given.
+#define SCENE_RAY_PACKET_SIZE 256
+#define SCENE_RAY_SORT_THRESHOLD 1024
+
+typedef struct scene_ray_query
+{
+	raytracer_scene *scene;
+	const scene_ray_batch *batch;
+	// ray indices in tracing order, or NULL for the order of the batch
+	const i32 *order;
+	i32 rayCount;
+	b32 isAnyHit;
+} scene_ray_query;
+
+// per sample candidate first hits, sorted by the near depth of their bounds
+typedef struct scene_visibility_buffer
+{
+	i32 sampleWidth;
+	i32 sampleHeight;
+	i32 xCount;
+	i32 yCount;
+	i32 sampleCapacity;
+	u8 *candidateCounts;
+	i32 *candidateIds;
+	real32 *candidateDepths;
+	real32 *overflowDepths;
+	b32 isValid;
+} scene_visibility_buffer;
+
+// ambient and directional lights reach everywhere. Point lights are binned into a
+// uniform grid over their range spheres.
+typedef struct scene_light_index
+{
+	i32 *globalLights;
+	i32 globalLightCount;
+	v4 boundsMin;
+	v4 boundsMax;
+	real32 cellSize;
+	i32 dims[3];
+	i32 *cellOffsets;
+	i32 *cellLights;
+	real32 *cellLightPdfs;
+	real32 *cellAliasProbabilities;
+	i32 *cellAliases;
+	b32 isDirty;
+} scene_light_index;
+
+#define SCENE_LIGHT_INDEX_MAX_DIM 64
+
+#define SCENE_LIGHT_CACHE_SIZE (1 << 17)
+#define SCENE_LIGHT_CACHE_PROBES 4
+#define SCENE_LIGHT_CACHE_LIGHTS 16
+
+typedef struct scene_light_cache_entry
+{
+	i32 objectId;
+	i32 cell[3];
+	u32 epoch;
+	i32 litLightCount;
+	v4 diffuse;
+	i32 litLights[SCENE_LIGHT_CACHE_LIGHTS];
+	real32 litVisibilities[SCENE_LIGHT_CACHE_LIGHTS];
+} scene_light_cache_entry;
+
+// the probes of a key stay within its aligned group of slots, so that each group can
+// be guarded by one of the striped locks when several threads trace the scene
+#define SCENE_LIGHT_CACHE_LOCKS 64
+
+// the space an object covered before and after it changed. Entries from before the
+// change stay valid if their shadow rays cannot pass through it.
+typedef struct scene_light_cache_region
+{
+	v4 boundsMin;
+	v4 boundsMax;
+	i32 objectId;
+} scene_light_cache_region;
+
+// a power of two, the last changes are kept in a ring indexed by their epoch
+#define SCENE_LIGHT_CACHE_REGIONS 16
+
+typedef struct scene_light_cache
+{
+	scene_light_cache_entry *entries;
+	real32 cellSize;
+	u32 epoch;
+	// entries older than this are invalid, without checking the regions
+	u32 validEpoch;
+	scene_light_cache_region regions[SCENE_LIGHT_CACHE_REGIONS];
+	pthread_mutex_t locks[SCENE_LIGHT_CACHE_LOCKS];
+} scene_light_cache;
+
+#define SCENE_SHADE_DIFFUSE (1 << 0)
+#define SCENE_SHADE_SPECULAR (1 << 1)
+#define SCENE_SHADE_SKIP_SHADOWS (1 << 2)
+#define SCENE_SHADE_VISIBILITY (1 << 3)
+
+#define SCENE_KERNEL_SPHERES (1 << 0)
+#define SCENE_KERNEL_BOXES (1 << 1)
+#define SCENE_KERNEL_MESHES (1 << 2)
+#define SCENE_KERNEL_CLUSTERS (1 << 3)
+
+// kernels only specialize when the generic loops are inlined with constant features
+#ifdef __GNUC__
+#define SCENE_KERNEL_INLINE static inline __attribute__((always_inline))
+#else
+#define SCENE_KERNEL_INLINE static inline
+#endif
+
+// the color and material are the object's own, or decoded from the palettes of a
+// sphere cluster
+typedef struct scene_hit
+{
+	scene_object *object;
+	real32 distance;
+	v4 point;
+	v4 normal;
+	color32 color;
+	const scene_material *material;
+} scene_hit;
+
+// intersection loops specialized for the object types in use
+typedef struct scene_kernel
+{
+	const char *name;
+	u32 features;
+	b32 (*findNearestHit)(raytracer_scene *scene, const i32 *objectIndices, 
+			i32 objectIndexCount, const v4 *origin, const v4 *direction, scene_hit *outHit);
+	b32 (*isLightOccluded)(raytracer_scene *scene, scene_trace_context *context, 
+			i32 lightId, const scene_object *ignoreObject, const v4 *origin, 
+			const v4 *direction, real32 maxDistance);
+	i32 (*queryRay)(raytracer_scene *scene, const v4 *origin, const v4 *direction, 
+			b32 isAnyHit, scene_hit *hit);
+} scene_kernel;
+
+typedef struct scene_file_settings
+{
+	real32 pixelSize;
+	i32 lightSampleCount;
+	i32 maxDepth;
+	i32 rayBudget;
+	real32 rouletteThreshold;
+	i32 mathMode;
+	real32 lightCacheCellSize;
+} scene_file_settings;
+
+// the mapping of the last loaded scene file, whose objects are used until the first 
+// one is added
+typedef struct scene_file_mapping
+{
+	u8 *data;
+	u64 size;
+	scene_object *objects;
+} scene_file_mapping;
+
+// shared with snapshots, see scene_snapshot.c
+typedef struct scene_share scene_share;
+typedef struct scene_page scene_page;
+
+// the page equal to each part of an array, or NULL where it changed since
+typedef struct scene_pages
+{
+	scene_page **pages;
+	i32 pageCount;
+	i32 pageCapacity;
+} scene_pages;
+
+// state owned by a single tracing thread
+struct scene_trace_context
+{
+	i32 *lightOccluders;
+	i32 lightOccluderCapacity;
+	// the objects the occluder ids refer to, which a load or adopted snapshot replaces
+	const scene_object *occluderObjects;
+	i32 occluderObjectCount;
+	u32 randomState;
+	scene_trace_stats stats;
+};
+
 struct raytracer_scene
 {
 	scene_camera camera;
+	scene_tile_bins tiles;
+	scene_ray_table rayTable;
+	scene_visibility_buffer visibility;
+	scene_light_index lightIndex;
+	scene_light_cache lightCache;
+	scene_object_bvh objectBvh;
+	scene_chunk_residency chunkResidency;
+	scene_file_mapping fileMapping;
+	// temporaries of the per frame updates, popped before they return
+	memory_arena *scratchArena;
+	memory_pool *clusterPool;
+	memory_pool *chunkPool;
+	// set while the storage is shared with snapshots, and copied before it changes
+	scene_pages objectPages;
+	scene_pages lightPages;
+	scene_pages instancePages;
+	scene_share *specularTableShare;
+	scene_share *chunkShare;
+	scene_snapshot *publishedSnapshot;
 	scene_light *lights;
 	i32 lightCount;
+	i32 lightCapacity;
 	scene_object *objects;
 	i32 objectCount;
+	i32 objectCapacity;
+	scene_instance *instances;
+	i32 instanceCount;
+	i32 instanceCapacity;
 	real32 pixelSize;
+	i32 lightSampleCount;
+	i32 maxDepth;
+	i32 rayBudget;
+	real32 rouletteThreshold;
+	scene_math_mode mathMode;
+	const scene_kernel *kernel;
+	fast_pow_table *specularTables;
+	i32 specularTableCount;
+	u32 version;
 };
 
+static const scene_kernel *
+_scene_get_generic_kernel();
+
+static void
+_scene_get_object_bounds(raytracer_scene *scene, scene_object *object, v4 *outMin, 
+		v4 *outMax);
+
+static void *
+_scene_unshare_storage(scene_share **share, void *data, u64 elementSize, i32 count);
+
+static void
+_scene_touch_pages(raytracer_scene *scene, scene_pages *pages, u64 elementSize, 
+		i32 first, i32 count);
+
+static void
+_scene_touch_all_pages(raytracer_scene *scene, scene_pages *pages, u64 elementSize);
+
 raytracer_scene *
 scene_init()
 {
@@ -76,12 +555,61 @@ scene_init()
 	scene->camera.viewport.fov = 90.f;
 	scene->camera.position = vec4_init(0.f, 0.f, 0.f, 0.f);
 	scene->camera.direction = vec4_init(0.f, 0.f, 1.f, 0.f);
+	scene->camera.yaw = 0.f;
+	scene->camera.pitch = 0.f;
+	scene->camera.orientation = m44_identity();
+	scene->camera.view = m44_identity();
 
 	scene->lights = NULL;
 	scene->lightCount = 0;
+	scene->lightCapacity = 0;
 	scene->pixelSize = 1.f;
+	scene->lightSampleCount = 0;
+	scene->maxDepth = 4;
+	scene->rayBudget = 1 << 20;
+	scene->rouletteThreshold = 0.1f;
+	scene->mathMode = SCENE_MATH_EXACT;
+	scene->kernel = _scene_get_generic_kernel();
+	scene->specularTables = NULL;
+	scene->specularTableCount = 0;
+	scene->version = 0;
 	scene->objects = NULL;
 	scene->objectCount = 0;
+	scene->objectCapacity = 0;
+	scene->instances = NULL;
+	scene->instanceCount = 0;
+	scene->instanceCapacity = 0;
+	memset(&scene->tiles, 0, sizeof(scene->tiles));
+	memset(&scene->visibility, 0, sizeof(scene->visibility));
+	memset(&scene->rayTable, 0, sizeof(scene->rayTable));
+	scene->rayTable.isDirty = B32_TRUE;
+	memset(&scene->lightIndex, 0, sizeof(scene->lightIndex));
+	scene->lightIndex.isDirty = B32_TRUE;
+	memset(&scene->objectBvh, 0, sizeof(scene->objectBvh));
+	scene->objectBvh.isDirty = B32_TRUE;
+	memset(&scene->chunkResidency, 0, sizeof(scene->chunkResidency));
+	scene->chunkResidency.budget = SCENE_CHUNK_DEFAULT_BUDGET;
+	scene->scratchArena = memory_create_arena("scene scratch", SCENE_SCRATCH_BLOCK_SIZE, 0);
+	scene->clusterPool = memory_create_pool("sphere clusters", sizeof(scene_sphere_cluster), 
+			SCENE_CHUNK_POOL_BLOCK);
+	scene->chunkPool = memory_create_pool("sphere chunks", sizeof(scene_sphere_chunk), 
+			SCENE_CHUNK_POOL_BLOCK);
+	memset(&scene->objectPages, 0, sizeof(scene->objectPages));
+	memset(&scene->lightPages, 0, sizeof(scene->lightPages));
+	memset(&scene->instancePages, 0, sizeof(scene->instancePages));
+	scene->specularTableShare = NULL;
+	scene->chunkShare = NULL;
+	scene->publishedSnapshot = NULL;
+	memset(&scene->fileMapping, 0, sizeof(scene->fileMapping));
+	scene->lightCache.entries = NULL;
+	scene->lightCache.cellSize = 0.f;
+	scene->lightCache.epoch = 1;
+	scene->lightCache.validEpoch = 1;
+
+	for(i32 i = 0; i < SCENE_LIGHT_CACHE_LOCKS; ++i)
+	{
+		pthread_mutex_init(&scene->lightCache.locks[i], NULL);
+	}
 
 	return scene;
 }
@@ -90,6 +618,8 @@ void
 scene_set_camera_viewport(raytracer_scene *scene, real32 left, real32 right, real32 top,
 		real32 bottom, real32 front, real32 distance, real32 fov)
 {
+	++scene->version;
+
 	scene->camera.viewport.left = left;
 	scene->camera.viewport.right = right;
 	scene->camera.viewport.top = top;
@@ -97,17 +627,23 @@ scene_set_camera_viewport(raytracer_scene *scene, real32 left, real32 right, rea
 	scene->camera.viewport.front = front;
 	scene->camera.viewport.back = scene->camera.viewport.front + distance;
 	scene->camera.viewport.fov = fov;
+
+	scene->rayTable.isDirty = B32_TRUE;
 }
 
 void
 scene_set_camera_position(raytracer_scene *scene, const v4 *position)
 {
+	++scene->version;
+
 	scene->camera.position = *position;
 }
 
 void
 scene_set_pixel_size(raytracer_scene *scene, real32 size)
 {
+	++scene->version;
+
 	scene->pixelSize = size;
 }
 
@@ -118,1001 +654,5325 @@ scene_get_pixel_size(raytracer_scene *scene)
 }
 
 void
-scene_get_camera_position(raytracer_scene *scene, v4 *out)
+scene_set_light_samples(raytracer_scene *scene, i32 sampleCount)
 {
-	*out = scene->camera.position;
+	++scene->version;
+	scene->lightSampleCount = sampleCount;
+}
+
+i32
+scene_get_light_samples(raytracer_scene *scene)
+{
+	return scene->lightSampleCount;
+}
+
+static void
+_scene_invalidate_light_cache(raytracer_scene *scene)
+{
+	scene->lightCache.validEpoch = ++scene->lightCache.epoch;
 }
 
 void
-scene_canvas_to_world_coordinates(raytracer_scene *scene, raytracer_canvas *canvas, 
-		i32 x, i32 y, v4 *out)
+scene_set_light_cache(raytracer_scene *scene, real32 cellSize)
 {
-	i32 width = canvas_get_width(canvas);
-	i32 height = canvas_get_height(canvas);
+	++scene->version;
 
-	v4 position = {{
-		(real32)x*((scene->camera.viewport.right - scene->camera.viewport.left)/
-			(real32)width) + (scene->camera.viewport.left),
-		(real32)-y*((scene->camera.viewport.top - scene->camera.viewport.bottom)/
-			(real32)height) - (scene->camera.viewport.bottom),
-		scene->camera.viewport.front,
-		0.f
-	}};
+	if(cellSize > 0.f && !scene->lightCache.entries)
+	{
+		scene->lightCache.entries = calloc(SCENE_LIGHT_CACHE_SIZE, 
+				sizeof(scene_light_cache_entry));
+	}
 
-	*out = position;
+	scene->lightCache.cellSize = cellSize;
+	_scene_invalidate_light_cache(scene);
 }
 
-i32
-scene_world_to_canvas_x(raytracer_scene *scene, raytracer_canvas *canvas,
-		const v4 *worldCoords)
+real32
+scene_get_light_cache(raytracer_scene *scene)
 {
-	// TODO: fix
-	i32 width = canvas_get_width(canvas);
+	return scene->lightCache.cellSize;
+}
 
-	return (i32)((worldCoords->x - scene->camera.viewport.left)*((real32)width/
-				(scene->camera.viewport.right - scene->camera.viewport.left)));
+void
+scene_set_max_depth(raytracer_scene *scene, i32 maxDepth)
+{
+	++scene->version;
+	scene->maxDepth = maxDepth;
 }
 
 i32
-scene_world_to_canvas_y(raytracer_scene *scene, raytracer_canvas *canvas,
-		const v4 *worldCoords)
+scene_get_max_depth(raytracer_scene *scene)
 {
-	// TODO: fix
-	i32 height = canvas_get_height(canvas);
+	return scene->maxDepth;
+}
 
-	return (i32)(-(worldCoords->y + scene->camera.viewport.bottom)*((real32)height/
-				(scene->camera.viewport.top - scene->camera.viewport.bottom)));
+void
+scene_set_ray_budget(raytracer_scene *scene, i32 rayBudget)
+{
+	++scene->version;
+	scene->rayBudget = rayBudget;
 }
 
 i32
-scene_create_object(raytracer_scene *scene, scene_object_t type)
+scene_get_ray_budget(raytracer_scene *scene)
 {
-	i32 index = scene->objectCount;
-	
-	if(scene->objectCount > 0)
-	{
-		scene->objects = realloc(scene->objects, sizeof(scene_object)*(++scene->objectCount));
-	}
-	else
-	{
-		scene->objects = malloc(sizeof(scene_object)*(++scene->objectCount));
-	}
-
-	scene_object *object = &scene->objects[index];
-	object->type = type;
-	object->position = vec4_init(0, 0, 0, 0);
-	object->color = 0xFFFFFF;
-	object->albedo = 1.f;
-	object->sphereRadius = 1.f;
-	object->boxWidth = 1.f;
-	object->boxHeight = 1.f;
-	object->boxDepth = 1.f;
-
-	return index;
+	return scene->rayBudget;
 }
 
 void
-scene_object_set_values(raytracer_scene *scene, i32 objectId, u32 valueFlags, 
-		const void **values)
+scene_set_roulette_threshold(raytracer_scene *scene, real32 threshold)
 {
-	scene_object *obj = &scene->objects[objectId];
+	++scene->version;
+	scene->rouletteThreshold = threshold;
+}
 
-	i32 valuesSet = 0;
+real32
+scene_get_roulette_threshold(raytracer_scene *scene)
+{
+	return scene->rouletteThreshold;
+}
+
+b32
+scene_is_stochastic(raytracer_scene *scene)
+{
+	if(scene->lightSampleCount > 0)
+	{
+		return B32_TRUE;
+	}
 
-	for(i32 i = 0; i < 32; ++i)
+	// penumbras are sampled with jittered shadow rays
+	for(i32 i = 0; i < scene->lightCount; ++i)
 	{
-		u32 flag = valueFlags & (1 << i);
+		if(scene->lights[i].type == LIGHT_SPHERE || scene->lights[i].type == LIGHT_RECT)
+		{
+			return B32_TRUE;
+		}
+	}
 
-		if(flag)
+	if(scene->rouletteThreshold > 0.f && scene->maxDepth > 0)
+	{
+		for(i32 i = 0; i < scene->objectCount; ++i)
 		{
-			switch(flag)
+			const scene_material *materials = &scene->objects[i].material;
+			i32 materialCount = 1;
+
+			if(scene->objects[i].cluster)
 			{
-				case SCENE_OBJECT_VALUE_TYPE:
-				{
-					obj->type = *((scene_object_t **)values)[valuesSet++];
-				} break;
-				
-				case SCENE_OBJECT_VALUE_POSITION:
-				{
-					obj->position = *((v4 **)values)[valuesSet++];
-				} break;
-				
-				case SCENE_OBJECT_VALUE_COLOR:
-				{
-					obj->color = *((color32 **)values)[valuesSet++];
-				} break;
-				
-				case SCENE_OBJECT_VALUE_ALBEDO:
-				{
-					obj->color = *((real32 **)values)[valuesSet++];
-				} break;
-				
-				case SCENE_OBJECT_VALUE_SPHERE_RADIUS:
-				{
-					obj->sphereRadius = *((real32 **)values)[valuesSet++];
-				} break;
-				
-				case SCENE_OBJECT_VALUE_BOX_WIDTH:
-				{
-					obj->boxWidth = *((real32 **)values)[valuesSet++];
-				} break;
-				
-				case SCENE_OBJECT_VALUE_BOX_HEIGHT:
-				{
-					obj->boxHeight = *((real32 **)values)[valuesSet++];
-				} break;
-				
-				case SCENE_OBJECT_VALUE_BOX_DEPTH:
-				{
-					obj->boxDepth = *((real32 **)values)[valuesSet++];
-				} break;
+				materials = scene->objects[i].cluster->palette->materials;
+				materialCount = scene->objects[i].cluster->palette->materialCount;
+			}
 
-				default:
+			for(i32 j = 0; j < materialCount; ++j)
+			{
+				if(materials[j].reflectivity > 0.f || materials[j].transparency > 0.f)
 				{
-					printf("Cannot set unknown scene object value!\n");
-				} break;
+					return B32_TRUE;
+				}
 			}
 		}
 	}
+
+	return B32_FALSE;
 }
 
 void
-scene_object_set_value(raytracer_scene *scene, i32 objectId, u32 valueFlag, 
-		const void *value)
+scene_set_math_mode(raytracer_scene *scene, scene_math_mode mode)
 {
-	scene_object *obj = &scene->objects[objectId];
+	++scene->version;
+	_scene_invalidate_light_cache(scene);
+	scene->mathMode = mode;
+}
 
-	switch(valueFlag)
-	{
-		case SCENE_OBJECT_VALUE_TYPE:
-		{
-			obj->type = *(scene_object_t *)value;
-		} break;
-		
-		case SCENE_OBJECT_VALUE_POSITION:
-		{
-			obj->position = *(v4 *)value;
-		} break;
-		
-		case SCENE_OBJECT_VALUE_COLOR:
-		{
-			obj->color = *(color32 *)value;
-		} break;
-		
-		case SCENE_OBJECT_VALUE_ALBEDO:
-		{
-			obj->albedo = *(real32 *)value;
-		} break;
-		
-		case SCENE_OBJECT_VALUE_SPHERE_RADIUS:
-		{
-			obj->sphereRadius = *(real32 *)value;
-		} break;
-		
-		case SCENE_OBJECT_VALUE_BOX_WIDTH:
-		{
-			obj->boxWidth = *(real32 *)value;
-		} break;
-		
-		case SCENE_OBJECT_VALUE_BOX_HEIGHT:
-		{
-			obj->boxHeight = *(real32 *)value;
-		} break;
-		
-		case SCENE_OBJECT_VALUE_BOX_DEPTH:
-		{
-			obj->boxDepth = *(real32 *)value;
-		} break;
+scene_math_mode
+scene_get_math_mode(raytracer_scene *scene)
+{
+	return scene->mathMode;
+}
 
-		default:
-		{
-			printf("Cannot set unknown scene object value!\n");
-		} break;
-	}
+u32
+scene_get_version(raytracer_scene *scene)
+{
+	return scene->version;
 }
 
 void
-scene_object_get_value(raytracer_scene *scene, i32 objectId, u32 valueFlag, 
-		void *outValue)
+scene_get_camera_position(raytracer_scene *scene, v4 *out)
 {
-	switch(valueFlag)
-	{
-		case SCENE_OBJECT_VALUE_TYPE:
-		{
-			*(scene_object_t *)outValue = scene->objects[objectId].type;
-		} break;
-		
-		case SCENE_OBJECT_VALUE_POSITION:
-		{
-			*(v4 *)outValue = scene->objects[objectId].position;
-		} break;
-		
-		case SCENE_OBJECT_VALUE_COLOR:
-		{
-			*(color32 *)outValue = scene->objects[objectId].color;
-		} break;
-		
-		case SCENE_OBJECT_VALUE_ALBEDO:
-		{
-			*(real32 *)outValue = scene->objects[objectId].albedo;
-		} break;
-		
-		case SCENE_OBJECT_VALUE_SPHERE_RADIUS:
-		{
-			*(real32 *)outValue = scene->objects[objectId].sphereRadius;
-		} break;
-		
-		case SCENE_OBJECT_VALUE_BOX_WIDTH:
-		{
-			*(real32 *)outValue = scene->objects[objectId].boxWidth;
-		} break;
-		
-		case SCENE_OBJECT_VALUE_BOX_HEIGHT:
-		{
-			*(real32 *)outValue = scene->objects[objectId].boxHeight;
-		} break;
-		
-		case SCENE_OBJECT_VALUE_BOX_DEPTH:
-		{
-			*(real32 *)outValue = scene->objects[objectId].boxDepth;
-		} break;
+	*out = scene->camera.position;
+}
 
-		default:
+// pitch is clamped short of straight up or down, where the up axis would flip
+static void
+_scene_get_orientation(real32 yaw, real32 *pitch, m44 *outOrientation, v4 *outDirection)
+{
+	if(*pitch > 89.f)
+	{
+		*pitch = 89.f;
+	}
+	else if(*pitch < -89.f)
+	{
+		*pitch = -89.f;
+	}
+
+	real32 yawSin = sinf(yaw*SCENE_PI/180.f);
+	real32 yawCos = cosf(yaw*SCENE_PI/180.f);
+	real32 pitchSin = sinf(*pitch*SCENE_PI/180.f);
+	real32 pitchCos = cosf(*pitch*SCENE_PI/180.f);
+
+	v4 right = vec4_init(yawCos, 0.f, -yawSin, 0.f);
+	v4 up = vec4_init(-yawSin*pitchSin, pitchCos, -yawCos*pitchSin, 0.f);
+	v4 direction = vec4_init(yawSin*pitchCos, pitchSin, yawCos*pitchCos, 0.f);
+
+	m44 orientation = {{
+		{right.x, up.x, direction.x, 0.f},
+		{right.y, up.y, direction.y, 0.f},
+		{right.z, up.z, direction.z, 0.f},
+		{0.f, 0.f, 0.f, 1.f}
+	}};
+
+	*outOrientation = orientation;
+	*outDirection = direction;
+}
+
+void
+scene_set_camera_orientation(raytracer_scene *scene, real32 yaw, real32 pitch)
+{
+	++scene->version;
+
+	_scene_get_orientation(yaw, &pitch, &scene->camera.orientation, 
+			&scene->camera.direction);
+	m44_transpose(&scene->camera.orientation, &scene->camera.view);
+
+	scene->camera.yaw = yaw;
+	scene->camera.pitch = pitch;
+}
+
+void
+scene_get_camera_orientation(raytracer_scene *scene, real32 *outYaw, real32 *outPitch)
+{
+	*outYaw = scene->camera.yaw;
+	*outPitch = scene->camera.pitch;
+}
+
+void
+scene_get_camera_direction(raytracer_scene *scene, v4 *out)
+{
+	*out = scene->camera.direction;
+}
+
+// the viewport point before the camera rotation is applied
+static void
+_scene_canvas_to_viewport(raytracer_scene *scene, i32 width, i32 height, i32 x, i32 y, 
+		v4 *out)
+{
+	v4 position = {{
+		(real32)x*((scene->camera.viewport.right - scene->camera.viewport.left)/
+			(real32)width) + (scene->camera.viewport.left),
+		(scene->camera.viewport.top) - (real32)y*((scene->camera.viewport.top - 
+				scene->camera.viewport.bottom)/(real32)height),
+		scene->camera.viewport.front,
+		0.f
+	}};
+
+	*out = position;
+}
+
+void
+scene_canvas_to_world_coordinates(raytracer_scene *scene, raytracer_canvas *canvas, 
+		i32 x, i32 y, v4 *out)
+{
+	v4 position;
+	_scene_canvas_to_viewport(scene, canvas_get_width(canvas), canvas_get_height(canvas), 
+			x, y, &position);
+
+	m44_transform_direction(&scene->camera.orientation, &position, out);
+}
+
+// the unnormalized direction through the top left pixel of the viewport and the steps 
+// to the next pixel and row, in world orientation
+static void
+_scene_get_ray_steps(raytracer_scene *scene, const m44 *orientation, i32 width, i32 height, 
+		v4 *outCorner, v4 *outXStep, v4 *outYStep)
+{
+	v4 corner;
+	_scene_canvas_to_viewport(scene, width, height, 0, 0, &corner);
+
+	v4 xStep = vec4_init((scene->camera.viewport.right - scene->camera.viewport.left)/
+			(real32)width, 0.f, 0.f, 0.f);
+	v4 yStep = vec4_init(0.f, -((scene->camera.viewport.top - 
+					scene->camera.viewport.bottom)/(real32)height), 0.f, 0.f);
+
+	m44_transform_direction(orientation, &corner, outCorner);
+	m44_transform_direction(orientation, &xStep, outXStep);
+	m44_transform_direction(orientation, &yStep, outYStep);
+}
+
+void
+scene_update_ray_table(raytracer_scene *scene, raytracer_canvas *canvas)
+{
+	scene_ray_table *table = &scene->rayTable;
+
+	i32 width = canvas_get_width(canvas);
+	i32 height = canvas_get_height(canvas);
+
+	_scene_get_ray_steps(scene, &scene->camera.orientation, width, height, &table->corner, 
+			&table->xStep, &table->yStep);
+
+	if(!table->isDirty && table->width == width && table->height == height)
+	{
+		return;
+	}
+
+	i32 pixelCount = width*height;
+
+	if(pixelCount > table->capacity)
+	{
+		table->capacity = pixelCount;
+		table->inverseLengths = realloc(table->inverseLengths, 
+				sizeof(real32)*table->capacity);
+	}
+
+	for(i32 y = 0; y < height; ++y)
+	{
+		for(i32 x = 0; x < width; ++x)
 		{
-			fprintf(stderr, "Cannot get unknown value from scene object!\n");
-		} break;
+			v4 viewportPoint;
+			_scene_canvas_to_viewport(scene, width, height, x, y, &viewportPoint);
+
+			table->inverseLengths[y*width + x] = 1.f/vec4_magnitude3(&viewportPoint);
+		}
+	}
+
+	table->width = width;
+	table->height = height;
+	table->isDirty = B32_FALSE;
+}
+
+// inverse of scene_canvas_to_world_coordinates, after projecting the camera relative
+// position onto the viewport plane. Points behind the camera cannot be projected.
+static b32
+_scene_world_to_canvas(const scene_camera *camera, i32 width, i32 height, 
+		const v4 *worldCoords, real32 *outX, real32 *outY)
+{
+	v4 relative;
+	vec4_subtract3(worldCoords, &camera->position, &relative);
+
+	v4 position;
+	m44_transform_direction(&camera->view, &relative, &position);
+
+	if(position.z <= 0.f)
+	{
+		return B32_FALSE;
 	}
+
+	real32 viewportX = position.x*camera->viewport.front/position.z;
+	real32 viewportY = position.y*camera->viewport.front/position.z;
+
+	*outX = (viewportX - camera->viewport.left)*((real32)width/
+			(camera->viewport.right - camera->viewport.left));
+	*outY = (camera->viewport.top - viewportY)*((real32)height/
+			(camera->viewport.top - camera->viewport.bottom));
+
+	return B32_TRUE;
 }
 
 i32
-scene_create_light(raytracer_scene *scene, scene_light_t type)
+scene_world_to_canvas_x(raytracer_scene *scene, raytracer_canvas *canvas,
+		const v4 *worldCoords)
 {
-	i32 index = scene->lightCount;
+	real32 x;
+	real32 y;
+
+	if(!_scene_world_to_canvas(&scene->camera, canvas_get_width(canvas), 
+				canvas_get_height(canvas), worldCoords, &x, &y))
+	{
+		return -1;
+	}
+
+	return (i32)floorf(x);
+}
+
+i32
+scene_world_to_canvas_y(raytracer_scene *scene, raytracer_canvas *canvas,
+		const v4 *worldCoords)
+{
+	real32 x;
+	real32 y;
+
+	if(!_scene_world_to_canvas(&scene->camera, canvas_get_width(canvas), 
+				canvas_get_height(canvas), worldCoords, &x, &y))
+	{
+		return -1;
+	}
+
+	return (i32)floorf(y);
+}
+
+// at least doubles the capacity so that appending one at a time stays linear
+static i32
+_scene_grow_capacity(i32 capacity, i32 count)
+{
+	i32 grown = capacity < 16 ? 16 : capacity*2;
+
+	return grown < count ? count : grown;
+}
+
+static void
+_scene_unshare_specular_tables(raytracer_scene *scene)
+{
+	if(scene->specularTableShare)
+	{
+		scene->specularTables = _scene_unshare_storage(&scene->specularTableShare, 
+				scene->specularTables, sizeof(fast_pow_table), scene->specularTableCount);
+	}
+}
+
+// objects share the specular table of their albedo
+static i32
+_scene_get_specular_table(raytracer_scene *scene, real32 exponent)
+{
+	for(i32 i = 0; i < scene->specularTableCount; ++i)
+	{
+		if(scene->specularTables[i].exponent == exponent)
+		{
+			return i;
+		}
+	}
+
+	_scene_unshare_specular_tables(scene);
+
+	scene->specularTables = realloc(scene->specularTables, 
+			sizeof(fast_pow_table)*(scene->specularTableCount + 1));
+	fast_pow_table_init(&scene->specularTables[scene->specularTableCount], exponent);
+
+	return scene->specularTableCount++;
+}
+
+// looks up the tables of many objects at once. Neighbouring objects mostly share their
+// albedo, so the table of the previous object is reused.
+static void
+_scene_assign_specular_tables(raytracer_scene *scene, i32 firstObjectId, i32 count)
+{
+	i32 specularTableId = -1;
+	real32 albedo = 0.f;
+
+	for(i32 i = firstObjectId; i < firstObjectId + count; ++i)
+	{
+		scene_object *object = &scene->objects[i];
 
-	if(scene->lightCount > 0)
+		if(specularTableId < 0 || object->material.albedo != albedo)
+		{
+			albedo = object->material.albedo;
+			specularTableId = _scene_get_specular_table(scene, albedo);
+		}
+
+		object->material.specularTableId = specularTableId;
+	}
+}
+
+// grows the instance array by count and returns the first new instance
+static scene_instance *
+_scene_append_instances(raytracer_scene *scene, i32 count)
+{
+	i32 index = scene->instanceCount;
+	scene->instanceCount += count;
+
+	_scene_touch_pages(scene, &scene->instancePages, sizeof(scene_instance), index, count);
+
+	if(!scene->instances || scene->instanceCount > scene->instanceCapacity)
+	{
+		_scene_touch_all_pages(scene, &scene->instancePages, sizeof(scene_instance));
+
+		scene->instanceCapacity = _scene_grow_capacity(scene->instanceCapacity, 
+				scene->instanceCount);
+		scene->instances = realloc(scene->instances, 
+				sizeof(scene_instance)*scene->instanceCapacity);
+	}
+
+	return &scene->instances[index];
+}
+
+// the last instance moves into the freed one, so the array never has gaps
+static void
+_scene_release_instance(raytracer_scene *scene, scene_object *object)
+{
+	i32 instanceId = object->instanceId;
+
+	if(instanceId == SCENE_INSTANCE_NULL)
+	{
+		return;
+	}
+
+	i32 lastId = scene->instanceCount - 1;
+	object->instanceId = SCENE_INSTANCE_NULL;
+
+	_scene_touch_pages(scene, &scene->instancePages, sizeof(scene_instance), instanceId, 1);
+	_scene_touch_pages(scene, &scene->instancePages, sizeof(scene_instance), lastId, 1);
+
+	if(instanceId != lastId)
+	{
+		scene_instance *instance = &scene->instances[instanceId];
+		*instance = scene->instances[lastId];
+
+		_scene_touch_pages(scene, &scene->objectPages, sizeof(scene_object), 
+				instance->objectId, 1);
+		scene->objects[instance->objectId].instanceId = instanceId;
+	}
+
+	--scene->instanceCount;
+}
+
+// the object's page must already be touched
+static void
+_scene_set_object_transform(raytracer_scene *scene, i32 objectId, const m44 *transform)
+{
+	m44 inverse;
+
+	if(!m44_inverse(transform, &inverse))
+	{
+		fprintf(stderr, "Cannot set a singular scene object transform!\n");
+
+		return;
+	}
+
+	scene_object *object = &scene->objects[objectId];
+	m44 identity = m44_identity();
+
+	// most objects are not transformed, which needs no instance
+	if(memcmp(transform, &identity, sizeof(m44)) == 0)
+	{
+		_scene_release_instance(scene, object);
+
+		return;
+	}
+
+	if(object->instanceId == SCENE_INSTANCE_NULL)
 	{
-		scene->lights = realloc(scene->lights, sizeof(scene_light)*(++scene->lightCount));
+		object->instanceId = scene->instanceCount;
+		_scene_append_instances(scene, 1)->objectId = objectId;
 	}
 	else
 	{
-		scene->lights = malloc(sizeof(scene_light)*(++scene->lightCount));
+		_scene_touch_pages(scene, &scene->instancePages, sizeof(scene_instance), 
+				object->instanceId, 1);
+	}
+
+	scene_instance *instance = &scene->instances[object->instanceId];
+	instance->transform = *transform;
+	instance->inverseTransform = inverse;
+}
+
+static m44
+_scene_get_object_transform(const raytracer_scene *scene, const scene_object *object)
+{
+	return object->instanceId == SCENE_INSTANCE_NULL ? m44_identity() : 
+		scene->instances[object->instanceId].transform;
+}
+
+static void
+_scene_unmap_file(raytracer_scene *scene)
+{
+	if(scene->fileMapping.data)
+	{
+		munmap(scene->fileMapping.data, scene->fileMapping.size);
+	}
+
+	memset(&scene->fileMapping, 0, sizeof(scene->fileMapping));
+}
+
+// leaves the scene without objects, releasing them or its hold on them
+static void
+_scene_release_objects(raytracer_scene *scene)
+{
+	_scene_touch_all_pages(scene, &scene->objectPages, sizeof(scene_object));
+
+	if(scene->objects != scene->fileMapping.objects)
+	{
+		free(scene->objects);
+	}
+
+	_scene_unmap_file(scene);
+
+	scene->objects = NULL;
+	scene->objectCount = 0;
+	scene->objectCapacity = 0;
+
+	_scene_touch_all_pages(scene, &scene->instancePages, sizeof(scene_instance));
+	scene->instanceCount = 0;
+}
+
+// grows the object array by count and returns the first new object. Objects of a 
+// loaded scene file move to the heap here.
+static scene_object *
+_scene_append_objects(raytracer_scene *scene, i32 count)
+{
+	i32 index = scene->objectCount;
+	scene->objectCount += count;
+
+	_scene_touch_pages(scene, &scene->objectPages, sizeof(scene_object), index, count);
+
+	if(scene->objects && scene->objects == scene->fileMapping.objects)
+	{
+		_scene_touch_all_pages(scene, &scene->objectPages, sizeof(scene_object));
+
+		scene->objectCapacity = _scene_grow_capacity(index, scene->objectCount);
+		scene->objects = malloc(sizeof(scene_object)*scene->objectCapacity);
+		memcpy(scene->objects, scene->fileMapping.objects, sizeof(scene_object)*index);
+
+		_scene_unmap_file(scene);
+	}
+	else if(!scene->objects || scene->objectCount > scene->objectCapacity)
+	{
+		_scene_touch_all_pages(scene, &scene->objectPages, sizeof(scene_object));
+
+		scene->objectCapacity = _scene_grow_capacity(scene->objectCapacity, 
+				scene->objectCount);
+		scene->objects = realloc(scene->objects, 
+				sizeof(scene_object)*scene->objectCapacity);
+	}
+
+	return &scene->objects[index];
+}
+
+// defaults of every value but the specular table, which is looked up by the caller
+static void
+_scene_init_object(scene_object *object, scene_object_t type)
+{
+	object->type = type;
+	object->position = vec4_init(0, 0, 0, 0);
+	object->color = 0xFFFFFF;
+	object->material.albedo = 1.f;
+	object->sphereRadius = 1.f;
+	object->boxWidth = 1.f;
+	object->boxHeight = 1.f;
+	object->boxDepth = 1.f;
+	object->material.reflectivity = 0.f;
+	object->material.transparency = 0.f;
+	object->material.refractiveIndex = 1.f;
+	object->mesh = NULL;
+	object->cluster = NULL;
+	object->instanceId = SCENE_INSTANCE_NULL;
+}
+
+i32
+scene_get_object_count(raytracer_scene *scene)
+{
+	return scene->objectCount;
+}
+
+i32
+scene_create_object(raytracer_scene *scene, scene_object_t type)
+{
+	++scene->version;
+	_scene_invalidate_light_cache(scene);
+
+	i32 index = scene->objectCount;
+
+	scene_object *object = _scene_append_objects(scene, 1);
+	_scene_init_object(object, type);
+	object->material.specularTableId = _scene_get_specular_table(scene, 
+			object->material.albedo);
+
+	scene->kernel = _scene_get_generic_kernel();
+	scene->objectBvh.isDirty = B32_TRUE;
+
+	return index;
+}
+
+// spreads the low 10 bits of x to every third bit
+static u32
+_scene_spread_morton_bits(u32 x)
+{
+	x &= 0x3FF;
+	x = (x | (x << 16)) & 0x030000FF;
+	x = (x | (x << 8)) & 0x0300F00F;
+	x = (x | (x << 4)) & 0x030C30C3;
+	x = (x | (x << 2)) & 0x09249249;
+
+	return x;
+}
+
+// least significant digit radix sort of 32 bit codes, a byte per pass. The other
+// arrays are scratch space of the same size, and the sorted result ends up in the
+// first ones after the even number of passes.
+static void
+_scene_sort_codes(u32 *codes, i32 *indices, u32 *otherCodes, i32 *otherIndices, 
+		i32 count)
+{
+	for(i32 shift = 0; shift < 32; shift += 8)
+	{
+		i32 offsets[256] = {};
+
+		for(i32 i = 0; i < count; ++i)
+		{
+			++offsets[(codes[i] >> shift) & 0xFF];
+		}
+
+		i32 offset = 0;
+		for(i32 i = 0; i < 256; ++i)
+		{
+			i32 bucketCount = offsets[i];
+			offsets[i] = offset;
+			offset += bucketCount;
+		}
+
+		for(i32 i = 0; i < count; ++i)
+		{
+			i32 slot = offsets[(codes[i] >> shift) & 0xFF]++;
+			otherCodes[slot] = codes[i];
+			otherIndices[slot] = indices[i];
+		}
+
+		u32 *swapCodes = codes;
+		codes = otherCodes;
+		otherCodes = swapCodes;
+
+		i32 *swapIndices = indices;
+		indices = otherIndices;
+		otherIndices = swapIndices;
+	}
+}
+
+// sorts sphere indices along a morton curve over their centers, so that consecutive
+// spheres are spatially close
+static i32 *
+_scene_sort_spheres(const v4 *positions, i32 sphereCount)
+{
+	v4 boundsMin = vec4_init(INFINITY, INFINITY, INFINITY, 0.f);
+	v4 boundsMax = vec4_init(-INFINITY, -INFINITY, -INFINITY, 0.f);
+
+	for(i32 i = 0; i < sphereCount; ++i)
+	{
+		for(i32 j = 0; j < 3; ++j)
+		{
+			boundsMin._[j] = positions[i]._[j] < boundsMin._[j] ? positions[i]._[j] : 
+				boundsMin._[j];
+			boundsMax._[j] = positions[i]._[j] > boundsMax._[j] ? positions[i]._[j] : 
+				boundsMax._[j];
+		}
 	}
 
-	scene_light *light = &scene->lights[index];
-	light->type = type;
-	light->position = vec4_init(0, 0, 0, 0);
-	light->direction = vec4_init(0, -1.f, 0, 0);
-	light->intensity = 1.f;
-	light->range = 1.f;
-	light->color = 0xFFFFFF;
+	u32 *codes = malloc(sizeof(u32)*2*sphereCount);
+	i32 *indices = malloc(sizeof(i32)*2*sphereCount);
+
+	for(i32 i = 0; i < sphereCount; ++i)
+	{
+		u32 code = 0;
+
+		for(i32 j = 0; j < 3; ++j)
+		{
+			real32 extent = boundsMax._[j] - boundsMin._[j];
+			u32 cell = extent > 0.f ? (u32)((positions[i]._[j] - boundsMin._[j])/extent*1023.f) : 
+				0;
+			code |= _scene_spread_morton_bits(cell) << j;
+		}
+
+		codes[i] = code;
+		indices[i] = i;
+	}
+
+	_scene_sort_codes(codes, indices, codes + sphereCount, indices + sphereCount, 
+			sphereCount);
+
+	free(codes);
+
+	return indices;
+}
+
+// distinct colors get their own palette entry. Beyond the 16 bit index range, colors
+// are reduced to 5, 6 and 5 bits, which always fit.
+static u16 *
+_scene_build_color_palette(const color32 *colors, i32 sphereCount, 
+		scene_sphere_palette *palette)
+{
+	u16 *colorIndices = malloc(sizeof(u16)*(sphereCount + 1));
+	palette->colors = malloc(sizeof(color32)*SCENE_SPHERE_PALETTE_SIZE);
+
+	if(!colors)
+	{
+		palette->colors[0] = 0xFFFFFF;
+		palette->colorCount = 1;
+		memset(colorIndices, 0, sizeof(u16)*sphereCount);
+
+		return colorIndices;
+	}
+
+	// open addressing over twice the palette size, keyed by the color
+	i32 tableSize = 2*SCENE_SPHERE_PALETTE_SIZE;
+	u32 *keys = malloc(sizeof(u32)*tableSize);
+	u16 *values = malloc(sizeof(u16)*tableSize);
+
+	u32 masks[2] = {0xFFFFFF, 0xF8FCF8};
+
+	for(i32 pass = 0; pass < 2; ++pass)
+	{
+		memset(keys, 0xFF, sizeof(u32)*tableSize);
+		palette->colorCount = 0;
+
+		i32 i = 0;
+		for(; i < sphereCount; ++i)
+		{
+			u32 key = colors[i] & masks[pass];
+			u32 slot = (key*0x9E3779B1u) >> 15;
+
+			while(keys[slot] != 0xFFFFFFFF && keys[slot] != key)
+			{
+				slot = (slot + 1) & (tableSize - 1);
+			}
+
+			if(keys[slot] == 0xFFFFFFFF)
+			{
+				if(palette->colorCount == SCENE_SPHERE_PALETTE_SIZE)
+				{
+					break;
+				}
+
+				keys[slot] = key;
+				values[slot] = (u16)palette->colorCount;
+				palette->colors[palette->colorCount++] = key;
+			}
+
+			colorIndices[i] = values[slot];
+		}
+
+		if(i == sphereCount)
+		{
+			break;
+		}
+	}
+
+	palette->colors = realloc(palette->colors, sizeof(color32)*palette->colorCount);
+
+	free(keys);
+	free(values);
+
+	return colorIndices;
+}
+
+static void
+_scene_build_sphere_cluster(scene_sphere_cluster *cluster, v4 *outPosition, 
+		const v4 *positions, const real32 *radii, const u16 *colorIndices, 
+		const u8 *materialIds, const i32 *sphereIds, i32 sphereCount)
+{
+	v4 boundsMin = vec4_init(INFINITY, INFINITY, INFINITY, 0.f);
+	v4 boundsMax = vec4_init(-INFINITY, -INFINITY, -INFINITY, 0.f);
+	real32 maxRadius = 0.f;
+
+	for(i32 i = 0; i < sphereCount; ++i)
+	{
+		const v4 *position = &positions[sphereIds[i]];
+		real32 radius = radii[sphereIds[i]];
+
+		for(i32 j = 0; j < 3; ++j)
+		{
+			real32 low = position->_[j] - radius;
+			real32 high = position->_[j] + radius;
+
+			boundsMin._[j] = low < boundsMin._[j] ? low : boundsMin._[j];
+			boundsMax._[j] = high > boundsMax._[j] ? high : boundsMax._[j];
+		}
+
+		maxRadius = radius > maxRadius ? radius : maxRadius;
+	}
+
+	*outPosition = vec4_init(0.f, 0.f, 0.f, 0.f);
+
+	for(i32 j = 0; j < 3; ++j)
+	{
+		real32 extent = boundsMax._[j] - boundsMin._[j];
+
+		cluster->scale[j] = (extent > 0.f ? extent : 1.f)/
+			(real32)(SCENE_SPHERE_CLUSTER_GRID - 2*SCENE_SPHERE_CLUSTER_MARGIN);
+		outPosition->_[j] = boundsMin._[j] - 
+			cluster->scale[j]*(real32)SCENE_SPHERE_CLUSTER_MARGIN;
+	}
+
+	cluster->radiusScale = (maxRadius > 0.f ? maxRadius : 1.f)/
+		(real32)SCENE_SPHERE_CLUSTER_GRID;
+	cluster->sphereCount = sphereCount;
+
+	scene_packed_sphere *spheres = malloc(sizeof(scene_packed_sphere)*sphereCount);
+	bvh_primitive *primitives = malloc(sizeof(bvh_primitive)*sphereCount);
+
+	for(i32 i = 0; i < sphereCount; ++i)
+	{
+		i32 sphereId = sphereIds[i];
+		scene_packed_sphere *sphere = &spheres[i];
+
+		real32 radius = roundf(radii[sphereId]/cluster->radiusScale);
+		sphere->radius = radius < 1.f ? 1 : (u16)radius;
+		sphere->colorIndex = colorIndices[sphereId];
+		sphere->materialIndex = materialIds ? materialIds[sphereId] : 0;
+
+		for(i32 j = 0; j < 3; ++j)
+		{
+			real32 step = roundf((positions[sphereId]._[j] - outPosition->_[j])/
+					cluster->scale[j]);
+			sphere->position[j] = (u16)step;
+
+			// bounds of the decoded sphere in grid steps
+			real32 gridRadius = (real32)sphere->radius*cluster->radiusScale/cluster->scale[j];
+			primitives[i].min[j] = step - gridRadius;
+			primitives[i].max[j] = step + gridRadius;
+		}
+
+		primitives[i].index = i;
+	}
+
+	i32 nodeCount;
+	bvh_node *nodes = bvh_build(primitives, sphereCount, 
+			SCENE_SPHERE_CLUSTER_MIN_LEAF_SIZE, &nodeCount);
+
+	cluster->spheres = malloc(sizeof(scene_packed_sphere)*sphereCount);
+	cluster->nodes = malloc(sizeof(scene_sphere_cluster_node)*nodeCount);
+	cluster->nodeCount = nodeCount;
+
+	for(i32 i = 0; i < sphereCount; ++i)
+	{
+		cluster->spheres[i] = spheres[primitives[i].index];
+	}
+
+	// rounded outwards so that the nodes still contain their spheres
+	for(i32 i = 0; i < nodeCount; ++i)
+	{
+		for(i32 j = 0; j < 3; ++j)
+		{
+			real32 low = floorf(nodes[i].min[j]);
+			real32 high = ceilf(nodes[i].max[j]);
+
+			cluster->nodes[i].min[j] = low < 0.f ? 0 : (u16)low;
+			cluster->nodes[i].max[j] = high > (real32)SCENE_SPHERE_CLUSTER_GRID ? 
+				SCENE_SPHERE_CLUSTER_GRID : (u16)high;
+		}
+
+		cluster->nodes[i].offset = (u16)nodes[i].offset;
+		cluster->nodes[i].sphereCount = (u16)nodes[i].primitiveCount;
+	}
+
+	free(nodes);
+	free(primitives);
+	free(spheres);
+}
+
+// material ids index the given materials, and without any only the default 0 exists
+static b32
+_scene_are_sphere_material_ids_valid(const u8 *materialIds, i32 sphereCount, 
+		i32 materialCount)
+{
+	for(i32 i = 0; materialIds && i < sphereCount; ++i)
+	{
+		if(materialIds[i] >= materialCount && materialIds[i] > 0)
+		{
+			fprintf(stderr, "Sphere %d uses material %d of %d!\n", i, materialIds[i], 
+					materialCount);
+
+			return B32_FALSE;
+		}
+	}
+
+	return B32_TRUE;
+}
+
+// without materials every sphere uses a white diffuse one
+static void
+_scene_init_sphere_materials(raytracer_scene *scene, scene_sphere_palette *palette, 
+		const scene_sphere_material *materials, i32 materialCount)
+{
+	palette->materialCount = materialCount > 0 ? materialCount : 1;
+	palette->materials = malloc(sizeof(scene_material)*palette->materialCount);
+
+	for(i32 i = 0; i < palette->materialCount; ++i)
+	{
+		scene_material *material = &palette->materials[i];
+
+		if(materialCount > 0)
+		{
+			material->albedo = materials[i].albedo;
+			material->reflectivity = materials[i].reflectivity;
+			material->transparency = materials[i].transparency;
+			material->refractiveIndex = materials[i].refractiveIndex;
+		}
+		else
+		{
+			material->albedo = 1.f;
+			material->reflectivity = 0.f;
+			material->transparency = 0.f;
+			material->refractiveIndex = 1.f;
+		}
+
+		material->specularTableId = _scene_get_specular_table(scene, material->albedo);
+	}
+}
+
+i32
+scene_create_sphere_clusters(raytracer_scene *scene, i32 sphereCount, const v4 *positions,
+		const real32 *radii, const color32 *colors, const u8 *materialIds, 
+		const scene_sphere_material *materials, i32 materialCount, i32 *outClusterCount)
+{
+	*outClusterCount = 0;
+
+	if(sphereCount <= 0 || 
+			!_scene_are_sphere_material_ids_valid(materialIds, sphereCount, materialCount))
+	{
+		return SCENE_OBJECT_NULL;
+	}
+
+	scene_sphere_palette *palette = malloc(sizeof(scene_sphere_palette));
+	_scene_init_sphere_materials(scene, palette, materials, materialCount);
+
+	u16 *colorIndices = _scene_build_color_palette(colors, sphereCount, palette);
+	i32 *sphereIds = _scene_sort_spheres(positions, sphereCount);
+
+	i32 firstObject = scene->objectCount;
+	i32 clusterCount = 0;
+
+	for(i32 i = 0; i < sphereCount; i += SCENE_SPHERE_CLUSTER_SIZE)
+	{
+		i32 count = sphereCount - i < SCENE_SPHERE_CLUSTER_SIZE ? sphereCount - i : 
+			SCENE_SPHERE_CLUSTER_SIZE;
+
+		scene_sphere_cluster *cluster = memory_pool_alloc(scene->clusterPool);
+		cluster->palette = palette;
+		cluster->chunk = NULL;
+
+		v4 position;
+		_scene_build_sphere_cluster(cluster, &position, positions, radii, colorIndices, 
+				materialIds, &sphereIds[i], count);
+
+		i32 objectId = scene_create_object(scene, SCENE_OBJECT_SPHERE_CLUSTER);
+		scene->objects[objectId].position = position;
+		scene->objects[objectId].cluster = cluster;
+
+		++clusterCount;
+	}
+
+	free(sphereIds);
+	free(colorIndices);
+
+	*outClusterCount = clusterCount;
+
+	return firstObject;
+}
+
+// 5, 6 and 5 bits of red, green and blue
+static u16
+_scene_get_color_565(color32 color)
+{
+	return (u16)(((color >> 8) & 0xF800) | ((color >> 5) & 0x07E0) | ((color >> 3) & 0x001F));
+}
+
+// the high bits are repeated in the low ones, so that full intensity stays full
+static color32
+_scene_get_color_from_565(u16 code)
+{
+	u32 r = (code >> 11) & 0x1F;
+	u32 g = (code >> 5) & 0x3F;
+	u32 b = code & 0x1F;
+
+	return (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8) | 
+		((b << 3) | (b >> 2));
+}
+
+scene_chunk_writer *
+scene_chunk_writer_open(const char *path, const scene_sphere_material *materials, 
+		i32 materialCount)
+{
+	FILE *file = fopen(path, "wb");
+	if(!file)
+	{
+		fprintf(stderr, "Cannot open chunk file '%s' for writing!\n", path);
+		return NULL;
+	}
+
+	scene_chunk_writer *writer = malloc(sizeof(scene_chunk_writer));
+	writer->file = file;
+	writer->pageSize = (u64)sysconf(_SC_PAGESIZE);
+	// the header is written on close, the chunks start on the page after it
+	writer->offset = writer->pageSize;
+	writer->entries = NULL;
+	writer->entryCount = 0;
+	writer->entryCapacity = 0;
+	writer->materialCount = materialCount > 0 ? materialCount : 0;
+	writer->materials = malloc(sizeof(scene_sphere_material)*(writer->materialCount + 1));
+
+	if(writer->materialCount)
+	{
+		memcpy(writer->materials, materials, 
+				sizeof(scene_sphere_material)*writer->materialCount);
+	}
+
+	return writer;
+}
+
+b32
+scene_chunk_writer_add_spheres(scene_chunk_writer *writer, i32 sphereCount, 
+		const v4 *positions, const real32 *radii, const color32 *colors, 
+		const u8 *materialIds)
+{
+	if(!_scene_are_sphere_material_ids_valid(materialIds, sphereCount, 
+				writer->materialCount))
+	{
+		return B32_FALSE;
+	}
+
+	u16 *colorIndices = malloc(sizeof(u16)*(sphereCount + 1));
+
+	for(i32 i = 0; i < sphereCount; ++i)
+	{
+		colorIndices[i] = colors ? _scene_get_color_565(colors[i]) : 0xFFFF;
+	}
+
+	i32 *sphereIds = _scene_sort_spheres(positions, sphereCount);
+	b32 isWritten = B32_TRUE;
+
+	for(i32 i = 0; i < sphereCount && isWritten; i += SCENE_SPHERE_CLUSTER_SIZE)
+	{
+		i32 count = sphereCount - i < SCENE_SPHERE_CLUSTER_SIZE ? sphereCount - i : 
+			SCENE_SPHERE_CLUSTER_SIZE;
+
+		scene_sphere_cluster cluster;
+		v4 position;
+		_scene_build_sphere_cluster(&cluster, &position, positions, radii, colorIndices, 
+				materialIds, &sphereIds[i], count);
+
+		if(writer->entryCount == writer->entryCapacity)
+		{
+			writer->entryCapacity = writer->entryCapacity ? 2*writer->entryCapacity : 64;
+			writer->entries = realloc(writer->entries, 
+					sizeof(scene_chunk_entry)*writer->entryCapacity);
+		}
+
+		scene_chunk_entry *entry = &writer->entries[writer->entryCount++];
+
+		for(i32 j = 0; j < 3; ++j)
+		{
+			entry->position[j] = position._[j];
+			entry->scale[j] = cluster.scale[j];
+		}
+
+		u64 dataSize = sizeof(scene_sphere_cluster_node)*cluster.nodeCount + 
+			sizeof(scene_packed_sphere)*cluster.sphereCount;
+
+		entry->radiusScale = cluster.radiusScale;
+		entry->sphereCount = cluster.sphereCount;
+		entry->nodeCount = cluster.nodeCount;
+		entry->padding = 0;
+		entry->offset = writer->offset;
+		entry->size = (dataSize + writer->pageSize - 1)/writer->pageSize*writer->pageSize;
+
+		isWritten = !fseeko(writer->file, (off_t)entry->offset, SEEK_SET) && 
+			fwrite(cluster.nodes, sizeof(scene_sphere_cluster_node), cluster.nodeCount, 
+					writer->file) == (size_t)cluster.nodeCount &&
+			fwrite(cluster.spheres, sizeof(scene_packed_sphere), cluster.sphereCount, 
+					writer->file) == (size_t)cluster.sphereCount;
+
+		writer->offset += entry->size;
+
+		free(cluster.nodes);
+		free(cluster.spheres);
+	}
+
+	free(sphereIds);
+	free(colorIndices);
+
+	if(!isWritten)
+	{
+		fprintf(stderr, "Could not write %d spheres to chunk file!\n", sphereCount);
+	}
+
+	return isWritten;
+}
+
+b32
+scene_chunk_writer_close(scene_chunk_writer *writer)
+{
+	scene_chunk_file_header header = {
+		SCENE_CHUNK_FORMAT_CODE, SCENE_CHUNK_FORMAT_VERSION, writer->entryCount, 
+		SCENE_SPHERE_PALETTE_SIZE, writer->materialCount, 0, writer->offset
+	};
+
+	color32 *colors = malloc(sizeof(color32)*SCENE_SPHERE_PALETTE_SIZE);
+
+	for(i32 i = 0; i < SCENE_SPHERE_PALETTE_SIZE; ++i)
+	{
+		colors[i] = _scene_get_color_from_565((u16)i);
+	}
+
+	b32 isWritten = !fseeko(writer->file, (off_t)writer->offset, SEEK_SET) && 
+		fwrite(writer->entries, sizeof(scene_chunk_entry), writer->entryCount, 
+				writer->file) == (size_t)writer->entryCount &&
+		fwrite(colors, sizeof(color32), SCENE_SPHERE_PALETTE_SIZE, 
+				writer->file) == SCENE_SPHERE_PALETTE_SIZE &&
+		fwrite(writer->materials, sizeof(scene_sphere_material), writer->materialCount, 
+				writer->file) == (size_t)writer->materialCount &&
+		!fseeko(writer->file, 0, SEEK_SET) && 
+		fwrite(&header, sizeof(header), 1, writer->file) == 1;
+
+	isWritten = !fclose(writer->file) && isWritten;
+
+	if(!isWritten)
+	{
+		fprintf(stderr, "Could not write the directory of chunk file!\n");
+	}
+
+	free(colors);
+	free(writer->entries);
+	free(writer->materials);
+	free(writer);
+
+	return isWritten;
+}
+
+i32
+scene_map_sphere_chunks(raytracer_scene *scene, const char *path, i32 *outChunkCount)
+{
+	*outChunkCount = 0;
+
+	i32 fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		fprintf(stderr, "Cannot open chunk file '%s'!\n", path);
+		return SCENE_OBJECT_NULL;
+	}
+
+	struct stat st;
+	scene_chunk_file_header header;
+
+	if(fstat(fd, &st) || pread(fd, &header, sizeof(header), 0) != sizeof(header) || 
+			header.formatCode != SCENE_CHUNK_FORMAT_CODE || 
+			header.version != SCENE_CHUNK_FORMAT_VERSION || header.chunkCount < 0 || 
+			header.colorCount <= 0 || header.colorCount > SCENE_SPHERE_PALETTE_SIZE || 
+			header.materialCount < 0 || header.materialCount > 256)
+	{
+		close(fd);
+		fprintf(stderr, "Could not read the header of chunk file '%s'! Wrong format.\n", 
+				path);
+
+		return SCENE_OBJECT_NULL;
+	}
+
+	u64 fileSize = (u64)st.st_size;
+	u64 pageSize = (u64)sysconf(_SC_PAGESIZE);
+	u64 directorySize = sizeof(scene_chunk_entry)*header.chunkCount + 
+		sizeof(color32)*header.colorCount + sizeof(scene_sphere_material)*header.materialCount;
+
+	u8 *directory = malloc(directorySize);
+	scene_chunk_entry *entries = (scene_chunk_entry *)directory;
+	color32 *colors = (color32 *)(entries + header.chunkCount);
+	scene_sphere_material *materials = (scene_sphere_material *)(colors + header.colorCount);
+
+	b32 isValid = header.directoryOffset + directorySize <= fileSize && 
+		pread(fd, directory, directorySize, (off_t)header.directoryOffset) == 
+		(ssize_t)directorySize;
+
+	// only the directory is checked here, the chunks themselves are not read until they
+	// are reached
+	for(i32 i = 0; i < header.chunkCount && isValid; ++i)
+	{
+		scene_chunk_entry *entry = &entries[i];
+
+		isValid = entry->sphereCount > 0 && entry->sphereCount <= SCENE_SPHERE_CLUSTER_SIZE && 
+			entry->nodeCount > 0 && entry->nodeCount < 2*entry->sphereCount && 
+			entry->offset % pageSize == 0 && 
+			entry->offset + entry->size <= header.directoryOffset && 
+			entry->size >= sizeof(scene_sphere_cluster_node)*entry->nodeCount + 
+			sizeof(scene_packed_sphere)*entry->sphereCount;
+	}
+
+	u8 *data = isValid ? mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+
+	if(data == MAP_FAILED)
+	{
+		free(directory);
+		close(fd);
+		fprintf(stderr, "Could not map chunk file '%s'! Data appears to be corrupted.\n", 
+				path);
+
+		return SCENE_OBJECT_NULL;
+	}
+
+	// rays reach the chunks in no particular order, so reading ahead of a fault only 
+	// fills memory
+	posix_madvise(data, fileSize, POSIX_MADV_RANDOM);
+
+	scene_sphere_palette *palette = malloc(sizeof(scene_sphere_palette));
+	palette->colorCount = header.colorCount;
+	palette->colors = malloc(sizeof(color32)*palette->colorCount);
+	memcpy(palette->colors, colors, sizeof(color32)*palette->colorCount);
+	_scene_init_sphere_materials(scene, palette, materials, header.materialCount);
+
+	scene_chunk_residency *residency = &scene->chunkResidency;
+
+	if(scene->chunkShare)
+	{
+		residency->chunks = _scene_unshare_storage(&scene->chunkShare, residency->chunks, 
+				sizeof(scene_sphere_chunk *), residency->chunkCount);
+	}
+
+	residency->chunks = realloc(residency->chunks, sizeof(scene_sphere_chunk *)*
+			(residency->chunkCount + header.chunkCount + 1));
+
+	i32 firstObject = scene->objectCount;
+
+	for(i32 i = 0; i < header.chunkCount; ++i)
+	{
+		scene_chunk_entry *entry = &entries[i];
+
+		scene_sphere_chunk *chunk = memory_pool_alloc(scene->chunkPool);
+		chunk->fd = fd;
+		chunk->data = data + entry->offset;
+		chunk->offset = entry->offset;
+		chunk->size = entry->size;
+		chunk->state = SCENE_CHUNK_UNCHECKED;
+		chunk->isResident = B32_FALSE;
+		chunk->isUsed = B32_FALSE;
+		chunk->lastFrame = residency->frame;
+
+		scene_sphere_cluster *cluster = memory_pool_alloc(scene->clusterPool);
+		cluster->scale[0] = entry->scale[0];
+		cluster->scale[1] = entry->scale[1];
+		cluster->scale[2] = entry->scale[2];
+		cluster->radiusScale = entry->radiusScale;
+		cluster->sphereCount = entry->sphereCount;
+		cluster->nodeCount = entry->nodeCount;
+		cluster->nodes = (scene_sphere_cluster_node *)chunk->data;
+		cluster->spheres = (scene_packed_sphere *)(cluster->nodes + cluster->nodeCount);
+		cluster->palette = palette;
+		cluster->chunk = chunk;
+
+		i32 objectId = scene_create_object(scene, SCENE_OBJECT_SPHERE_CLUSTER);
+		scene->objects[objectId].position = vec4_init(entry->position[0], 
+				entry->position[1], entry->position[2], 0.f);
+		scene->objects[objectId].cluster = cluster;
+
+		residency->chunks[residency->chunkCount++] = chunk;
+	}
+
+	free(directory);
+
+	*outChunkCount = header.chunkCount;
+
+	return firstObject;
+}
+
+void
+scene_set_chunk_budget(raytracer_scene *scene, u64 budgetBytes)
+{
+	scene->chunkResidency.budget = budgetBytes;
+}
+
+u64
+scene_get_resident_chunk_bytes(raytracer_scene *scene)
+{
+	return scene->chunkResidency.residentBytes;
+}
+
+static int
+_scene_compare_chunk_use(const void *lhs, const void *rhs)
+{
+	u32 lhsFrame = (*(scene_sphere_chunk *const *)lhs)->lastFrame;
+	u32 rhsFrame = (*(scene_sphere_chunk *const *)rhs)->lastFrame;
+
+	return lhsFrame < rhsFrame ? -1 : lhsFrame > rhsFrame;
+}
+
+// mapping the range again drops its pages from the process. They are read from the 
+// file again once a ray reaches the chunk.
+static void
+_scene_release_chunk(scene_sphere_chunk *chunk)
+{
+	if(mmap(chunk->data, chunk->size, PROT_READ, MAP_PRIVATE | MAP_FIXED, chunk->fd, 
+				(off_t)chunk->offset) == MAP_FAILED)
+	{
+		fprintf(stderr, "Could not release chunk at offset %llu!\n", 
+				(unsigned long long)chunk->offset);
+		return;
+	}
+
+	posix_madvise(chunk->data, chunk->size, POSIX_MADV_RANDOM);
+	chunk->isResident = B32_FALSE;
+}
+
+void
+scene_update_chunk_residency(raytracer_scene *scene)
+{
+	scene_chunk_residency *residency = &scene->chunkResidency;
+
+	++residency->frame;
+	residency->residentBytes = 0;
+
+	for(i32 i = 0; i < residency->chunkCount; ++i)
+	{
+		scene_sphere_chunk *chunk = residency->chunks[i];
+
+		if(chunk->isUsed)
+		{
+			chunk->lastFrame = residency->frame;
+			chunk->isUsed = B32_FALSE;
+		}
+
+		if(chunk->isResident)
+		{
+			residency->residentBytes += chunk->size;
+		}
+	}
+
+	if(residency->residentBytes <= residency->budget)
+	{
+		return;
+	}
+
+	// chunks reached in the last frame are likely reached in the next one as well
+	u64 scratchMarker = memory_arena_get_marker(scene->scratchArena);
+	scene_sphere_chunk **candidates = memory_arena_push(scene->scratchArena, 
+			sizeof(scene_sphere_chunk *)*residency->chunkCount);
+	i32 candidateCount = 0;
+
+	for(i32 i = 0; i < residency->chunkCount; ++i)
+	{
+		scene_sphere_chunk *chunk = residency->chunks[i];
+
+		if(chunk->isResident && chunk->lastFrame != residency->frame)
+		{
+			candidates[candidateCount++] = chunk;
+		}
+	}
+
+	qsort(candidates, candidateCount, sizeof(scene_sphere_chunk *), 
+			_scene_compare_chunk_use);
+
+	for(i32 i = 0; i < candidateCount && residency->residentBytes > residency->budget; ++i)
+	{
+		_scene_release_chunk(candidates[i]);
+
+		if(!candidates[i]->isResident)
+		{
+			residency->residentBytes -= candidates[i]->size;
+		}
+	}
+
+	memory_arena_pop(scene->scratchArena, scratchMarker);
+}
+
+// records where the object was and is now, instead of dropping every light cache entry
+static void
+_scene_record_light_cache_change(raytracer_scene *scene, i32 objectId, const v4 *oldMin, 
+		const v4 *oldMax)
+{
+	scene_light_cache *cache = &scene->lightCache;
+	scene_light_cache_region *region = &cache->regions[++cache->epoch & 
+		(SCENE_LIGHT_CACHE_REGIONS - 1)];
+
+	_scene_get_object_bounds(scene, &scene->objects[objectId], &region->boundsMin, 
+			&region->boundsMax);
+	region->objectId = objectId;
+
+	for(i32 i = 0; i < 3; ++i)
+	{
+		region->boundsMin._[i] = fminf(region->boundsMin._[i], oldMin->_[i]);
+		region->boundsMax._[i] = fmaxf(region->boundsMax._[i], oldMax->_[i]);
+	}
+}
+
+void
+scene_object_set_values(raytracer_scene *scene, i32 objectId, u32 valueFlags, 
+		const void **values)
+{
+	++scene->version;
+
+	_scene_touch_pages(scene, &scene->objectPages, sizeof(scene_object), objectId, 1);
+
+	scene_object *obj = &scene->objects[objectId];
+
+	// the cached lighting only depends on where objects are, not on their materials
+	b32 isMoved = (valueFlags & SCENE_OBJECT_BOUNDS_VALUES) != 0;
+	v4 oldMin, oldMax;
+
+	if(isMoved)
+	{
+		_scene_get_object_bounds(scene, obj, &oldMin, &oldMax);
+		scene->objectBvh.isDirty = B32_TRUE;
+	}
+
+	i32 valuesSet = 0;
+
+	// visits only the set flags, lowest first like their values
+	for(u32 flags = valueFlags; flags; flags &= flags - 1)
+	{
+		u32 flag = flags & (~flags + 1);
+
+		switch(flag)
+		{
+			case SCENE_OBJECT_VALUE_TYPE:
+			{
+				obj->type = *(const scene_object_t *)values[valuesSet++];
+				scene->kernel = _scene_get_generic_kernel();
+			} break;
+			
+			case SCENE_OBJECT_VALUE_POSITION:
+			{
+				obj->position = *(const v4 *)values[valuesSet++];
+			} break;
+			
+			case SCENE_OBJECT_VALUE_COLOR:
+			{
+				obj->color = *(const color32 *)values[valuesSet++];
+			} break;
+			
+			case SCENE_OBJECT_VALUE_ALBEDO:
+			{
+				obj->material.albedo = *(const real32 *)values[valuesSet++];
+				obj->material.specularTableId = _scene_get_specular_table(scene, 
+						obj->material.albedo);
+			} break;
+			
+			case SCENE_OBJECT_VALUE_SPHERE_RADIUS:
+			{
+				obj->sphereRadius = *(const real32 *)values[valuesSet++];
+			} break;
+			
+			case SCENE_OBJECT_VALUE_BOX_WIDTH:
+			{
+				obj->boxWidth = *(const real32 *)values[valuesSet++];
+			} break;
+			
+			case SCENE_OBJECT_VALUE_BOX_HEIGHT:
+			{
+				obj->boxHeight = *(const real32 *)values[valuesSet++];
+			} break;
+			
+			case SCENE_OBJECT_VALUE_BOX_DEPTH:
+			{
+				obj->boxDepth = *(const real32 *)values[valuesSet++];
+			} break;
+			
+			case SCENE_OBJECT_VALUE_REFLECTIVITY:
+			{
+				obj->material.reflectivity = *(const real32 *)values[valuesSet++];
+			} break;
+			
+			case SCENE_OBJECT_VALUE_TRANSPARENCY:
+			{
+				obj->material.transparency = *(const real32 *)values[valuesSet++];
+			} break;
+			
+			case SCENE_OBJECT_VALUE_REFRACTIVE_INDEX:
+			{
+				obj->material.refractiveIndex = *(const real32 *)values[valuesSet++];
+			} break;
+
+			case SCENE_OBJECT_VALUE_MESH:
+			{
+				obj->mesh = *(raytracer_mesh * const *)values[valuesSet++];
+			} break;
+
+			case SCENE_OBJECT_VALUE_TRANSFORM:
+			{
+				_scene_set_object_transform(scene, objectId, 
+						(const m44 *)values[valuesSet++]);
+			} break;
+
+			default:
+			{
+				printf("Cannot set unknown scene object value!\n");
+			} break;
+		}
+	}
+
+	if(isMoved)
+	{
+		_scene_record_light_cache_change(scene, objectId, &oldMin, &oldMax);
+	}
+}
+
+void
+scene_object_set_value(raytracer_scene *scene, i32 objectId, u32 valueFlag, 
+		const void *value)
+{
+	++scene->version;
+
+	_scene_touch_pages(scene, &scene->objectPages, sizeof(scene_object), objectId, 1);
+
+	scene_object *obj = &scene->objects[objectId];
+
+	b32 isMoved = (valueFlag & SCENE_OBJECT_BOUNDS_VALUES) != 0;
+	v4 oldMin, oldMax;
+
+	if(isMoved)
+	{
+		_scene_get_object_bounds(scene, obj, &oldMin, &oldMax);
+		scene->objectBvh.isDirty = B32_TRUE;
+	}
+
+	switch(valueFlag)
+	{
+		case SCENE_OBJECT_VALUE_TYPE:
+		{
+			obj->type = *(scene_object_t *)value;
+			scene->kernel = _scene_get_generic_kernel();
+		} break;
+		
+		case SCENE_OBJECT_VALUE_POSITION:
+		{
+			obj->position = *(v4 *)value;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_COLOR:
+		{
+			obj->color = *(color32 *)value;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_ALBEDO:
+		{
+			obj->material.albedo = *(real32 *)value;
+			obj->material.specularTableId = _scene_get_specular_table(scene, 
+					obj->material.albedo);
+		} break;
+		
+		case SCENE_OBJECT_VALUE_SPHERE_RADIUS:
+		{
+			obj->sphereRadius = *(real32 *)value;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_BOX_WIDTH:
+		{
+			obj->boxWidth = *(real32 *)value;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_BOX_HEIGHT:
+		{
+			obj->boxHeight = *(real32 *)value;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_BOX_DEPTH:
+		{
+			obj->boxDepth = *(real32 *)value;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_REFLECTIVITY:
+		{
+			obj->material.reflectivity = *(real32 *)value;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_TRANSPARENCY:
+		{
+			obj->material.transparency = *(real32 *)value;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_REFRACTIVE_INDEX:
+		{
+			obj->material.refractiveIndex = *(real32 *)value;
+		} break;
+
+		case SCENE_OBJECT_VALUE_MESH:
+		{
+			obj->mesh = *(raytracer_mesh **)value;
+		} break;
+
+		case SCENE_OBJECT_VALUE_TRANSFORM:
+		{
+			_scene_set_object_transform(scene, objectId, (m44 *)value);
+		} break;
+
+		default:
+		{
+			printf("Cannot set unknown scene object value!\n");
+		} break;
+	}
+
+	if(isMoved)
+	{
+		_scene_record_light_cache_change(scene, objectId, &oldMin, &oldMax);
+	}
+}
+
+void
+scene_object_get_value(raytracer_scene *scene, i32 objectId, u32 valueFlag, 
+		void *outValue)
+{
+	switch(valueFlag)
+	{
+		case SCENE_OBJECT_VALUE_TYPE:
+		{
+			*(scene_object_t *)outValue = scene->objects[objectId].type;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_POSITION:
+		{
+			*(v4 *)outValue = scene->objects[objectId].position;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_COLOR:
+		{
+			*(color32 *)outValue = scene->objects[objectId].color;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_ALBEDO:
+		{
+			*(real32 *)outValue = scene->objects[objectId].material.albedo;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_SPHERE_RADIUS:
+		{
+			*(real32 *)outValue = scene->objects[objectId].sphereRadius;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_BOX_WIDTH:
+		{
+			*(real32 *)outValue = scene->objects[objectId].boxWidth;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_BOX_HEIGHT:
+		{
+			*(real32 *)outValue = scene->objects[objectId].boxHeight;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_BOX_DEPTH:
+		{
+			*(real32 *)outValue = scene->objects[objectId].boxDepth;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_REFLECTIVITY:
+		{
+			*(real32 *)outValue = scene->objects[objectId].material.reflectivity;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_TRANSPARENCY:
+		{
+			*(real32 *)outValue = scene->objects[objectId].material.transparency;
+		} break;
+		
+		case SCENE_OBJECT_VALUE_REFRACTIVE_INDEX:
+		{
+			*(real32 *)outValue = scene->objects[objectId].material.refractiveIndex;
+		} break;
+
+		case SCENE_OBJECT_VALUE_MESH:
+		{
+			*(raytracer_mesh **)outValue = scene->objects[objectId].mesh;
+		} break;
+
+		case SCENE_OBJECT_VALUE_TRANSFORM:
+		{
+			*(m44 *)outValue = _scene_get_object_transform(scene, 
+					&scene->objects[objectId]);
+		} break;
+
+		default:
+		{
+			fprintf(stderr, "Cannot get unknown value from scene object!\n");
+		} break;
+	}
+}
+
+static void
+_scene_object_to_desc(const raytracer_scene *scene, const scene_object *object, 
+		scene_object_desc *desc)
+{
+	desc->position = object->position;
+	desc->color = object->color;
+	desc->albedo = object->material.albedo;
+	desc->sphereRadius = object->sphereRadius;
+	desc->boxWidth = object->boxWidth;
+	desc->boxHeight = object->boxHeight;
+	desc->boxDepth = object->boxDepth;
+	desc->reflectivity = object->material.reflectivity;
+	desc->transparency = object->material.transparency;
+	desc->refractiveIndex = object->material.refractiveIndex;
+	desc->mesh = object->mesh;
+	desc->transform = _scene_get_object_transform(scene, object);
+}
+
+// every value but the specular table, which is looked up by the caller
+static void
+_scene_object_from_desc(raytracer_scene *scene, i32 objectId, 
+		const scene_object_desc *desc, const m44 *identity)
+{
+	scene_object *object = &scene->objects[objectId];
+	object->position = desc->position;
+	object->color = desc->color;
+	object->material.albedo = desc->albedo;
+	object->sphereRadius = desc->sphereRadius;
+	object->boxWidth = desc->boxWidth;
+	object->boxHeight = desc->boxHeight;
+	object->boxDepth = desc->boxDepth;
+	object->material.reflectivity = desc->reflectivity;
+	object->material.transparency = desc->transparency;
+	object->material.refractiveIndex = desc->refractiveIndex;
+	object->mesh = desc->mesh;
+
+	// most objects are not transformed, which needs no inverse
+	if(memcmp(&desc->transform, identity, sizeof(m44)) == 0)
+	{
+		_scene_release_instance(scene, object);
+	}
+	else
+	{
+		_scene_set_object_transform(scene, objectId, &desc->transform);
+	}
+}
+
+void
+scene_object_desc_init(scene_object_desc *desc)
+{
+	scene_object object;
+	_scene_init_object(&object, SCENE_OBJECT_SPHERE);
+	_scene_object_to_desc(NULL, &object, desc);
+}
+
+i32
+scene_create_objects(raytracer_scene *scene, i32 count, scene_object_t type, 
+		const scene_object_desc *descs)
+{
+	++scene->version;
+	_scene_invalidate_light_cache(scene);
+
+	i32 index = scene->objectCount;
+
+	scene_object *objects = _scene_append_objects(scene, count);
+	m44 identity = m44_identity();
+
+	for(i32 i = 0; i < count; ++i)
+	{
+		if(descs)
+		{
+			objects[i].type = type;
+			objects[i].cluster = NULL;
+			objects[i].instanceId = SCENE_INSTANCE_NULL;
+			_scene_object_from_desc(scene, index + i, &descs[i], &identity);
+		}
+		else
+		{
+			_scene_init_object(&objects[i], type);
+		}
+	}
+
+	_scene_assign_specular_tables(scene, index, count);
+
+	scene->kernel = _scene_get_generic_kernel();
+	scene->objectBvh.isDirty = B32_TRUE;
+
+	return index;
+}
+
+void
+scene_set_object_descs(raytracer_scene *scene, i32 firstObjectId, i32 count, 
+		const scene_object_desc *descs)
+{
+	++scene->version;
+
+	_scene_touch_pages(scene, &scene->objectPages, sizeof(scene_object), firstObjectId, 
+			count);
+
+	m44 identity = m44_identity();
+
+	// each object takes a region, so large updates drop every entry at once
+	b32 isRecorded = count <= SCENE_LIGHT_CACHE_REGIONS/2;
+
+	if(!isRecorded)
+	{
+		_scene_invalidate_light_cache(scene);
+	}
+
+	for(i32 i = 0; i < count; ++i)
+	{
+		scene_object *obj = &scene->objects[firstObjectId + i];
+		v4 oldMin, oldMax;
+
+		if(isRecorded)
+		{
+			_scene_get_object_bounds(scene, obj, &oldMin, &oldMax);
+		}
+
+		_scene_object_from_desc(scene, firstObjectId + i, &descs[i], &identity);
+
+		if(isRecorded)
+		{
+			_scene_record_light_cache_change(scene, firstObjectId + i, &oldMin, &oldMax);
+		}
+	}
+
+	_scene_assign_specular_tables(scene, firstObjectId, count);
+
+	scene->objectBvh.isDirty = B32_TRUE;
+}
+
+void
+scene_get_object_descs(raytracer_scene *scene, i32 firstObjectId, i32 count, 
+		scene_object_desc *outDescs)
+{
+	for(i32 i = 0; i < count; ++i)
+	{
+		_scene_object_to_desc(scene, &scene->objects[firstObjectId + i], &outDescs[i]);
+	}
+}
+
+static void
+_scene_init_light(scene_light *light, scene_light_t type)
+{
+	light->type = type;
+	light->position = vec4_init(0, 0, 0, 0);
+	light->direction = vec4_init(0, -1.f, 0, 0);
+	light->intensity = 1.f;
+	light->range = 1.f;
+	light->radius = 0.1f;
+	light->width = 0.2f;
+	light->height = 0.2f;
+	light->color = 0xFFFFFF;
+}
+
+// grows the light array by count and returns the first new light
+static scene_light *
+_scene_append_lights(raytracer_scene *scene, i32 count)
+{
+	i32 index = scene->lightCount;
+	scene->lightCount += count;
+
+	_scene_touch_pages(scene, &scene->lightPages, sizeof(scene_light), index, count);
+
+	if(!scene->lights || scene->lightCount > scene->lightCapacity)
+	{
+		_scene_touch_all_pages(scene, &scene->lightPages, sizeof(scene_light));
+
+		scene->lightCapacity = _scene_grow_capacity(scene->lightCapacity, 
+				scene->lightCount);
+		scene->lights = realloc(scene->lights, sizeof(scene_light)*scene->lightCapacity);
+	}
+
+	return &scene->lights[index];
+}
+
+i32
+scene_get_light_count(raytracer_scene *scene)
+{
+	return scene->lightCount;
+}
+
+i32
+scene_create_light(raytracer_scene *scene, scene_light_t type)
+{
+	++scene->version;
+
+	i32 index = scene->lightCount;
+
+	_scene_init_light(_scene_append_lights(scene, 1), type);
+
+	scene->lightIndex.isDirty = B32_TRUE;
+	_scene_invalidate_light_cache(scene);
+
+	return index;
+}
+
+static void
+_scene_light_to_desc(const scene_light *light, scene_light_desc *desc)
+{
+	desc->position = light->position;
+	desc->direction = light->direction;
+	desc->color = light->color;
+	desc->intensity = light->intensity;
+	desc->range = light->range;
+	desc->radius = light->radius;
+	desc->width = light->width;
+	desc->height = light->height;
+}
+
+static void
+_scene_light_from_desc(scene_light *light, const scene_light_desc *desc)
+{
+	light->position = desc->position;
+	vec4_normal(&desc->direction, &light->direction);
+	light->color = desc->color;
+	light->intensity = desc->intensity;
+	light->range = desc->range;
+	light->radius = desc->radius;
+	light->width = desc->width;
+	light->height = desc->height;
+}
+
+void
+scene_light_desc_init(scene_light_desc *desc)
+{
+	scene_light light;
+	_scene_init_light(&light, LIGHT_POINT);
+	_scene_light_to_desc(&light, desc);
+}
+
+i32
+scene_create_lights(raytracer_scene *scene, i32 count, scene_light_t type, 
+		const scene_light_desc *descs)
+{
+	++scene->version;
+
+	i32 index = scene->lightCount;
+
+	scene_light *lights = _scene_append_lights(scene, count);
+
+	for(i32 i = 0; i < count; ++i)
+	{
+		_scene_init_light(&lights[i], type);
+
+		if(descs)
+		{
+			_scene_light_from_desc(&lights[i], &descs[i]);
+		}
+	}
+
+	scene->lightIndex.isDirty = B32_TRUE;
+	_scene_invalidate_light_cache(scene);
+
+	return index;
+}
+
+void
+scene_set_light_descs(raytracer_scene *scene, i32 firstLightId, i32 count, 
+		const scene_light_desc *descs)
+{
+	++scene->version;
+
+	_scene_touch_pages(scene, &scene->lightPages, sizeof(scene_light), firstLightId, 
+			count);
+
+	for(i32 i = 0; i < count; ++i)
+	{
+		_scene_light_from_desc(&scene->lights[firstLightId + i], &descs[i]);
+	}
+
+	scene->lightIndex.isDirty = B32_TRUE;
+	_scene_invalidate_light_cache(scene);
+}
+
+void
+scene_get_light_descs(raytracer_scene *scene, i32 firstLightId, i32 count, 
+		scene_light_desc *outDescs)
+{
+	for(i32 i = 0; i < count; ++i)
+	{
+		_scene_light_to_desc(&scene->lights[firstLightId + i], &outDescs[i]);
+	}
+}
+
+void
+light_set_values(raytracer_scene *scene, i32 lightId, u32 valueFlags, 
+		const void **values)
+{
+	++scene->version;
+
+	_scene_touch_pages(scene, &scene->lightPages, sizeof(scene_light), lightId, 1);
+
+	scene_light *light = &scene->lights[lightId];
+
+	scene->lightIndex.isDirty = B32_TRUE;
+	_scene_invalidate_light_cache(scene);
+
+	i32 valuesSet = 0;
+
+	// visits only the set flags, lowest first like their values
+	for(u32 flags = valueFlags; flags; flags &= flags - 1)
+	{
+		u32 flag = flags & (~flags + 1);
+
+		switch(flag)
+		{
+			case LIGHT_VALUE_TYPE:
+			{
+				light->type = *(const scene_light_t *)values[valuesSet++];
+			} break;
+			
+			case LIGHT_VALUE_POSITION:
+			{
+				light->position = *(const v4 *)values[valuesSet++];
+			} break;
+			
+			case LIGHT_VALUE_DIRECTION:
+			{
+				light->direction = *(const v4 *)values[valuesSet++];
+				vec4_normal(&light->direction, &light->direction);
+			} break;
+			
+			case LIGHT_VALUE_COLOR:
+			{
+				light->color = *(const color32 *)values[valuesSet++];
+			} break;
+			
+			case LIGHT_VALUE_INTENSITY:
+			{
+				light->intensity = *(const real32 *)values[valuesSet++];
+			} break;
+			
+			case LIGHT_VALUE_RANGE:
+			{
+				light->range = *(const real32 *)values[valuesSet++];
+			} break;
+			
+			case LIGHT_VALUE_RADIUS:
+			{
+				light->radius = *(const real32 *)values[valuesSet++];
+			} break;
+			
+			case LIGHT_VALUE_WIDTH:
+			{
+				light->width = *(const real32 *)values[valuesSet++];
+			} break;
+			
+			case LIGHT_VALUE_HEIGHT:
+			{
+				light->height = *(const real32 *)values[valuesSet++];
+			} break;
+
+			default:
+			{
+				printf("Cannot set unknown light value!\n");
+			} break;
+		}
+	}
+}
+
+void
+light_set_value(raytracer_scene *scene, i32 lightId, u32 valueFlag, const void *value)
+{
+	++scene->version;
+
+	_scene_touch_pages(scene, &scene->lightPages, sizeof(scene_light), lightId, 1);
+
+	scene->lightIndex.isDirty = B32_TRUE;
+	_scene_invalidate_light_cache(scene);
+
+	switch(valueFlag)
+	{
+		case LIGHT_VALUE_TYPE:
+		{
+			scene->lights[lightId].type = *(scene_light_t *)value;
+		} break;
+		
+		case LIGHT_VALUE_POSITION:
+		{
+			scene->lights[lightId].position = *(v4 *)value;
+		} break;
+		
+		case LIGHT_VALUE_DIRECTION:
+		{
+			scene->lights[lightId].direction = *(v4 *)value;
+			vec4_normal(&scene->lights[lightId].direction, &scene->lights[lightId].direction);
+		} break;
+		
+		case LIGHT_VALUE_COLOR:
+		{
+			scene->lights[lightId].color = *(color32 *)value;
+		} break;
+		
+		case LIGHT_VALUE_INTENSITY:
+		{
+			scene->lights[lightId].intensity = *(real32 *)value;
+		} break;
+		
+		case LIGHT_VALUE_RANGE:
+		{
+			scene->lights[lightId].range = *(real32 *)value;
+		} break;
+		
+		case LIGHT_VALUE_RADIUS:
+		{
+			scene->lights[lightId].radius = *(real32 *)value;
+		} break;
+		
+		case LIGHT_VALUE_WIDTH:
+		{
+			scene->lights[lightId].width = *(real32 *)value;
+		} break;
+		
+		case LIGHT_VALUE_HEIGHT:
+		{
+			scene->lights[lightId].height = *(real32 *)value;
+		} break;
+
+		default:
+		{
+			fprintf(stderr, "Cannot set unknown value of light!\n");
+		} break;
+	}
+}
+
+void
+light_get_value(raytracer_scene *scene, i32 lightId, u32 valueFlag, void *outValue)
+{
+	switch(valueFlag)
+	{
+		case LIGHT_VALUE_TYPE:
+		{
+			*(scene_light_t *)outValue = scene->lights[lightId].type;
+		} break;
+		
+		case LIGHT_VALUE_POSITION:
+		{
+			*(v4 *)outValue = scene->lights[lightId].position;
+		} break;
+		
+		case LIGHT_VALUE_DIRECTION:
+		{
+			*(v4 *)outValue = scene->lights[lightId].direction;
+		} break;
+		
+		case LIGHT_VALUE_COLOR:
+		{
+			*(color32 *)outValue = scene->lights[lightId].color;
+		} break;
+		
+		case LIGHT_VALUE_INTENSITY:
+		{
+			*(real32 *)outValue = scene->lights[lightId].intensity;
+		} break;
+		
+		case LIGHT_VALUE_RANGE:
+		{
+			*(real32 *)outValue = scene->lights[lightId].range;
+		} break;
+		
+		case LIGHT_VALUE_RADIUS:
+		{
+			*(real32 *)outValue = scene->lights[lightId].radius;
+		} break;
+		
+		case LIGHT_VALUE_WIDTH:
+		{
+			*(real32 *)outValue = scene->lights[lightId].width;
+		} break;
+		
+		case LIGHT_VALUE_HEIGHT:
+		{
+			*(real32 *)outValue = scene->lights[lightId].height;
+		} break;
+
+		default:
+		{
+			fprintf(stderr, "Cannot get unknown value from light!\n");
+		} break;
+	}
+}
+
+static i32
+_scene_get_ray_sphere_intersection(scene_object *object, const v4 *origin, 
+		const v4 *direction, real32 *out0, real32 *out1)
+{
+	// direction is expected to be normalized
+	v4 CO;
+	vec4_subtract3(origin, &object->position, &CO);
+
+	real32 b = 2.f*vec4_dot3(&CO, direction);
+	real32 c = vec4_dot3(&CO, &CO) - object->sphereRadius*object->sphereRadius;
+
+	real32 discriminant = b*b - 4*c;
+
+	if(discriminant < 0)
+	{
+		return 0;
+	}
+
+	real32 d = sqrtf(discriminant);
+	*out0 = (-b - d)/2.f;
+	*out1 = (-b + d)/2.f;
+
+	return 2;
+}
+
+static b32
+_scene_get_ray_box_intersection(scene_object *object, const v4 *origin, 
+		const v4 *direction, v4 *outNormal, real32 *outDistance)
+{
+	real32 halfExtents[3] = {
+		object->boxWidth/2.f,
+		object->boxHeight/2.f,
+		object->boxDepth/2.f
+	};
+
+	real32 tNear = -INFINITY;
+	real32 tFar = INFINITY;
+	i32 nearPlane = 0;
+	i32 farPlane = 0;
+
+	for(i32 i = 0; i < 3; ++i)
+	{
+		real32 invDirection = 1.f/direction->_[i];
+		real32 t0 = (object->position._[i] - halfExtents[i] - origin->_[i])*invDirection;
+		real32 t1 = (object->position._[i] + halfExtents[i] - origin->_[i])*invDirection;
+
+		if(t0 > t1)
+		{
+			real32 swap = t0;
+			t0 = t1;
+			t1 = swap;
+		}
+
+		if(t0 > tNear)
+		{
+			tNear = t0;
+			nearPlane = i;
+		}
+
+		if(t1 < tFar)
+		{
+			tFar = t1;
+			farPlane = i;
+		}
+
+		if(tNear > tFar)
+		{
+			return B32_FALSE;
+		}
+	}
+
+	if(tFar < SCENE_RAY_EPSILON)
+	{
+		return B32_FALSE;
+	}
+
+	i32 plane;
+
+	// an origin inside of the box exits through the far plane
+	if(tNear > SCENE_RAY_EPSILON)
+	{
+		*outDistance = tNear;
+		plane = nearPlane;
+	}
+	else
+	{
+		*outDistance = tFar;
+		plane = farPlane;
+	}
+
+	real32 point = origin->_[plane] + direction->_[plane]*(*outDistance);
+
+	*outNormal = vec4_init(0.f, 0.f, 0.f, 0.f);
+	outNormal->_[plane] = point < object->position._[plane] ? -1.f : 1.f;
+
+	return B32_TRUE;
+}
+
+static b32
+_scene_is_ray_sphere_occluded(scene_object *object, const v4 *origin, 
+		const v4 *direction, real32 maxDistance)
+{
+	v4 CO;
+	vec4_subtract3(origin, &object->position, &CO);
+
+	real32 b = vec4_dot3(&CO, direction);
+	real32 c = vec4_dot3(&CO, &CO) - object->sphereRadius*object->sphereRadius;
+
+	// origin outside of the sphere and pointing away from it
+	if(c > 0.f && b > 0.f)
+	{
+		return B32_FALSE;
+	}
+
+	real32 discriminant = b*b - c;
+
+	if(discriminant < 0.f)
+	{
+		return B32_FALSE;
+	}
+
+	real32 d = sqrtf(discriminant);
+	real32 t = -b - d;
+
+	if(t <= SCENE_RAY_EPSILON)
+	{
+		t = -b + d;
+	}
+
+	return t > SCENE_RAY_EPSILON && t < maxDistance;
+}
+
+static b32
+_scene_is_ray_box_occluded(scene_object *object, const v4 *origin, 
+		const v4 *direction, real32 maxDistance)
+{
+	real32 halfExtents[3] = {
+		object->boxWidth/2.f,
+		object->boxHeight/2.f,
+		object->boxDepth/2.f
+	};
+
+	real32 tNear = -INFINITY;
+	real32 tFar = INFINITY;
+
+	for(i32 i = 0; i < 3; ++i)
+	{
+		real32 invDirection = 1.f/direction->_[i];
+		real32 t0 = (object->position._[i] - halfExtents[i] - origin->_[i])*invDirection;
+		real32 t1 = (object->position._[i] + halfExtents[i] - origin->_[i])*invDirection;
+
+		if(t0 > t1)
+		{
+			real32 swap = t0;
+			t0 = t1;
+			t1 = swap;
+		}
+
+		tNear = t0 > tNear ? t0 : tNear;
+		tFar = t1 < tFar ? t1 : tFar;
+
+		if(tNear > tFar)
+		{
+			return B32_FALSE;
+		}
+	}
+
+	real32 t = tNear > SCENE_RAY_EPSILON ? tNear : tFar;
+
+	return t > SCENE_RAY_EPSILON && t < maxDistance;
+}
+
+// meshes are stored in their own space, transformed and offset by the object position.
+// The local direction is left unnormalized so that distances stay in world units.
+static void
+_scene_get_mesh_ray(raytracer_scene *scene, scene_object *object, const v4 *origin, 
+		const v4 *direction, v4 *outOrigin, v4 *outDirection)
+{
+	vec4_subtract3(origin, &object->position, outOrigin);
+	*outDirection = *direction;
+
+	if(object->instanceId != SCENE_INSTANCE_NULL)
+	{
+		const m44 *inverse = &scene->instances[object->instanceId].inverseTransform;
+		m44_transform_point(inverse, outOrigin, outOrigin);
+		m44_transform_direction(inverse, outDirection, outDirection);
+	}
+}
+
+static b32
+_scene_get_ray_mesh_intersection(raytracer_scene *scene, scene_object *object, 
+		const v4 *origin, const v4 *direction, real32 maxDistance, v4 *outNormal, 
+		real32 *outDistance)
+{
+	if(!object->mesh)
+	{
+		return B32_FALSE;
+	}
+
+	v4 localOrigin;
+	v4 localDirection;
+	_scene_get_mesh_ray(scene, object, origin, direction, &localOrigin, &localDirection);
+
+	if(!mesh_intersect(object->mesh, &localOrigin, &localDirection, SCENE_RAY_EPSILON, 
+				maxDistance, outDistance, outNormal))
+	{
+		return B32_FALSE;
+	}
+
+	if(object->instanceId != SCENE_INSTANCE_NULL)
+	{
+		// normals transform with the inverse transpose
+		m44 normalTransform;
+		m44_transpose(&scene->instances[object->instanceId].inverseTransform, 
+				&normalTransform);
+		m44_transform_direction(&normalTransform, outNormal, outNormal);
+		vec4_normal(outNormal, outNormal);
+	}
+
+	return B32_TRUE;
+}
+
+static b32
+_scene_is_ray_mesh_occluded(raytracer_scene *scene, scene_object *object, 
+		const v4 *origin, const v4 *direction, real32 maxDistance)
+{
+	if(!object->mesh)
+	{
+		return B32_FALSE;
+	}
+
+	v4 localOrigin;
+	v4 localDirection;
+	_scene_get_mesh_ray(scene, object, origin, direction, &localOrigin, &localDirection);
+
+	return mesh_is_occluded(object->mesh, &localOrigin, &localDirection, SCENE_RAY_EPSILON, 
+			maxDistance);
+}
+
+static b32
+_scene_intersect_sphere_cluster_node(const scene_sphere_cluster_node *node, 
+		const real32 *origin, const real32 *invDirection, real32 maxDistance, real32 *outNear)
+{
+	real32 tNear = 0.f;
+	real32 tFar = maxDistance;
+
+	for(i32 i = 0; i < 3; ++i)
+	{
+		real32 t0 = ((real32)node->min[i] - origin[i])*invDirection[i];
+		real32 t1 = ((real32)node->max[i] - origin[i])*invDirection[i];
+
+		if(t0 > t1)
+		{
+			real32 swap = t0;
+			t0 = t1;
+			t1 = swap;
+		}
+
+		tNear = t0 > tNear ? t0 : tNear;
+		tFar = t1 < tFar ? t1 : tFar;
+	}
+
+	*outNear = tNear;
+
+	return tNear <= tFar;
+}
+
+// whether every node stays inside the node table with its children after it, so that 
+// traversal cannot loop, and every sphere inside the sphere table and palettes
+static b32
+_scene_is_sphere_cluster_valid(const scene_sphere_cluster *cluster)
+{
+	for(i32 i = 0; i < cluster->nodeCount; ++i)
+	{
+		const scene_sphere_cluster_node *node = &cluster->nodes[i];
+
+		if(node->sphereCount ? node->offset + node->sphereCount > cluster->sphereCount : 
+				node->offset <= i || node->offset + 1 >= cluster->nodeCount)
+		{
+			return B32_FALSE;
+		}
+	}
+
+	for(i32 i = 0; i < cluster->sphereCount; ++i)
+	{
+		const scene_packed_sphere *sphere = &cluster->spheres[i];
+
+		if(sphere->colorIndex >= cluster->palette->colorCount || 
+				sphere->materialIndex >= cluster->palette->materialCount)
+		{
+			return B32_FALSE;
+		}
+	}
+
+	return B32_TRUE;
+}
+
+// the whole chunk is read at once, rather than a page per fault. Returns false for a 
+// chunk whose contents are corrupted, which is never traced. Every tracing thread 
+// marks the chunks it reaches, so the flags are atomic and only the thread that makes
+// a chunk resident asks for its pages.
+static b32
+_scene_use_chunk(const scene_sphere_cluster *cluster)
+{
+	scene_sphere_chunk *chunk = cluster->chunk;
+
+	if(!__atomic_load_n(&chunk->isUsed, __ATOMIC_RELAXED))
+	{
+		__atomic_store_n(&chunk->isUsed, B32_TRUE, __ATOMIC_RELAXED);
+
+		if(!__atomic_exchange_n(&chunk->isResident, B32_TRUE, __ATOMIC_RELAXED))
+		{
+			posix_madvise(chunk->data, chunk->size, POSIX_MADV_WILLNEED);
+		}
+	}
+
+	i32 state = __atomic_load_n(&chunk->state, __ATOMIC_ACQUIRE);
+
+	if(state == SCENE_CHUNK_UNCHECKED)
+	{
+		// threads reaching the chunk at once all check it, and only one reports it
+		state = _scene_is_sphere_cluster_valid(cluster) ? SCENE_CHUNK_VALID : 
+			SCENE_CHUNK_CORRUPTED;
+
+		if(__atomic_exchange_n(&chunk->state, state, __ATOMIC_ACQ_REL) == 
+				SCENE_CHUNK_UNCHECKED && state == SCENE_CHUNK_CORRUPTED)
+		{
+			fprintf(stderr, "Chunk at offset %llu is corrupted and is not traced!\n", 
+					(unsigned long long)chunk->offset);
+		}
+	}
+
+	return state == SCENE_CHUNK_VALID;
+}
+
+static void
+_scene_get_packed_sphere(const scene_object *object, const scene_packed_sphere *sphere, 
+		v4 *outCenter, real32 *outRadius)
+{
+	const scene_sphere_cluster *cluster = object->cluster;
+
+	*outCenter = vec4_init(
+			object->position.x + (real32)sphere->position[0]*cluster->scale[0], 
+			object->position.y + (real32)sphere->position[1]*cluster->scale[1], 
+			object->position.z + (real32)sphere->position[2]*cluster->scale[2], 0.f);
+	*outRadius = (real32)sphere->radius*cluster->radiusScale;
+}
+
+// nodes are tested in grid steps, where the ray keeps its parameterization, and the
+// spheres are decoded to world space. Returns the hit sphere or -1, with isAnyHit 
+// ending the search at the first one.
+static i32
+_scene_traverse_sphere_cluster(scene_object *object, const v4 *origin, const v4 *direction,
+		real32 maxDistance, b32 isAnyHit, real32 *outDistance)
+{
+	const scene_sphere_cluster *cluster = object->cluster;
+
+	if(!cluster || !cluster->sphereCount)
+	{
+		return -1;
+	}
+
+	real32 gridOrigin[3];
+	real32 invDirection[3];
+
+	for(i32 i = 0; i < 3; ++i)
+	{
+		gridOrigin[i] = (origin->_[i] - object->position._[i])/cluster->scale[i];
+		invDirection[i] = cluster->scale[i]/direction->_[i];
+	}
+
+	i32 nodeStack[BVH_STACK_SIZE];
+	real32 nearStack[BVH_STACK_SIZE];
+	i32 stackCount = 0;
+
+	real32 nearest = maxDistance;
+	i32 hitSphere = -1;
+
+	real32 near;
+	if(!_scene_intersect_sphere_cluster_node(&cluster->nodes[0], gridOrigin, invDirection, 
+				nearest, &near))
+	{
+		return -1;
+	}
+
+	if(cluster->chunk && !_scene_use_chunk(cluster))
+	{
+		return -1;
+	}
+
+	nodeStack[0] = 0;
+	nearStack[0] = near;
+	stackCount = 1;
+
+	while(stackCount > 0)
+	{
+		--stackCount;
+
+		if(nearStack[stackCount] > nearest)
+		{
+			continue;
+		}
+
+		const scene_sphere_cluster_node *node = &cluster->nodes[nodeStack[stackCount]];
+
+		if(node->sphereCount)
+		{
+			for(i32 i = node->offset; i < node->offset + node->sphereCount; ++i)
+			{
+				v4 center;
+				real32 radius;
+				_scene_get_packed_sphere(object, &cluster->spheres[i], &center, &radius);
+
+				v4 CO;
+				vec4_subtract3(origin, &center, &CO);
+
+				real32 b = vec4_dot3(&CO, direction);
+				real32 c = vec4_dot3(&CO, &CO) - radius*radius;
+				real32 discriminant = b*b - c;
+
+				if(discriminant < 0.f)
+				{
+					continue;
+				}
+
+				real32 d = sqrtf(discriminant);
+				real32 t = -b - d;
+
+				if(t <= SCENE_RAY_EPSILON)
+				{
+					t = -b + d;
+				}
+
+				if(t > SCENE_RAY_EPSILON && t < nearest)
+				{
+					nearest = t;
+					hitSphere = i;
+
+					if(isAnyHit)
+					{
+						*outDistance = nearest;
+
+						return hitSphere;
+					}
+				}
+			}
+
+			continue;
+		}
+
+		// built clusters never fill the stack, a chunk file might
+		if(stackCount + 2 > BVH_STACK_SIZE)
+		{
+			continue;
+		}
+
+		const scene_sphere_cluster_node *left = &cluster->nodes[node->offset];
+		const scene_sphere_cluster_node *right = left + 1;
+
+		real32 leftNear;
+		real32 rightNear;
+		b32 isLeftHit = _scene_intersect_sphere_cluster_node(left, gridOrigin, invDirection, 
+				nearest, &leftNear);
+		b32 isRightHit = _scene_intersect_sphere_cluster_node(right, gridOrigin, 
+				invDirection, nearest, &rightNear);
+
+		if(isLeftHit && isRightHit)
+		{
+			// the nearer child is pushed last so that it is popped first
+			b32 isLeftNearer = leftNear <= rightNear;
+
+			nodeStack[stackCount] = isLeftNearer ? node->offset + 1 : node->offset;
+			nearStack[stackCount++] = isLeftNearer ? rightNear : leftNear;
+			nodeStack[stackCount] = isLeftNearer ? node->offset : node->offset + 1;
+			nearStack[stackCount++] = isLeftNearer ? leftNear : rightNear;
+		}
+		else if(isLeftHit)
+		{
+			nodeStack[stackCount] = node->offset;
+			nearStack[stackCount++] = leftNear;
+		}
+		else if(isRightHit)
+		{
+			nodeStack[stackCount] = node->offset + 1;
+			nearStack[stackCount++] = rightNear;
+		}
+	}
+
+	*outDistance = nearest;
+
+	return hitSphere;
+}
+
+// keeps the nearest sphere of the cluster, with its color and material decoded from 
+// the palettes
+static void
+_scene_intersect_sphere_cluster(scene_object *object, const v4 *origin, 
+		const v4 *direction, scene_hit *hit)
+{
+	real32 distance;
+	i32 sphereId = _scene_traverse_sphere_cluster(object, origin, direction, hit->distance, 
+			B32_FALSE, &distance);
+
+	if(sphereId < 0)
+	{
+		return;
+	}
+
+	const scene_packed_sphere *sphere = &object->cluster->spheres[sphereId];
+	const scene_sphere_palette *palette = object->cluster->palette;
+
+	v4 center;
+	real32 radius;
+	_scene_get_packed_sphere(object, sphere, &center, &radius);
+
+	v4 point;
+	vec4_scalar3(direction, distance, &point);
+	vec4_add3(origin, &point, &point);
+
+	hit->object = object;
+	hit->distance = distance;
+	vec4_direction(&center, &point, &hit->normal);
+	hit->color = palette->colors[sphere->colorIndex];
+	hit->material = &palette->materials[sphere->materialIndex];
+}
+
+static b32
+_scene_is_ray_sphere_cluster_occluded(scene_object *object, const v4 *origin, 
+		const v4 *direction, real32 maxDistance)
+{
+	real32 distance;
+
+	return _scene_traverse_sphere_cluster(object, origin, direction, maxDistance, B32_TRUE, 
+			&distance) >= 0;
+}
+
+// whether an object is of a type the kernel handles. Kernels with a single type
+// skip the check entirely.
+SCENE_KERNEL_INLINE b32
+_scene_kernel_has_type(u32 features, u32 feature, scene_object_t type, 
+		const scene_object *object)
+{
+	return (features & feature) && (features == feature || object->type == type);
+}
+
+SCENE_KERNEL_INLINE b32
+_scene_is_object_occluding(raytracer_scene *scene, scene_object *object, const v4 *origin,
+		const v4 *direction, real32 maxDistance, const u32 features)
+{
+	if(_scene_kernel_has_type(features, SCENE_KERNEL_SPHERES, SCENE_OBJECT_SPHERE, object))
+	{
+		return _scene_is_ray_sphere_occluded(object, origin, direction, maxDistance);
+	}
+
+	if(_scene_kernel_has_type(features, SCENE_KERNEL_BOXES, SCENE_OBJECT_BOX, object))
+	{
+		return _scene_is_ray_box_occluded(object, origin, direction, maxDistance);
+	}
+
+	if(_scene_kernel_has_type(features, SCENE_KERNEL_MESHES, SCENE_OBJECT_MESH, object))
+	{
+		return _scene_is_ray_mesh_occluded(scene, object, origin, direction, maxDistance);
+	}
+
+	if(_scene_kernel_has_type(features, SCENE_KERNEL_CLUSTERS, SCENE_OBJECT_SPHERE_CLUSTER, 
+				object))
+	{
+		return _scene_is_ray_sphere_cluster_occluded(object, origin, direction, maxDistance);
+	}
+
+	return B32_FALSE;
+}
+
+// keeps the hit if the object is nearer than the one found so far
+SCENE_KERNEL_INLINE void
+_scene_intersect_object(raytracer_scene *scene, scene_object *o, const v4 *origin, 
+		const v4 *direction, scene_hit *hit, const u32 features)
+{
+	if(_scene_kernel_has_type(features, SCENE_KERNEL_SPHERES, SCENE_OBJECT_SPHERE, o))
+	{
+		real32 d[2];
+
+		if(_scene_get_ray_sphere_intersection(o, origin, direction, &d[0], &d[1]))
+		{
+			real32 t = d[0] > SCENE_RAY_EPSILON ? d[0] : d[1];
+
+			if(t > SCENE_RAY_EPSILON && t < hit->distance)
+			{
+				hit->object = o;
+				hit->distance = t;
+			}
+		}
+	}
+	else if(_scene_kernel_has_type(features, SCENE_KERNEL_BOXES, SCENE_OBJECT_BOX, o))
+	{
+		v4 n;
+		real32 d;
+
+		if(_scene_get_ray_box_intersection(o, origin, direction, &n, &d))
+		{
+			if(d < hit->distance)
+			{
+				hit->object = o;
+				hit->distance = d;
+				hit->normal = n;
+			}
+		}
+	}
+	else if(_scene_kernel_has_type(features, SCENE_KERNEL_MESHES, SCENE_OBJECT_MESH, o))
+	{
+		v4 n;
+		real32 d;
+
+		if(_scene_get_ray_mesh_intersection(scene, o, origin, direction, hit->distance, 
+					&n, &d))
+		{
+			hit->object = o;
+			hit->distance = d;
+			hit->normal = n;
+		}
+	}
+	else if(_scene_kernel_has_type(features, SCENE_KERNEL_CLUSTERS, 
+				SCENE_OBJECT_SPHERE_CLUSTER, o))
+	{
+		_scene_intersect_sphere_cluster(o, origin, direction, hit);
+	}
+	else
+	{
+		fprintf(stderr, "Unknown object type. Cannot trace ray!\n");
+	}
+}
+
+// visits the nearer child first and skips nodes beyond the nearest hit so far. With
+// isAnyHit the search ends at the first occluding object, whose id is returned.
+SCENE_KERNEL_INLINE i32
+_scene_traverse_objects(raytracer_scene *scene, const v4 *origin, const v4 *direction, 
+		const scene_object *ignoreObject, i32 ignoreId, b32 isAnyHit, scene_hit *hit, 
+		const u32 features)
+{
+	scene_object_bvh *bvh = &scene->objectBvh;
+
+	if(!scene->objectCount)
+	{
+		return SCENE_OBJECT_NULL;
+	}
+
+	real32 rayOrigin[3] = {origin->x, origin->y, origin->z};
+	real32 invDirection[3] = {1.f/direction->x, 1.f/direction->y, 1.f/direction->z};
+
+	i32 nodeStack[BVH_STACK_SIZE];
+	real32 nearStack[BVH_STACK_SIZE];
+	i32 stackCount = 0;
+
+	real32 near;
+	if(!bvh_intersect_node(&bvh->nodes[0], rayOrigin, invDirection, 0.f, hit->distance, 
+				&near))
+	{
+		return SCENE_OBJECT_NULL;
+	}
+
+	nodeStack[0] = 0;
+	nearStack[0] = near;
+	stackCount = 1;
+
+	while(stackCount > 0)
+	{
+		--stackCount;
+
+		if(nearStack[stackCount] > hit->distance)
+		{
+			continue;
+		}
+
+		const bvh_node *node = &bvh->nodes[nodeStack[stackCount]];
+
+		if(node->primitiveCount)
+		{
+			for(i32 i = 0; i < node->primitiveCount; ++i)
+			{
+				i32 objectId = bvh->objectIds[node->offset + i];
+				scene_object *o = &scene->objects[objectId];
+
+				if(!isAnyHit)
+				{
+					_scene_intersect_object(scene, o, origin, direction, hit, features);
+				}
+				else if(o != ignoreObject && objectId != ignoreId && 
+						_scene_is_object_occluding(scene, o, origin, direction, hit->distance, 
+							features))
+				{
+					return objectId;
+				}
+			}
+
+			continue;
+		}
+
+		const bvh_node *left = &bvh->nodes[node->offset];
+		const bvh_node *right = left + 1;
+
+		real32 leftNear;
+		real32 rightNear;
+		b32 isLeftHit = bvh_intersect_node(left, rayOrigin, invDirection, 0.f, 
+				hit->distance, &leftNear);
+		b32 isRightHit = bvh_intersect_node(right, rayOrigin, invDirection, 0.f, 
+				hit->distance, &rightNear);
+
+		if(isLeftHit && isRightHit)
+		{
+			// the nearer child is pushed last so that it is popped first
+			b32 isLeftNearer = leftNear <= rightNear;
+
+			nodeStack[stackCount] = isLeftNearer ? node->offset + 1 : node->offset;
+			nearStack[stackCount++] = isLeftNearer ? rightNear : leftNear;
+			nodeStack[stackCount] = isLeftNearer ? node->offset : node->offset + 1;
+			nearStack[stackCount++] = isLeftNearer ? leftNear : rightNear;
+		}
+		else if(isLeftHit)
+		{
+			nodeStack[stackCount] = node->offset;
+			nearStack[stackCount++] = leftNear;
+		}
+		else if(isRightHit)
+		{
+			nodeStack[stackCount] = node->offset + 1;
+			nearStack[stackCount++] = rightNear;
+		}
+	}
+
+	return SCENE_OBJECT_NULL;
+}
+
+// any hit query that exits on the first blocker. The last object found occluding each
+// light is tested first, since neighbouring rays are usually shadowed by the same one.
+SCENE_KERNEL_INLINE b32
+_scene_is_light_occluded_kernel(raytracer_scene *scene, scene_trace_context *context, 
+		i32 lightId, const scene_object *ignoreObject, const v4 *origin, const v4 *direction, 
+		real32 maxDistance, const u32 features)
+{
+	i32 *occluder = &context->lightOccluders[lightId];
+
+	if(*occluder != SCENE_OBJECT_NULL)
+	{
+		scene_object *o = &scene->objects[*occluder];
+
+		if(o != ignoreObject && _scene_is_object_occluding(scene, o, origin, direction, 
+					maxDistance, features))
+		{
+			return B32_TRUE;
+		}
+	}
+
+	if(!scene->objectBvh.isDirty)
+	{
+		scene_hit hit;
+		hit.object = NULL;
+		hit.distance = maxDistance;
+
+		i32 objectId = _scene_traverse_objects(scene, origin, direction, ignoreObject, 
+				*occluder, B32_TRUE, &hit, features);
+
+		if(objectId != SCENE_OBJECT_NULL)
+		{
+			*occluder = objectId;
+
+			return B32_TRUE;
+		}
+
+		return B32_FALSE;
+	}
+
+	for(i32 i = 0; i < scene->objectCount; ++i)
+	{
+		scene_object *o = &scene->objects[i];
+
+		if(o == ignoreObject || i == *occluder)
+		{
+			continue;
+		}
+
+		if(_scene_is_object_occluding(scene, o, origin, direction, maxDistance, features))
+		{
+			*occluder = i;
+
+			return B32_TRUE;
+		}
+	}
+
+	return B32_FALSE;
+}
+
+static void
+_scene_get_object_bounds(raytracer_scene *scene, scene_object *object, v4 *outMin, 
+		v4 *outMax)
+{
+	if(object->type == SCENE_OBJECT_SPHERE_CLUSTER)
+	{
+		*outMin = object->position;
+		*outMax = object->position;
+
+		if(object->cluster)
+		{
+			for(i32 i = 0; i < 3; ++i)
+			{
+				outMax->_[i] += object->cluster->scale[i]*(real32)SCENE_SPHERE_CLUSTER_GRID;
+			}
+		}
+
+		return;
+	}
+
+	if(object->type == SCENE_OBJECT_MESH)
+	{
+		*outMin = vec4_init(0.f, 0.f, 0.f, 0.f);
+		*outMax = vec4_init(0.f, 0.f, 0.f, 0.f);
+
+		if(object->mesh)
+		{
+			mesh_get_bounds(object->mesh, outMin, outMax);
+		}
+
+		if(object->instanceId != SCENE_INSTANCE_NULL)
+		{
+			const m44 *transform = &scene->instances[object->instanceId].transform;
+			v4 meshMin = *outMin;
+			v4 meshMax = *outMax;
+
+			*outMin = vec4_init(INFINITY, INFINITY, INFINITY, 0.f);
+			*outMax = vec4_init(-INFINITY, -INFINITY, -INFINITY, 0.f);
+
+			for(i32 i = 0; i < 8; ++i)
+			{
+				v4 corner = vec4_init((i & 1) ? meshMax.x : meshMin.x, 
+						(i & 2) ? meshMax.y : meshMin.y, 
+						(i & 4) ? meshMax.z : meshMin.z, 0.f);
+				m44_transform_point(transform, &corner, &corner);
+
+				for(i32 j = 0; j < 3; ++j)
+				{
+					outMin->_[j] = corner._[j] < outMin->_[j] ? corner._[j] : outMin->_[j];
+					outMax->_[j] = corner._[j] > outMax->_[j] ? corner._[j] : outMax->_[j];
+				}
+			}
+		}
+
+		vec4_add3(&object->position, outMin, outMin);
+		vec4_add3(&object->position, outMax, outMax);
+
+		return;
+	}
+
+	v4 halfExtents;
+
+	switch(object->type)
+	{
+		case SCENE_OBJECT_SPHERE:
+		{
+			halfExtents = vec4_init(object->sphereRadius, object->sphereRadius, 
+					object->sphereRadius, 0.f);
+		} break;
+
+		case SCENE_OBJECT_BOX:
+		{
+			halfExtents = vec4_init(object->boxWidth/2.f, object->boxHeight/2.f, 
+					object->boxDepth/2.f, 0.f);
+		} break;
+
+		default:
+		{
+			halfExtents = vec4_init(0.f, 0.f, 0.f, 0.f);
+		} break;
+	}
+
+	*outMin = vec4_init(0.f, 0.f, 0.f, 0.f);
+	*outMax = vec4_init(0.f, 0.f, 0.f, 0.f);
+	vec4_subtract3(&object->position, &halfExtents, outMin);
+	vec4_add3(&object->position, &halfExtents, outMax);
+}
+
+static void
+_scene_get_object_bvh_primitive(raytracer_scene *scene, scene_object *object, 
+		i32 objectId, bvh_primitive *outPrimitive)
+{
+	v4 boundsMin;
+	v4 boundsMax;
+	_scene_get_object_bounds(scene, object, &boundsMin, &boundsMax);
+
+	for(i32 j = 0; j < 3; ++j)
+	{
+		outPrimitive->min[j] = boundsMin._[j];
+		outPrimitive->max[j] = boundsMax._[j];
+	}
+
+	outPrimitive->index = objectId;
+}
+
+void
+scene_update_object_bvh(raytracer_scene *scene)
+{
+	scene_object_bvh *bvh = &scene->objectBvh;
+
+	if(!bvh->isDirty)
+	{
+		return;
+	}
+
+	u64 scratchMarker = memory_arena_get_marker(scene->scratchArena);
+	bvh_primitive *primitives = memory_arena_push(scene->scratchArena, 
+			sizeof(bvh_primitive)*(scene->objectCount + 1));
+
+	if(!bvh->isRebuildNeeded && bvh->nodes && scene->objectCount > 0 && 
+			bvh->objectCount == scene->objectCount)
+	{
+		for(i32 i = 0; i < scene->objectCount; ++i)
+		{
+			i32 objectId = bvh->objectIds[i];
+			_scene_get_object_bvh_primitive(scene, &scene->objects[objectId], objectId, 
+					&primitives[i]);
+		}
+
+		real32 area = bvh_refit(bvh->nodes, bvh->nodeCount, primitives);
+
+		if(area <= bvh->builtArea*SCENE_OBJECT_BVH_REFIT_LIMIT)
+		{
+			memory_arena_pop(scene->scratchArena, scratchMarker);
+
+			bvh->isDirty = B32_FALSE;
+
+			return;
+		}
+	}
+
+	free(bvh->nodes);
+	free(bvh->objectIds);
+
+	for(i32 i = 0; i < scene->objectCount; ++i)
+	{
+		_scene_get_object_bvh_primitive(scene, &scene->objects[i], i, &primitives[i]);
+	}
+
+	bvh->nodes = bvh_build(primitives, scene->objectCount, SCENE_OBJECT_BVH_MIN_LEAF_SIZE, 
+			&bvh->nodeCount);
+	bvh->objectIds = malloc(sizeof(i32)*(scene->objectCount + 1));
+
+	for(i32 i = 0; i < scene->objectCount; ++i)
+	{
+		bvh->objectIds[i] = primitives[i].index;
+	}
+
+	memory_arena_pop(scene->scratchArena, scratchMarker);
+
+	bvh->objectCount = scene->objectCount;
+	bvh->builtArea = bvh_get_area(bvh->nodes, bvh->nodeCount);
+	bvh->isDirty = B32_FALSE;
+	bvh->isRebuildNeeded = B32_FALSE;
+}
+
+// depth range of the object bounds along the camera direction
+static void
+_scene_get_object_view_depth(raytracer_scene *scene, const scene_camera *camera, 
+		scene_object *object, real32 *outNear, real32 *outFar)
+{
+	v4 boundsMin;
+	v4 boundsMax;
+	_scene_get_object_bounds(scene, object, &boundsMin, &boundsMax);
+
+	*outNear = INFINITY;
+	*outFar = -INFINITY;
+
+	for(i32 i = 0; i < 8; ++i)
+	{
+		v4 corner = vec4_init((i & 1) ? boundsMax.x : boundsMin.x, 
+				(i & 2) ? boundsMax.y : boundsMin.y, 
+				(i & 4) ? boundsMax.z : boundsMin.z, 0.f);
+		vec4_subtract3(&corner, &camera->position, &corner);
+
+		real32 depth = vec4_dot3(&corner, &camera->direction);
+
+		*outNear = depth < *outNear ? depth : *outNear;
+		*outFar = depth > *outFar ? depth : *outFar;
+	}
+}
+
+static b32
+_scene_get_object_canvas_rect(raytracer_scene *scene, const scene_camera *camera, 
+		scene_object *object, i32 width, i32 height, i32 *outRect)
+{
+	v4 boundsMin;
+	v4 boundsMax;
+	_scene_get_object_bounds(scene, object, &boundsMin, &boundsMax);
+
+	real32 nearZ;
+	real32 farZ;
+	_scene_get_object_view_depth(scene, camera, object, &nearZ, &farZ);
+
+	if(farZ <= 0.f)
+	{
+		// entirely behind the camera
+		return B32_FALSE;
+	}
+
+	if(nearZ <= SCENE_RAY_EPSILON)
+	{
+		// straddles the camera plane, so the projection is unbounded
+		outRect[0] = 0;
+		outRect[1] = 0;
+		outRect[2] = width - 1;
+		outRect[3] = height - 1;
+
+		return B32_TRUE;
+	}
+
+	real32 xMin = INFINITY;
+	real32 yMin = INFINITY;
+	real32 xMax = -INFINITY;
+	real32 yMax = -INFINITY;
+
+	for(i32 i = 0; i < 8; ++i)
+	{
+		v4 corner = vec4_init((i & 1) ? boundsMax.x : boundsMin.x, 
+				(i & 2) ? boundsMax.y : boundsMin.y, 
+				(i & 4) ? boundsMax.z : boundsMin.z, 0.f);
+
+		real32 x;
+		real32 y;
+		_scene_world_to_canvas(camera, width, height, &corner, &x, &y);
+
+		xMin = x < xMin ? x : xMin;
+		yMin = y < yMin ? y : yMin;
+		xMax = x > xMax ? x : xMax;
+		yMax = y > yMax ? y : yMax;
+	}
+
+	// pad by a pixel to stay conservative against rounding
+	outRect[0] = (i32)floorf(xMin) - 1;
+	outRect[1] = (i32)floorf(yMin) - 1;
+	outRect[2] = (i32)ceilf(xMax) + 1;
+	outRect[3] = (i32)ceilf(yMax) + 1;
+
+	if(outRect[2] < 0 || outRect[3] < 0 || outRect[0] >= width || outRect[1] >= height)
+	{
+		return B32_FALSE;
+	}
+
+	outRect[0] = outRect[0] < 0 ? 0 : outRect[0];
+	outRect[1] = outRect[1] < 0 ? 0 : outRect[1];
+	outRect[2] = outRect[2] >= width ? width - 1 : outRect[2];
+	outRect[3] = outRect[3] >= height ? height - 1 : outRect[3];
+
+	return B32_TRUE;
+}
+
+static void
+_scene_bin_objects(raytracer_scene *scene, const scene_camera *camera, 
+		scene_tile_bins *bins, i32 width, i32 height, i32 tileSize)
+{
+	bins->tileSize = tileSize;
+	bins->xCount = (width + tileSize - 1)/tileSize;
+	bins->yCount = (height + tileSize - 1)/tileSize;
+
+	i32 tileCount = bins->xCount*bins->yCount;
+
+	if(tileCount + 1 > bins->offsetCapacity)
+	{
+		bins->offsetCapacity = tileCount + 1;
+		bins->offsets = realloc(bins->offsets, sizeof(i32)*bins->offsetCapacity);
+	}
+
+	if(scene->objectCount*4 > bins->rectCapacity)
+	{
+		bins->rectCapacity = scene->objectCount*4;
+		bins->rects = realloc(bins->rects, sizeof(i32)*bins->rectCapacity);
+	}
+
+	memset(bins->offsets, 0, sizeof(i32)*(tileCount + 1));
+
+	for(i32 i = 0; i < scene->objectCount; ++i)
+	{
+		i32 *rect = &bins->rects[i*4];
+
+		if(!_scene_get_object_canvas_rect(scene, camera, &scene->objects[i], width, height, 
+					rect))
+		{
+			rect[0] = 0;
+			rect[1] = 0;
+			rect[2] = -tileSize;
+			rect[3] = -tileSize;
+
+			continue;
+		}
+
+		for(i32 tY = rect[1]/tileSize; tY <= rect[3]/tileSize; ++tY)
+		{
+			for(i32 tX = rect[0]/tileSize; tX <= rect[2]/tileSize; ++tX)
+			{
+				++bins->offsets[tY*bins->xCount + tX];
+			}
+		}
+	}
+
+	i32 indexCount = 0;
+	for(i32 i = 0; i < tileCount; ++i)
+	{
+		i32 count = bins->offsets[i];
+		bins->offsets[i] = indexCount;
+		indexCount += count;
+	}
+	bins->offsets[tileCount] = indexCount;
+
+	if(indexCount > bins->indexCapacity)
+	{
+		bins->indexCapacity = indexCount;
+		bins->indices = realloc(bins->indices, sizeof(i32)*bins->indexCapacity);
+	}
+
+	// offsets advance to the end of each tile while filling, then shift back
+	for(i32 i = 0; i < scene->objectCount; ++i)
+	{
+		i32 *rect = &bins->rects[i*4];
+
+		for(i32 tY = rect[1]/tileSize; tY <= rect[3]/tileSize; ++tY)
+		{
+			for(i32 tX = rect[0]/tileSize; tX <= rect[2]/tileSize; ++tX)
+			{
+				bins->indices[bins->offsets[tY*bins->xCount + tX]++] = i;
+			}
+		}
+	}
+
+	for(i32 i = tileCount; i > 0; --i)
+	{
+		bins->offsets[i] = bins->offsets[i - 1];
+	}
+	bins->offsets[0] = 0;
+}
+
+void
+scene_bin_objects(raytracer_scene *scene, raytracer_canvas *canvas, i32 tileSize)
+{
+	_scene_bin_objects(scene, &scene->camera, &scene->tiles, canvas_get_width(canvas), 
+			canvas_get_height(canvas), tileSize);
+}
+
+static i32
+_scene_get_bin_tile(const scene_tile_bins *bins, i32 x, i32 y)
+{
+	if(!bins->offsets || x < 0 || y < 0)
+	{
+		return SCENE_TILE_NULL;
+	}
+
+	i32 tX = x/bins->tileSize;
+	i32 tY = y/bins->tileSize;
+
+	if(tX >= bins->xCount || tY >= bins->yCount)
+	{
+		return SCENE_TILE_NULL;
+	}
+
+	return tY*bins->xCount + tX;
+}
+
+i32
+scene_get_tile(raytracer_scene *scene, i32 x, i32 y)
+{
+	return _scene_get_bin_tile(&scene->tiles, x, y);
+}
+
+void
+scene_rasterize_visibility(raytracer_scene *scene, raytracer_canvas *canvas, 
+		i32 sampleWidth, i32 sampleHeight)
+{
+	scene_visibility_buffer *visibility = &scene->visibility;
+
+	i32 width = canvas_get_width(canvas);
+	i32 height = canvas_get_height(canvas);
+
+	visibility->sampleWidth = sampleWidth;
+	visibility->sampleHeight = sampleHeight;
+	visibility->xCount = width/sampleWidth;
+	visibility->yCount = height/sampleHeight;
+
+	i32 sampleCount = visibility->xCount*visibility->yCount;
+
+	if(sampleCount > visibility->sampleCapacity)
+	{
+		visibility->sampleCapacity = sampleCount;
+		visibility->candidateCounts = realloc(visibility->candidateCounts, 
+				sizeof(u8)*sampleCount);
+		visibility->candidateIds = realloc(visibility->candidateIds, 
+				sizeof(i32)*sampleCount*SCENE_VISIBILITY_CANDIDATES);
+		visibility->candidateDepths = realloc(visibility->candidateDepths, 
+				sizeof(real32)*sampleCount*SCENE_VISIBILITY_CANDIDATES);
+		visibility->overflowDepths = realloc(visibility->overflowDepths, 
+				sizeof(real32)*sampleCount);
+	}
+
+	memset(visibility->candidateCounts, 0, sizeof(u8)*sampleCount);
+	for(i32 i = 0; i < sampleCount; ++i)
+	{
+		visibility->overflowDepths[i] = INFINITY;
+	}
+
+	for(i32 i = 0; i < scene->objectCount; ++i)
+	{
+		scene_object *object = &scene->objects[i];
+
+		i32 rect[4];
+		if(!_scene_get_object_canvas_rect(scene, &scene->camera, object, width, height, 
+					rect))
+		{
+			continue;
+		}
+
+		real32 depth;
+		real32 farDepth;
+		_scene_get_object_view_depth(scene, &scene->camera, object, &depth, &farDepth);
+
+		// samples are taken at the center of each sample rect
+		i32 xMin = (rect[0] - sampleWidth/2 + sampleWidth - 1)/sampleWidth;
+		i32 yMin = (rect[1] - sampleHeight/2 + sampleHeight - 1)/sampleHeight;
+		i32 xMax = (rect[2] - sampleWidth/2)/sampleWidth;
+		i32 yMax = (rect[3] - sampleHeight/2)/sampleHeight;
+
+		xMin = xMin < 0 ? 0 : xMin;
+		yMin = yMin < 0 ? 0 : yMin;
+		xMax = xMax >= visibility->xCount ? visibility->xCount - 1 : xMax;
+		yMax = yMax >= visibility->yCount ? visibility->yCount - 1 : yMax;
+
+		for(i32 y = yMin; y <= yMax; ++y)
+		{
+			for(i32 x = xMin; x <= xMax; ++x)
+			{
+				i32 sample = y*visibility->xCount + x;
+				i32 *ids = &visibility->candidateIds[sample*SCENE_VISIBILITY_CANDIDATES];
+				real32 *depths = &visibility->candidateDepths[sample*SCENE_VISIBILITY_CANDIDATES];
+				i32 count = visibility->candidateCounts[sample];
+
+				if(count == SCENE_VISIBILITY_CANDIDATES)
+				{
+					real32 droppedDepth = depths[count - 1];
+
+					if(depth >= droppedDepth)
+					{
+						droppedDepth = depth;
+					}
+					else
+					{
+						--count;
+					}
+
+					if(droppedDepth < visibility->overflowDepths[sample])
+					{
+						visibility->overflowDepths[sample] = droppedDepth;
+					}
+
+					if(count == SCENE_VISIBILITY_CANDIDATES)
+					{
+						continue;
+					}
+				}
+
+				i32 j = count;
+				for(; j > 0 && depths[j - 1] > depth; --j)
+				{
+					ids[j] = ids[j - 1];
+					depths[j] = depths[j - 1];
+				}
+
+				ids[j] = i;
+				depths[j] = depth;
+				visibility->candidateCounts[sample] = count + 1;
+			}
+		}
+	}
+
+	visibility->isValid = B32_TRUE;
+}
+
+i32
+scene_get_sample(raytracer_scene *scene, i32 x, i32 y)
+{
+	scene_visibility_buffer *visibility = &scene->visibility;
+
+	if(!visibility->isValid || x < 0 || y < 0)
+	{
+		return SCENE_SAMPLE_NULL;
+	}
+
+	i32 sX = x/visibility->sampleWidth;
+	i32 sY = y/visibility->sampleHeight;
+
+	if(sX >= visibility->xCount || sY >= visibility->yCount)
+	{
+		return SCENE_SAMPLE_NULL;
+	}
+
+	return sY*visibility->xCount + sX;
+}
+
+static void
+_scene_direction(raytracer_scene *scene, const v4 *from, const v4 *to, v4 *out)
+{
+	if(scene->mathMode == SCENE_MATH_FAST)
+	{
+		fast_vec4_direction(from, to, out);
+	}
+	else
+	{
+		vec4_direction(from, to, out);
+	}
+}
+
+SCENE_KERNEL_INLINE b32
+_scene_find_nearest_hit_kernel(raytracer_scene *scene, const i32 *objectIndices, 
+		i32 objectIndexCount, const v4 *origin, const v4 *direction, scene_hit *outHit, 
+		const u32 features)
+{
+	outHit->object = NULL;
+	outHit->distance = INFINITY;
+
+	if(!objectIndices && !scene->objectBvh.isDirty)
+	{
+		_scene_traverse_objects(scene, origin, direction, NULL, SCENE_OBJECT_NULL, B32_FALSE, 
+				outHit, features);
+	}
+	else
+	{
+		for(i32 i = 0; i < objectIndexCount; ++i)
+		{
+			scene_object *o = objectIndices ? &scene->objects[objectIndices[i]] : 
+				&scene->objects[i];
+
+			_scene_intersect_object(scene, o, origin, direction, outHit, features);
+		}
+	}
+
+	if(!outHit->object)
+	{
+		return B32_FALSE;
+	}
+
+	outHit->point = vec4_init(0.f, 0.f, 0.f, 0.f);
+	vec4_scalar3(direction, outHit->distance, &outHit->point);
+	vec4_add3(origin, &outHit->point, &outHit->point);
+
+	if(outHit->object->type == SCENE_OBJECT_SPHERE)
+	{
+		_scene_direction(scene, &outHit->object->position, &outHit->point, &outHit->normal);
+	}
+
+	if(outHit->object->type != SCENE_OBJECT_SPHERE_CLUSTER)
+	{
+		outHit->color = outHit->object->color;
+		outHit->material = &outHit->object->material;
+	}
+
+	return B32_TRUE;
+}
+
+// nearest or any hit closer than the distance the hit starts with, for the queries of
+// scene_trace_rays. Expects an up to date hierarchy and returns the hit object id.
+SCENE_KERNEL_INLINE i32
+_scene_query_ray_kernel(raytracer_scene *scene, const v4 *origin, const v4 *direction, 
+		b32 isAnyHit, scene_hit *hit, const u32 features)
+{
+	i32 objectId = _scene_traverse_objects(scene, origin, direction, NULL, 
+			SCENE_OBJECT_NULL, isAnyHit, hit, features);
+
+	if(isAnyHit || !hit->object)
+	{
+		return objectId;
+	}
+
+	if(hit->object->type == SCENE_OBJECT_SPHERE)
+	{
+		v4 point = vec4_init(0.f, 0.f, 0.f, 0.f);
+		vec4_scalar3(direction, hit->distance, &point);
+		vec4_add3(origin, &point, &point);
+
+		_scene_direction(scene, &hit->object->position, &point, &hit->normal);
+	}
+
+	return (i32)(hit->object - scene->objects);
+}
+
+// the intersection loops are generated once per combination of object types, so that
+// no kernel dispatches on types the scene does not contain and scenes with a single type
+// run without any type dispatch in the innermost loop. Ordered by feature mask, the
+// first kernel that covers a set of types is the one generated for exactly that set.
+#define SCENE_KERNELS(X) \
+	X(spheres, SCENE_KERNEL_SPHERES) \
+	X(boxes, SCENE_KERNEL_BOXES) \
+	X(spheres_boxes, SCENE_KERNEL_SPHERES | SCENE_KERNEL_BOXES) \
+	X(meshes, SCENE_KERNEL_MESHES) \
+	X(spheres_meshes, SCENE_KERNEL_SPHERES | SCENE_KERNEL_MESHES) \
+	X(boxes_meshes, SCENE_KERNEL_BOXES | SCENE_KERNEL_MESHES) \
+	X(spheres_boxes_meshes, SCENE_KERNEL_SPHERES | SCENE_KERNEL_BOXES | \
+			SCENE_KERNEL_MESHES) \
+	X(clusters, SCENE_KERNEL_CLUSTERS) \
+	X(spheres_clusters, SCENE_KERNEL_SPHERES | SCENE_KERNEL_CLUSTERS) \
+	X(boxes_clusters, SCENE_KERNEL_BOXES | SCENE_KERNEL_CLUSTERS) \
+	X(spheres_boxes_clusters, SCENE_KERNEL_SPHERES | SCENE_KERNEL_BOXES | \
+			SCENE_KERNEL_CLUSTERS) \
+	X(meshes_clusters, SCENE_KERNEL_MESHES | SCENE_KERNEL_CLUSTERS) \
+	X(spheres_meshes_clusters, SCENE_KERNEL_SPHERES | SCENE_KERNEL_MESHES | \
+			SCENE_KERNEL_CLUSTERS) \
+	X(boxes_meshes_clusters, SCENE_KERNEL_BOXES | SCENE_KERNEL_MESHES | \
+			SCENE_KERNEL_CLUSTERS) \
+	X(mixed, SCENE_KERNEL_SPHERES | SCENE_KERNEL_BOXES | SCENE_KERNEL_MESHES | \
+			SCENE_KERNEL_CLUSTERS)
+
+#define SCENE_KERNEL_DEFINE(name, features) \
+static b32 \
+_scene_find_nearest_hit_##name(raytracer_scene *scene, const i32 *objectIndices, \
+		i32 objectIndexCount, const v4 *origin, const v4 *direction, scene_hit *outHit) \
+{ \
+	return _scene_find_nearest_hit_kernel(scene, objectIndices, objectIndexCount, origin, \
+			direction, outHit, features); \
+} \
+\
+static b32 \
+_scene_is_light_occluded_##name(raytracer_scene *scene, scene_trace_context *context, \
+		i32 lightId, const scene_object *ignoreObject, const v4 *origin, \
+		const v4 *direction, real32 maxDistance) \
+{ \
+	return _scene_is_light_occluded_kernel(scene, context, lightId, ignoreObject, origin, \
+			direction, maxDistance, features); \
+} \
+\
+static i32 \
+_scene_query_ray_##name(raytracer_scene *scene, const v4 *origin, const v4 *direction, \
+		b32 isAnyHit, scene_hit *hit) \
+{ \
+	return _scene_query_ray_kernel(scene, origin, direction, isAnyHit, hit, features); \
+}
+
+SCENE_KERNELS(SCENE_KERNEL_DEFINE)
+
+#define SCENE_KERNEL_ENTRY(name, features) \
+	{#name, features, _scene_find_nearest_hit_##name, _scene_is_light_occluded_##name, \
+		_scene_query_ray_##name},
+
+static const scene_kernel _sceneKernels[] = {
+	SCENE_KERNELS(SCENE_KERNEL_ENTRY)
+};
+
+#define SCENE_KERNEL_COUNT ((i32)(sizeof(_sceneKernels)/sizeof(_sceneKernels[0])))
+
+// handles every object type, used until a narrower kernel is selected
+static const scene_kernel *
+_scene_get_generic_kernel()
+{
+	return &_sceneKernels[SCENE_KERNEL_COUNT - 1];
+}
+
+static b32
+_scene_find_nearest_hit(raytracer_scene *scene, const i32 *objectIndices, i32 objectIndexCount, 
+		const v4 *origin, const v4 *direction, scene_hit *outHit)
+{
+	return scene->kernel->findNearestHit(scene, objectIndices, objectIndexCount, origin, 
+			direction, outHit);
+}
+
+static b32
+_scene_is_light_occluded(raytracer_scene *scene, scene_trace_context *context, 
+		i32 lightId, const scene_object *ignoreObject, const v4 *origin, const v4 *direction, 
+		real32 maxDistance)
+{
+	return scene->kernel->isLightOccluded(scene, context, lightId, ignoreObject, origin, 
+			direction, maxDistance);
+}
+
+void
+scene_select_kernel(raytracer_scene *scene)
+{
+	u32 features = 0;
+
+	for(i32 i = 0; i < scene->objectCount; ++i)
+	{
+		switch(scene->objects[i].type)
+		{
+			case SCENE_OBJECT_SPHERE:
+			{
+				features |= SCENE_KERNEL_SPHERES;
+			} break;
+
+			case SCENE_OBJECT_BOX:
+			{
+				features |= SCENE_KERNEL_BOXES;
+			} break;
+
+			case SCENE_OBJECT_MESH:
+			{
+				features |= SCENE_KERNEL_MESHES;
+			} break;
+
+			case SCENE_OBJECT_SPHERE_CLUSTER:
+			{
+				features |= SCENE_KERNEL_CLUSTERS;
+			} break;
+		}
+	}
+
+	// the kernel generated for exactly the object types in use
+	const scene_kernel *kernel = _scene_get_generic_kernel();
+
+	for(i32 i = 0; i < SCENE_KERNEL_COUNT; ++i)
+	{
+		if((_sceneKernels[i].features & features) == features)
+		{
+			kernel = &_sceneKernels[i];
+			break;
+		}
+	}
+
+	scene->kernel = kernel;
+}
+
+const char *
+scene_get_kernel_name(raytracer_scene *scene)
+{
+	return scene->kernel->name;
+}
+
+// point and area lights only reach as far as their range
+static b32
+_scene_is_light_local(const scene_light *light)
+{
+	return light->type == LIGHT_POINT || light->type == LIGHT_SPHERE || 
+		light->type == LIGHT_RECT;
+}
+
+// the estimated contribution of a point light to a cell, from its color, intensity
+// and range falloff at the nearest point of the cell
+static real32
+_scene_estimate_light_weight(scene_light_index *index, scene_light *light, i32 cellX, 
+		i32 cellY, i32 cellZ)
+{
+	i32 cell[3] = {cellX, cellY, cellZ};
+	real32 distanceSquared = 0.f;
+
+	for(i32 j = 0; j < 3; ++j)
+	{
+		real32 min = index->boundsMin._[j] + (real32)cell[j]*index->cellSize;
+		real32 max = min + index->cellSize;
+		real32 p = light->position._[j];
+		real32 d = p < min ? min - p : (p > max ? p - max : 0.f);
+
+		distanceSquared += d*d;
+	}
+
+	real32 falloff = 1.f - sqrtf(distanceSquared)/light->range;
+	falloff = falloff < 0.01f ? 0.01f : falloff;
+
+	real32 luminance = 0.2126f*(real32)((light->color >> 16) & 0xFF) + 
+		0.7152f*(real32)((light->color >> 8) & 0xFF) + 
+		0.0722f*(real32)((light->color) & 0xFF);
+
+	return (luminance/(real32)0xFF + 0.001f)*light->intensity*falloff;
+}
+
+// builds a Vose alias table per cell so that lights can be sampled in proportion to
+// their estimated contribution in constant time
+static void
+_scene_build_light_alias_tables(raytracer_scene *scene, scene_light_index *index)
+{
+	i32 cellCount = index->dims[0]*index->dims[1]*index->dims[2];
+	i32 entryCount = index->cellOffsets[cellCount];
+
+	index->cellLightPdfs = malloc(sizeof(real32)*(entryCount + 1));
+	index->cellAliasProbabilities = malloc(sizeof(real32)*(entryCount + 1));
+	index->cellAliases = malloc(sizeof(i32)*(entryCount + 1));
+
+	i32 maxCellLightCount = 0;
+	for(i32 i = 0; i < cellCount; ++i)
+	{
+		i32 count = index->cellOffsets[i + 1] - index->cellOffsets[i];
+		maxCellLightCount = count > maxCellLightCount ? count : maxCellLightCount;
+	}
+
+	u64 scratchMarker = memory_arena_get_marker(scene->scratchArena);
+	i32 *small = memory_arena_push(scene->scratchArena, sizeof(i32)*(maxCellLightCount + 1));
+	i32 *large = memory_arena_push(scene->scratchArena, sizeof(i32)*(maxCellLightCount + 1));
+
+	for(i32 z = 0; z < index->dims[2]; ++z)
+	{
+		for(i32 y = 0; y < index->dims[1]; ++y)
+		{
+			for(i32 x = 0; x < index->dims[0]; ++x)
+			{
+				i32 cell = (z*index->dims[1] + y)*index->dims[0] + x;
+				i32 offset = index->cellOffsets[cell];
+				i32 count = index->cellOffsets[cell + 1] - offset;
+
+				real32 *pdfs = &index->cellLightPdfs[offset];
+				real32 *probabilities = &index->cellAliasProbabilities[offset];
+				i32 *aliases = &index->cellAliases[offset];
+
+				// negative intensities weigh nothing, rather than making negative pdfs
+				real32 weightSum = 0.f;
+				for(i32 i = 0; i < count; ++i)
+				{
+					real32 weight = _scene_estimate_light_weight(index, 
+							&scene->lights[index->cellLights[offset + i]], x, y, z);
+					pdfs[i] = weight > 0.f ? weight : 0.f;
+					weightSum += pdfs[i];
+				}
+
+				// cells whose lights all weigh nothing, or overflow, pick them uniformly
+				b32 isUniform = !(weightSum > 0.f && weightSum < INFINITY);
+
+				i32 smallCount = 0;
+				i32 largeCount = 0;
+
+				for(i32 i = 0; i < count; ++i)
+				{
+					pdfs[i] = isUniform ? 1.f/(real32)count : pdfs[i]/weightSum;
+					probabilities[i] = pdfs[i]*(real32)count;
+					aliases[i] = i;
+
+					if(probabilities[i] < 1.f)
+					{
+						small[smallCount++] = i;
+					}
+					else
+					{
+						large[largeCount++] = i;
+					}
+				}
+
+				while(smallCount > 0 && largeCount > 0)
+				{
+					i32 less = small[--smallCount];
+					i32 more = large[largeCount - 1];
+
+					aliases[less] = more;
+					probabilities[more] -= 1.f - probabilities[less];
+
+					if(probabilities[more] < 1.f)
+					{
+						--largeCount;
+						small[smallCount++] = more;
+					}
+				}
+
+				// leftovers are only off from 1 by rounding
+				while(smallCount > 0)
+				{
+					probabilities[small[--smallCount]] = 1.f;
+				}
+				while(largeCount > 0)
+				{
+					probabilities[large[--largeCount]] = 1.f;
+				}
+			}
+		}
+	}
+
+	memory_arena_pop(scene->scratchArena, scratchMarker);
+}
+
+void
+scene_update_light_index(raytracer_scene *scene)
+{
+	scene_light_index *index = &scene->lightIndex;
+
+	if(!index->isDirty)
+	{
+		return;
+	}
+
+	free(index->globalLights);
+	free(index->cellOffsets);
+	free(index->cellLights);
+	free(index->cellLightPdfs);
+	free(index->cellAliasProbabilities);
+	free(index->cellAliases);
+
+	index->globalLights = malloc(sizeof(i32)*(scene->lightCount + 1));
+	index->globalLightCount = 0;
+	index->cellOffsets = NULL;
+	index->cellLights = NULL;
+	index->cellLightPdfs = NULL;
+	index->cellAliasProbabilities = NULL;
+	index->cellAliases = NULL;
+	index->dims[0] = index->dims[1] = index->dims[2] = 0;
+
+	i32 pointLightCount = 0;
+	v4 boundsMin = vec4_init(INFINITY, INFINITY, INFINITY, 0.f);
+	v4 boundsMax = vec4_init(-INFINITY, -INFINITY, -INFINITY, 0.f);
+
+	for(i32 i = 0; i < scene->lightCount; ++i)
+	{
+		scene_light *light = &scene->lights[i];
+
+		if(!_scene_is_light_local(light))
+		{
+			index->globalLights[index->globalLightCount++] = i;
+			continue;
+		}
+
+		if(light->range <= 0.f)
+		{
+			continue;
+		}
+
+		for(i32 j = 0; j < 3; ++j)
+		{
+			real32 min = light->position._[j] - light->range;
+			real32 max = light->position._[j] + light->range;
+
+			boundsMin._[j] = min < boundsMin._[j] ? min : boundsMin._[j];
+			boundsMax._[j] = max > boundsMax._[j] ? max : boundsMax._[j];
+		}
+
+		++pointLightCount;
+	}
+
+	if(pointLightCount > 0)
+	{
+		// aim for a few cells per light
+		v4 extent;
+		vec4_subtract3(&boundsMax, &boundsMin, &extent);
+
+		real32 volume = extent.x*extent.y*extent.z;
+		real32 cellSize = cbrtf(volume/(real32)(pointLightCount*4));
+
+		for(i32 j = 0; j < 3; ++j)
+		{
+			real32 minCellSize = extent._[j]/(real32)SCENE_LIGHT_INDEX_MAX_DIM;
+			cellSize = cellSize < minCellSize ? minCellSize : cellSize;
+		}
+
+		index->boundsMin = boundsMin;
+		index->boundsMax = boundsMax;
+		index->cellSize = cellSize;
+
+		for(i32 j = 0; j < 3; ++j)
+		{
+			i32 dim = (i32)ceilf(extent._[j]/cellSize);
+			index->dims[j] = dim < 1 ? 1 : (dim > SCENE_LIGHT_INDEX_MAX_DIM ? 
+					SCENE_LIGHT_INDEX_MAX_DIM : dim);
+		}
+
+		i32 cellCount = index->dims[0]*index->dims[1]*index->dims[2];
+		index->cellOffsets = calloc(cellCount + 1, sizeof(i32));
+
+		for(i32 pass = 0; pass < 2; ++pass)
+		{
+			for(i32 i = 0; i < scene->lightCount; ++i)
+			{
+				scene_light *light = &scene->lights[i];
+
+				if(!_scene_is_light_local(light) || light->range <= 0.f)
+				{
+					continue;
+				}
+
+				i32 cellMin[3];
+				i32 cellMax[3];
+
+				for(i32 j = 0; j < 3; ++j)
+				{
+					cellMin[j] = (i32)((light->position._[j] - light->range - 
+								boundsMin._[j])/cellSize);
+					cellMax[j] = (i32)((light->position._[j] + light->range - 
+								boundsMin._[j])/cellSize);
+
+					cellMin[j] = cellMin[j] < 0 ? 0 : cellMin[j];
+					cellMax[j] = cellMax[j] >= index->dims[j] ? index->dims[j] - 1 : cellMax[j];
+				}
+
+				for(i32 z = cellMin[2]; z <= cellMax[2]; ++z)
+				{
+					for(i32 y = cellMin[1]; y <= cellMax[1]; ++y)
+					{
+						for(i32 x = cellMin[0]; x <= cellMax[0]; ++x)
+						{
+							i32 cell = (z*index->dims[1] + y)*index->dims[0] + x;
+
+							if(pass == 0)
+							{
+								++index->cellOffsets[cell];
+							}
+							else
+							{
+								index->cellLights[index->cellOffsets[cell]++] = i;
+							}
+						}
+					}
+				}
+			}
+
+			if(pass == 0)
+			{
+				i32 cellLightCount = 0;
+				for(i32 i = 0; i < cellCount; ++i)
+				{
+					i32 count = index->cellOffsets[i];
+					index->cellOffsets[i] = cellLightCount;
+					cellLightCount += count;
+				}
+				index->cellOffsets[cellCount] = cellLightCount;
+
+				index->cellLights = malloc(sizeof(i32)*(cellLightCount + 1));
+			}
+			else
+			{
+				for(i32 i = cellCount; i > 0; --i)
+				{
+					index->cellOffsets[i] = index->cellOffsets[i - 1];
+				}
+				index->cellOffsets[0] = 0;
+			}
+		}
+
+		_scene_build_light_alias_tables(scene, index);
+	}
+
+	index->isDirty = B32_FALSE;
+}
+
+static i32
+_scene_get_light_cell(scene_light_index *index, const v4 *point)
+{
+	if(!index->cellOffsets)
+	{
+		return -1;
+	}
+
+	i32 cell[3];
+
+	for(i32 j = 0; j < 3; ++j)
+	{
+		if(point->_[j] < index->boundsMin._[j] || point->_[j] > index->boundsMax._[j])
+		{
+			return -1;
+		}
+
+		cell[j] = (i32)((point->_[j] - index->boundsMin._[j])/index->cellSize);
+		cell[j] = cell[j] >= index->dims[j] ? index->dims[j] - 1 : cell[j];
+	}
+
+	return (cell[2]*index->dims[1] + cell[1])*index->dims[0] + cell[0];
+}
+
+// xorshift, uniform in [0, 1)
+static real32
+_scene_random(scene_trace_context *context)
+{
+	u32 x = context->randomState;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	context->randomState = x;
+
+	return (real32)(x >> 8)*(1.f/16777216.f);
+}
+
+// object that shadow rays leaving the hit skip. Only spheres and boxes are convex and
+// cannot shadow themselves, meshes and clusters rely on the ray epsilon instead.
+static const scene_object *
+_scene_get_shadow_ignore_object(const scene_hit *hit)
+{
+	b32 isConvex = hit->object->type == SCENE_OBJECT_SPHERE || 
+		hit->object->type == SCENE_OBJECT_BOX;
+
+	return isConvex ? hit->object : NULL;
+}
+
+// fraction of an area light visible from the hit. A few stratified shadow rays decide
+// whether the hit is fully lit or shadowed, only penumbras take more.
+static real32
+_scene_get_area_light_visibility(raytracer_scene *scene, scene_trace_context *context, 
+		i32 lightId, const scene_hit *hit)
+{
+	scene_light *light = &scene->lights[lightId];
+	const scene_object *ignoreObject = _scene_get_shadow_ignore_object(hit);
+
+	v4 normal;
+	real32 extentU;
+	real32 extentV;
+	b32 isDisk;
+
+	if(light->type == LIGHT_SPHERE)
+	{
+		// a sphere looks like a disk facing the hit
+		vec4_direction(&hit->point, &light->position, &normal);
+		extentU = extentV = light->radius;
+		isDisk = B32_TRUE;
+	}
+	else
+	{
+		normal = light->direction;
+		extentU = light->width/2.f;
+		extentV = light->height/2.f;
+		isDisk = B32_FALSE;
+	}
+
+	v4 up = fabsf(normal.y) < 0.9f ? vec4_init(0.f, 1.f, 0.f, 0.f) : 
+		vec4_init(1.f, 0.f, 0.f, 0.f);
+
+	v4 axisU;
+	v4 axisV;
+	vec4_cross3(&up, &normal, &axisU);
+	vec4_normal(&axisU, &axisU);
+	vec4_cross3(&normal, &axisU, &axisV);
+
+	i32 visibleCount = 0;
+	i32 sampleCount = 0;
+
+	for(i32 pass = 0; pass < 2; ++pass)
+	{
+		i32 gridSize = pass == 0 ? SCENE_AREA_LIGHT_GRID : SCENE_AREA_LIGHT_PENUMBRA_GRID;
+
+		for(i32 i = 0; i < gridSize*gridSize; ++i)
+		{
+			// the first pass uses the stratum centers, the penumbra pass jitters them
+			real32 jitterU = pass == 0 ? 0.5f : _scene_random(context);
+			real32 jitterV = pass == 0 ? 0.5f : _scene_random(context);
+
+			real32 u = ((real32)(i % gridSize) + jitterU)/(real32)gridSize;
+			real32 v = ((real32)(i/gridSize) + jitterV)/(real32)gridSize;
+
+			real32 s;
+			real32 t;
+
+			if(isDisk)
+			{
+				real32 r = sqrtf(u);
+				s = r*cosf(2.f*SCENE_PI*v);
+				t = r*sinf(2.f*SCENE_PI*v);
+			}
+			else
+			{
+				s = 2.f*u - 1.f;
+				t = 2.f*v - 1.f;
+			}
+
+			v4 samplePoint;
+			v4 offset;
+			vec4_scalar3(&axisU, s*extentU, &offset);
+			vec4_add3(&light->position, &offset, &samplePoint);
+			vec4_scalar3(&axisV, t*extentV, &offset);
+			vec4_add3(&samplePoint, &offset, &samplePoint);
+
+			v4 sampleDirection;
+			_scene_direction(scene, &hit->point, &samplePoint, &sampleDirection);
+			real32 sampleDistance = vec4_distance3(&hit->point, &samplePoint);
+
+			if(!_scene_is_light_occluded(scene, context, lightId, ignoreObject, &hit->point, 
+						&sampleDirection, sampleDistance))
+			{
+				++visibleCount;
+			}
+
+			++sampleCount;
+		}
+
+		if(visibleCount == 0 || visibleCount == sampleCount)
+		{
+			break;
+		}
+	}
+
+	return (real32)visibleCount/(real32)sampleCount;
+}
+
+// returns whether the light reaches the hit. Shadow rays are only traced when the 
+// light contributes, or when the visibility itself is asked for.
+static b32
+_scene_shade_light(raytracer_scene *scene, scene_trace_context *context, i32 lightId, 
+		real32 weight, u32 shadeFlags, const scene_hit *hit, const v4 *origin, 
+		v4 *colorIntensity, v4 *specularColor, real32 *outVisibility)
+{
+	const scene_object *ignoreObject = _scene_get_shadow_ignore_object(hit);
+	const v4 *intersectionPoint = &hit->point;
+	const v4 *surfaceNormal = &hit->normal;
+	scene_light *light = &scene->lights[lightId];
+
+	v4 lightDirection;
+	real32 lightDistance = INFINITY;
+	real32 distanceCoeff = 1.f;
+
+	switch(light->type)
+	{
+		case LIGHT_AMBIENT:
+		{
+			if(shadeFlags & SCENE_SHADE_DIFFUSE)
+			{
+				colorIntensity->r += light->intensity*weight;
+				colorIntensity->g += light->intensity*weight;
+				colorIntensity->b += light->intensity*weight;
+			}
+
+			if(outVisibility)
+			{
+				*outVisibility = 1.f;
+			}
+
+			return B32_TRUE;
+		} break;
+		
+		case LIGHT_DIRECTIONAL:
+		{
+			lightDirection = light->direction;
+		} break;
+		
+		case LIGHT_POINT:
+		case LIGHT_SPHERE:
+		case LIGHT_RECT:
+		{
+			lightDistance = vec4_distance3(&light->position, intersectionPoint);
+
+			// nothing is lit outside of the range
+			if(lightDistance >= light->range)
+			{
+				return B32_FALSE;
+			}
+
+			_scene_direction(scene, &light->position, intersectionPoint, &lightDirection);
+			distanceCoeff = 1.f - lightDistance/light->range;
+
+			// rect lights only emit to the side they face
+			if(light->type == LIGHT_RECT && 
+					vec4_dot3(&lightDirection, &light->direction) <= 0.f)
+			{
+				return B32_FALSE;
+			}
+		} break;
+
+		default:
+		{
+			return B32_FALSE;
+		} break;
+	}
+
+	real32 diffuseFactor = 0.f;
+	real32 specularFactor = 0.f;
+
+	if(shadeFlags & SCENE_SHADE_DIFFUSE)
+	{
+		real32 dot = vec4_dot3(surfaceNormal, &lightDirection);
+
+		if(dot < 0.f)
+		{
+			real32 cosine = -dot;
+
+			// the fast mode relies on both being unit length already
+			if(scene->mathMode == SCENE_MATH_EXACT)
+			{
+				real32 nLength = vec4_magnitude3(surfaceNormal);
+				real32 lLength = vec4_magnitude3(&lightDirection);
+				cosine /= nLength*lLength;
+			}
+
+			diffuseFactor = cosine*distanceCoeff*weight;
+		}
+	}
+
+	if(shadeFlags & SCENE_SHADE_SPECULAR)
+	{
+		v4 vertexToEye;
+		_scene_direction(scene, intersectionPoint, origin, &vertexToEye);
+
+		v4 lightReflect;
+		vec4_scalar3(surfaceNormal, 2.f*vec4_dot3(&lightDirection, surfaceNormal), 
+				&lightReflect);
+		vec4_subtract3(&lightDirection, &lightReflect, &lightReflect);
+
+		real32 factor = vec4_dot3(&vertexToEye, &lightReflect)*distanceCoeff;
+
+		if(factor > 0.f)
+		{
+			if(scene->mathMode == SCENE_MATH_FAST)
+			{
+				specularFactor = fast_pow_table_lookup(
+						&scene->specularTables[hit->material->specularTableId], factor)*weight;
+			}
+			else
+			{
+				specularFactor = pow(factor, hit->material->albedo)*weight;
+			}
+		}
+	}
+
+	if(!(shadeFlags & SCENE_SHADE_VISIBILITY) && diffuseFactor == 0.f && 
+			specularFactor == 0.f)
+	{
+		return B32_FALSE;
+	}
+
+	real32 visibility = 1.f;
+
+	if(!(shadeFlags & SCENE_SHADE_SKIP_SHADOWS))
+	{
+		if(light->type == LIGHT_SPHERE || light->type == LIGHT_RECT)
+		{
+			visibility = _scene_get_area_light_visibility(scene, context, lightId, hit);
+
+			if(visibility <= 0.f)
+			{
+				return B32_FALSE;
+			}
+
+			diffuseFactor *= visibility;
+			specularFactor *= visibility;
+		}
+		else
+		{
+			v4 invLightDirection;
+			vec4_scalar3(&lightDirection, -1.f, &invLightDirection);
+
+			if(_scene_is_light_occluded(scene, context, lightId, ignoreObject, 
+						intersectionPoint, &invLightDirection, lightDistance))
+			{
+				return B32_FALSE;
+			}
+		}
+	}
+
+	if(outVisibility)
+	{
+		*outVisibility = visibility;
+	}
+
+	v4 lightColor = vec4_from_color32(light->color);
+
+	colorIntensity->r += diffuseFactor*lightColor.r;
+	colorIntensity->g += diffuseFactor*lightColor.g;
+	colorIntensity->b += diffuseFactor*lightColor.b;
+
+	specularColor->r += specularFactor*lightColor.r;
+	specularColor->g += specularFactor*lightColor.g;
+	specularColor->b += specularFactor*lightColor.b;
+
+	return B32_TRUE;
+}
+
+// evaluates every light that can reach the hit. Lit lights and how much of them is
+// visible are written out up to the capacity; the count is set to -1 if they did not fit.
+static void
+_scene_shade_lights(raytracer_scene *scene, scene_trace_context *context, u32 shadeFlags, 
+		b32 isSampled, const scene_hit *hit, const v4 *origin, v4 *colorIntensity, 
+		v4 *specularColor, i32 *outLitLights, real32 *outLitVisibilities, i32 litLightCapacity, 
+		i32 *outLitLightCount)
+{
+	scene_light_index *index = &scene->lightIndex;
+
+	const i32 *lights = NULL;
+	i32 lightCount = scene->lightCount;
+
+	i32 cellOffset = 0;
+	i32 cellLightCount = 0;
+
+	if(!index->isDirty)
+	{
+		lights = index->globalLights;
+		lightCount = index->globalLightCount;
+
+		i32 cell = _scene_get_light_cell(index, &hit->point);
+
+		if(cell != -1)
+		{
+			cellOffset = index->cellOffsets[cell];
+			cellLightCount = index->cellOffsets[cell + 1] - cellOffset;
+		}
+	}
+
+	i32 litLightCount = 0;
+
+	for(i32 i = 0; i < lightCount + cellLightCount; ++i)
+	{
+		i32 lightId;
+		real32 weight = 1.f;
+
+		if(i < lightCount)
+		{
+			lightId = lights ? lights[i] : i;
+		}
+		else if(isSampled && scene->lightSampleCount > 0 && 
+				cellLightCount > scene->lightSampleCount)
+		{
+			if(i >= lightCount + scene->lightSampleCount)
+			{
+				break;
+			}
+
+			// unbiased estimate from a few lights picked by their estimated contribution
+			real32 u = _scene_random(context)*(real32)cellLightCount;
+			i32 entry = (i32)u;
+			entry = entry >= cellLightCount ? cellLightCount - 1 : entry;
+
+			if(u - (real32)entry >= index->cellAliasProbabilities[cellOffset + entry])
+			{
+				entry = index->cellAliases[cellOffset + entry];
+			}
+
+			// lights that weigh nothing are only reached through rounding of the table
+			if(index->cellLightPdfs[cellOffset + entry] <= 0.f)
+			{
+				continue;
+			}
+
+			lightId = index->cellLights[cellOffset + entry];
+			weight = 1.f/((real32)scene->lightSampleCount*
+					index->cellLightPdfs[cellOffset + entry]);
+		}
+		else
+		{
+			lightId = index->cellLights[cellOffset + i - lightCount];
+		}
+
+		real32 visibility;
+
+		if(_scene_shade_light(scene, context, lightId, weight, shadeFlags, hit, origin, 
+					colorIntensity, specularColor, &visibility))
+		{
+			if(litLightCount < litLightCapacity)
+			{
+				outLitLights[litLightCount] = lightId;
+				outLitVisibilities[litLightCount] = visibility;
+			}
+
+			++litLightCount;
+		}
+	}
+
+	if(outLitLightCount)
+	{
+		*outLitLightCount = litLightCount <= litLightCapacity ? litLightCount : -1;
+	}
+}
+
+static u32
+_scene_hash_light_cache_key(i32 objectId, const i32 *cell)
+{
+	u32 hash = (u32)objectId*0x9E3779B1u;
+	hash ^= (u32)cell[0]*0x85EBCA77u;
+	hash ^= (u32)cell[1]*0xC2B2AE3Du;
+	hash ^= (u32)cell[2]*0x27D4EB2Fu;
+	hash ^= hash >> 15;
+	hash *= 0x2C1B3C6Du;
+	hash ^= hash >> 12;
+
+	return hash;
+}
+
+// slab test of the segment from the origin to origin + direction*maxDistance against the
+// box grown by the margin
+static b32
+_scene_is_segment_in_box(const v4 *origin, const v4 *direction, real32 maxDistance, 
+		const v4 *boundsMin, const v4 *boundsMax, real32 margin)
+{
+	real32 nearDistance = 0.f;
+	real32 farDistance = maxDistance;
+
+	for(i32 i = 0; i < 3; ++i)
+	{
+		real32 slabMin = boundsMin->_[i] - margin;
+		real32 slabMax = boundsMax->_[i] + margin;
+
+		if(direction->_[i] == 0.f)
+		{
+			if(origin->_[i] < slabMin || origin->_[i] > slabMax)
+			{
+				return B32_FALSE;
+			}
+
+			continue;
+		}
+
+		real32 t0 = (slabMin - origin->_[i])/direction->_[i];
+		real32 t1 = (slabMax - origin->_[i])/direction->_[i];
+
+		nearDistance = fmaxf(nearDistance, fminf(t0, t1));
+		farDistance = fminf(farDistance, fmaxf(t0, t1));
+
+		if(nearDistance > farDistance)
+		{
+			return B32_FALSE;
+		}
+	}
 
-	return index;
+	return B32_TRUE;
 }
 
-void
-light_set_values(raytracer_scene *scene, i32 lightId, u32 valueFlags, 
-		const void **values)
+// an entry from before the last object changes still holds if none of them was its own
+// object and no shadow ray from the cell to a light can pass where they were or are. 
+// Rays are bounded by segments from the cell center grown by the cell and light extents.
+static b32
+_scene_is_light_cache_entry_valid(raytracer_scene *scene, 
+		const scene_light_cache_entry *entry)
 {
-	scene_light *light = &scene->lights[lightId];
+	scene_light_cache *cache = &scene->lightCache;
+	u32 changeCount = cache->epoch - entry->epoch;
 
-	i32 valuesSet = 0;
+	if(entry->epoch < cache->validEpoch || changeCount > SCENE_LIGHT_CACHE_REGIONS)
+	{
+		return B32_FALSE;
+	}
 
-	for(i32 i = 0; i < 32; ++i)
+	real32 cellRadius = cache->cellSize*0.8660254f;
+	v4 center = vec4_init(((real32)entry->cell[0] + 0.5f)*cache->cellSize, 
+			((real32)entry->cell[1] + 0.5f)*cache->cellSize, 
+			((real32)entry->cell[2] + 0.5f)*cache->cellSize, 0.f);
+
+	for(u32 i = 1; i <= changeCount; ++i)
 	{
-		u32 flag = valueFlags & (1 << i);
+		const scene_light_cache_region *region = &cache->regions[(entry->epoch + i) & 
+			(SCENE_LIGHT_CACHE_REGIONS - 1)];
+
+		if(region->objectId == entry->objectId)
+		{
+			return B32_FALSE;
+		}
 
-		if(flag)
+		for(i32 lightId = 0; lightId < scene->lightCount; ++lightId)
 		{
-			switch(flag)
+			scene_light *light = &scene->lights[lightId];
+			v4 direction;
+			real32 maxDistance = 1.f;
+			real32 lightRadius = 0.f;
+
+			switch(light->type)
 			{
-				case LIGHT_VALUE_TYPE:
-				{
-					light->type = *((real32 **)values)[valuesSet++];
-				} break;
-				
-				case LIGHT_VALUE_POSITION:
-				{
-					light->position = *((v4 **)values)[valuesSet++];
-				} break;
-				
-				case LIGHT_VALUE_DIRECTION:
-				{
-					light->direction = *((v4 **)values)[valuesSet++];
-					vec4_normal(&light->direction, &light->direction);
-				} break;
-				
-				case LIGHT_VALUE_COLOR:
-				{
-					light->color = *((color32 **)values)[valuesSet++];
-				} break;
-				
-				case LIGHT_VALUE_INTENSITY:
+				case LIGHT_AMBIENT:
 				{
-					light->intensity = *((real32 **)values)[valuesSet++];
+					continue;
 				} break;
-				
-				case LIGHT_VALUE_RANGE:
+
+				case LIGHT_DIRECTIONAL:
 				{
-					light->range = *((real32 **)values)[valuesSet++];
+					vec4_scalar3(&light->direction, -1.f, &direction);
+					maxDistance = INFINITY;
 				} break;
 
 				default:
 				{
-					printf("Cannot set unknown light value!\n");
+					if(vec4_distance3(&light->position, &center) >= light->range + cellRadius)
+					{
+						continue;
+					}
+
+					vec4_subtract3(&light->position, &center, &direction);
+
+					if(light->type == LIGHT_SPHERE)
+					{
+						lightRadius = light->radius;
+					}
+					else if(light->type == LIGHT_RECT)
+					{
+						lightRadius = 0.5f*sqrtf(light->width*light->width + 
+								light->height*light->height);
+					}
 				} break;
 			}
+
+			if(_scene_is_segment_in_box(&center, &direction, maxDistance, 
+						&region->boundsMin, &region->boundsMax, cellRadius + lightRadius))
+			{
+				return B32_FALSE;
+			}
 		}
 	}
+
+	return B32_TRUE;
 }
 
-void
-light_set_value(raytracer_scene *scene, i32 lightId, u32 valueFlag, const void *value)
+// the slot of the key in the group, or the slot to replace if it is missing. An entry 
+// that outlived object changes is moved to the current epoch once it is found valid.
+static scene_light_cache_entry *
+_scene_probe_light_cache(raytracer_scene *scene, u32 hash, i32 objectId, const i32 *cell, 
+		b32 *outIsFound)
 {
-	switch(valueFlag)
+	scene_light_cache *cache = &scene->lightCache;
+	u32 group = hash & ~(u32)(SCENE_LIGHT_CACHE_PROBES - 1);
+	scene_light_cache_entry *replaced = NULL;
+
+	for(i32 i = 0; i < SCENE_LIGHT_CACHE_PROBES; ++i)
 	{
-		case LIGHT_VALUE_TYPE:
-		{
-			scene->lights[lightId].type = *(scene_light_t *)value;
-		} break;
-		
-		case LIGHT_VALUE_POSITION:
-		{
-			scene->lights[lightId].position = *(v4 *)value;
-		} break;
-		
-		case LIGHT_VALUE_DIRECTION:
-		{
-			scene->lights[lightId].direction = *(v4 *)value;
-			vec4_normal(&scene->lights[lightId].direction, &scene->lights[lightId].direction);
-		} break;
-		
-		case LIGHT_VALUE_COLOR:
-		{
-			scene->lights[lightId].color = *(color32 *)value;
-		} break;
-		
-		case LIGHT_VALUE_INTENSITY:
-		{
-			scene->lights[lightId].intensity = *(real32 *)value;
-		} break;
-		
-		case LIGHT_VALUE_RANGE:
+		scene_light_cache_entry *entry = &cache->entries[(group + ((hash + i) & 
+					(SCENE_LIGHT_CACHE_PROBES - 1))) & (SCENE_LIGHT_CACHE_SIZE - 1)];
+
+		if(entry->epoch >= cache->validEpoch && entry->objectId == objectId && 
+				entry->cell[0] == cell[0] && entry->cell[1] == cell[1] && 
+				entry->cell[2] == cell[2])
 		{
-			scene->lights[lightId].range = *(real32 *)value;
-		} break;
+			*outIsFound = entry->epoch == cache->epoch || 
+				_scene_is_light_cache_entry_valid(scene, entry);
 
-		default:
+			if(*outIsFound)
+			{
+				entry->epoch = cache->epoch;
+			}
+
+			// replacing the stale slot keeps every key in at most one of them
+			return entry;
+		}
+		else if(entry->epoch != cache->epoch && !replaced)
 		{
-			fprintf(stderr, "Cannot set unknown value of light!\n");
-		} break;
+			replaced = entry;
+		}
 	}
+
+	*outIsFound = B32_FALSE;
+
+	return replaced ? replaced : &cache->entries[hash & (SCENE_LIGHT_CACHE_SIZE - 1)];
 }
 
-void
-light_get_value(raytracer_scene *scene, i32 lightId, u32 valueFlag, void *outValue)
+// diffuse irradiance and light visibility do not depend on the view, so they are
+// cached per object and quantized world position until a light or object changes. 
+// The entry is copied out, and a missing one is shaded outside of the lock.
+static void
+_scene_get_light_cache_entry(raytracer_scene *scene, scene_trace_context *context, 
+		const scene_hit *hit, const v4 *origin, scene_light_cache_entry *outEntry)
 {
-	switch(valueFlag)
+	scene_light_cache *cache = &scene->lightCache;
+
+	i32 objectId = (i32)(hit->object - scene->objects);
+	i32 cell[3];
+
+	for(i32 i = 0; i < 3; ++i)
 	{
-		case LIGHT_VALUE_TYPE:
-		{
-			*(scene_light_t *)outValue = scene->lights[lightId].type;
-		} break;
-		
-		case LIGHT_VALUE_POSITION:
+		cell[i] = (i32)floorf(hit->point._[i]/cache->cellSize);
+	}
+
+	u32 hash = _scene_hash_light_cache_key(objectId, cell);
+	pthread_mutex_t *lock = &cache->locks[(hash/SCENE_LIGHT_CACHE_PROBES) & 
+		(SCENE_LIGHT_CACHE_LOCKS - 1)];
+
+	b32 isFound;
+
+	pthread_mutex_lock(lock);
+	scene_light_cache_entry *entry = _scene_probe_light_cache(scene, hash, objectId, cell, 
+			&isFound);
+
+	if(isFound)
+	{
+		*outEntry = *entry;
+	}
+
+	pthread_mutex_unlock(lock);
+
+	if(isFound)
+	{
+		return;
+	}
+
+	outEntry->objectId = objectId;
+	outEntry->cell[0] = cell[0];
+	outEntry->cell[1] = cell[1];
+	outEntry->cell[2] = cell[2];
+	outEntry->epoch = cache->epoch;
+	outEntry->diffuse = vec4_init(0.f, 0.f, 0.f, 0.f);
+
+	v4 specularColor = {};
+	_scene_shade_lights(scene, context, SCENE_SHADE_DIFFUSE | SCENE_SHADE_VISIBILITY, 
+			B32_FALSE, hit, origin, &outEntry->diffuse, &specularColor, outEntry->litLights, 
+			outEntry->litVisibilities, SCENE_LIGHT_CACHE_LIGHTS, &outEntry->litLightCount);
+
+	// another thread may have added the same key meanwhile, with the same result
+	pthread_mutex_lock(lock);
+	entry = _scene_probe_light_cache(scene, hash, objectId, cell, &isFound);
+
+	if(!isFound)
+	{
+		*entry = *outEntry;
+	}
+
+	pthread_mutex_unlock(lock);
+}
+
+static void
+_scene_shade(raytracer_scene *scene, scene_trace_context *context, const scene_hit *hit, 
+		const v4 *origin, v4 *outColor)
+{
+	v4 specularColor = {};
+	v4 colorIntensity = {};
+
+	if(scene->lightCache.cellSize > 0.f)
+	{
+		scene_light_cache_entry entry;
+		_scene_get_light_cache_entry(scene, context, hit, origin, &entry);
+
+		if(entry.litLightCount >= 0)
 		{
-			*(v4 *)outValue = scene->lights[lightId].position;
-		} break;
-		
-		case LIGHT_VALUE_DIRECTION:
+			// the lights that reach the cell are known, so no shadow rays are traced
+			for(i32 i = 0; i < entry.litLightCount; ++i)
+			{
+				_scene_shade_light(scene, context, entry.litLights[i], entry.litVisibilities[i], 
+						SCENE_SHADE_DIFFUSE | SCENE_SHADE_SPECULAR | SCENE_SHADE_SKIP_SHADOWS, 
+						hit, origin, &colorIntensity, &specularColor, NULL);
+			}
+		}
+		else
 		{
-			*(v4 *)outValue = scene->lights[lightId].direction;
-		} break;
-		
-		case LIGHT_VALUE_COLOR:
+			// too many lights to remember, so reuse the irradiance and only trace 
+			// shadow rays for the lights with a specular highlight
+			colorIntensity = entry.diffuse;
+
+			_scene_shade_lights(scene, context, SCENE_SHADE_SPECULAR, B32_FALSE, hit, origin, 
+					&colorIntensity, &specularColor, NULL, NULL, 0, NULL);
+		}
+	}
+	else
+	{
+		_scene_shade_lights(scene, context, SCENE_SHADE_DIFFUSE | SCENE_SHADE_SPECULAR, 
+				B32_TRUE, hit, origin, &colorIntensity, &specularColor, NULL, NULL, 0, NULL);
+	}
+
+	v4 c = {{((real32)((hit->color >> 16) & 0xFF)/(real32)0xFF)*colorIntensity.r,
+		((real32)((hit->color >> 8) & 0xFF)/(real32)0xFF)*colorIntensity.g,
+		((real32)((hit->color) & 0xFF)/(real32)0xFF)*colorIntensity.b,
+		0.f}};
+
+	vec4_add3(&c, &specularColor, &c);
+
+	*outColor = c;
+}
+
+static void
+_scene_shade_path(raytracer_scene *scene, scene_trace_context *context, const scene_hit *hit, 
+		const v4 *origin, const v4 *direction, i32 depth, real32 throughput, v4 *outColor);
+
+// secondary rays are bounded by the max depth and the context's ray budget. Paths 
+// carrying little light are terminated by russian roulette.
+static void
+_scene_trace_secondary_ray(raytracer_scene *scene, scene_trace_context *context, 
+		const v4 *origin, const v4 *direction, i32 depth, real32 throughput, v4 *outColor)
+{
+	*outColor = vec4_init(0.f, 0.f, 0.f, 0.f);
+
+	if(depth > scene->maxDepth)
+	{
+		return;
+	}
+
+	if(scene->rayBudget > 0 && context->stats.secondaryRayCount >= scene->rayBudget)
+	{
+		++context->stats.budgetTerminationCount;
+
+		return;
+	}
+
+	real32 weight = 1.f;
+
+	if(throughput < scene->rouletteThreshold)
+	{
+		real32 survival = throughput/scene->rouletteThreshold;
+
+		if(_scene_random(context) >= survival)
 		{
-			*(color32 *)outValue = scene->lights[lightId].color;
-		} break;
-		
-		case LIGHT_VALUE_INTENSITY:
+			++context->stats.rouletteTerminationCount;
+
+			return;
+		}
+
+		weight = 1.f/survival;
+		throughput = scene->rouletteThreshold;
+	}
+
+	++context->stats.secondaryRayCount;
+
+	scene_hit hit;
+
+	if(_scene_find_nearest_hit(scene, NULL, scene->objectCount, origin, direction, &hit))
+	{
+		_scene_shade_path(scene, context, &hit, origin, direction, depth, throughput, 
+				outColor);
+		vec4_scalar3(outColor, weight, outColor);
+	}
+}
+
+static void
+_scene_shade_path(raytracer_scene *scene, scene_trace_context *context, const scene_hit *hit, 
+		const v4 *origin, const v4 *direction, i32 depth, real32 throughput, v4 *outColor)
+{
+	const scene_material *material = hit->material;
+
+	_scene_shade(scene, context, hit, origin, outColor);
+
+	if(material->reflectivity <= 0.f && material->transparency <= 0.f)
+	{
+		return;
+	}
+
+	// the surface keeps what is neither reflected nor transmitted
+	real32 surfaceWeight = 1.f - material->reflectivity - material->transparency;
+	vec4_scalar3(outColor, surfaceWeight > 0.f ? surfaceWeight : 0.f, outColor);
+
+	v4 normal = hit->normal;
+	real32 cosIncident = vec4_dot3(direction, &normal);
+	b32 isInside = cosIncident > 0.f;
+
+	if(isInside)
+	{
+		vec4_scalar3(&normal, -1.f, &normal);
+		cosIncident = -cosIncident;
+	}
+
+	v4 reflectDirection;
+	vec4_scalar3(&normal, 2.f*cosIncident, &reflectDirection);
+	vec4_subtract3(direction, &reflectDirection, &reflectDirection);
+
+	if(material->reflectivity > 0.f)
+	{
+		v4 reflectColor;
+		_scene_trace_secondary_ray(scene, context, &hit->point, &reflectDirection, depth + 1, 
+				throughput*material->reflectivity, &reflectColor);
+
+		vec4_scalar3(&reflectColor, material->reflectivity, &reflectColor);
+		vec4_add3(outColor, &reflectColor, outColor);
+	}
+
+	if(material->transparency > 0.f)
+	{
+		real32 eta = isInside ? material->refractiveIndex : 1.f/material->refractiveIndex;
+		real32 k = 1.f - eta*eta*(1.f - cosIncident*cosIncident);
+
+		// total internal reflection sends the transmitted light back inside
+		v4 refractDirection = reflectDirection;
+
+		if(k >= 0.f)
 		{
-			*(real32 *)outValue = scene->lights[lightId].intensity;
-		} break;
-		
-		case LIGHT_VALUE_RANGE:
+			v4 tangent;
+			vec4_scalar3(direction, eta, &refractDirection);
+			vec4_scalar3(&normal, -eta*cosIncident - sqrtf(k), &tangent);
+			vec4_add3(&refractDirection, &tangent, &refractDirection);
+			vec4_normal(&refractDirection, &refractDirection);
+		}
+
+		v4 refractColor;
+		_scene_trace_secondary_ray(scene, context, &hit->point, &refractDirection, depth + 1, 
+				throughput*material->transparency, &refractColor);
+
+		vec4_scalar3(&refractColor, material->transparency, &refractColor);
+		vec4_add3(outColor, &refractColor, outColor);
+	}
+}
+
+// tests the sample's candidates front to back by the near depth of their bounds. The
+// search is exact when the nearest hit lies in front of every candidate not yet tested,
+// otherwise it falls back to the tile's full object list.
+static b32
+_scene_find_visible_hit(raytracer_scene *scene, i32 sampleId, const v4 *origin, 
+		const v4 *direction, scene_hit *outHit, b32 *outIsResolved)
+{
+	scene_visibility_buffer *visibility = &scene->visibility;
+
+	const i32 *ids = &visibility->candidateIds[sampleId*SCENE_VISIBILITY_CANDIDATES];
+	const real32 *depths = &visibility->candidateDepths[sampleId*SCENE_VISIBILITY_CANDIDATES];
+	i32 count = visibility->candidateCounts[sampleId];
+
+	outHit->object = NULL;
+	outHit->distance = INFINITY;
+
+	real32 hitDepth = INFINITY;
+
+	for(i32 i = 0; i < count; ++i)
+	{
+		if(hitDepth <= depths[i])
 		{
-			*(real32 *)outValue = scene->lights[lightId].range;
-		} break;
+			*outIsResolved = B32_TRUE;
 
-		default:
+			return outHit->object != NULL;
+		}
+
+		scene_hit hit;
+		if(_scene_find_nearest_hit(scene, &ids[i], 1, origin, direction, &hit))
 		{
-			fprintf(stderr, "Cannot get unknown value from light!\n");
-		} break;
+			if(hit.distance < outHit->distance)
+			{
+				*outHit = hit;
+
+				v4 relative;
+				vec4_subtract3(&hit.point, origin, &relative);
+				hitDepth = vec4_dot3(&relative, &scene->camera.direction);
+			}
+		}
 	}
+
+	*outIsResolved = hitDepth <= visibility->overflowDepths[sampleId];
+
+	return outHit->object != NULL;
 }
 
-static i32
-_scene_get_ray_sphere_intersection(raytracer_scene *scene, scene_object *object, 
-		const v4 *viewportPosition, const v4 *origin, real32 *out0, real32 *out1)
+scene_trace_context *
+scene_create_trace_context()
 {
-	v4 objPosition;
-	vec4_subtract3(&object->position, &scene->camera.position, &objPosition);
+	scene_trace_context *context = malloc(sizeof(scene_trace_context));
+	static u32 contextCount = 0;
 
-	v4 CO;
-	vec4_subtract3(origin, &objPosition, &CO);
+	context->lightOccluders = NULL;
+	context->lightOccluderCapacity = 0;
+	context->occluderObjects = NULL;
+	context->occluderObjectCount = 0;
+	context->randomState = 0x9E3779B9u*(++contextCount);
+	scene_reset_trace_stats(context);
+
+	return context;
+}
+
+void
+scene_reset_trace_stats(scene_trace_context *context)
+{
+	memset(&context->stats, 0, sizeof(context->stats));
+}
+
+void
+scene_get_trace_stats(scene_trace_context *context, scene_trace_stats *outStats)
+{
+	*outStats = context->stats;
+}
+
+static void
+_scene_prepare_trace_context(raytracer_scene *scene, scene_trace_context *context)
+{
+	if(scene->lightCount > context->lightOccluderCapacity)
+	{
+		context->lightOccluders = realloc(context->lightOccluders, 
+				sizeof(i32)*scene->lightCount);
+
+		for(i32 i = context->lightOccluderCapacity; i < scene->lightCount; ++i)
+		{
+			context->lightOccluders[i] = SCENE_OBJECT_NULL;
+		}
+
+		context->lightOccluderCapacity = scene->lightCount;
+	}
+
+	// the ids are only hints, but must stay within the objects they are tested against
+	if(context->occluderObjects != scene->objects || 
+			context->occluderObjectCount != scene->objectCount)
+	{
+		for(i32 i = 0; i < context->lightOccluderCapacity; ++i)
+		{
+			context->lightOccluders[i] = SCENE_OBJECT_NULL;
+		}
+
+		context->occluderObjects = scene->objects;
+		context->occluderObjectCount = scene->objectCount;
+	}
+}
 
-	real32 a = vec4_dot3(viewportPosition, viewportPosition);
-	real32 b = 2.f*vec4_dot3(&CO, viewportPosition);
-	real32 c = vec4_dot3(&CO, &CO) - object->sphereRadius*object->sphereRadius;
+b32
+scene_trace_ray(raytracer_scene *scene, scene_trace_context *context, 
+		const v4 *viewportPosition, color32 *outColor)
+{
+	return scene_trace_tile_ray(scene, context, SCENE_TILE_NULL, viewportPosition, outColor);
+}
 
-	real32 discriminant = b*b - 4*a*c;
+b32
+scene_trace_tile_ray(raytracer_scene *scene, scene_trace_context *context, i32 tileId, 
+		const v4 *viewportPosition, color32 *outColor)
+{
+	v4 color;
 
-	if(discriminant < 0)
+	if(scene_trace_sample_ray(scene, context, SCENE_SAMPLE_NULL, tileId, viewportPosition, 
+				&color))
 	{
-		return 0;
-	}
+		*outColor = vec4_to_color32(&color);
 
-	real32 d = sqrtf(discriminant);
-	*out0 = (-b + d) / (2.f*a);
-	*out1 = (-b - d) / (2.f*a);
+		return B32_TRUE;
+	}
 
-	return 2;
+	return B32_FALSE;
 }
 
 static b32
-_scene_get_ray_box_intersection(raytracer_scene *scene, scene_object *object, 
-		const v4 *viewportPosition, const v4 *origin, v4 *outNormal, real32 *outDistance)
+_scene_trace_primary_ray(raytracer_scene *scene, scene_trace_context *context, i32 sampleId, 
+		const scene_tile_bins *tiles, i32 tileId, const v4 *rayOrigin, const v4 *rayDirection, 
+		v4 *outColor)
 {
-	v4 objectPosition;
-	vec4_subtract3(&object->position, &scene->camera.position, &objectPosition);
-
-	v4 rayDirection;
-	vec4_direction(origin, viewportPosition, &rayDirection);
+	_scene_prepare_trace_context(scene, context);
 
-	real32 halfWidth = object->boxWidth/2.f;
-	real32 halfHeight = object->boxHeight/2.f;
-	real32 halfDepth = object->boxDepth/2.f;
+	v4 origin = *rayOrigin;
 
-	real32 xBoundsMin = objectPosition.x - halfWidth;
-	real32 xBoundsMax = objectPosition.x + halfWidth;
-	real32 yBoundsMin = objectPosition.y - halfHeight;
-	real32 yBoundsMax = objectPosition.y + halfHeight;
-	real32 zBoundsMin = objectPosition.z - halfDepth;
-	real32 zBoundsMax = objectPosition.z + halfDepth;
+	scene_hit hit;
+	b32 isHit = B32_FALSE;
+	b32 isResolved = B32_FALSE;
 
-	i32 t0Plane = 0;
-	i32 t1Plane = 0;
-
-	real32 t0 = (xBoundsMin - origin->x)/rayDirection.x;
-	real32 t1 = (xBoundsMax + origin->x)/rayDirection.x;
-
-	if(t0 > t1)
+	if(sampleId != SCENE_SAMPLE_NULL)
 	{
-		real32 swap = t0;
-		t0 = t1;
-		t1 = swap;
+		isHit = _scene_find_visible_hit(scene, sampleId, &origin, rayDirection, &hit, 
+				&isResolved);
 	}
 
-	real32 tY0 = (yBoundsMin - origin->y)/rayDirection.y;
-	real32 tY1 = (yBoundsMax + origin->y)/rayDirection.y;
-
-	if(tY0 > tY1)
+	if(!isResolved)
 	{
-		real32 swap = tY0;
-		tY0 = tY1;
-		tY1 = swap;
-	}
+		const i32 *objectIndices = NULL;
+		i32 objectIndexCount = scene->objectCount;
 
-	if((t0 > tY1) || (tY0 > t1))
-	{
-		return B32_FALSE;
-	}
+		if(tileId != SCENE_TILE_NULL)
+		{
+			objectIndices = &tiles->indices[tiles->offsets[tileId]];
+			objectIndexCount = tiles->offsets[tileId + 1] - tiles->offsets[tileId];
 
-	if(tY0 > t0)
-	{
-		t0 = tY0;
-		t0Plane = 1;
-	}
-	
-	if(tY1 < t1)
-	{
-		t1 = tY1;
-		t1Plane = 1;
-	}
-	
-	real32 tZ0 = (zBoundsMin - origin->z)/rayDirection.z;
-	real32 tZ1 = (zBoundsMax + origin->z)/rayDirection.z;
-	
-	if(tZ0 > tZ1)
-	{
-		real32 swap = tZ0;
-		tZ0 = tZ1;
-		tZ1 = swap;
-	}
+			if(objectIndexCount > SCENE_OBJECT_BVH_TILE_THRESHOLD && 
+					!scene->objectBvh.isDirty)
+			{
+				objectIndices = NULL;
+				objectIndexCount = scene->objectCount;
+			}
+		}
 
-	if((t0 > tZ1) || (tZ0 > t1))
-	{
-		return B32_FALSE;
+		isHit = _scene_find_nearest_hit(scene, objectIndices, objectIndexCount, &origin, 
+				rayDirection, &hit);
 	}
 
-	if(tZ0 > t0)
-	{
-		t0 = tZ0;
-		t0Plane = 2;
-	}
-	
-	if(tZ1 < t1)
-	{
-		t1 = tZ1;
-		t1Plane = 2;
-	}
+	++context->stats.primaryRayCount;
 
-	if(t0 > t1)
+	if(isHit)
 	{
-		*outDistance = t1;
-
-		v4 point = rayDirection;
-		vec4_scalar3(&point, t1, &point);
-		vec4_add3(origin, &point, &point);
+		_scene_shade_path(scene, context, &hit, &origin, rayDirection, 0, 1.f, outColor);
 
-		switch(t1Plane)
-		{
-			case 0:
-			{
-				if(point.x < objectPosition.x)
-				{
-					*outNormal = vec4_init(-1.f, 0.f, 0.f, 0.f);
-				}
-				else
-				{
-					*outNormal = vec4_init(1.f, 0.f, 0.f, 0.f);
-				}
-			} break;
-			
-			case 1:
-			{
-				if(point.y < objectPosition.y)
-				{
-					*outNormal = vec4_init(0.f, -1.f, 0.f, 0.f);
-				}
-				else
-				{
-					*outNormal = vec4_init(0.f, 1.f, 0.f, 0.f);
-				}
-			} break;
-			
-			case 2:
-			{
-				if(point.z < objectPosition.z)
-				{
-					*outNormal = vec4_init(0.f, 0.f, -1.f, 0.f);
-				}
-				else
-				{
-					*outNormal = vec4_init(0.f, 0.f, 1.f, 0.f);
-				}
-			} break;
-		}
+		return B32_TRUE;
 	}
-	else
-	{
-		*outDistance = t0;
 
-		v4 point = rayDirection;
-		vec4_scalar3(&point, t0, &point);
-		vec4_add3(origin, &point, &point);
+	return B32_FALSE;
+}
 
-		switch(t0Plane)
-		{
-			case 0:
-			{
-				if(point.x < objectPosition.x)
-				{
-					*outNormal = vec4_init(-1.f, 0.f, 0.f, 0.f);
-				}
-				else
-				{
-					*outNormal = vec4_init(1.f, 0.f, 0.f, 0.f);
-				}
-			} break;
-			
-			case 1:
-			{
-				if(point.y < objectPosition.y)
-				{
-					*outNormal = vec4_init(0.f, -1.f, 0.f, 0.f);
-				}
-				else
-				{
-					*outNormal = vec4_init(0.f, 1.f, 0.f, 0.f);
-				}
-			} break;
-			
-			case 2:
-			{
-				if(point.z < objectPosition.z)
-				{
-					*outNormal = vec4_init(0.f, 0.f, -1.f, 0.f);
-				}
-				else
-				{
-					*outNormal = vec4_init(0.f, 0.f, 1.f, 0.f);
-				}
-			} break;
-		}
-	}
+b32
+scene_trace_sample_ray(raytracer_scene *scene, scene_trace_context *context, i32 sampleId, 
+		i32 tileId, const v4 *viewportPosition, v4 *outColor)
+{
+	// the viewport position is relative to the camera, which is the ray origin
+	v4 rayDirection = vec4_init(0.f, 0.f, 0.f, 0.f);
+	vec4_normal(viewportPosition, &rayDirection);
 
-	return B32_TRUE;
+	return _scene_trace_primary_ray(scene, context, sampleId, &scene->tiles, tileId, 
+			&scene->camera.position, &rayDirection, outColor);
 }
 
 b32
-scene_trace_ray(raytracer_scene *scene, const v4 *viewportPosition, color32 *outColor)
+scene_trace_pixel_ray(raytracer_scene *scene, scene_trace_context *context, i32 sampleId, 
+		i32 tileId, i32 x, i32 y, v4 *outColor)
 {
-	v4 origin = vec4_init(0.f, 0.f, 0.f, 0.f);
+	scene_ray_table *table = &scene->rayTable;
+
+	v4 rowStep;
+	v4 pixelStep;
+	vec4_scalar3(&table->yStep, (real32)y, &rowStep);
+	vec4_scalar3(&table->xStep, (real32)x, &pixelStep);
+
 	v4 rayDirection;
-	vec4_direction(&origin, viewportPosition, &rayDirection);
+	vec4_add3(&table->corner, &rowStep, &rayDirection);
+	vec4_add3(&rayDirection, &pixelStep, &rayDirection);
+	vec4_scalar3(&rayDirection, table->inverseLengths[y*table->width + x], &rayDirection);
 
-	scene_object *obj = NULL;
-	real32 distance;
-	v4 intersectionPoint;
-	v4 surfaceNormal;
-	v4 objPosition;
+	return _scene_trace_primary_ray(scene, context, sampleId, &scene->tiles, tileId, 
+			&scene->camera.position, &rayDirection, outColor);
+}
 
-	for(i32 i = 0; i < scene->objectCount; ++i)
-	{
-		scene_object *o = &scene->objects[i];
+scene_view *
+scene_create_view()
+{
+	return calloc(1, sizeof(scene_view));
+}
 
-		switch(o->type)
-		{
-			case SCENE_OBJECT_SPHERE:
-			{
-				real32 d[2];
-				i32 intersectionCount = _scene_get_ray_sphere_intersection(scene, o, viewportPosition, 
-						&origin, &d[0], &d[1]);
+void
+scene_destroy_view(scene_view *view)
+{
+	free(view->tiles.offsets);
+	free(view->tiles.indices);
+	free(view->tiles.rects);
+	free(view);
+}
 
-				if(intersectionCount > 0)
-				{
-					for(i32 j = 0; j < intersectionCount; ++j)
-					{
-						if(obj)
-						{
-							if(d[j] < distance)
-							{
-								obj = o;
-								distance = d[j];
+void
+scene_update_view(raytracer_scene *scene, scene_view *view, const v4 *position, 
+		real32 yaw, real32 pitch, i32 width, i32 height, i32 tileSize)
+{
+	scene_camera *camera = &view->camera;
+	camera->viewport = scene->camera.viewport;
+	camera->position = *position;
+	_scene_get_orientation(yaw, &pitch, &camera->orientation, &camera->direction);
+	m44_transpose(&camera->orientation, &camera->view);
+	camera->yaw = yaw;
+	camera->pitch = pitch;
+
+	_scene_get_ray_steps(scene, &camera->orientation, width, height, &view->corner, 
+			&view->xStep, &view->yStep);
+	_scene_bin_objects(scene, camera, &view->tiles, width, height, tileSize);
+}
 
-								vec4_scalar(&rayDirection, distance, &intersectionPoint);
-								vec4_add3(&origin, &intersectionPoint, &intersectionPoint);
-			
-								vec4_subtract3(&obj->position, &scene->camera.position, &objPosition);
-								vec4_direction(&objPosition, &intersectionPoint, &surfaceNormal);
-							}
-						}
-						else
-						{
-							obj = o;
-							distance = d[j];
+b32
+scene_trace_view_ray(raytracer_scene *scene, scene_trace_context *context, 
+		const scene_view *view, i32 x, i32 y, v4 *outColor)
+{
+	v4 rowStep;
+	v4 pixelStep;
+	vec4_scalar3(&view->yStep, (real32)y, &rowStep);
+	vec4_scalar3(&view->xStep, (real32)x, &pixelStep);
 
-							vec4_scalar(&rayDirection, distance, &intersectionPoint);
-							vec4_add3(&origin, &intersectionPoint, &intersectionPoint);
+	v4 rayDirection;
+	vec4_add3(&view->corner, &rowStep, &rayDirection);
+	vec4_add3(&rayDirection, &pixelStep, &rayDirection);
+	vec4_normal(&rayDirection, &rayDirection);
 
-							vec4_subtract3(&obj->position, &scene->camera.position, &objPosition);
-							vec4_direction(&objPosition, &intersectionPoint, &surfaceNormal);
-						}
-					}
-				}
-			} break;
+	return _scene_trace_primary_ray(scene, context, SCENE_SAMPLE_NULL, &view->tiles, 
+			_scene_get_bin_tile(&view->tiles, x, y), &view->camera.position, &rayDirection, 
+			outColor);
+}
 
-			case SCENE_OBJECT_BOX:
-			{
-				v4 n;
-				real32 d;
+// gathers each ray of the packet from the arrays, traces it through the kernel and
+// scatters the results back to the slot of the ray
+static void
+_scene_trace_ray_packet(void *data, i32 index)
+{
+	scene_ray_query *query = data;
+	raytracer_scene *scene = query->scene;
+	const scene_ray_batch *batch = query->batch;
 
-				if(_scene_get_ray_box_intersection(scene, o, viewportPosition, &origin, 
-							&n, &d))
-				{
-					if(obj)
-					{
-						if(d < distance)
-						{
-							obj = o;
-							distance = d;
-					
-							vec4_scalar(&rayDirection, distance, &intersectionPoint);
-							vec4_add3(&origin, &intersectionPoint, &intersectionPoint);
+	i32 first = index*SCENE_RAY_PACKET_SIZE;
+	i32 last = first + SCENE_RAY_PACKET_SIZE < query->rayCount ? 
+		first + SCENE_RAY_PACKET_SIZE : query->rayCount;
 
-							vec4_subtract3(&obj->position, &scene->camera.position, &objPosition);
+	for(i32 i = first; i < last; ++i)
+	{
+		i32 rayId = query->order ? query->order[i] : i;
 
-							surfaceNormal = n;
-						}
-					}
-					else
-					{
-						obj = o;
-						distance = d;
-					
-						vec4_scalar(&rayDirection, distance, &intersectionPoint);
-						vec4_add3(&origin, &intersectionPoint, &intersectionPoint);
-
-						vec4_subtract3(&obj->position, &scene->camera.position, &objPosition);
-						
-						surfaceNormal = n;
-					}
-				}
-			} break;
+		v4 origin = vec4_init(batch->originX[rayId], batch->originY[rayId], 
+				batch->originZ[rayId], 0.f);
+		v4 direction = vec4_init(batch->directionX[rayId], batch->directionY[rayId], 
+				batch->directionZ[rayId], 0.f);
 
-			default:
-			{
-				fprintf(stderr, "Unknown object type. Cannot trace ray!\n");
-			} break;
+		scene_hit hit;
+		hit.object = NULL;
+		hit.distance = batch->maxDistance ? batch->maxDistance[rayId] : INFINITY;
+		hit.normal = vec4_init(0.f, 0.f, 0.f, 0.f);
+
+		i32 objectId = SCENE_OBJECT_NULL;
+
+		if(vec4_magnitude3_squared(&direction) > 0.f)
+		{
+			vec4_normal(&direction, &direction);
+			objectId = scene->kernel->queryRay(scene, &origin, &direction, query->isAnyHit, 
+					&hit);
 		}
-	}
 
-	if(obj)
-	{
-		v4 specularColor = {};
-		v4 colorIntensity = {};
+		batch->outObjectId[rayId] = objectId;
 
-		for(i32 i = 0; i < scene->lightCount; ++i)
+		if(query->isAnyHit)
 		{
-			scene_light *light = &scene->lights[i];
+			continue;
+		}
 
-			switch(light->type)
-			{
-				case LIGHT_AMBIENT:
-				{
-					colorIntensity.r += light->intensity;
-					colorIntensity.g += light->intensity;
-					colorIntensity.b += light->intensity;
-				} break;
-				
-				case LIGHT_DIRECTIONAL:
-				{
-					scene_light *light = &scene->lights[i];
+		batch->outDistance[rayId] = objectId != SCENE_OBJECT_NULL ? hit.distance : INFINITY;
 
-					b32 isOccluded = B32_FALSE;
-					for(i32 j = 0; j < scene->objectCount; ++j)
-					{
-						scene_object *o = &scene->objects[j];
+		if(batch->outNormalX)
+		{
+			batch->outNormalX[rayId] = hit.normal.x;
+			batch->outNormalY[rayId] = hit.normal.y;
+			batch->outNormalZ[rayId] = hit.normal.z;
+		}
+	}
+}
 
-						if(o == obj)
-						{
-							continue;
-						}
+// orders the rays by direction octant and then along a morton curve over their origins,
+// or over their directions if they all start at the same point, so that the rays of a
+// packet walk the same hierarchy nodes
+static i32 *
+_scene_sort_rays(raytracer_scene *scene, const scene_ray_batch *batch, i32 rayCount)
+{
+	const real32 *origins[3] = {batch->originX, batch->originY, batch->originZ};
+	const real32 *directions[3] = {batch->directionX, batch->directionY, batch->directionZ};
 
-						v4 invLightDirection;
-						vec4_scalar3(&light->direction, -1.f, &invLightDirection);
+	real32 boundsMin[3] = {INFINITY, INFINITY, INFINITY};
+	real32 boundsMax[3] = {-INFINITY, -INFINITY, -INFINITY};
 
-						v4 lightPosition;
-						vec4_add3(&intersectionPoint, &invLightDirection, &lightPosition);
+	for(i32 j = 0; j < 3; ++j)
+	{
+		for(i32 i = 0; i < rayCount; ++i)
+		{
+			boundsMin[j] = origins[j][i] < boundsMin[j] ? origins[j][i] : boundsMin[j];
+			boundsMax[j] = origins[j][i] > boundsMax[j] ? origins[j][i] : boundsMax[j];
+		}
+	}
 
-						switch(o->type)
-						{
-							case SCENE_OBJECT_SPHERE:
-							{
-								real32 d[2];
-								i32 intersectionCount = _scene_get_ray_sphere_intersection(scene, o, &lightPosition, 
-										&intersectionPoint, &d[0], &d[1]);
-
-								if(intersectionCount > 0)
-								{
-									for(i32 k = 0; k < intersectionCount; ++k)
-									{
-										if(d[k] >= 0)
-										{
-											isOccluded = B32_TRUE;
-											break;
-										}
-									}
-								}
-							} break;
-							
-							case SCENE_OBJECT_BOX:
-							{
-								v4 n;
-								real32 d;
-
-								if(_scene_get_ray_box_intersection(scene, o, &lightPosition, &intersectionPoint, 
-										&n, &d))
-								{
-									if(d >= 0)
-									{
-										isOccluded = B32_TRUE;
-									}
-								}
-							} break;
-						}
+	b32 isSharedOrigin = boundsMax[0] <= boundsMin[0] && boundsMax[1] <= boundsMin[1] && 
+		boundsMax[2] <= boundsMin[2];
 
-						if(isOccluded)
-						{
-							break;
-						}
-					}
+	u32 *codes = memory_arena_push(scene->scratchArena, sizeof(u32)*2*rayCount);
+	i32 *indices = memory_arena_push(scene->scratchArena, sizeof(i32)*2*rayCount);
 
-					if(isOccluded)
-					{
-						continue;
-					}
+	if(!codes || !indices)
+	{
+		return NULL;
+	}
 
-					real32 dot = vec4_dot3(&surfaceNormal, &light->direction);
+	for(i32 i = 0; i < rayCount; ++i)
+	{
+		u32 code = 0;
+		real32 magnitude = sqrtf(directions[0][i]*directions[0][i] + 
+				directions[1][i]*directions[1][i] + directions[2][i]*directions[2][i]);
 
-					if(dot < 0.f)
-					{
-						real32 nLength = vec4_magnitude3(&surfaceNormal);
-						real32 lLength = vec4_magnitude3(&light->direction);
-						real32 coeff = -dot/(nLength*lLength);
-						
-						colorIntensity.r += coeff*((real32)((light->color >> 16) & 0xFF)/(real32)0xFF);
-						colorIntensity.g += coeff*((real32)((light->color >> 8) & 0xFF)/(real32)0xFF);
-						colorIntensity.b += coeff*((real32)((light->color) & 0xFF)/(real32)0xFF);
-					}
+		for(i32 j = 0; j < 3; ++j)
+		{
+			real32 direction = directions[j][i];
+			u32 cell = 0;
 
-					v4 vertexToEye;
-					vec4_direction(&intersectionPoint, &origin, &vertexToEye);
-					vec4_normal(&vertexToEye, &vertexToEye);
+			if(isSharedOrigin)
+			{
+				cell = magnitude > 0.f ? (u32)((direction/magnitude*0.5f + 0.5f)*511.f) : 0;
+			}
+			else if(boundsMax[j] > boundsMin[j])
+			{
+				cell = (u32)((origins[j][i] - boundsMin[j])/(boundsMax[j] - boundsMin[j])*511.f);
+			}
 
-					v4 lightReflect;
-					vec4_scalar3(&surfaceNormal, 2.f*vec4_dot3(&light->direction, &surfaceNormal), 
-							&lightReflect);
-					vec4_subtract3(&light->direction, &lightReflect, &lightReflect);
+			code |= _scene_spread_morton_bits(cell & 0x1FF) << j;
+			code |= (direction < 0.f ? 1u : 0u) << (27 + j);
+		}
 
-					real32 specularFactor = vec4_dot3(&vertexToEye, &lightReflect);
+		codes[i] = code;
+		indices[i] = i;
+	}
 
-					if(specularFactor > 0.f)
-					{
-						specularFactor = pow(specularFactor, obj->albedo);
+	_scene_sort_codes(codes, indices, codes + rayCount, indices + rayCount, rayCount);
 
-						specularColor.r += specularFactor*((real32)((light->color >> 16) & 0xFF)/(real32)0xFF);
-						specularColor.g += specularFactor*((real32)((light->color >> 8) & 0xFF)/(real32)0xFF);
-						specularColor.b += specularFactor*((real32)((light->color) & 0xFF)/(real32)0xFF);
-					}
-				} break;
-				
-				case LIGHT_POINT:
-				{
-					scene_light *light = &scene->lights[i];
-
-					v4 lightPosition;
-					vec4_subtract3(&light->position, &scene->camera.position, &lightPosition);
-					
-					v4 lightDirection;
-					vec4_direction(&lightPosition, &intersectionPoint, &lightDirection);
-					
-					v4 invLightDirection;
-					vec4_scalar3(&lightDirection, -1.f, &invLightDirection);
-
-					vec4_add3(&intersectionPoint, &invLightDirection, &lightPosition);
-					
-					b32 isOccluded = B32_FALSE;
-					for(i32 j = 0; j < scene->objectCount; ++j)
-					{
-						scene_object *o = &scene->objects[j];
+	return indices;
+}
 
-						if(o == obj)
-						{
-							continue;
-						}
+void
+scene_trace_rays(raytracer_scene *scene, work_dispatcher *dispatcher, 
+		scene_ray_query_mode mode, const scene_ray_batch *batch, i32 rayCount)
+{
+	if(rayCount <= 0)
+	{
+		return;
+	}
 
-						switch(o->type)
-						{
-							case SCENE_OBJECT_SPHERE:
-							{
-								real32 d[2];
-								i32 intersectionCount = _scene_get_ray_sphere_intersection(scene, o, &lightPosition, 
-										&intersectionPoint, &d[0], &d[1]);
-
-								if(intersectionCount > 0)
-								{
-									for(i32 k = 0; k < intersectionCount; ++k)
-									{
-										if(d[k] >= 0)
-										{
-											isOccluded = B32_TRUE;
-											break;
-										}
-									}
-								}
-							} break;
-							
-							case SCENE_OBJECT_BOX:
-							{
-								v4 n;
-								real32 d;
-
-								if(_scene_get_ray_box_intersection(scene, o, &lightPosition, &intersectionPoint, 
-										&n, &d))
-								{
-									if(d >= 0)
-									{
-										isOccluded = B32_TRUE;
-									}
-								}
-							} break;
-						}
+	scene_update_object_bvh(scene);
 
-						if(isOccluded)
-						{
-							break;
-						}
-					}
+	u64 scratchMarker = memory_arena_get_marker(scene->scratchArena);
 
-					if(isOccluded)
-					{
-						break;
-					}
+	scene_ray_query query;
+	query.scene = scene;
+	query.batch = batch;
+	query.order = rayCount >= SCENE_RAY_SORT_THRESHOLD ? 
+		_scene_sort_rays(scene, batch, rayCount) : NULL;
+	query.rayCount = rayCount;
+	query.isAnyHit = mode == SCENE_RAY_ANY;
 
-					real32 lightDistance = vec4_distance3(&lightPosition, &intersectionPoint);
-					real32 distanceCoeff = lightDistance <= light->range ? (1.f - lightDistance/light->range) : 0.f;
+	i32 packetCount = (rayCount + SCENE_RAY_PACKET_SIZE - 1)/SCENE_RAY_PACKET_SIZE;
 
-					real32 dot = vec4_dot3(&surfaceNormal, &lightDirection);
+	// tracing only reads the scene, apart from atomically marking the streamed chunks 
+	// it reaches
+	if(dispatcher && packetCount > 1)
+	{
+		work_run(dispatcher, _scene_trace_ray_packet, &query, packetCount);
+	}
+	else
+	{
+		for(i32 i = 0; i < packetCount; ++i)
+		{
+			_scene_trace_ray_packet(&query, i);
+		}
+	}
 
-					if(dot < 0.f)
-					{
-						real32 nLength = vec4_magnitude3(&surfaceNormal);
-						real32 lLength = vec4_magnitude3(&lightDirection);
-						real32 coeff = -dot/(nLength*lLength)*distanceCoeff;
-						
-						colorIntensity.r += coeff*((real32)((light->color >> 16) & 0xFF)/(real32)0xFF);
-						colorIntensity.g += coeff*((real32)((light->color >> 8) & 0xFF)/(real32)0xFF);
-						colorIntensity.b += coeff*((real32)((light->color) & 0xFF)/(real32)0xFF);
-					}
+	memory_arena_pop(scene->scratchArena, scratchMarker);
+}
 
-					v4 vertexToEye;
-					vec4_direction(&intersectionPoint, &origin, &vertexToEye);
-					vec4_normal(&vertexToEye, &vertexToEye);
+void
+scene_measure_math_error(raytracer_scene *scene, raytracer_canvas *canvas, 
+		real32 *outMaxError, real32 *outMeanError)
+{
+	i32 width = canvas_get_width(canvas);
+	i32 height = canvas_get_height(canvas);
 
-					v4 lightReflect;
-					vec4_scalar3(&surfaceNormal, 2.f*vec4_dot3(&lightDirection, &surfaceNormal), 
-							&lightReflect);
-					vec4_subtract3(&lightDirection, &lightReflect, &lightReflect);
+	color32 *exactColors = malloc(sizeof(color32)*width*height);
+	scene_trace_context *context = scene_create_trace_context();
+	scene_math_mode mode = scene->mathMode;
 
-					real32 specularFactor = vec4_dot3(&vertexToEye, &lightReflect)*distanceCoeff;
+	u32 maxError = 0;
+	u64 errorSum = 0;
 
-					if(specularFactor > 0.f)
-					{
-						specularFactor = pow(specularFactor, obj->albedo);
+	for(i32 pass = 0; pass < 2; ++pass)
+	{
+		// both passes draw the same random numbers
+		scene->mathMode = pass == 0 ? SCENE_MATH_EXACT : SCENE_MATH_FAST;
+		_scene_invalidate_light_cache(scene);
+		context->randomState = 0x9E3779B9u;
 
-						specularColor.r += specularFactor*((real32)((light->color >> 16) & 0xFF)/(real32)0xFF);
-						specularColor.g += specularFactor*((real32)((light->color >> 8) & 0xFF)/(real32)0xFF);
-						specularColor.b += specularFactor*((real32)((light->color) & 0xFF)/(real32)0xFF);
-					}
-				} break;
-			}
-		}
+		for(i32 y = 0; y < height; ++y)
+		{
+			for(i32 x = 0; x < width; ++x)
+			{
+				v4 viewportPoint;
+				scene_canvas_to_world_coordinates(scene, canvas, x, y, &viewportPoint);
 
-		v4 c = {{((real32)((obj->color >> 16) & 0xFF)/(real32)0xFF)*colorIntensity.r,
-			((real32)((obj->color >> 8) & 0xFF)/(real32)0xFF)*colorIntensity.g,
-			((real32)((obj->color) & 0xFF)/(real32)0xFF)*colorIntensity.b,
-			0.f}};
+				color32 color = 0;
+				scene_trace_ray(scene, context, &viewportPoint, &color);
 
-		vec4_add3(&c, &specularColor, &c);
+				if(pass == 0)
+				{
+					exactColors[y*width + x] = color;
+					continue;
+				}
 
-		if(c.r > 1.f)
-		{
-			c.r = 1.f;
-		}
-		if(c.g > 1.f)
-		{
-			c.g = 1.f;
-		}
-		if(c.b > 1.f)
-		{
-			c.b = 1.f;
-		}
+				color32 exact = exactColors[y*width + x];
 
-		*outColor = ((u32)(c.r*0xFF) << 16) | ((u32)(c.g*0xFF) << 8) | (u32)(c.b*0xFF);
+				for(i32 shift = 0; shift < 24; shift += 8)
+				{
+					i32 a = (exact >> shift) & 0xFF;
+					i32 b = (color >> shift) & 0xFF;
+					u32 error = a > b ? a - b : b - a;
 
-		return B32_TRUE;
+					maxError = error > maxError ? error : maxError;
+					errorSum += error;
+				}
+			}
+		}
 	}
 
-	return B32_FALSE;
-}
+	scene->mathMode = mode;
+	_scene_invalidate_light_cache(scene);
 
-void
-scene_save(raytracer_scene *scene, const char *name)
-{
-}
+	free(context->lightOccluders);
+	free(context);
+	free(exactColors);
 
-void
-scene_load(raytracer_scene *scene, const char *name)
-{
+	*outMaxError = (real32)maxError;
+	*outMeanError = width*height > 0 ? (real32)errorSum/(real32)(3*width*height) : 0.f;
 }
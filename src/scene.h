@@ -3,24 +3,39 @@
 
 #include "stdinc.h"
 #include "rt_math.h"
+#include "mesh.h"
+#include "work.h"
 
 typedef struct raytracer_scene raytracer_scene;
+typedef struct scene_trace_context scene_trace_context;
 struct raytracer_canvas;
 
 typedef enum scene_light_type
 {
 	LIGHT_AMBIENT,
 	LIGHT_DIRECTIONAL,
-	LIGHT_POINT
+	LIGHT_POINT,
+	LIGHT_SPHERE,
+	LIGHT_RECT
 } scene_light_t;
 
 typedef enum scene_object_type
 {
 	SCENE_OBJECT_SPHERE,
-	SCENE_OBJECT_BOX
+	SCENE_OBJECT_BOX,
+	SCENE_OBJECT_MESH,
+	SCENE_OBJECT_SPHERE_CLUSTER
 } scene_object_t;
 
+typedef enum scene_math_mode
+{
+	SCENE_MATH_EXACT,
+	SCENE_MATH_FAST
+} scene_math_mode;
+
 #define SCENE_OBJECT_NULL (-1)
+#define SCENE_TILE_NULL (-1)
+#define SCENE_SAMPLE_NULL (-1)
 
 #define LIGHT_VALUE_TYPE (1 << 0)
 #define LIGHT_VALUE_POSITION (1 << 1)
@@ -28,6 +43,9 @@ typedef enum scene_object_type
 #define LIGHT_VALUE_COLOR (1 << 3)
 #define LIGHT_VALUE_INTENSITY (1 << 4)
 #define LIGHT_VALUE_RANGE (1 << 5)
+#define LIGHT_VALUE_RADIUS (1 << 6)
+#define LIGHT_VALUE_WIDTH (1 << 7)
+#define LIGHT_VALUE_HEIGHT (1 << 8)
 
 #define SCENE_OBJECT_VALUE_TYPE (1 << 0)
 #define SCENE_OBJECT_VALUE_POSITION (1 << 1)
@@ -37,6 +55,62 @@ typedef enum scene_object_type
 #define SCENE_OBJECT_VALUE_BOX_WIDTH (1 << 5)
 #define SCENE_OBJECT_VALUE_BOX_HEIGHT (1 << 6)
 #define SCENE_OBJECT_VALUE_BOX_DEPTH (1 << 7)
+#define SCENE_OBJECT_VALUE_REFLECTIVITY (1 << 8)
+#define SCENE_OBJECT_VALUE_TRANSPARENCY (1 << 9)
+#define SCENE_OBJECT_VALUE_REFRACTIVE_INDEX (1 << 10)
+// a raytracer_mesh pointer, placed at the object position. The scene does not own it.
+#define SCENE_OBJECT_VALUE_MESH (1 << 11)
+// an m44 mapping the mesh into place around the object position, so that any number of
+// objects can share one mesh. Ignored by spheres and boxes.
+#define SCENE_OBJECT_VALUE_TRANSFORM (1 << 12)
+
+// material of clustered spheres, with the meaning of the object values of the same name
+typedef struct scene_sphere_material
+{
+	real32 albedo;
+	real32 reflectivity;
+	real32 transparency;
+	real32 refractiveIndex;
+} scene_sphere_material;
+
+// every value of an object but its type, for creating and updating many objects at once
+typedef struct scene_object_desc
+{
+	v4 position;
+	color32 color;
+	real32 albedo;
+	real32 sphereRadius;
+	real32 boxWidth;
+	real32 boxHeight;
+	real32 boxDepth;
+	real32 reflectivity;
+	real32 transparency;
+	real32 refractiveIndex;
+	raytracer_mesh *mesh;
+	m44 transform;
+} scene_object_desc;
+
+// every value of a light but its type
+typedef struct scene_light_desc
+{
+	v4 position;
+	v4 direction;
+	color32 color;
+	real32 intensity;
+	real32 range;
+	real32 radius;
+	real32 width;
+	real32 height;
+} scene_light_desc;
+
+// rays traced by a context since its stats were last reset
+typedef struct scene_trace_stats
+{
+	i32 primaryRayCount;
+	i32 secondaryRayCount;
+	i32 budgetTerminationCount;
+	i32 rouletteTerminationCount;
+} scene_trace_stats;
 
 extern raytracer_scene *
 scene_init();
@@ -57,10 +131,85 @@ scene_get_pixel_size(raytracer_scene *scene);
 extern void
 scene_get_camera_position(raytracer_scene *scene, v4 *out);
 
+// yaw turns around the world up axis and pitch around the camera right axis, both in
+// degrees. Pitch is clamped short of straight up or down.
+extern void
+scene_set_camera_orientation(raytracer_scene *scene, real32 yaw, real32 pitch);
+
+extern void
+scene_get_camera_orientation(raytracer_scene *scene, real32 *outYaw, real32 *outPitch);
+
+// normalized view direction in world space
+extern void
+scene_get_camera_direction(raytracer_scene *scene, v4 *out);
+
+// samples this many point lights per hit, picked by their estimated contribution, 
+// instead of evaluating every light in range. 0 evaluates all lights exactly.
+extern void
+scene_set_light_samples(raytracer_scene *scene, i32 sampleCount);
+
+extern i32
+scene_get_light_samples(raytracer_scene *scene);
+
+// caches diffuse lighting and light visibility per object and world cell of this 
+// size, so it is reused across camera moves and, for cells whose shadow rays moved 
+// objects cannot cross, across object moves. 0 disables the cache.
+extern void
+scene_set_light_cache(raytracer_scene *scene, real32 cellSize);
+
+extern real32
+scene_get_light_cache(raytracer_scene *scene);
+
+// reflection and refraction stop after this many bounces
+extern void
+scene_set_max_depth(raytracer_scene *scene, i32 maxDepth);
+
+extern i32
+scene_get_max_depth(raytracer_scene *scene);
+
+// secondary rays each trace context may spend until its stats are reset, usually once
+// per frame. 0 does not limit them.
+extern void
+scene_set_ray_budget(raytracer_scene *scene, i32 rayBudget);
+
+extern i32
+scene_get_ray_budget(raytracer_scene *scene);
+
+// paths carrying less light than this are randomly terminated, and the survivors 
+// weighted up. 0 disables russian roulette.
+extern void
+scene_set_roulette_threshold(raytracer_scene *scene, real32 threshold);
+
+extern real32
+scene_get_roulette_threshold(raytracer_scene *scene);
+
+// whether traced colors are random estimates that converge over several frames
+extern b32
+scene_is_stochastic(raytracer_scene *scene);
+
+// the fast mode shades with approximate normalization and tabulated specular powers
+extern void
+scene_set_math_mode(raytracer_scene *scene, scene_math_mode mode);
+
+extern scene_math_mode
+scene_get_math_mode(raytracer_scene *scene);
+
+// traces every canvas pixel in both math modes and returns the largest and the mean
+// difference of a color channel, in 8 bit levels
+extern void
+scene_measure_math_error(raytracer_scene *scene, raytracer_canvas *canvas, 
+		real32 *outMaxError, real32 *outMeanError);
+
+// changes whenever the scene is modified
+extern u32
+scene_get_version(raytracer_scene *scene);
+
+// the point on the viewport in world orientation, relative to the camera position
 extern void
 scene_canvas_to_world_coordinates(raytracer_scene *scene, raytracer_canvas *canvas, 
 		i32 x, i32 y, v4 *out);
 
+// both return -1 for points behind the camera
 extern i32
 scene_world_to_canvas_x(raytracer_scene *scene, raytracer_canvas *canvas,
 		const v4 *worldCoords);
@@ -69,9 +218,28 @@ extern i32
 scene_world_to_canvas_y(raytracer_scene *scene, raytracer_canvas *canvas,
 		const v4 *worldCoords);
 
+extern void
+scene_bin_objects(raytracer_scene *scene, raytracer_canvas *canvas, i32 tileSize);
+
+extern i32
+scene_get_tile(raytracer_scene *scene, i32 x, i32 y);
+
+// rasterizes object bounds into a candidate id/depth buffer with one sample at the
+// center of every sampleWidth*sampleHeight rect of the canvas
+extern void
+scene_rasterize_visibility(raytracer_scene *scene, raytracer_canvas *canvas, 
+		i32 sampleWidth, i32 sampleHeight);
+
+extern i32
+scene_get_sample(raytracer_scene *scene, i32 x, i32 y);
+
 extern i32
 scene_create_object(raytracer_scene *scene, scene_object_t type);
 
+// object ids run from 0 up to the count
+extern i32
+scene_get_object_count(raytracer_scene *scene);
+
 extern void
 scene_object_set_values(raytracer_scene *scene, i32 objectId, u32 valueFlags, 
 		const void **values);
@@ -83,9 +251,80 @@ scene_object_set_value(raytracer_scene *scene, i32 objectId, u32 valueFlag,
 extern void
 scene_object_get_value(raytracer_scene *scene, i32 objectId, u32 valueFlag, void *outValue);
 
+// the values objects are created with
+extern void
+scene_object_desc_init(scene_object_desc *desc);
+
+// creates count objects of one type with at most one allocation. Without descs the 
+// objects start with the default values. Returns the id of the first object, the others
+// follow it.
+extern i32
+scene_create_objects(raytracer_scene *scene, i32 count, scene_object_t type, 
+		const scene_object_desc *descs);
+
+// replaces every value but the type of count objects, starting at firstObjectId
+extern void
+scene_set_object_descs(raytracer_scene *scene, i32 firstObjectId, i32 count, 
+		const scene_object_desc *descs);
+
+extern void
+scene_get_object_descs(raytracer_scene *scene, i32 firstObjectId, i32 count, 
+		scene_object_desc *outDescs);
+
+// stores many spheres compactly in objects of up to a few thousand spatially close
+// spheres each. Positions and radii are quantized to 16 bits relative to the bounds of
+// their cluster, colors are indexed into a palette and materials into the given ones.
+// Colors and materialIds may be NULL for white spheres of the first material. Returns
+// the id of the first cluster object, the others follow it, or SCENE_OBJECT_NULL 
+// without spheres or with a material id of a material that was not given.
+extern i32
+scene_create_sphere_clusters(raytracer_scene *scene, i32 sphereCount, const v4 *positions,
+		const real32 *radii, const color32 *colors, const u8 *materialIds, 
+		const scene_sphere_material *materials, i32 materialCount, i32 *outClusterCount);
+
+// writes sphere clusters to a chunk file in batches, so that files larger than memory
+// can be produced. Every batch is clustered on its own and should be spatially close.
+// Colors are reduced to 5, 6 and 5 bits so that every batch shares one palette.
+typedef struct scene_chunk_writer scene_chunk_writer;
+
+extern scene_chunk_writer *
+scene_chunk_writer_open(const char *path, const scene_sphere_material *materials, 
+		i32 materialCount);
+
+// fails without writing if a material id is not one of the writer's materials
+extern b32
+scene_chunk_writer_add_spheres(scene_chunk_writer *writer, i32 sphereCount, 
+		const v4 *positions, const real32 *radii, const color32 *colors, 
+		const u8 *materialIds);
+
+// writes the chunk directory and closes the file
+extern b32
+scene_chunk_writer_close(scene_chunk_writer *writer);
+
+// memory maps a chunk file and adds a cluster object per chunk. Only the directory is
+// read up front, the spheres of a chunk are paged in once a ray first reaches it. 
+// Returns the id of the first cluster object, or SCENE_OBJECT_NULL if the file cannot
+// be mapped.
+extern i32
+scene_map_sphere_chunks(raytracer_scene *scene, const char *path, i32 *outChunkCount);
+
+// resident chunks beyond the budget that were not reached in the last frame are
+// released, least recently used first
+extern void
+scene_set_chunk_budget(raytracer_scene *scene, u64 budgetBytes);
+
+extern u64
+scene_get_resident_chunk_bytes(raytracer_scene *scene);
+
+extern void
+scene_update_chunk_residency(raytracer_scene *scene);
+
 extern i32
 scene_create_light(raytracer_scene *scene, scene_light_t type);
 
+extern i32
+scene_get_light_count(raytracer_scene *scene);
+
 extern void
 light_set_values(raytracer_scene *scene, i32 lightId, u32 valueFlags, const void **values);
 
@@ -95,13 +334,138 @@ light_set_value(raytracer_scene *scene, i32 lightId, u32 valueFlag, const void *
 extern void
 light_get_value(raytracer_scene *scene, i32 lightId, u32 valueFlag, void *outValue);
 
+extern void
+scene_light_desc_init(scene_light_desc *desc);
+
+// same as scene_create_objects for lights
+extern i32
+scene_create_lights(raytracer_scene *scene, i32 count, scene_light_t type, 
+		const scene_light_desc *descs);
+
+extern void
+scene_set_light_descs(raytracer_scene *scene, i32 firstLightId, i32 count, 
+		const scene_light_desc *descs);
+
+extern void
+scene_get_light_descs(raytracer_scene *scene, i32 firstLightId, i32 count, 
+		scene_light_desc *outDescs);
+
+// rebuilds the spatial index of light ranges after lights changed. Until it is rebuilt
+// every light is evaluated for every hit.
+extern void
+scene_update_light_index(raytracer_scene *scene);
+
+// refits the hierarchy over object bounds after objects moved or changed shape, and 
+// rebuilds it once objects were added or the refitted nodes overlap too much. Until it 
+// is updated, rays outside of the tiles test every object.
+extern void
+scene_update_object_bvh(raytracer_scene *scene);
+
+// picks the trace kernel specialized for the object types in the scene. Adding objects
+// or changing their type falls back to the generic kernel until called again.
+extern void
+scene_select_kernel(raytracer_scene *scene);
+
+extern const char *
+scene_get_kernel_name(raytracer_scene *scene);
+
+// each tracing thread needs its own context
+extern scene_trace_context *
+scene_create_trace_context();
+
+extern void
+scene_reset_trace_stats(scene_trace_context *context);
+
+extern void
+scene_get_trace_stats(scene_trace_context *context, scene_trace_stats *outStats);
+
+extern b32
+scene_trace_ray(raytracer_scene *scene, scene_trace_context *context, 
+		const v4 *viewportPosition, color32 *outColor);
+
+// only tests the objects binned to the tile by scene_bin_objects
+extern b32
+scene_trace_tile_ray(raytracer_scene *scene, scene_trace_context *context, i32 tileId, 
+		const v4 *viewportPosition, color32 *outColor);
+
+// resolves the first hit from the rasterized candidates of the sample, if any. The
+// color is linear and left unclamped so that it can be accumulated.
 extern b32
-scene_trace_ray(raytracer_scene *scene, const v4 *viewportPosition, color32 *outColor);
+scene_trace_sample_ray(raytracer_scene *scene, scene_trace_context *context, i32 sampleId, 
+		i32 tileId, const v4 *viewportPosition, v4 *outColor);
 
+// a camera besides the scene's own, with the scene's viewport, so that several views 
+// of one scene can be traced at once
+typedef struct scene_view scene_view;
+
+extern scene_view *
+scene_create_view();
+
+extern void
+scene_destroy_view(scene_view *view);
+
+// places the view's camera, with yaw and pitch as for scene_set_camera_orientation, and 
+// bins the objects into its tiles for an image of this size, as scene_bin_objects does 
+// for the scene camera. Called again whenever objects move.
+extern void
+scene_update_view(raytracer_scene *scene, scene_view *view, const v4 *position, 
+		real32 yaw, real32 pitch, i32 width, i32 height, i32 tileSize);
+
+// same as scene_trace_pixel_ray for a pixel of the view, with the tile looked up from 
+// the pixel. Any number of threads can trace a scene this way, each with its own 
+// context, as long as the scene is not changed meanwhile and its hierarchy, light
+// index and kernel are up to date.
+extern b32
+scene_trace_view_ray(raytracer_scene *scene, scene_trace_context *context, 
+		const scene_view *view, i32 x, i32 y, v4 *outColor);
+
+typedef enum scene_ray_query_mode
+{
+	// the nearest hit, with its distance and normal
+	SCENE_RAY_NEAREST,
+	// whether anything is hit, which ends at the first object found
+	SCENE_RAY_ANY
+} scene_ray_query_mode;
+
+// one element per ray in every array. Directions do not need to be normalized, and
+// distances are measured along the normalized direction.
+typedef struct scene_ray_batch
+{
+	const real32 *originX;
+	const real32 *originY;
+	const real32 *originZ;
+	const real32 *directionX;
+	const real32 *directionY;
+	const real32 *directionZ;
+	// only hits closer than this count. NULL for unbounded rays.
+	const real32 *maxDistance;
+	// SCENE_OBJECT_NULL for misses
+	i32 *outObjectId;
+	// INFINITY for misses. Only written for nearest hits, like the normals.
+	real32 *outDistance;
+	// zero for misses. NULL if not needed.
+	real32 *outNormalX;
+	real32 *outNormalY;
+	real32 *outNormalZ;
+} scene_ray_batch;
+
+// intersects a batch of rays with the scene objects, ignoring lights and materials, for
+// collision and visibility queries. Updates the object hierarchy first, and traces the
+// rays in spatially sorted packets on the dispatcher, which can be NULL to trace on 
+// the calling thread.
 extern void
-scene_save(raytracer_scene *scene, const char *name);
+scene_trace_rays(raytracer_scene *scene, work_dispatcher *dispatcher, 
+		scene_ray_query_mode mode, const scene_ray_batch *batch, i32 rayCount);
 
+// prepares the primary ray directions of every canvas pixel for the current camera.
+// Only the per pixel normalization is cached, and only rebuilds when the viewport or 
+// the canvas size changed.
 extern void
-scene_load(raytracer_scene *scene, const char *name);
+scene_update_ray_table(raytracer_scene *scene, raytracer_canvas *canvas);
+
+// same as scene_trace_sample_ray for the direction of a canvas pixel from the table
+extern b32
+scene_trace_pixel_ray(raytracer_scene *scene, scene_trace_context *context, i32 sampleId, 
+		i32 tileId, i32 x, i32 y, v4 *outColor);
 
 #endif
@@ -0,0 +1,321 @@
+#include "scene_file.h"
+#include "scene.h"
+#include "fast_math.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// scene files are a header followed by page aligned sections, which hold the scene 
+// structures as they are laid out in memory. Loading maps the file and uses the objects
+// in place, so a file only loads into builds with the same element sizes.
+#define SCENE_FILE_FORMAT_CODE 0x4E435352
+#define SCENE_FILE_FORMAT_VERSION 1
+// objects written to a scene file at once
+#define SCENE_FILE_OBJECT_BATCH 4096
+
+typedef enum scene_file_section_type
+{
+	SCENE_FILE_SECTION_CAMERA,
+	SCENE_FILE_SECTION_SETTINGS,
+	SCENE_FILE_SECTION_SPECULAR_TABLES,
+	SCENE_FILE_SECTION_LIGHTS,
+	SCENE_FILE_SECTION_OBJECTS,
+	SCENE_FILE_SECTION_COUNT
+} scene_file_section_type;
+
+typedef struct scene_file_section
+{
+	u64 offset;
+	i32 count;
+	i32 elementSize;
+} scene_file_section;
+
+typedef struct scene_file_header
+{
+	u32 formatCode;
+	u32 version;
+	scene_file_section sections[SCENE_FILE_SECTION_COUNT];
+} scene_file_header;
+
+b32
+scene_save(raytracer_scene *scene, const char *name)
+{
+	FILE *file = fopen(name, "wb");
+	if(!file)
+	{
+		fprintf(stderr, "Cannot open scene file '%s' for writing!\n", name);
+		return B32_FALSE;
+	}
+
+	scene_file_settings settings = {
+		scene->pixelSize, scene->lightSampleCount, scene->maxDepth, scene->rayBudget, 
+		scene->rouletteThreshold, (i32)scene->mathMode, scene->lightCache.cellSize
+	};
+
+	// meshes and sphere clusters point to data outside of the scene
+	i32 savedObjectCount = 0;
+
+	for(i32 i = 0; i < scene->objectCount; ++i)
+	{
+		if(scene->objects[i].type != SCENE_OBJECT_MESH && 
+				scene->objects[i].type != SCENE_OBJECT_SPHERE_CLUSTER)
+		{
+			++savedObjectCount;
+		}
+	}
+
+	const void *sectionData[SCENE_FILE_SECTION_COUNT] = {
+		&scene->camera, &settings, scene->specularTables, scene->lights, NULL
+	};
+	i32 sectionCounts[SCENE_FILE_SECTION_COUNT] = {
+		1, 1, scene->specularTableCount, scene->lightCount, savedObjectCount
+	};
+	i32 elementSizes[SCENE_FILE_SECTION_COUNT] = {
+		sizeof(scene_camera), sizeof(scene_file_settings), sizeof(fast_pow_table), 
+		sizeof(scene_light), sizeof(scene_object)
+	};
+
+	scene_file_header header;
+	memset(&header, 0, sizeof(header));
+	header.formatCode = SCENE_FILE_FORMAT_CODE;
+	header.version = SCENE_FILE_FORMAT_VERSION;
+
+	u64 pageSize = (u64)sysconf(_SC_PAGESIZE);
+	u64 offset = pageSize;
+	b32 isWritten = B32_TRUE;
+
+	for(i32 i = 0; i < SCENE_FILE_SECTION_COUNT && isWritten; ++i)
+	{
+		u64 sectionSize = (u64)sectionCounts[i]*elementSizes[i];
+
+		header.sections[i].offset = offset;
+		header.sections[i].count = sectionCounts[i];
+		header.sections[i].elementSize = elementSizes[i];
+
+		isWritten = !fseeko(file, (off_t)offset, SEEK_SET) && (!sectionData[i] || 
+				fwrite(sectionData[i], elementSizes[i], sectionCounts[i], file) == 
+				(size_t)sectionCounts[i]);
+
+		offset += (sectionSize + pageSize - 1)/pageSize*pageSize;
+	}
+
+	scene_object *batch = malloc(sizeof(scene_object)*SCENE_FILE_OBJECT_BATCH);
+	i32 batchCount = 0;
+
+	isWritten = isWritten && !fseeko(file, 
+			(off_t)header.sections[SCENE_FILE_SECTION_OBJECTS].offset, SEEK_SET);
+
+	for(i32 i = 0; i < scene->objectCount && isWritten; ++i)
+	{
+		if(scene->objects[i].type == SCENE_OBJECT_MESH || 
+				scene->objects[i].type == SCENE_OBJECT_SPHERE_CLUSTER)
+		{
+			continue;
+		}
+
+		// the transforms of spheres and boxes have no effect, so instances are not saved
+		batch[batchCount] = scene->objects[i];
+		batch[batchCount++].instanceId = SCENE_INSTANCE_NULL;
+
+		if(batchCount == SCENE_FILE_OBJECT_BATCH)
+		{
+			isWritten = fwrite(batch, sizeof(scene_object), batchCount, file) == 
+				(size_t)batchCount;
+			batchCount = 0;
+		}
+	}
+
+	isWritten = isWritten && 
+		fwrite(batch, sizeof(scene_object), batchCount, file) == (size_t)batchCount &&
+		!fseeko(file, 0, SEEK_SET) && fwrite(&header, sizeof(header), 1, file) == 1;
+
+	isWritten = !fclose(file) && isWritten;
+
+	free(batch);
+
+	if(!isWritten)
+	{
+		fprintf(stderr, "Could not write scene file '%s'!\n", name);
+		return B32_FALSE;
+	}
+
+	if(savedObjectCount < scene->objectCount)
+	{
+		printf("Skipped %d mesh and sphere cluster objects saving '%s'.\n", 
+				scene->objectCount - savedObjectCount, name);
+	}
+
+	return B32_TRUE;
+}
+
+// settings the setters would never produce. Comparisons are written so that NaN fails.
+static b32
+_scene_are_file_settings_valid(const scene_file_settings *settings)
+{
+	return settings->pixelSize > 0.f && settings->pixelSize < INFINITY && 
+		settings->maxDepth >= 0 && 
+		settings->rouletteThreshold >= 0.f && settings->rouletteThreshold < INFINITY && 
+		(settings->mathMode == SCENE_MATH_EXACT || settings->mathMode == SCENE_MATH_FAST) &&
+		settings->lightCacheCellSize >= 0.f && settings->lightCacheCellSize < INFINITY;
+}
+
+// the records are used as they are mapped, so everything they index must be in range.
+// Meshes, clusters and instances are never saved, and what points to them would be 
+// meaningless.
+static b32
+_scene_is_file_data_valid(const scene_file_header *header, const u8 *data)
+{
+	const scene_file_section *objectSection = &header->sections[SCENE_FILE_SECTION_OBJECTS];
+	const scene_file_section *lightSection = &header->sections[SCENE_FILE_SECTION_LIGHTS];
+	i32 tableCount = header->sections[SCENE_FILE_SECTION_SPECULAR_TABLES].count;
+
+	scene_file_settings settings;
+	memcpy(&settings, data + header->sections[SCENE_FILE_SECTION_SETTINGS].offset, 
+			sizeof(scene_file_settings));
+
+	if(objectSection->offset % sizeof(v4) != 0 || !_scene_are_file_settings_valid(&settings))
+	{
+		return B32_FALSE;
+	}
+
+	const scene_object *objects = (const scene_object *)(data + objectSection->offset);
+
+	for(i32 i = 0; i < objectSection->count; ++i)
+	{
+		if((objects[i].type != SCENE_OBJECT_SPHERE && objects[i].type != SCENE_OBJECT_BOX) ||
+				objects[i].instanceId != SCENE_INSTANCE_NULL || 
+				objects[i].material.specularTableId < 0 || 
+				objects[i].material.specularTableId >= tableCount)
+		{
+			return B32_FALSE;
+		}
+	}
+
+	for(i32 i = 0; i < lightSection->count; ++i)
+	{
+		scene_light light;
+		memcpy(&light, data + lightSection->offset + sizeof(scene_light)*i, 
+				sizeof(scene_light));
+
+		if((u32)light.type > (u32)LIGHT_RECT)
+		{
+			return B32_FALSE;
+		}
+	}
+
+	return B32_TRUE;
+}
+
+b32
+scene_load(raytracer_scene *scene, const char *name)
+{
+	i32 fd = open(name, O_RDONLY);
+	if(fd < 0)
+	{
+		fprintf(stderr, "Cannot open scene file '%s'!\n", name);
+		return B32_FALSE;
+	}
+
+	i32 elementSizes[SCENE_FILE_SECTION_COUNT] = {
+		sizeof(scene_camera), sizeof(scene_file_settings), sizeof(fast_pow_table), 
+		sizeof(scene_light), sizeof(scene_object)
+	};
+
+	struct stat st;
+	scene_file_header header;
+
+	b32 isValid = !fstat(fd, &st) && 
+		pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) && 
+		header.formatCode == SCENE_FILE_FORMAT_CODE && 
+		header.version == SCENE_FILE_FORMAT_VERSION;
+
+	for(i32 i = 0; i < SCENE_FILE_SECTION_COUNT && isValid; ++i)
+	{
+		scene_file_section *section = &header.sections[i];
+
+		// written so that a huge offset cannot wrap around the file size
+		isValid = section->elementSize == elementSizes[i] && section->count >= 0 && 
+			section->offset <= (u64)st.st_size && 
+			(u64)section->count*section->elementSize <= (u64)st.st_size - section->offset;
+	}
+
+	isValid = isValid && header.sections[SCENE_FILE_SECTION_CAMERA].count == 1 && 
+		header.sections[SCENE_FILE_SECTION_SETTINGS].count == 1;
+
+	// private, so that objects can change in place without writing to the file
+	u8 *data = isValid ? mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, 
+			MAP_PRIVATE, fd, 0) : MAP_FAILED;
+
+	close(fd);
+
+	if(data != MAP_FAILED && !_scene_is_file_data_valid(&header, data))
+	{
+		munmap(data, (size_t)st.st_size);
+		data = MAP_FAILED;
+	}
+
+	if(data == MAP_FAILED)
+	{
+		fprintf(stderr, "Could not read scene file '%s'! Wrong format.\n", name);
+		return B32_FALSE;
+	}
+
+	// the first frame reads every object, so paging them in can start right away
+	posix_madvise(data, (size_t)st.st_size, POSIX_MADV_WILLNEED);
+
+	_scene_release_objects(scene);
+
+	scene->fileMapping.data = data;
+	scene->fileMapping.size = (u64)st.st_size;
+	scene->fileMapping.objects = (scene_object *)
+		(data + header.sections[SCENE_FILE_SECTION_OBJECTS].offset);
+
+	memcpy(&scene->camera, data + header.sections[SCENE_FILE_SECTION_CAMERA].offset, 
+			sizeof(scene_camera));
+
+	const scene_file_settings *settings = (const scene_file_settings *)
+		(data + header.sections[SCENE_FILE_SECTION_SETTINGS].offset);
+
+	scene->pixelSize = settings->pixelSize;
+	scene->lightSampleCount = settings->lightSampleCount;
+	scene->maxDepth = settings->maxDepth;
+	scene->rayBudget = settings->rayBudget;
+	scene->rouletteThreshold = settings->rouletteThreshold;
+	scene->mathMode = (scene_math_mode)settings->mathMode;
+	scene_set_light_cache(scene, settings->lightCacheCellSize);
+
+	// specular tables and lights are few and grow on their own, so they are copied
+	scene_file_section *tables = &header.sections[SCENE_FILE_SECTION_SPECULAR_TABLES];
+	_scene_unshare_specular_tables(scene);
+	scene->specularTableCount = tables->count;
+	scene->specularTables = realloc(scene->specularTables, 
+			sizeof(fast_pow_table)*(tables->count + 1));
+	memcpy(scene->specularTables, data + tables->offset, 
+			sizeof(fast_pow_table)*tables->count);
+
+	scene_file_section *lights = &header.sections[SCENE_FILE_SECTION_LIGHTS];
+	scene->lightCount = 0;
+	memcpy(_scene_append_lights(scene, lights->count), data + lights->offset, 
+			sizeof(scene_light)*lights->count);
+
+	// the first object appended copies the mapped ones to the heap
+	scene->objects = scene->fileMapping.objects;
+	scene->objectCount = header.sections[SCENE_FILE_SECTION_OBJECTS].count;
+	scene->objectCapacity = scene->objectCount;
+
+	++scene->version;
+	_scene_invalidate_light_cache(scene);
+	scene->kernel = _scene_get_generic_kernel();
+	scene->objectBvh.isDirty = B32_TRUE;
+	scene->objectBvh.isRebuildNeeded = B32_TRUE;
+	scene->lightIndex.isDirty = B32_TRUE;
+	scene->rayTable.isDirty = B32_TRUE;
+	scene->visibility.isValid = B32_FALSE;
+
+	return B32_TRUE;
+}
@@ -0,0 +1,19 @@
+#ifndef __SCENE_FILE_H
+#define __SCENE_FILE_H
+
+#include "stdinc.h"
+#include "scene.h"
+
+// writes the camera, render settings, lights and objects to a binary scene file. Meshes
+// and sphere clusters are skipped, as they reference data outside of the scene.
+extern b32
+scene_save(raytracer_scene *scene, const char *name);
+
+// replaces the scene with the one in a scene file. The file is memory mapped and its
+// objects are used in place until an object is added, so loading does not depend on
+// the object count. Returns false if the file is missing or was saved by a build with a
+// different layout.
+extern b32
+scene_load(raytracer_scene *scene, const char *name);
+
+#endif
@@ -0,0 +1,648 @@
+#include "scene_snapshot.h"
+#include "scene.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// storage that a scene and its snapshots share until the scene changes it. The last 
+// release frees the data.
+struct scene_share
+{
+	i32 refCount;
+	void *data;
+};
+
+// objects, instances and lights are shared in pages of this many, so that a change copies only 
+// the page it lies in
+#define SCENE_PAGE_SIZE 1024
+
+// elements of a published page. They lie in the array of the scene that published 
+// them until it changes or moves them, which copies them into the page first.
+struct scene_page
+{
+	i32 refCount;
+	i32 count;
+	void *data;
+	// the scene whose array data points into, or NULL once the page owns its copy
+	const raytracer_scene *owner;
+};
+
+// frozen parts of a scene, which hold a reference to each share and page
+struct scene_snapshot
+{
+	i32 refCount;
+	scene_camera camera;
+	scene_file_settings settings;
+	scene_page **objectPages;
+	i32 objectCount;
+	scene_page **lightPages;
+	i32 lightCount;
+	scene_page **instancePages;
+	i32 instanceCount;
+	scene_share *specularTables;
+	i32 specularTableCount;
+	scene_share *chunks;
+	i32 chunkCount;
+	u64 chunkBudget;
+};
+
+// guards the reference counts of shares and snapshots, and the published snapshots
+static pthread_mutex_t _scene_share_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+_scene_retain_share(scene_share *share)
+{
+	if(share)
+	{
+		pthread_mutex_lock(&_scene_share_mutex);
+		++share->refCount;
+		pthread_mutex_unlock(&_scene_share_mutex);
+	}
+}
+
+static void
+_scene_release_share(scene_share *share)
+{
+	if(!share)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&_scene_share_mutex);
+	i32 refCount = --share->refCount;
+	pthread_mutex_unlock(&_scene_share_mutex);
+
+	if(refCount == 0)
+	{
+		free(share->data);
+		free(share);
+	}
+}
+
+// called before shared storage of count elements changes. Returns the storage to 
+// change, which is a copy with room for one more element while a snapshot holds it.
+static void *
+_scene_unshare_storage(scene_share **share, void *data, u64 elementSize, i32 count)
+{
+	scene_share *shared = *share;
+	*share = NULL;
+
+	pthread_mutex_lock(&_scene_share_mutex);
+	b32 isShared = shared->refCount > 1;
+
+	if(isShared)
+	{
+		--shared->refCount;
+	}
+
+	pthread_mutex_unlock(&_scene_share_mutex);
+
+	if(!isShared)
+	{
+		free(shared);
+
+		return data;
+	}
+
+	void *copy = malloc(elementSize*(count + 1));
+	memcpy(copy, data, elementSize*count);
+
+	return copy;
+}
+
+// the share of the scene's storage for a snapshot, created on the first publish after
+// the storage changed
+static scene_share *
+_scene_share_storage(scene_share **share, void *data)
+{
+	if(!data)
+	{
+		return NULL;
+	}
+
+	if(!*share)
+	{
+		*share = malloc(sizeof(scene_share));
+		(*share)->refCount = 1;
+		(*share)->data = data;
+	}
+
+	_scene_retain_share(*share);
+
+	return *share;
+}
+
+static void
+_scene_free_page(scene_page *page)
+{
+	if(!page->owner)
+	{
+		free(page->data);
+	}
+
+	free(page);
+}
+
+static void
+_scene_release_page(scene_page *page)
+{
+	pthread_mutex_lock(&_scene_share_mutex);
+	i32 refCount = --page->refCount;
+	pthread_mutex_unlock(&_scene_share_mutex);
+
+	// the scene a page borrows from holds it until it copies, so it is the last
+	if(refCount == 0)
+	{
+		_scene_free_page(page);
+	}
+}
+
+// called before elements first to first + count of the scene's array change. The scene
+// lets go of their pages, and pages that snapshots still hold copy them first.
+static void
+_scene_touch_pages(raytracer_scene *scene, scene_pages *pages, u64 elementSize, 
+		i32 first, i32 count)
+{
+	if(count <= 0)
+	{
+		return;
+	}
+
+	i32 lastPage = (i32)(((i64)first + count - 1)/SCENE_PAGE_SIZE);
+
+	if(lastPage >= pages->pageCount)
+	{
+		lastPage = pages->pageCount - 1;
+	}
+
+	for(i32 p = first/SCENE_PAGE_SIZE; p <= lastPage; ++p)
+	{
+		scene_page *page = pages->pages[p];
+
+		if(!page)
+		{
+			continue;
+		}
+
+		pages->pages[p] = NULL;
+
+		// under the lock, as scenes adopting the page read the data while they hold it
+		pthread_mutex_lock(&_scene_share_mutex);
+
+		if(page->owner == scene && page->refCount > 1)
+		{
+			void *copy = malloc(elementSize*page->count);
+			memcpy(copy, page->data, elementSize*page->count);
+			page->data = copy;
+			page->owner = NULL;
+		}
+
+		i32 refCount = --page->refCount;
+		pthread_mutex_unlock(&_scene_share_mutex);
+
+		if(refCount == 0)
+		{
+			_scene_free_page(page);
+		}
+	}
+}
+
+// called before the scene's array moves or is freed
+static void
+_scene_touch_all_pages(raytracer_scene *scene, scene_pages *pages, u64 elementSize)
+{
+	_scene_touch_pages(scene, pages, elementSize, 0, pages->pageCount*SCENE_PAGE_SIZE);
+	pages->pageCount = 0;
+}
+
+// sizes the page table for count elements, letting go of the pages beyond them
+static void
+_scene_resize_pages(raytracer_scene *scene, scene_pages *pages, u64 elementSize, 
+		i32 count)
+{
+	i32 pageCount = (count + SCENE_PAGE_SIZE - 1)/SCENE_PAGE_SIZE;
+
+	_scene_touch_pages(scene, pages, elementSize, pageCount*SCENE_PAGE_SIZE, 
+			(pages->pageCount - pageCount)*SCENE_PAGE_SIZE);
+
+	if(pageCount > pages->pageCapacity)
+	{
+		pages->pageCapacity = _scene_grow_capacity(pages->pageCapacity, pageCount);
+		pages->pages = realloc(pages->pages, sizeof(scene_page *)*pages->pageCapacity);
+	}
+
+	for(i32 p = pages->pageCount; p < pageCount; ++p)
+	{
+		pages->pages[p] = NULL;
+	}
+
+	pages->pageCount = pageCount;
+}
+
+// the pages of the count elements of the scene's array for a snapshot. Parts that 
+// changed since the last publish get a new page, which borrows the array.
+static scene_page **
+_scene_publish_pages(raytracer_scene *scene, scene_pages *pages, void *data, 
+		u64 elementSize, i32 count)
+{
+	_scene_resize_pages(scene, pages, elementSize, count);
+
+	if(pages->pageCount == 0)
+	{
+		return NULL;
+	}
+
+	scene_page **published = malloc(sizeof(scene_page *)*pages->pageCount);
+
+	for(i32 p = 0; p < pages->pageCount; ++p)
+	{
+		if(!pages->pages[p])
+		{
+			i32 first = p*SCENE_PAGE_SIZE;
+
+			scene_page *page = malloc(sizeof(scene_page));
+			page->refCount = 1;
+			page->count = count - first < SCENE_PAGE_SIZE ? count - first : SCENE_PAGE_SIZE;
+			page->data = (u8 *)data + elementSize*first;
+			page->owner = scene;
+
+			pages->pages[p] = page;
+		}
+
+		published[p] = pages->pages[p];
+	}
+
+	pthread_mutex_lock(&_scene_share_mutex);
+
+	for(i32 p = 0; p < pages->pageCount; ++p)
+	{
+		++published[p]->refCount;
+	}
+
+	pthread_mutex_unlock(&_scene_share_mutex);
+
+	return published;
+}
+
+static void
+_scene_release_published_pages(scene_page **published, i32 pageCount)
+{
+	for(i32 p = 0; p < pageCount; ++p)
+	{
+		_scene_release_page(published[p]);
+	}
+
+	free(published);
+}
+
+void
+scene_publish(raytracer_scene *scene)
+{
+	scene_snapshot *snapshot = malloc(sizeof(scene_snapshot));
+	snapshot->refCount = 1;
+	snapshot->camera = scene->camera;
+	snapshot->settings.pixelSize = scene->pixelSize;
+	snapshot->settings.lightSampleCount = scene->lightSampleCount;
+	snapshot->settings.maxDepth = scene->maxDepth;
+	snapshot->settings.rayBudget = scene->rayBudget;
+	snapshot->settings.rouletteThreshold = scene->rouletteThreshold;
+	snapshot->settings.mathMode = (i32)scene->mathMode;
+	snapshot->settings.lightCacheCellSize = scene->lightCache.cellSize;
+
+	// objects still in a scene file mapping are copied into their pages before it is 
+	// unmapped
+	snapshot->objectPages = _scene_publish_pages(scene, &scene->objectPages, 
+			scene->objects, sizeof(scene_object), scene->objectCount);
+	snapshot->objectCount = scene->objectCount;
+	snapshot->lightPages = _scene_publish_pages(scene, &scene->lightPages, scene->lights, 
+			sizeof(scene_light), scene->lightCount);
+	snapshot->lightCount = scene->lightCount;
+	snapshot->instancePages = _scene_publish_pages(scene, &scene->instancePages, 
+			scene->instances, sizeof(scene_instance), scene->instanceCount);
+	snapshot->instanceCount = scene->instanceCount;
+	snapshot->specularTables = _scene_share_storage(&scene->specularTableShare, 
+			scene->specularTables);
+	snapshot->specularTableCount = scene->specularTableCount;
+	snapshot->chunks = _scene_share_storage(&scene->chunkShare, 
+			scene->chunkResidency.chunks);
+	snapshot->chunkCount = scene->chunkResidency.chunkCount;
+	snapshot->chunkBudget = scene->chunkResidency.budget;
+
+	pthread_mutex_lock(&_scene_share_mutex);
+	scene_snapshot *previous = scene->publishedSnapshot;
+	scene->publishedSnapshot = snapshot;
+	pthread_mutex_unlock(&_scene_share_mutex);
+
+	if(previous)
+	{
+		scene_release_snapshot(previous);
+	}
+}
+
+scene_snapshot *
+scene_acquire_snapshot(raytracer_scene *scene)
+{
+	pthread_mutex_lock(&_scene_share_mutex);
+	scene_snapshot *snapshot = scene->publishedSnapshot;
+
+	if(snapshot)
+	{
+		++snapshot->refCount;
+	}
+
+	pthread_mutex_unlock(&_scene_share_mutex);
+
+	return snapshot;
+}
+
+void
+scene_release_snapshot(scene_snapshot *snapshot)
+{
+	pthread_mutex_lock(&_scene_share_mutex);
+	i32 refCount = --snapshot->refCount;
+	pthread_mutex_unlock(&_scene_share_mutex);
+
+	if(refCount == 0)
+	{
+		_scene_release_published_pages(snapshot->objectPages, 
+				(snapshot->objectCount + SCENE_PAGE_SIZE - 1)/SCENE_PAGE_SIZE);
+		_scene_release_published_pages(snapshot->lightPages, 
+				(snapshot->lightCount + SCENE_PAGE_SIZE - 1)/SCENE_PAGE_SIZE);
+		_scene_release_published_pages(snapshot->instancePages, 
+				(snapshot->instanceCount + SCENE_PAGE_SIZE - 1)/SCENE_PAGE_SIZE);
+		_scene_release_share(snapshot->specularTables);
+		_scene_release_share(snapshot->chunks);
+		free(snapshot);
+	}
+}
+
+// copies an element that changed in a snapshot into the scene's array
+typedef void (*scene_adopt_function)(raytracer_scene *scene, i32 index, 
+		const void *element);
+
+// copies the elements of a snapshot's pages that differ from the ones the scene holds 
+// into its own array. Returns whether any did.
+static b32
+_scene_adopt_pages(raytracer_scene *scene, scene_pages *pages, void **data, i32 *count,
+		i32 *capacity, u64 elementSize, scene_page **published, i32 publishedCount, 
+		scene_adopt_function adoptElement)
+{
+	i32 previousCount = *count;
+	b32 isChanged = previousCount != publishedCount;
+
+	if(publishedCount > *capacity)
+	{
+		*capacity = _scene_grow_capacity(*capacity, publishedCount);
+		*data = realloc(*data, elementSize*(*capacity));
+	}
+
+	*count = publishedCount;
+	_scene_resize_pages(scene, pages, elementSize, publishedCount);
+
+	for(i32 p = 0; p < pages->pageCount; ++p)
+	{
+		scene_page *page = published[p];
+
+		if(pages->pages[p] == page)
+		{
+			continue;
+		}
+
+		i32 first = p*SCENE_PAGE_SIZE;
+		u8 *elements = (u8 *)*data + elementSize*first;
+
+		// elements the scene held before are compared, so that only changes are adopted
+		i32 comparedCount = previousCount - first;
+		comparedCount = comparedCount < 0 ? 0 : comparedCount;
+		comparedCount = comparedCount > page->count ? page->count : comparedCount;
+
+		// the scene that published the page may copy it out of its array meanwhile
+		pthread_mutex_lock(&_scene_share_mutex);
+		++page->refCount;
+		const u8 *adopted = page->data;
+
+		for(i32 i = 0; i < comparedCount; ++i)
+		{
+			if(memcmp(elements + elementSize*i, adopted + elementSize*i, elementSize) != 0)
+			{
+				adoptElement(scene, first + i, adopted + elementSize*i);
+				isChanged = B32_TRUE;
+			}
+		}
+
+		memcpy(elements + elementSize*comparedCount, adopted + elementSize*comparedCount, 
+				elementSize*(page->count - comparedCount));
+		pthread_mutex_unlock(&_scene_share_mutex);
+
+		if(pages->pages[p])
+		{
+			_scene_release_page(pages->pages[p]);
+		}
+
+		pages->pages[p] = page;
+	}
+
+	return isChanged;
+}
+
+// updates the part of the light cache and object hierarchy the object lies in, like
+// the object setters do
+static void
+_scene_update_adopted_object(raytracer_scene *scene, i32 objectId, const v4 *oldMin, 
+		const v4 *oldMax)
+{
+	v4 newMin, newMax;
+	_scene_get_object_bounds(scene, &scene->objects[objectId], &newMin, &newMax);
+
+	// with an unchanged count the hierarchy is refit instead of rebuilt
+	if(memcmp(oldMin, &newMin, sizeof(v4)) != 0 || memcmp(oldMax, &newMax, sizeof(v4)) != 0)
+	{
+		scene->objectBvh.isDirty = B32_TRUE;
+	}
+
+	_scene_record_light_cache_change(scene, objectId, oldMin, oldMax);
+}
+
+static void
+_scene_adopt_object(raytracer_scene *scene, i32 objectId, const void *element)
+{
+	scene_object *object = &scene->objects[objectId];
+	const scene_object *adopted = element;
+
+	// an instance the object gave up may lie past the adopted ones, where it is kept
+	v4 oldMin, oldMax;
+	_scene_get_object_bounds(scene, object, &oldMin, &oldMax);
+
+	if(object->type != adopted->type)
+	{
+		scene->kernel = _scene_get_generic_kernel();
+	}
+
+	*object = *adopted;
+
+	_scene_update_adopted_object(scene, objectId, &oldMin, &oldMax);
+}
+
+// a changed instance moves the object that used it, whose own record may be equal. 
+// Objects that take the instance over differ themselves and are adopted after.
+static void
+_scene_adopt_instance(raytracer_scene *scene, i32 instanceId, const void *element)
+{
+	scene_instance *instance = &scene->instances[instanceId];
+	i32 objectId = instance->objectId;
+
+	b32 isUsed = objectId < scene->objectCount && 
+		scene->objects[objectId].instanceId == instanceId;
+
+	v4 oldMin, oldMax;
+
+	if(isUsed)
+	{
+		_scene_get_object_bounds(scene, &scene->objects[objectId], &oldMin, &oldMax);
+	}
+
+	*instance = *(const scene_instance *)element;
+
+	if(isUsed)
+	{
+		_scene_update_adopted_object(scene, objectId, &oldMin, &oldMax);
+	}
+}
+
+static void
+_scene_adopt_light(raytracer_scene *scene, i32 lightId, const void *element)
+{
+	scene->lights[lightId] = *(const scene_light *)element;
+}
+
+void
+scene_adopt_snapshot(raytracer_scene *scene, scene_snapshot *snapshot)
+{
+	b32 isChanged = B32_FALSE;
+
+	i32 objectCount = scene->objectCount;
+	u32 lightCacheEpoch = scene->lightCache.epoch;
+
+	// instances come first, as the bounds of adopted objects depend on them
+	b32 isInstanceChanged = _scene_adopt_pages(scene, &scene->instancePages, 
+			(void **)&scene->instances, &scene->instanceCount, &scene->instanceCapacity, 
+			sizeof(scene_instance), snapshot->instancePages, snapshot->instanceCount, 
+			_scene_adopt_instance);
+
+	// equal pages hold equal elements, so the hierarchies over them stay valid. Objects 
+	// are compared with the ones adopted before, so any number of snapshots may be 
+	// skipped in between.
+	if(_scene_adopt_pages(scene, &scene->objectPages, (void **)&scene->objects, 
+				&scene->objectCount, &scene->objectCapacity, sizeof(scene_object), 
+				snapshot->objectPages, snapshot->objectCount, _scene_adopt_object) || 
+			isInstanceChanged)
+	{
+		if(scene->objectCount != objectCount)
+		{
+			scene->kernel = _scene_get_generic_kernel();
+			scene->objectBvh.isDirty = B32_TRUE;
+			scene->visibility.isValid = B32_FALSE;
+			_scene_invalidate_light_cache(scene);
+		}
+		else if(scene->lightCache.epoch - lightCacheEpoch > SCENE_LIGHT_CACHE_REGIONS/2)
+		{
+			// each object took a region, so large updates drop every entry at once
+			_scene_invalidate_light_cache(scene);
+		}
+
+		isChanged = B32_TRUE;
+	}
+
+	if(_scene_adopt_pages(scene, &scene->lightPages, (void **)&scene->lights, 
+				&scene->lightCount, &scene->lightCapacity, sizeof(scene_light), 
+				snapshot->lightPages, snapshot->lightCount, _scene_adopt_light))
+	{
+		scene->lightIndex.isDirty = B32_TRUE;
+		_scene_invalidate_light_cache(scene);
+		isChanged = B32_TRUE;
+	}
+
+	if(scene->specularTableShare != snapshot->specularTables)
+	{
+		if(scene->specularTableShare)
+		{
+			_scene_release_share(scene->specularTableShare);
+		}
+		else
+		{
+			free(scene->specularTables);
+		}
+
+		_scene_retain_share(snapshot->specularTables);
+
+		scene->specularTableShare = snapshot->specularTables;
+		scene->specularTables = snapshot->specularTables ? 
+			snapshot->specularTables->data : NULL;
+		scene->specularTableCount = snapshot->specularTableCount;
+		isChanged = B32_TRUE;
+	}
+
+	scene_chunk_residency *residency = &scene->chunkResidency;
+
+	if(scene->chunkShare != snapshot->chunks)
+	{
+		if(scene->chunkShare)
+		{
+			_scene_release_share(scene->chunkShare);
+		}
+		else
+		{
+			free(residency->chunks);
+		}
+
+		_scene_retain_share(snapshot->chunks);
+
+		scene->chunkShare = snapshot->chunks;
+		residency->chunks = snapshot->chunks ? snapshot->chunks->data : NULL;
+		residency->chunkCount = snapshot->chunkCount;
+	}
+
+	residency->budget = snapshot->chunkBudget;
+
+	if(memcmp(&scene->camera, &snapshot->camera, sizeof(scene_camera)) != 0)
+	{
+		if(memcmp(&scene->camera.viewport, &snapshot->camera.viewport, 
+					sizeof(camera_viewport)) != 0)
+		{
+			scene->rayTable.isDirty = B32_TRUE;
+		}
+
+		scene->camera = snapshot->camera;
+		isChanged = B32_TRUE;
+	}
+
+	const scene_file_settings *settings = &snapshot->settings;
+
+	if(scene->pixelSize != settings->pixelSize || 
+			scene->lightSampleCount != settings->lightSampleCount ||
+			scene->maxDepth != settings->maxDepth || 
+			scene->rayBudget != settings->rayBudget ||
+			scene->rouletteThreshold != settings->rouletteThreshold ||
+			scene->mathMode != (scene_math_mode)settings->mathMode)
+	{
+		scene->pixelSize = settings->pixelSize;
+		scene->lightSampleCount = settings->lightSampleCount;
+		scene->maxDepth = settings->maxDepth;
+		scene->rayBudget = settings->rayBudget;
+		scene->rouletteThreshold = settings->rouletteThreshold;
+		scene->mathMode = (scene_math_mode)settings->mathMode;
+		_scene_invalidate_light_cache(scene);
+		isChanged = B32_TRUE;
+	}
+
+	if(scene->lightCache.cellSize != settings->lightCacheCellSize)
+	{
+		scene_set_light_cache(scene, settings->lightCacheCellSize);
+	}
+
+	if(isChanged)
+	{
+		++scene->version;
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef __SCENE_SNAPSHOT_H
+#define __SCENE_SNAPSHOT_H
+
+#include "stdinc.h"
+#include "scene.h"
+
+// frozen objects, lights, camera and render settings of a scene, for rendering while 
+// the scene is edited on another thread
+typedef struct scene_snapshot scene_snapshot;
+
+// replaces the published snapshot of the scene, meant to be called between frames. 
+// Nothing is copied: the scene shares its storage with the snapshot, and afterwards 
+// copies the page of objects or lights that a change lies in.
+extern void
+scene_publish(raytracer_scene *scene);
+
+// the last published snapshot, or NULL. It stays valid until it is released, which 
+// may happen on any thread.
+extern scene_snapshot *
+scene_acquire_snapshot(raytracer_scene *scene);
+
+extern void
+scene_release_snapshot(scene_snapshot *snapshot);
+
+// makes a scene that is only rendered a copy of the snapshot. Only the pages of 
+// objects and lights that changed since the snapshot adopted before are copied. Moved
+// objects refit the object hierarchy and drop only the light cache entries around 
+// them, like the object setters; added or removed objects rebuild both.
+extern void
+scene_adopt_snapshot(raytracer_scene *scene, scene_snapshot *snapshot);
+
+#endif
@@ -0,0 +1,752 @@
+#include "scene_text.h"
+#include "scene.h"
+#include "parse.h"
+#include "work.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// text scene files are read in blocks, which are split at line ends into chunks that
+// are parsed in parallel
+#define SCENE_TEXT_BLOCK_SIZE (32 << 20)
+#define SCENE_TEXT_CHUNKS_PER_THREAD 4
+
+#define SCENE_TEXT_CAMERA_POSITION (1 << 0)
+#define SCENE_TEXT_CAMERA_YAW (1 << 1)
+#define SCENE_TEXT_CAMERA_PITCH (1 << 2)
+#define SCENE_TEXT_CAMERA_PIXEL_SIZE (1 << 3)
+
+// the values of the last camera statement of a chunk
+typedef struct scene_text_camera
+{
+	u32 valueFlags;
+	v4 position;
+	real32 yaw;
+	real32 pitch;
+	real32 pixelSize;
+} scene_text_camera;
+
+// transforms are set after the parallel parse, as they take instances of the scene
+typedef struct scene_text_transform
+{
+	i32 objectIndex;
+	m44 transform;
+} scene_text_transform;
+
+typedef struct scene_text_chunk
+{
+	const char *start;
+	const char *end;
+	i32 objectCount;
+	i32 lightCount;
+	// into the objects and lights of the block
+	i32 objectOffset;
+	i32 lightOffset;
+	scene_text_camera camera;
+	// object indices are into the block
+	scene_text_transform *transforms;
+	i32 transformCount;
+	i32 transformCapacity;
+	const char *malformedLine;
+} scene_text_chunk;
+
+typedef struct scene_text_block
+{
+	scene_text_chunk *chunks;
+	scene_object *objects;
+	scene_light *lights;
+} scene_text_block;
+
+// type names of the text format, in the order of the enums
+static const char *_scene_text_object_types[] = {"sphere", "box"};
+static const char *_scene_text_light_types[] = {
+	"ambient", "directional", "point", "sphere", "rect"
+};
+
+static const char *
+_scene_text_skip_token(const char *c, const char *end)
+{
+	while(c < end && *c != '\n' && !parse_is_space(*c))
+	{
+		++c;
+	}
+
+	return c;
+}
+
+static b32
+_scene_text_is(const char *c, const char *end, const char *word)
+{
+	size_t length = strlen(word);
+
+	return (size_t)(end - c) == length && !memcmp(c, word, length);
+}
+
+static const char *
+_scene_text_parse_vector(const char *c, const char *end, v4 *out)
+{
+	*out = vec4_init(0.f, 0.f, 0.f, 0.f);
+	c = parse_real(c, end, &out->_[0]);
+
+	for(i32 i = 1; i < 3 && c; ++i)
+	{
+		c = c < end && *c == ',' ? parse_real(c + 1, end, &out->_[i]) : NULL;
+	}
+
+	return c;
+}
+
+// the sixteen values of a matrix, row by row
+static const char *
+_scene_text_parse_matrix(const char *c, const char *end, m44 *out)
+{
+	c = parse_real(c, end, &out->_[0]);
+
+	for(i32 i = 1; i < 16 && c; ++i)
+	{
+		c = c < end && *c == ',' ? parse_real(c + 1, end, &out->_[i]) : NULL;
+	}
+
+	return c;
+}
+
+// the index of the name in the table, or -1
+static i32
+_scene_text_find_name(const char *c, const char *end, const char **names, i32 nameCount)
+{
+	for(i32 i = 0; i < nameCount; ++i)
+	{
+		if(_scene_text_is(c, end, names[i]))
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// the next key=value pair of the line. Returns the end of the value, or NULL at the
+// end of the line. Without a separator the key is empty and matches no key name.
+static const char *
+_scene_text_next_pair(const char *c, const char *end, const char **outKey, 
+		const char **outKeyEnd)
+{
+	c = parse_skip_spaces(c, end);
+
+	if(c == end || *c == '\n')
+	{
+		return NULL;
+	}
+
+	const char *valueEnd = _scene_text_skip_token(c, end);
+	const char *separator = memchr(c, '=', valueEnd - c);
+
+	*outKey = c;
+	*outKeyEnd = separator ? separator : c;
+
+	return valueEnd;
+}
+
+static b32
+_scene_text_parse_object(const char *c, const char *end, scene_object *object, 
+		m44 *outTransform)
+{
+	_scene_init_object(object, SCENE_OBJECT_SPHERE);
+	*outTransform = m44_identity();
+
+	const char *key;
+	const char *keyEnd;
+	const char *valueEnd;
+
+	while((valueEnd = _scene_text_next_pair(c, end, &key, &keyEnd)))
+	{
+		const char *value = keyEnd + 1;
+		const char *parsed = NULL;
+
+		if(_scene_text_is(key, keyEnd, "type"))
+		{
+			i32 type = _scene_text_find_name(value, valueEnd, _scene_text_object_types, 
+					sizeof(_scene_text_object_types)/sizeof(_scene_text_object_types[0]));
+
+			object->type = type >= 0 ? (scene_object_t)type : object->type;
+			parsed = type >= 0 ? valueEnd : NULL;
+		}
+		else if(_scene_text_is(key, keyEnd, "position"))
+		{
+			parsed = _scene_text_parse_vector(value, valueEnd, &object->position);
+		}
+		else if(_scene_text_is(key, keyEnd, "color"))
+		{
+			parsed = parse_hex(value, valueEnd, &object->color);
+		}
+		else if(_scene_text_is(key, keyEnd, "albedo"))
+		{
+			parsed = parse_real(value, valueEnd, &object->material.albedo);
+		}
+		else if(_scene_text_is(key, keyEnd, "radius"))
+		{
+			parsed = parse_real(value, valueEnd, &object->sphereRadius);
+		}
+		else if(_scene_text_is(key, keyEnd, "width"))
+		{
+			parsed = parse_real(value, valueEnd, &object->boxWidth);
+		}
+		else if(_scene_text_is(key, keyEnd, "height"))
+		{
+			parsed = parse_real(value, valueEnd, &object->boxHeight);
+		}
+		else if(_scene_text_is(key, keyEnd, "depth"))
+		{
+			parsed = parse_real(value, valueEnd, &object->boxDepth);
+		}
+		else if(_scene_text_is(key, keyEnd, "reflectivity"))
+		{
+			parsed = parse_real(value, valueEnd, &object->material.reflectivity);
+		}
+		else if(_scene_text_is(key, keyEnd, "transparency"))
+		{
+			parsed = parse_real(value, valueEnd, &object->material.transparency);
+		}
+		else if(_scene_text_is(key, keyEnd, "refractive_index"))
+		{
+			parsed = parse_real(value, valueEnd, &object->material.refractiveIndex);
+		}
+		else if(_scene_text_is(key, keyEnd, "transform"))
+		{
+			parsed = _scene_text_parse_matrix(value, valueEnd, outTransform);
+		}
+
+		if(parsed != valueEnd)
+		{
+			return B32_FALSE;
+		}
+
+		c = valueEnd;
+	}
+
+	return B32_TRUE;
+}
+
+static b32
+_scene_text_parse_light(const char *c, const char *end, scene_light *light)
+{
+	_scene_init_light(light, LIGHT_POINT);
+
+	const char *key;
+	const char *keyEnd;
+	const char *valueEnd;
+
+	while((valueEnd = _scene_text_next_pair(c, end, &key, &keyEnd)))
+	{
+		const char *value = keyEnd + 1;
+		const char *parsed = NULL;
+
+		if(_scene_text_is(key, keyEnd, "type"))
+		{
+			i32 type = _scene_text_find_name(value, valueEnd, _scene_text_light_types, 
+					sizeof(_scene_text_light_types)/sizeof(_scene_text_light_types[0]));
+
+			light->type = type >= 0 ? (scene_light_t)type : light->type;
+			parsed = type >= 0 ? valueEnd : NULL;
+		}
+		else if(_scene_text_is(key, keyEnd, "position"))
+		{
+			parsed = _scene_text_parse_vector(value, valueEnd, &light->position);
+		}
+		else if(_scene_text_is(key, keyEnd, "direction"))
+		{
+			parsed = _scene_text_parse_vector(value, valueEnd, &light->direction);
+			vec4_normal(&light->direction, &light->direction);
+		}
+		else if(_scene_text_is(key, keyEnd, "color"))
+		{
+			parsed = parse_hex(value, valueEnd, &light->color);
+		}
+		else if(_scene_text_is(key, keyEnd, "intensity"))
+		{
+			parsed = parse_real(value, valueEnd, &light->intensity);
+		}
+		else if(_scene_text_is(key, keyEnd, "range"))
+		{
+			parsed = parse_real(value, valueEnd, &light->range);
+		}
+		else if(_scene_text_is(key, keyEnd, "radius"))
+		{
+			parsed = parse_real(value, valueEnd, &light->radius);
+		}
+		else if(_scene_text_is(key, keyEnd, "width"))
+		{
+			parsed = parse_real(value, valueEnd, &light->width);
+		}
+		else if(_scene_text_is(key, keyEnd, "height"))
+		{
+			parsed = parse_real(value, valueEnd, &light->height);
+		}
+
+		if(parsed != valueEnd)
+		{
+			return B32_FALSE;
+		}
+
+		c = valueEnd;
+	}
+
+	return B32_TRUE;
+}
+
+static b32
+_scene_text_parse_camera(const char *c, const char *end, scene_text_camera *camera)
+{
+	const char *key;
+	const char *keyEnd;
+	const char *valueEnd;
+
+	while((valueEnd = _scene_text_next_pair(c, end, &key, &keyEnd)))
+	{
+		const char *value = keyEnd + 1;
+		const char *parsed = NULL;
+
+		if(_scene_text_is(key, keyEnd, "position"))
+		{
+			parsed = _scene_text_parse_vector(value, valueEnd, &camera->position);
+			camera->valueFlags |= SCENE_TEXT_CAMERA_POSITION;
+		}
+		else if(_scene_text_is(key, keyEnd, "yaw"))
+		{
+			parsed = parse_real(value, valueEnd, &camera->yaw);
+			camera->valueFlags |= SCENE_TEXT_CAMERA_YAW;
+		}
+		else if(_scene_text_is(key, keyEnd, "pitch"))
+		{
+			parsed = parse_real(value, valueEnd, &camera->pitch);
+			camera->valueFlags |= SCENE_TEXT_CAMERA_PITCH;
+		}
+		else if(_scene_text_is(key, keyEnd, "pixel_size"))
+		{
+			parsed = parse_real(value, valueEnd, &camera->pixelSize);
+			camera->valueFlags |= SCENE_TEXT_CAMERA_PIXEL_SIZE;
+		}
+
+		if(parsed != valueEnd)
+		{
+			return B32_FALSE;
+		}
+
+		c = valueEnd;
+	}
+
+	return B32_TRUE;
+}
+
+static void
+_scene_text_count_chunk(void *data, i32 index)
+{
+	scene_text_chunk *chunk = &((scene_text_block *)data)->chunks[index];
+
+	const char *c = chunk->start;
+
+	while(c < chunk->end)
+	{
+		c = parse_skip_spaces(c, chunk->end);
+		const char *tokenEnd = _scene_text_skip_token(c, chunk->end);
+
+		if(_scene_text_is(c, tokenEnd, "object"))
+		{
+			++chunk->objectCount;
+		}
+		else if(_scene_text_is(c, tokenEnd, "light"))
+		{
+			++chunk->lightCount;
+		}
+
+		c = parse_skip_line(c, chunk->end);
+	}
+}
+
+static void
+_scene_text_parse_chunk(void *data, i32 index)
+{
+	scene_text_block *block = data;
+	scene_text_chunk *chunk = &block->chunks[index];
+
+	scene_object *object = &block->objects[chunk->objectOffset];
+	scene_light *light = &block->lights[chunk->lightOffset];
+
+	const char *c = chunk->start;
+
+	while(c < chunk->end)
+	{
+		const char *line = c;
+
+		c = parse_skip_spaces(c, chunk->end);
+		const char *tokenEnd = _scene_text_skip_token(c, chunk->end);
+
+		b32 isValid = B32_TRUE;
+
+		// blank lines and comments are skipped
+		if(c == tokenEnd || *c == '#')
+		{
+		}
+		else if(_scene_text_is(c, tokenEnd, "object"))
+		{
+			m44 transform;
+			m44 identity = m44_identity();
+			isValid = _scene_text_parse_object(tokenEnd, chunk->end, object, &transform);
+
+			if(isValid && memcmp(&transform, &identity, sizeof(m44)) != 0)
+			{
+				if(chunk->transformCount == chunk->transformCapacity)
+				{
+					chunk->transformCapacity = _scene_grow_capacity(chunk->transformCapacity, 
+							chunk->transformCount + 1);
+					chunk->transforms = realloc(chunk->transforms, 
+							sizeof(scene_text_transform)*chunk->transformCapacity);
+				}
+
+				scene_text_transform *t = &chunk->transforms[chunk->transformCount++];
+				t->objectIndex = (i32)(object - block->objects);
+				t->transform = transform;
+			}
+
+			++object;
+		}
+		else if(_scene_text_is(c, tokenEnd, "light"))
+		{
+			isValid = _scene_text_parse_light(tokenEnd, chunk->end, light++);
+		}
+		else if(_scene_text_is(c, tokenEnd, "camera"))
+		{
+			isValid = _scene_text_parse_camera(tokenEnd, chunk->end, &chunk->camera);
+		}
+		else
+		{
+			isValid = B32_FALSE;
+		}
+
+		if(!isValid)
+		{
+			chunk->malformedLine = line;
+
+			return;
+		}
+
+		c = parse_skip_line(c, chunk->end);
+	}
+}
+
+b32
+scene_load_text(raytracer_scene *scene, work_dispatcher *dispatcher, const char *path)
+{
+	FILE *file = fopen(path, "rb");
+
+	if(!file)
+	{
+		fprintf(stderr, "Cannot open scene file '%s'!\n", path);
+
+		return B32_FALSE;
+	}
+
+	i32 chunkCount = work_get_thread_count(dispatcher)*SCENE_TEXT_CHUNKS_PER_THREAD;
+
+	char *buffer = malloc(SCENE_TEXT_BLOCK_SIZE);
+	scene_text_chunk *chunks = malloc(sizeof(scene_text_chunk)*chunkCount);
+
+	i32 firstObject = scene->objectCount;
+	i32 firstLight = scene->lightCount;
+
+	scene_text_camera camera;
+	memset(&camera, 0, sizeof(camera));
+
+	b32 isMalformed = B32_FALSE;
+	size_t carrySize = 0;
+
+	for(;;)
+	{
+		size_t readSize = fread(buffer + carrySize, 1, SCENE_TEXT_BLOCK_SIZE - carrySize, 
+				file);
+		size_t size = carrySize + readSize;
+		b32 isLastBlock = readSize < SCENE_TEXT_BLOCK_SIZE - carrySize;
+
+		if(isLastBlock && ferror(file))
+		{
+			fprintf(stderr, "Cannot read scene file '%s'!\n", path);
+			isMalformed = B32_TRUE;
+
+			break;
+		}
+
+		// a partial last line is carried over to the next block
+		size_t parseSize = size;
+
+		if(!isLastBlock)
+		{
+			while(parseSize > 0 && buffer[parseSize - 1] != '\n')
+			{
+				--parseSize;
+			}
+
+			if(!parseSize)
+			{
+				fprintf(stderr, "Line too long in scene file '%s'!\n", path);
+				isMalformed = B32_TRUE;
+
+				break;
+			}
+		}
+
+		const char *start = buffer;
+		const char *end = buffer + parseSize;
+
+		for(i32 i = 0; i < chunkCount; ++i)
+		{
+			const char *chunkEnd = i == chunkCount - 1 ? end :
+				buffer + parseSize*(size_t)(i + 1)/(size_t)chunkCount;
+
+			if(chunkEnd < start)
+			{
+				chunkEnd = start;
+			}
+			else if(chunkEnd > start && chunkEnd < end && chunkEnd[-1] != '\n')
+			{
+				chunkEnd = parse_skip_line(chunkEnd, end);
+			}
+
+			memset(&chunks[i], 0, sizeof(scene_text_chunk));
+			chunks[i].start = start;
+			chunks[i].end = chunkEnd;
+
+			start = chunkEnd;
+		}
+
+		scene_text_block block;
+		block.chunks = chunks;
+
+		work_run(dispatcher, _scene_text_count_chunk, &block, chunkCount);
+
+		i32 blockObjectCount = 0;
+		i32 blockLightCount = 0;
+
+		for(i32 i = 0; i < chunkCount; ++i)
+		{
+			chunks[i].objectOffset = blockObjectCount;
+			chunks[i].lightOffset = blockLightCount;
+			blockObjectCount += chunks[i].objectCount;
+			blockLightCount += chunks[i].lightCount;
+		}
+
+		// every statement of the block is parsed into its slot of the grown arrays
+		block.objects = _scene_append_objects(scene, blockObjectCount);
+
+		block.lights = _scene_append_lights(scene, blockLightCount);
+
+		work_run(dispatcher, _scene_text_parse_chunk, &block, chunkCount);
+
+		i32 blockFirstObject = scene->objectCount - blockObjectCount;
+
+		for(i32 i = 0; i < chunkCount; ++i)
+		{
+			scene_text_chunk *chunk = &chunks[i];
+
+			for(i32 j = 0; j < chunk->transformCount; ++j)
+			{
+				_scene_set_object_transform(scene, 
+						blockFirstObject + chunk->transforms[j].objectIndex, 
+						&chunk->transforms[j].transform);
+			}
+
+			free(chunk->transforms);
+		}
+
+		for(i32 i = 0; i < chunkCount && !isMalformed; ++i)
+		{
+			scene_text_chunk *chunk = &chunks[i];
+
+			if(chunk->malformedLine)
+			{
+				const char *lineEnd = memchr(chunk->malformedLine, '\n', 
+						end - chunk->malformedLine);
+
+				fprintf(stderr, "Malformed statement in scene file '%s': '%.*s'\n", path, 
+						(int)((lineEnd ? lineEnd : end) - chunk->malformedLine), 
+						chunk->malformedLine);
+				isMalformed = B32_TRUE;
+			}
+
+			// later camera statements override the values of earlier ones
+			if(chunk->camera.valueFlags & SCENE_TEXT_CAMERA_POSITION)
+			{
+				camera.position = chunk->camera.position;
+			}
+
+			if(chunk->camera.valueFlags & SCENE_TEXT_CAMERA_YAW)
+			{
+				camera.yaw = chunk->camera.yaw;
+			}
+
+			if(chunk->camera.valueFlags & SCENE_TEXT_CAMERA_PITCH)
+			{
+				camera.pitch = chunk->camera.pitch;
+			}
+
+			if(chunk->camera.valueFlags & SCENE_TEXT_CAMERA_PIXEL_SIZE)
+			{
+				camera.pixelSize = chunk->camera.pixelSize;
+			}
+
+			camera.valueFlags |= chunk->camera.valueFlags;
+		}
+
+		if(isMalformed || isLastBlock)
+		{
+			break;
+		}
+
+		carrySize = size - parseSize;
+		memmove(buffer, buffer + parseSize, carrySize);
+	}
+
+	fclose(file);
+	free(buffer);
+	free(chunks);
+
+	if(isMalformed)
+	{
+		for(i32 i = firstObject; i < scene->objectCount; ++i)
+		{
+			_scene_release_instance(scene, &scene->objects[i]);
+		}
+
+		scene->objectCount = firstObject;
+		scene->lightCount = firstLight;
+
+		return B32_FALSE;
+	}
+
+	// specular tables belong to the scene, so they are looked up after the parallel 
+	// parse
+	_scene_assign_specular_tables(scene, firstObject, scene->objectCount - firstObject);
+
+	if(camera.valueFlags & SCENE_TEXT_CAMERA_POSITION)
+	{
+		scene_set_camera_position(scene, &camera.position);
+	}
+
+	if(camera.valueFlags & (SCENE_TEXT_CAMERA_YAW | SCENE_TEXT_CAMERA_PITCH))
+	{
+		real32 yaw;
+		real32 pitch;
+		scene_get_camera_orientation(scene, &yaw, &pitch);
+
+		scene_set_camera_orientation(scene, 
+				camera.valueFlags & SCENE_TEXT_CAMERA_YAW ? camera.yaw : yaw, 
+				camera.valueFlags & SCENE_TEXT_CAMERA_PITCH ? camera.pitch : pitch);
+	}
+
+	if(camera.valueFlags & SCENE_TEXT_CAMERA_PIXEL_SIZE)
+	{
+		scene_set_pixel_size(scene, camera.pixelSize);
+	}
+
+	++scene->version;
+	_scene_invalidate_light_cache(scene);
+	scene->kernel = _scene_get_generic_kernel();
+	scene->objectBvh.isDirty = B32_TRUE;
+	scene->lightIndex.isDirty = B32_TRUE;
+
+	return B32_TRUE;
+}
+
+b32
+scene_save_text(raytracer_scene *scene, const char *path)
+{
+	FILE *file = fopen(path, "w");
+
+	if(!file)
+	{
+		fprintf(stderr, "Cannot open scene file '%s' for writing!\n", path);
+
+		return B32_FALSE;
+	}
+
+	// nine significant digits so that every value reads back exactly
+	fprintf(file, "camera position=%.9g,%.9g,%.9g yaw=%.9g pitch=%.9g pixel_size=%.9g\n", 
+			scene->camera.position.x, scene->camera.position.y, scene->camera.position.z, 
+			scene->camera.yaw, scene->camera.pitch, scene->pixelSize);
+
+	for(i32 i = 0; i < scene->lightCount; ++i)
+	{
+		const scene_light *light = &scene->lights[i];
+
+		fprintf(file, "light type=%s position=%.9g,%.9g,%.9g direction=%.9g,%.9g,%.9g "
+				"color=%06x intensity=%.9g range=%.9g radius=%.9g width=%.9g height=%.9g\n", 
+				_scene_text_light_types[light->type], light->position.x, light->position.y, 
+				light->position.z, light->direction.x, light->direction.y, 
+				light->direction.z, light->color, light->intensity, light->range, 
+				light->radius, light->width, light->height);
+	}
+
+	i32 skippedCount = 0;
+
+	for(i32 i = 0; i < scene->objectCount; ++i)
+	{
+		const scene_object *object = &scene->objects[i];
+
+		if(object->type != SCENE_OBJECT_SPHERE && object->type != SCENE_OBJECT_BOX)
+		{
+			++skippedCount;
+			continue;
+		}
+
+		fprintf(file, "object type=%s position=%.9g,%.9g,%.9g color=%06x albedo=%.9g ", 
+				_scene_text_object_types[object->type], object->position.x, 
+				object->position.y, object->position.z, object->color, 
+				object->material.albedo);
+
+		if(object->type == SCENE_OBJECT_SPHERE)
+		{
+			fprintf(file, "radius=%.9g ", object->sphereRadius);
+		}
+		else
+		{
+			fprintf(file, "width=%.9g height=%.9g depth=%.9g ", object->boxWidth, 
+					object->boxHeight, object->boxDepth);
+		}
+
+		fprintf(file, "reflectivity=%.9g transparency=%.9g refractive_index=%.9g", 
+				object->material.reflectivity, object->material.transparency, 
+				object->material.refractiveIndex);
+
+		if(object->instanceId != SCENE_INSTANCE_NULL)
+		{
+			const real32 *t = scene->instances[object->instanceId].transform._;
+
+			fprintf(file, " transform=%.9g", t[0]);
+
+			for(i32 j = 1; j < 16; ++j)
+			{
+				fprintf(file, ",%.9g", t[j]);
+			}
+		}
+
+		fprintf(file, "\n");
+	}
+
+	b32 isWritten = !ferror(file);
+	isWritten = !fclose(file) && isWritten;
+
+	if(!isWritten)
+	{
+		fprintf(stderr, "Could not write scene file '%s'!\n", path);
+
+		return B32_FALSE;
+	}
+
+	if(skippedCount)
+	{
+		printf("Skipped %d mesh and sphere cluster objects saving '%s'.\n", skippedCount, 
+				path);
+	}
+
+	return B32_TRUE;
+}
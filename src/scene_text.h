@@ -0,0 +1,29 @@
+#ifndef __SCENE_TEXT_H
+#define __SCENE_TEXT_H
+
+#include "stdinc.h"
+#include "scene.h"
+#include "work.h"
+
+// text scene files hold one statement per line, with key=value pairs in any order and
+// lines starting with # as comments:
+//   camera position=0,0,0 yaw=0 pitch=0 pixel_size=1
+//   light type=point position=0,2,2 color=ffffff intensity=1 range=10
+//   object type=sphere position=0,0,2.5 radius=0.5 color=ff0000 albedo=32
+//   object type=box position=1,0,3 width=1 height=1 depth=1 reflectivity=0.5
+// Lights also take direction, radius, width and height, objects transparency,
+// refractive_index and a transform of sixteen values row by row. Values left out keep
+// the defaults of scene_create_light and scene_create_object.
+
+// appends the objects and lights of a text scene file and applies its camera. The file
+// is read in blocks that are parsed on every thread of the dispatcher, straight into
+// the object and light arrays. Returns false and leaves the scene as it was if the 
+// file cannot be read or has a malformed statement.
+extern b32
+scene_load_text(raytracer_scene *scene, work_dispatcher *dispatcher, const char *path);
+
+// writes every object but meshes and sphere clusters, every light and the camera
+extern b32
+scene_save_text(raytracer_scene *scene, const char *path);
+
+#endif
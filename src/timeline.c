@@ -0,0 +1,342 @@
+#include "timeline.h"
+#include "scene.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum timeline_track_type
+{
+	TIMELINE_TRACK_OBJECT,
+	TIMELINE_TRACK_LIGHT,
+	TIMELINE_TRACK_CAMERA
+} timeline_track_t;
+
+// the values a key does not animate for its track are left zero
+typedef struct timeline_key
+{
+	real32 time;
+	v4 position;
+	color32 color;
+	real32 intensity;
+	real32 yaw;
+	real32 pitch;
+} timeline_key;
+
+typedef struct timeline_track
+{
+	timeline_track_t type;
+	i32 id;
+	// sorted by time
+	timeline_key *keys;
+	i32 keyCount;
+	i32 keyCapacity;
+} timeline_track;
+
+struct raytracer_timeline
+{
+	timeline_track *tracks;
+	i32 trackCount;
+	i32 trackCapacity;
+};
+
+raytracer_timeline *
+timeline_create()
+{
+	raytracer_timeline *timeline = calloc(1, sizeof(raytracer_timeline));
+
+	return timeline;
+}
+
+void
+timeline_destroy(raytracer_timeline *timeline)
+{
+	for(i32 i = 0; i < timeline->trackCount; ++i)
+	{
+		free(timeline->tracks[i].keys);
+	}
+
+	free(timeline->tracks);
+	free(timeline);
+}
+
+static timeline_track *
+_timeline_get_track(raytracer_timeline *timeline, timeline_track_t type, i32 id)
+{
+	for(i32 i = 0; i < timeline->trackCount; ++i)
+	{
+		if(timeline->tracks[i].type == type && timeline->tracks[i].id == id)
+		{
+			return &timeline->tracks[i];
+		}
+	}
+
+	if(timeline->trackCount == timeline->trackCapacity)
+	{
+		timeline->trackCapacity = timeline->trackCapacity < 16 ? 16 :
+			timeline->trackCapacity*2;
+		timeline->tracks = realloc(timeline->tracks,
+				sizeof(timeline_track)*timeline->trackCapacity);
+	}
+
+	timeline_track *track = &timeline->tracks[timeline->trackCount++];
+	memset(track, 0, sizeof(timeline_track));
+	track->type = type;
+	track->id = id;
+
+	return track;
+}
+
+static void
+_timeline_add_key(raytracer_timeline *timeline, timeline_track_t type, i32 id,
+		const timeline_key *key)
+{
+	timeline_track *track = _timeline_get_track(timeline, type, id);
+
+	i32 index = track->keyCount;
+
+	while(index > 0 && track->keys[index - 1].time > key->time)
+	{
+		--index;
+	}
+
+	if(index > 0 && track->keys[index - 1].time == key->time)
+	{
+		track->keys[index - 1] = *key;
+
+		return;
+	}
+
+	if(track->keyCount == track->keyCapacity)
+	{
+		track->keyCapacity = track->keyCapacity < 16 ? 16 : track->keyCapacity*2;
+		track->keys = realloc(track->keys, sizeof(timeline_key)*track->keyCapacity);
+	}
+
+	memmove(&track->keys[index + 1], &track->keys[index],
+			sizeof(timeline_key)*(track->keyCount - index));
+	track->keys[index] = *key;
+	++track->keyCount;
+}
+
+void
+timeline_add_object_key(raytracer_timeline *timeline, i32 objectId, real32 time,
+		const v4 *position)
+{
+	timeline_key key = {};
+	key.time = time;
+	key.position = *position;
+
+	_timeline_add_key(timeline, TIMELINE_TRACK_OBJECT, objectId, &key);
+}
+
+void
+timeline_add_light_key(raytracer_timeline *timeline, i32 lightId, real32 time,
+		const v4 *position, color32 color, real32 intensity)
+{
+	timeline_key key = {};
+	key.time = time;
+	key.position = *position;
+	key.color = color;
+	key.intensity = intensity;
+
+	_timeline_add_key(timeline, TIMELINE_TRACK_LIGHT, lightId, &key);
+}
+
+void
+timeline_add_camera_key(raytracer_timeline *timeline, real32 time, const v4 *position,
+		real32 yaw, real32 pitch)
+{
+	timeline_key key = {};
+	key.time = time;
+	key.position = *position;
+	key.yaw = yaw;
+	key.pitch = pitch;
+
+	_timeline_add_key(timeline, TIMELINE_TRACK_CAMERA, 0, &key);
+}
+
+real32
+timeline_get_duration(raytracer_timeline *timeline)
+{
+	real32 duration = 0.f;
+
+	for(i32 i = 0; i < timeline->trackCount; ++i)
+	{
+		timeline_track *track = &timeline->tracks[i];
+
+		if(track->keyCount > 0 && track->keys[track->keyCount - 1].time > duration)
+		{
+			duration = track->keys[track->keyCount - 1].time;
+		}
+	}
+
+	return duration;
+}
+
+// keys are returned unchanged at and beyond their times, so that a track holding still
+// sets nothing
+static void
+_timeline_sample_track(const timeline_track *track, real32 time, timeline_key *outKey)
+{
+	const timeline_key *keys = track->keys;
+
+	if(time <= keys[0].time)
+	{
+		*outKey = keys[0];
+
+		return;
+	}
+
+	if(time >= keys[track->keyCount - 1].time)
+	{
+		*outKey = keys[track->keyCount - 1];
+
+		return;
+	}
+
+	// the last key at or before the time
+	i32 low = 0;
+	i32 high = track->keyCount - 1;
+
+	while(high - low > 1)
+	{
+		i32 middle = (low + high)/2;
+
+		if(keys[middle].time <= time)
+		{
+			low = middle;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	const timeline_key *from = &keys[low];
+	const timeline_key *to = &keys[high];
+	real32 t = (time - from->time)/(to->time - from->time);
+
+	outKey->time = time;
+
+	for(i32 i = 0; i < 4; ++i)
+	{
+		outKey->position._[i] = from->position._[i] + (to->position._[i] -
+				from->position._[i])*t;
+	}
+
+	outKey->color = 0;
+
+	// per channel, so that colors stay exact at the keys
+	for(i32 shift = 0; shift < 24; shift += 8)
+	{
+		real32 fromChannel = (real32)((from->color >> shift) & 0xFF);
+		real32 toChannel = (real32)((to->color >> shift) & 0xFF);
+
+		outKey->color |= (u32)(fromChannel + (toChannel - fromChannel)*t + 0.5f) << shift;
+	}
+
+	outKey->intensity = from->intensity + (to->intensity - from->intensity)*t;
+	outKey->yaw = from->yaw + (to->yaw - from->yaw)*t;
+	outKey->pitch = from->pitch + (to->pitch - from->pitch)*t;
+}
+
+static b32
+_timeline_is_same_position(const v4 *lhs, const v4 *rhs)
+{
+	return lhs->x == rhs->x && lhs->y == rhs->y && lhs->z == rhs->z;
+}
+
+void
+timeline_apply(raytracer_timeline *timeline, raytracer_scene *scene, real32 time)
+{
+	for(i32 i = 0; i < timeline->trackCount; ++i)
+	{
+		timeline_track *track = &timeline->tracks[i];
+
+		// a load may have left fewer objects or lights than were keyed
+		if(track->keyCount == 0 || 
+				(track->type == TIMELINE_TRACK_OBJECT && 
+				 track->id >= scene_get_object_count(scene)) ||
+				(track->type == TIMELINE_TRACK_LIGHT && 
+				 track->id >= scene_get_light_count(scene)))
+		{
+			continue;
+		}
+
+		timeline_key key;
+		_timeline_sample_track(track, time, &key);
+
+		switch(track->type)
+		{
+			case TIMELINE_TRACK_OBJECT:
+			{
+				v4 position;
+				scene_object_get_value(scene, track->id, SCENE_OBJECT_VALUE_POSITION,
+						&position);
+
+				if(!_timeline_is_same_position(&position, &key.position))
+				{
+					scene_object_set_value(scene, track->id, SCENE_OBJECT_VALUE_POSITION,
+							&key.position);
+				}
+			} break;
+
+			case TIMELINE_TRACK_LIGHT:
+			{
+				v4 position;
+				color32 color;
+				real32 intensity;
+				light_get_value(scene, track->id, LIGHT_VALUE_POSITION, &position);
+				light_get_value(scene, track->id, LIGHT_VALUE_COLOR, &color);
+				light_get_value(scene, track->id, LIGHT_VALUE_INTENSITY, &intensity);
+
+				u32 valueFlags = 0;
+				const void *values[3];
+				i32 valueCount = 0;
+
+				// in flag order, as light_set_values reads them
+				if(!_timeline_is_same_position(&position, &key.position))
+				{
+					valueFlags |= LIGHT_VALUE_POSITION;
+					values[valueCount++] = &key.position;
+				}
+
+				if(color != key.color)
+				{
+					valueFlags |= LIGHT_VALUE_COLOR;
+					values[valueCount++] = &key.color;
+				}
+
+				if(intensity != key.intensity)
+				{
+					valueFlags |= LIGHT_VALUE_INTENSITY;
+					values[valueCount++] = &key.intensity;
+				}
+
+				if(valueFlags)
+				{
+					light_set_values(scene, track->id, valueFlags, values);
+				}
+			} break;
+
+			case TIMELINE_TRACK_CAMERA:
+			{
+				v4 position;
+				real32 yaw;
+				real32 pitch;
+				scene_get_camera_position(scene, &position);
+				scene_get_camera_orientation(scene, &yaw, &pitch);
+
+				if(!_timeline_is_same_position(&position, &key.position))
+				{
+					scene_set_camera_position(scene, &key.position);
+				}
+
+				if(yaw != key.yaw || pitch != key.pitch)
+				{
+					scene_set_camera_orientation(scene, key.yaw, key.pitch);
+				}
+			} break;
+		}
+	}
+}
@@ -0,0 +1,43 @@
+#ifndef __TIMELINE_H
+#define __TIMELINE_H
+
+#include "stdinc.h"
+#include "rt_math.h"
+
+struct raytracer_scene;
+
+// keyframed object positions, light parameters and camera placement, interpolated
+// linearly between keys and held before the first and after the last key of a track
+typedef struct raytracer_timeline raytracer_timeline;
+
+extern raytracer_timeline *
+timeline_create();
+
+extern void
+timeline_destroy(raytracer_timeline *timeline);
+
+// a key at the time of an existing one of the track replaces it
+extern void
+timeline_add_object_key(raytracer_timeline *timeline, i32 objectId, real32 time, 
+		const v4 *position);
+
+extern void
+timeline_add_light_key(raytracer_timeline *timeline, i32 lightId, real32 time, 
+		const v4 *position, color32 color, real32 intensity);
+
+// yaw and pitch as for scene_set_camera_orientation
+extern void
+timeline_add_camera_key(raytracer_timeline *timeline, real32 time, const v4 *position, 
+		real32 yaw, real32 pitch);
+
+// the time of the last key, 0 without keys
+extern real32
+timeline_get_duration(raytracer_timeline *timeline);
+
+// moves everything with a track to where it is at the time. Values that stay the same
+// are not set, so that static objects and lights keep their cached lighting. Tracks of
+// objects and lights the scene no longer has are skipped.
+extern void
+timeline_apply(raytracer_timeline *timeline, raytracer_scene *scene, real32 time);
+
+#endif
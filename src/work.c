@@ -1,16 +1,35 @@
 #include "work.h"
 
 #include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
 
-typedef struct work_object
+// indices of a job are handed out one at a time, so uneven items balance out
+typedef struct work_job
 {
-	i32 _placeholder;
-} work_object;
+	work_function function;
+	void *data;
+	i32 count;
+	i32 nextIndex;
+	pthread_mutex_t mutex;
+} work_job;
 
+// the workers are started by the first job and then wait for the next one
 struct work_dispatcher
 {
-	work_object *objects;
-	i32 objectCount;
+	pthread_t *threads;
+	i32 threadCount;
+	i32 startedCount;
+	b32 isStarted;
+	// held while a job runs, so that nested and concurrent calls are noticed
+	pthread_mutex_t runMutex;
+	// guards the job, its generation and the busy count
+	pthread_mutex_t mutex;
+	pthread_cond_t jobCondition;
+	pthread_cond_t doneCondition;
+	work_job *job;
+	u32 jobGeneration;
+	i32 busyCount;
 };
 
 work_dispatcher *
@@ -18,5 +37,132 @@ work_init_dispatcher()
 {
 	work_dispatcher *dispatcher = calloc(1, sizeof(work_dispatcher));
 
+	long processorCount = sysconf(_SC_NPROCESSORS_ONLN);
+
+	dispatcher->threadCount = processorCount > 0 ? (i32)processorCount : 1;
+	dispatcher->threads = malloc(sizeof(pthread_t)*dispatcher->threadCount);
+
+	pthread_mutex_init(&dispatcher->runMutex, NULL);
+	pthread_mutex_init(&dispatcher->mutex, NULL);
+	pthread_cond_init(&dispatcher->jobCondition, NULL);
+	pthread_cond_init(&dispatcher->doneCondition, NULL);
+
 	return dispatcher;
 }
+
+i32
+work_get_thread_count(work_dispatcher *dispatcher)
+{
+	return dispatcher->threadCount;
+}
+
+static void
+_work_run_job(work_job *job)
+{
+	for(;;)
+	{
+		pthread_mutex_lock(&job->mutex);
+		i32 index = job->nextIndex++;
+		pthread_mutex_unlock(&job->mutex);
+
+		if(index >= job->count)
+		{
+			break;
+		}
+
+		job->function(job->data, index);
+	}
+}
+
+// takes part in every job once, then reports that it is done with it
+static void *
+_work_run_worker(void *data)
+{
+	work_dispatcher *dispatcher = data;
+	u32 generation = 0;
+
+	pthread_mutex_lock(&dispatcher->mutex);
+
+	for(;;)
+	{
+		while(dispatcher->jobGeneration == generation)
+		{
+			pthread_cond_wait(&dispatcher->jobCondition, &dispatcher->mutex);
+		}
+
+		generation = dispatcher->jobGeneration;
+		work_job *job = dispatcher->job;
+		pthread_mutex_unlock(&dispatcher->mutex);
+
+		_work_run_job(job);
+
+		pthread_mutex_lock(&dispatcher->mutex);
+
+		if(--dispatcher->busyCount == 0)
+		{
+			pthread_cond_signal(&dispatcher->doneCondition);
+		}
+	}
+
+	return NULL;
+}
+
+void
+work_run(work_dispatcher *dispatcher, work_function function, void *data, i32 count)
+{
+	work_job job;
+	job.function = function;
+	job.data = data;
+	job.count = count;
+	job.nextIndex = 0;
+	pthread_mutex_init(&job.mutex, NULL);
+
+	// a call from inside a job, or from another thread while one runs, would wait for
+	// workers that are busy, so it runs on the calling thread alone
+	if(pthread_mutex_trylock(&dispatcher->runMutex))
+	{
+		_work_run_job(&job);
+		pthread_mutex_destroy(&job.mutex);
+
+		return;
+	}
+
+	// the calling thread takes part, so a single thread dispatcher starts nothing
+	if(!dispatcher->isStarted)
+	{
+		dispatcher->isStarted = B32_TRUE;
+
+		for(i32 i = 1; i < dispatcher->threadCount; ++i)
+		{
+			if(pthread_create(&dispatcher->threads[dispatcher->startedCount], NULL, 
+						_work_run_worker, dispatcher))
+			{
+				break;
+			}
+
+			++dispatcher->startedCount;
+		}
+	}
+
+	pthread_mutex_lock(&dispatcher->mutex);
+	dispatcher->job = &job;
+	dispatcher->busyCount = dispatcher->startedCount;
+	++dispatcher->jobGeneration;
+	pthread_cond_broadcast(&dispatcher->jobCondition);
+	pthread_mutex_unlock(&dispatcher->mutex);
+
+	_work_run_job(&job);
+
+	// the job lives on this stack, so every worker must be done with it
+	pthread_mutex_lock(&dispatcher->mutex);
+
+	while(dispatcher->busyCount > 0)
+	{
+		pthread_cond_wait(&dispatcher->doneCondition, &dispatcher->mutex);
+	}
+
+	pthread_mutex_unlock(&dispatcher->mutex);
+
+	pthread_mutex_unlock(&dispatcher->runMutex);
+	pthread_mutex_destroy(&job.mutex);
+}
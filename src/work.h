@@ -1,9 +1,24 @@
 #ifndef __WORK_H
 #define __WORK_H
 
+#include "stdinc.h"
+
 typedef struct work_dispatcher work_dispatcher;
 
+// called once for every index of a job, from any of the dispatcher's threads
+typedef void (*work_function)(void *data, i32 index);
+
+// one thread per online processor
 extern work_dispatcher *
 work_init_dispatcher();
 
+extern i32
+work_get_thread_count(work_dispatcher *dispatcher);
+
+// runs the function for every index in [0, count) and returns once all of them are done.
+// The threads are started by the first call and kept for the next ones. A call made 
+// from inside a job, or while another thread's job runs, runs on the calling thread.
+extern void
+work_run(work_dispatcher *dispatcher, work_function function, void *data, i32 count);
+
 #endif